@@ -0,0 +1,112 @@
+/*
+ * acbench.c - measure the per byte cost of the trigger pattern matcher
+ *
+ * Copyright (c) 2010 Hamish Coleman <hamish@zot.org>
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ *   acbench [nr_patterns [megabytes]]
+ *
+ * Builds a matcher from a few well known console messages padded out
+ * with generated syslog style tags, then scans console-like text in
+ * BUFSIZE chunks, the same way wconsd_com_to_net would.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "acmatch.h"
+
+#define BUFSIZE 1024
+
+static char *well_known[] = {
+	"Kernel panic", "login:", "%SYS-2-MALLOCFAIL", "Oops:",
+	"Call Trace:", "%LINK-3-UPDOWN", "Press any key", "panic(",
+};
+
+static unsigned long matches;
+static void count_match(void *ctx, int pattern, size_t end) {
+	matches++;
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+int main(int argc, char **argv) {
+	int nr = argc>1 ? atoi(argv[1]) : 300;
+	int mb = argc>2 ? atoi(argv[2]) : 64;
+	char **patterns = calloc(nr,sizeof(char *));
+	unsigned char *text;
+	size_t len = (size_t)mb*1024*1024;
+	struct acmatch *ac;
+	double start, build, scan;
+	size_t i;
+	int state = 0;
+
+	srand(1);
+	for (i=0;i<nr;i++) {
+		if (i<sizeof(well_known)/sizeof(well_known[0])) {
+			patterns[i] = strdup(well_known[i]);
+		} else {
+			patterns[i] = malloc(32);
+			snprintf(patterns[i],32,"%%FAC%d-%d-EVENT%d",
+				rand()%100,rand()%8,(int)i);
+		}
+	}
+
+	/* something that looks a bit like console output */
+	text = malloc(len);
+	for (i=0;i<len;i++) {
+		int r = rand()%64;
+		text[i] = r<52 ? "etaoinshrdlucmfwypvbgkqjxzETAOINSHRDLUCMFWYPVBGKQJXZ"[r]
+			: r<60 ? ' ' : r<62 ? '\r' : '\n';
+	}
+	for (i=0;i+64<len;i+=4096) {
+		memcpy(text+i,"Kernel panic",12);
+	}
+
+	start = now();
+	ac = ac_build(patterns,nr);
+	build = now()-start;
+	if (!ac) {
+		fprintf(stderr,"ac_build failed\n");
+		return 1;
+	}
+
+	start = now();
+	for (i=0;i<len;i+=BUFSIZE) {
+		state = ac_scan(ac,state,text+i,len-i<BUFSIZE?len-i:BUFSIZE,count_match,NULL);
+	}
+	scan = now()-start;
+
+	printf("patterns       %d\n",nr);
+	printf("automaton      %lu bytes\n",(unsigned long)ac_size(ac));
+	printf("build time     %.3f ms\n",build*1000);
+	printf("scanned        %d MB in %.3f s\n",mb,scan);
+	printf("throughput     %.1f MB/s\n",mb/scan);
+	printf("cost           %.2f ns/byte\n",scan*1e9/len);
+	printf("matches        %lu\n",matches);
+
+	ac_free(ac);
+	return 0;
+}
@@ -0,0 +1,185 @@
+/*
+ * acmatch.c - Aho-Corasick multiple pattern matcher
+ *
+ * Copyright (c) 2010 Hamish Coleman <hamish@zot.org>
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * The automaton is compiled into a complete DFA, so scanning costs one
+ * table lookup and one test per byte no matter how many patterns there
+ * are.  To keep the table small, bytes are first mapped to classes: every
+ * byte that appears in some pattern gets its own class, all other bytes
+ * share class zero.  A few hundred console messages therefore need a
+ * table of (total pattern length) x (distinct bytes) entries.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "acmatch.h"
+
+struct acmatch {
+	int nr_states;
+	int nr_classes;
+	unsigned char cls[256];	/* byte to class */
+	int *delta;		/* nr_states * nr_classes transitions */
+	int *out;		/* pattern ending at this state, or -1 */
+	int *dict;		/* next state down the fail chain with output */
+	unsigned char *hit;	/* nonzero if any pattern ends at this state */
+};
+
+void ac_free(struct acmatch *ac) {
+	if (!ac) {
+		return;
+	}
+	free(ac->delta);
+	free(ac->out);
+	free(ac->dict);
+	free(ac->hit);
+	free(ac);
+}
+
+size_t ac_size(const struct acmatch *ac) {
+	return sizeof(*ac) + (size_t)ac->nr_states *
+		(ac->nr_classes*sizeof(int) + 2*sizeof(int) + 1);
+}
+
+struct acmatch *ac_build(char **patterns, int nr_patterns) {
+	struct acmatch *ac;
+	int max_states = 1;
+	int *fail = NULL;
+	int *queue = NULL;
+	int head, tail;
+	int i, c, k;
+
+	if (!(ac = calloc(1,sizeof(*ac)))) {
+		return NULL;
+	}
+
+	/* assign the byte classes, and bound the number of states */
+	ac->nr_classes = 1;
+	for (i=0;i<nr_patterns;i++) {
+		unsigned char *p = (unsigned char *)patterns[i];
+		for (;*p;p++) {
+			if (!ac->cls[*p]) {
+				ac->cls[*p] = ac->nr_classes++;
+			}
+			max_states++;
+		}
+	}
+	k = ac->nr_classes;
+
+	ac->delta = malloc((size_t)max_states*k*sizeof(int));
+	ac->out = malloc(max_states*sizeof(int));
+	ac->dict = malloc(max_states*sizeof(int));
+	ac->hit = calloc(max_states,1);
+	fail = calloc(max_states,sizeof(int));
+	queue = malloc(max_states*sizeof(int));
+	if (!ac->delta || !ac->out || !ac->dict || !ac->hit || !fail || !queue) {
+		goto error;
+	}
+	memset(ac->delta,0xff,(size_t)max_states*k*sizeof(int));
+
+	/* build the trie, -1 marks a missing edge */
+	ac->nr_states = 1;
+	ac->out[0] = -1;
+	for (i=0;i<nr_patterns;i++) {
+		unsigned char *p = (unsigned char *)patterns[i];
+		int s = 0;
+		if (!*p) {
+			continue;
+		}
+		for (;*p;p++) {
+			int *next = &ac->delta[s*k + ac->cls[*p]];
+			if (*next<0) {
+				*next = ac->nr_states;
+				ac->out[ac->nr_states] = -1;
+				ac->nr_states++;
+			}
+			s = *next;
+		}
+		if (ac->out[s]<0) {
+			/* a duplicate pattern just reports as the first one */
+			ac->out[s] = i;
+		}
+	}
+
+	/*
+	 * Breadth first, compute the fail links and fill in the missing
+	 * edges from the fail state, turning the trie into a DFA
+	 */
+	head = tail = 0;
+	ac->dict[0] = -1;
+	for (c=0;c<k;c++) {
+		int s = ac->delta[c];
+		if (s<0) {
+			ac->delta[c] = 0;
+		} else {
+			fail[s] = 0;
+			queue[tail++] = s;
+		}
+	}
+	while (head<tail) {
+		int r = queue[head++];
+		int f = fail[r];
+
+		ac->dict[r] = ac->out[f]>=0 ? f : ac->dict[f];
+		ac->hit[r] = ac->out[r]>=0 || ac->dict[r]>=0;
+
+		for (c=0;c<k;c++) {
+			int s = ac->delta[r*k + c];
+			if (s<0) {
+				ac->delta[r*k + c] = ac->delta[f*k + c];
+			} else {
+				fail[s] = ac->delta[f*k + c];
+				queue[tail++] = s;
+			}
+		}
+	}
+
+	free(fail);
+	free(queue);
+	return ac;
+
+error:
+	free(fail);
+	free(queue);
+	ac_free(ac);
+	return NULL;
+}
+
+int ac_scan(const struct acmatch *ac, int state, const unsigned char *buf,
+		size_t len, ac_callback cb, void *ctx) {
+	const int *delta = ac->delta;
+	const unsigned char *cls = ac->cls;
+	const unsigned char *hit = ac->hit;
+	const int k = ac->nr_classes;
+	size_t i;
+
+	for (i=0;i<len;i++) {
+		state = delta[state*k + cls[buf[i]]];
+		if (hit[state]) {
+			int s = ac->out[state]>=0 ? state : ac->dict[state];
+			while (s>=0) {
+				cb(ctx,ac->out[s],i);
+				s = ac->dict[s];
+			}
+		}
+	}
+	return state;
+}
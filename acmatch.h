@@ -0,0 +1,25 @@
+/*
+ * acmatch.h - Aho-Corasick multiple pattern matcher
+ *
+ * This has no dependencies on wconsd or windows, so that it can also be
+ * built into the acbench tool on any machine.
+ */
+
+#include <stddef.h>
+
+struct acmatch;
+
+/* called for every match, with the pattern number and the buffer offset
+ * of the last byte of the match */
+typedef void (*ac_callback)(void *ctx, int pattern, size_t end);
+
+struct acmatch *ac_build(char **patterns, int nr_patterns);
+void ac_free(struct acmatch *);
+size_t ac_size(const struct acmatch *);
+
+/*
+ * Scan a buffer, starting in the given state (zero for the start of a
+ * stream) and return the state to carry into the next buffer
+ */
+int ac_scan(const struct acmatch *, int state, const unsigned char *buf,
+	size_t len, ac_callback cb, void *ctx);
@@ -0,0 +1,279 @@
+/*
+ * autobaud.c - guess the speed of whatever is on a serial port
+ *
+ * Copyright (c) 2010 Hamish Coleman <hamish@zot.org>
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Each candidate speed gets an equal slice of the time budget.  At each
+ * one a CR is sent to provoke a prompt, and whatever comes back is
+ * scored: text received at the wrong speed is mostly non-printable
+ * garbage and usually comes with framing errors.  The best scoring
+ * speed wins, and if nothing at all was heard the configured speed is
+ * left alone.
+ *
+ * Most devices answer at the first speed tried, so the candidates are
+ * in order of how common they are, and a convincing score ends the
+ * search early.
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libcli/libcli/libcli.h"
+#include "module.h"
+#include "debug.h"
+#include "autobaud.h"
+
+#define MAXPORTS	16
+#define AUTOBAUD_SAMPLE	256
+#define AUTOBAUD_GOOD	90	/* a score that ends the search */
+#define AUTOBAUD_MIN	50	/* anything less is not believed */
+
+int autobaud_enabled = 0;
+static int autobaud_timeout = 3000;	/* ms for the whole search */
+
+/* in the order they are tried */
+static const DWORD candidates[] = {
+	9600, 115200, 19200, 38400, 57600, 4800, 2400, 1200,
+};
+#define NR_CANDIDATES	(sizeof(candidates)/sizeof(candidates[0]))
+
+/* anything else the speed command will refuse */
+static const DWORD valid_speeds[] = {
+	110, 300, 600, 1200, 2400, 4800, 9600, 14400, 19200, 38400,
+	57600, 115200, 128000, 230400, 256000, 460800, 921600,
+};
+
+/* the outcome of the last search on each port */
+static struct autobaud_result {
+	DWORD speed;		/* 0 if nothing was believable */
+	int score;
+	DWORD ms;
+	int tried;
+} results[MAXPORTS+1];
+
+int autobaud_valid(DWORD speed) {
+	int i;
+
+	for (i=0;i<sizeof(valid_speeds)/sizeof(valid_speeds[0]);i++) {
+		if (speed==valid_speeds[i]) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Score a sample from 0 to 100 on how much it looks like console text.
+ * Each poll that saw a framing, parity or break error costs 20.
+ */
+int autobaud_score(const unsigned char *buf, int len, int errors) {
+	int printable = 0;
+	int i, score;
+
+	if (len<=0) {
+		return 0;
+	}
+	for (i=0;i<len;i++) {
+		if ((buf[i]>=0x20 && buf[i]<0x7f) || buf[i]=='\r' || buf[i]=='\n'
+				|| buf[i]=='\t' || buf[i]==0x08) {
+			printable++;
+		}
+	}
+	score = printable*100/len - errors*20;
+	/* a single char could be a fluke */
+	if (len<3) {
+		score /= 2;
+	}
+	return score<0?0:score;
+}
+
+/* send a CR at the current speed and collect the reply */
+static int sample(HANDLE serial, OVERLAPPED *o, DWORD dwell, unsigned char *buf, int *errors) {
+	DWORD start = GetTickCount();
+	DWORD size, flags;
+	COMSTAT cs;
+	int len = 0;
+
+	*errors = 0;
+	PurgeComm(serial,PURGE_RXCLEAR|PURGE_RXABORT);
+	ClearCommError(serial,&flags,&cs);
+
+	ResetEvent(o->hEvent);
+	if (!WriteFile(serial,"\r",1,&size,o)) {
+		if (GetLastError()!=ERROR_IO_PENDING) {
+			return -1;
+		}
+		GetOverlappedResult(serial,o,&size,TRUE);
+	}
+
+	while (len<AUTOBAUD_SAMPLE && GetTickCount()-start < dwell) {
+		ResetEvent(o->hEvent);
+		if (!ReadFile(serial,buf+len,AUTOBAUD_SAMPLE-len,&size,o)) {
+			if (GetLastError()!=ERROR_IO_PENDING
+					|| !GetOverlappedResult(serial,o,&size,TRUE)) {
+				return -1;
+			}
+		}
+		len += size;
+		if (ClearCommError(serial,&flags,&cs)
+				&& (flags & (CE_FRAME|CE_RXPARITY|CE_BREAK))) {
+			(*errors)++;
+		}
+	}
+	return len;
+}
+
+/*
+ * Try the candidate speeds on an open port, within the time budget.
+ * On return the port and dcb are set to the best speed found, which is
+ * returned, or left as they were if nothing convincing turned up, when
+ * 0 is returned.
+ */
+DWORD autobaud_detect(HANDLE serial, DCB *dcb, int port) {
+	unsigned char buf[AUTOBAUD_SAMPLE];
+	DWORD start = GetTickCount();
+	DWORD original = dcb->BaudRate;
+	DWORD best = 0;
+	DWORD dwell = autobaud_timeout/NR_CANDIDATES;
+	COMMTIMEOUTS t = {0};
+	OVERLAPPED o = {0};
+	int best_score = 0;
+	int i, len, errors, score, tried = 0;
+
+	if (dwell<100) {
+		dwell = 100;
+	}
+
+	/* short reads so that the dwell time is kept */
+	t.ReadIntervalTimeout = 20;
+	t.ReadTotalTimeoutConstant = 50;
+	SetCommTimeouts(serial,&t);
+	o.hEvent = CreateEvent(NULL,TRUE,FALSE,NULL);
+
+	for (i=0;i<NR_CANDIDATES && GetTickCount()-start < autobaud_timeout;i++) {
+		dcb->BaudRate = candidates[i];
+		if (!SetCommState(serial,dcb)) {
+			continue;
+		}
+		if ((len = sample(serial,&o,dwell,buf,&errors))<0) {
+			break;
+		}
+		tried++;
+		score = autobaud_score(buf,len,errors);
+		dprintf(2,"wconsd: autobaud COM%i %lu: %i bytes, %i errors, score %i\n",
+			port,candidates[i],len,errors,score);
+		if (score>best_score) {
+			best_score = score;
+			best = candidates[i];
+		}
+		if (score>=AUTOBAUD_GOOD) {
+			break;
+		}
+	}
+	CloseHandle(o.hEvent);
+
+	if (best_score<AUTOBAUD_MIN) {
+		best = 0;
+	}
+	dcb->BaudRate = best?best:original;
+	SetCommState(serial,dcb);
+	PurgeComm(serial,PURGE_RXCLEAR|PURGE_RXABORT);
+
+	if (port>=1 && port<=MAXPORTS) {
+		results[port].speed = best;
+		results[port].score = best_score;
+		results[port].ms = GetTickCount()-start;
+		results[port].tried = tried;
+	}
+	dprintf(1,"wconsd: autobaud COM%i chose %lu (score %i) in %lu ms\n",
+		port,dcb->BaudRate,best_score,GetTickCount()-start);
+	return best;
+}
+
+static int cmd_showautobaud(struct cli_def *cli, char *command, char *argv[], int argc) {
+	int port;
+
+	cli_print(cli, "autobaud %s, %i ms budget",
+		autobaud_enabled?"enabled":"disabled",autobaud_timeout);
+	cli_print(cli, "port    speed score tried     ms");
+	for (port=1;port<=MAXPORTS;port++) {
+		struct autobaud_result *r = &results[port];
+
+		if (!r->tried) {
+			continue;
+		}
+		cli_print(cli, "COM%-2i %8lu %5i %5i %6lu",
+			port,r->speed,r->score,r->tried,r->ms);
+	}
+	return CLI_OK;
+}
+
+static int cmd_cautobaud(struct cli_def *cli, char *command, char *argv[], int argc) {
+	if (argc!=1) {
+		cli_print(cli,"Need a single value");
+		return CLI_ERROR;
+	}
+
+	if (strstr(command,"timeout")) {
+		if (atoi(argv[0])<100) {
+			cli_print(cli,"Timeout must be at least 100ms");
+			return CLI_ERROR;
+		}
+		autobaud_timeout = atoi(argv[0]);
+	} else {
+		autobaud_enabled = atoi(argv[0]);
+	}
+	return CLI_OK;
+}
+
+/* show the config for this module */
+static int this_showrun(struct cli_def *cli) {
+	cli_print(cli, "autobaud enable %i",autobaud_enabled);
+	cli_print(cli, "autobaud timeout %i",autobaud_timeout);
+	return CLI_OK;
+}
+
+/* Our local module definition */
+static struct module_def this_module = {
+	.name = "autobaud",
+	.desc = "Serial speed detection",
+	.showrun = this_showrun,
+};
+
+/* initialise and register this module */
+int autobaud_init(struct cli_def *cli) {
+	cli_register_command(cli, lookup_parent("show"), "autobaud", cmd_showautobaud,
+		PRIVILEGE_UNPRIVILEGED, MODE_EXEC, "Results of serial speed detection");
+
+	register_parent("config autobaud",
+		cli_register_command(cli, NULL, "autobaud", NULL, PRIVILEGE_PRIVILEGED,
+		MODE_CONFIG, "Serial speed detection"));
+
+	cli_register_command(cli, lookup_parent("config autobaud"), "enable", cmd_cautobaud,
+		PRIVILEGE_PRIVILEGED, MODE_CONFIG, "Detect the speed when a port is opened (0/1)");
+
+	cli_register_command(cli, lookup_parent("config autobaud"), "timeout", cmd_cautobaud,
+		PRIVILEGE_PRIVILEGED, MODE_CONFIG, "Milliseconds the detection may take");
+
+	register_module(&this_module);
+	return 0;
+}
@@ -0,0 +1,13 @@
+/*
+ * autobaud.h - guess the speed of whatever is on a serial port
+ *
+ */
+
+/* set to nonzero to detect the speed whenever a port is opened */
+extern int autobaud_enabled;
+
+int autobaud_valid(DWORD speed);
+int autobaud_score(const unsigned char *buf, int len, int errors);
+DWORD autobaud_detect(HANDLE serial, DCB *dcb, int port);
+
+int autobaud_init(struct cli_def *);
@@ -0,0 +1,206 @@
+/*
+ * autobaudtest.c - check speed detection against a simulated device
+ *
+ * Copyright (c) 2010 Hamish Coleman <hamish@zot.org>
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ *   autobaudtest
+ *
+ * First autobaud_score is given samples of console text and of what
+ * text looks like when it is received at the wrong speed.  Then
+ * autobaud_detect is run on a pty opened through the posix layer, with
+ * a thread on the master side playing a device that answers a CR with
+ * a prompt at its own speed and with garbage at any other, one that
+ * only ever sends garbage, and one that says nothing.  The pty does not
+ * care about the speed, so the device looks at what the line was last
+ * set to, and takes that as what it would have heard.
+ *
+ * Each check prints a line, and the exit status is the number that
+ * failed, for 'make test-native'.
+ */
+
+#define _GNU_SOURCE
+#include <poll.h>
+#include <pthread.h>
+#include <pty.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "windows.h"
+#include "libcli/libcli/libcli.h"
+#include "autobaud.h"
+
+#define DEVICE_PROMPT	1	/* a prompt at its speed, garbage otherwise */
+#define DEVICE_GARBAGE	2	/* garbage at every speed */
+#define DEVICE_SILENT	3
+
+static int failed;
+
+/* what wconsd_dprintf would log, kept quiet */
+int dprintf(unsigned char severity, const char *fmt, ...) {
+	return 0;
+}
+
+static void check(int ok, const char *what) {
+	printf("%s %s\n",ok?"ok  ":"FAIL",what);
+	if (!ok) {
+		failed++;
+	}
+}
+
+/* text sent at 9600 and received at 115200 looks much like this */
+static const unsigned char garbage[] = {
+	0x00, 0xf8, 0x80, 0x00, 0xfe, 0x00, 0x80, 0xf0, 0x00, 0x78, 0x86, 0xe0,
+	0x00, 0x00, 0xf8, 0x1e, 0x80, 0x00, 0xfe, 0xc0,
+};
+static const unsigned char prompt[] = "\r\nrouter login: ";
+
+static void scores(void) {
+	static const unsigned char banner[] =
+		"\r\nUser Access Verification\r\n\r\nUsername: ";
+	unsigned char mixed[sizeof(banner)-1+sizeof(garbage)];
+
+	check(autobaud_score(prompt,sizeof(prompt)-1,0)>=90,"a prompt scores high");
+	check(autobaud_score(banner,sizeof(banner)-1,0)>=90,"a banner scores high");
+	check(autobaud_score(garbage,sizeof(garbage),0)<50,"garbage scores low");
+	check(autobaud_score(prompt,sizeof(prompt)-1,3)<autobaud_score(prompt,sizeof(prompt)-1,0),
+		"line errors lower the score");
+	check(autobaud_score(prompt,sizeof(prompt)-1,5)==0,"many line errors score nothing");
+	check(autobaud_score(prompt,0,0)==0,"nothing scores nothing");
+	check(autobaud_score((const unsigned char *)"ok",2,0)<90,
+		"a couple of chars is not convincing");
+
+	memcpy(mixed,banner,sizeof(banner)-1);
+	memcpy(mixed+sizeof(banner)-1,garbage,sizeof(garbage));
+	check(autobaud_score(mixed,sizeof(mixed),0) < autobaud_score(banner,sizeof(banner)-1,0),
+		"garbage after text lowers the score");
+
+	check(autobaud_valid(9600) && autobaud_valid(115200) && autobaud_valid(921600),
+		"standard speeds are valid");
+	check(!autobaud_valid(0) && !autobaud_valid(9601) && !autobaud_valid(12345),
+		"odd speeds are not");
+}
+
+struct device {
+	int master;
+	int kind;
+	speed_t speed;		/* the one it answers properly at */
+	volatile int run;
+};
+
+static void *device_thread(void *arg) {
+	struct device *d = arg;
+	struct pollfd pfd;
+	struct termios t;
+	unsigned char buf[64];
+	int i, n;
+
+	pfd.fd = d->master;
+	pfd.events = POLLIN;
+	while (d->run) {
+		if (poll(&pfd,1,50)!=1 || (n = read(d->master,buf,sizeof(buf)))<=0) {
+			continue;
+		}
+		for (i=0;i<n;i++) {
+			if (buf[i]!='\r' || d->kind==DEVICE_SILENT) {
+				continue;
+			}
+			if (d->kind==DEVICE_PROMPT && !tcgetattr(d->master,&t)
+					&& cfgetospeed(&t)==d->speed) {
+				n = write(d->master,prompt,sizeof(prompt)-1);
+			} else {
+				n = write(d->master,garbage,sizeof(garbage));
+			}
+			break;
+		}
+	}
+	return NULL;
+}
+
+/* run the detection on a fresh pty against one kind of device */
+static DWORD detect(int kind, speed_t speed, DWORD *left_at) {
+	struct device d;
+	char name[64], path[80];
+	pthread_t thread;
+	int slave;
+	DWORD found;
+	HANDLE h;
+	DCB dcb;
+
+	if (openpty(&d.master,&slave,name,NULL,NULL)) {
+		perror("openpty");
+		return -1;
+	}
+	close(slave);
+	snprintf(path,sizeof(path),"\\\\.\\%s",name);
+	h = CreateFile(path,GENERIC_READ|GENERIC_WRITE,0,NULL,
+		OPEN_EXISTING,FILE_FLAG_OVERLAPPED,NULL);
+	if (h==INVALID_HANDLE_VALUE) {
+		close(d.master);
+		return -1;
+	}
+	memset(&dcb,0,sizeof(dcb));
+	dcb.DCBlength = sizeof(dcb);
+	GetCommState(h,&dcb);
+	dcb.BaudRate = 2400;
+	dcb.ByteSize = 8;
+	dcb.Parity = NOPARITY;
+	dcb.StopBits = ONESTOPBIT;
+	SetCommState(h,&dcb);
+
+	d.kind = kind;
+	d.speed = speed;
+	d.run = 1;
+	pthread_create(&thread,NULL,device_thread,&d);
+
+	found = autobaud_detect(h,&dcb,1);
+	GetCommState(h,&dcb);
+	*left_at = dcb.BaudRate;
+
+	d.run = 0;
+	pthread_join(thread,NULL);
+	CloseHandle(h);
+	close(d.master);
+	return found;
+}
+
+int main(int argc, char **argv) {
+	DWORD found, left_at;
+
+	setvbuf(stdout,NULL,_IOLBF,0);
+	scores();
+
+	found = detect(DEVICE_PROMPT,B19200,&left_at);
+	check(found==19200 && left_at==19200,"finds a device at 19200");
+
+	found = detect(DEVICE_PROMPT,B1200,&left_at);
+	check(found==1200 && left_at==1200,"finds a device at the last speed tried");
+
+	found = detect(DEVICE_GARBAGE,B0,&left_at);
+	check(found==0 && left_at==2400,"garbage at every speed leaves the line alone");
+
+	found = detect(DEVICE_SILENT,B0,&left_at);
+	check(found==0 && left_at==2400,"a silent device leaves the line alone");
+
+	printf("%i failed\n",failed);
+	return failed;
+}
@@ -0,0 +1,276 @@
+/*
+ * capread.c - read wconsd session capture files
+ *
+ * Copyright (c) 2010 Hamish Coleman <hamish@zot.org>
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * This is built with the native compiler, so the captures can be looked
+ * at on whatever machine they have been copied to.
+ *
+ *   capread [-s start] [-e end] [-c connid] [-a] [-f text|asciicast] file
+ *
+ * Times are either "yyyy-mm-dd hh:mm:ss", "hh:mm:ss" (on the day the
+ * capture was started) or "+seconds" from the start of the capture.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "capture.h"
+
+#define FORMAT_TEXT	0
+#define FORMAT_ASCIICAST 1
+
+static struct capture_file_header fh;
+
+/* wall clock seconds for a capture relative time */
+static time_t wall_time(uint64_t time_us) {
+	return (time_t)((fh.epoch_us + time_us) / 1000000);
+}
+
+/* convert a user supplied time into capture relative microseconds */
+static uint64_t parse_time(const char *s) {
+	struct tm tm;
+	time_t t;
+	int64_t us;
+	int Y,M,D,h,m,sec;
+
+	if (s[0]=='+') {
+		return (uint64_t)(atof(s+1)*1000000);
+	}
+
+	t = wall_time(0);
+	tm = *localtime(&t);
+	if (sscanf(s,"%d-%d-%d %d:%d:%d",&Y,&M,&D,&h,&m,&sec)==6) {
+		tm.tm_year = Y-1900;
+		tm.tm_mon = M-1;
+		tm.tm_mday = D;
+	} else if (sscanf(s,"%d:%d:%d",&h,&m,&sec)!=3) {
+		fprintf(stderr,"cannot parse time '%s'\n",s);
+		exit(1);
+	}
+	tm.tm_hour = h;
+	tm.tm_min = m;
+	tm.tm_sec = sec;
+	tm.tm_isdst = -1;
+
+	us = (int64_t)mktime(&tm)*1000000 - (int64_t)fh.epoch_us;
+	return us<0 ? 0 : (uint64_t)us;
+}
+
+/*
+ * Use the sparse index to find the offset of the last chunk starting at
+ * or before the given time.  Without an index, start at the beginning.
+ */
+static long seek_offset(const char *filename, uint64_t start_us) {
+	char name[4096];
+	struct capture_index *idx;
+	long offset = sizeof(fh);
+	long nr, lo, hi;
+	FILE *f;
+
+	snprintf(name,sizeof(name),"%s.idx",filename);
+	if (!start_us || !(f=fopen(name,"rb"))) {
+		return offset;
+	}
+
+	fseek(f,0,SEEK_END);
+	nr = ftell(f) / sizeof(*idx);
+	fseek(f,0,SEEK_SET);
+	if (!nr || !(idx=malloc(nr*sizeof(*idx)))) {
+		fclose(f);
+		return offset;
+	}
+	nr = fread(idx,sizeof(*idx),nr,f);
+	fclose(f);
+
+	/* binary search for the last entry with time_us <= start_us */
+	lo = 0;
+	hi = nr-1;
+	while (lo<=hi) {
+		long mid = (lo+hi)/2;
+		if (idx[mid].time_us <= start_us) {
+			offset = idx[mid].offset;
+			lo = mid+1;
+		} else {
+			hi = mid-1;
+		}
+	}
+	free(idx);
+	return offset;
+}
+
+/* print a json string body, as asciicast needs */
+static void json_escape(const unsigned char *buf, int len) {
+	int i;
+	for (i=0;i<len;i++) {
+		unsigned char ch = buf[i];
+		if (ch=='"' || ch=='\\') {
+			printf("\\%c",ch);
+		} else if (ch<0x20 || ch>=0x7f) {
+			/* not strictly unicode, but keeps the json valid */
+			printf("\\u%04x",ch);
+		} else {
+			putchar(ch);
+		}
+	}
+}
+
+static void text_stamp(uint64_t time_us) {
+	char buf[32];
+	time_t t = wall_time(time_us);
+	strftime(buf,sizeof(buf),"%Y-%m-%d %H:%M:%S",localtime(&t));
+	printf("[%s.%03u] ",buf,(unsigned)(((fh.epoch_us+time_us)/1000)%1000));
+}
+
+static void usage(const char *name) {
+	fprintf(stderr,
+		"Usage: %s [-s start] [-e end] [-c connid] [-a] [-t] [-f text|asciicast] file\n"
+		"   -s time    start at this time\n"
+		"   -e time    stop at this time\n"
+		"   -c connid  only show this connection\n"
+		"   -a         also show data sent to the serial port\n"
+		"   -t         prefix each line with its timestamp (text only)\n"
+		"   -f format  output text (default) or asciicast v2\n"
+		"\n"
+		"Times are 'yyyy-mm-dd hh:mm:ss', 'hh:mm:ss' or '+seconds'\n",
+		name);
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	char *start_s=NULL, *end_s=NULL;
+	uint64_t start_us=0, end_us=UINT64_MAX;
+	int format=FORMAT_TEXT;
+	int conn_id=0;
+	int all=0;
+	int stamps=0;
+	int bol=1;
+	struct capture_chunk_header chunk;
+	struct capture_record r;
+	unsigned char data[65536];
+	FILE *f;
+	int c;
+
+	while ((c=getopt(argc,argv,"s:e:c:atf:"))!=-1) {
+		switch (c) {
+			case 's': start_s=optarg; break;
+			case 'e': end_s=optarg; break;
+			case 'c': conn_id=atoi(optarg); break;
+			case 'a': all=1; break;
+			case 't': stamps=1; break;
+			case 'f':
+				if (!strcmp(optarg,"asciicast")) {
+					format=FORMAT_ASCIICAST;
+				} else if (strcmp(optarg,"text")) {
+					usage(argv[0]);
+				}
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (optind!=argc-1) {
+		usage(argv[0]);
+	}
+
+	if (!(f=fopen(argv[optind],"rb"))) {
+		perror(argv[optind]);
+		return 1;
+	}
+	if (fread(&fh,sizeof(fh),1,f)!=1 || memcmp(fh.magic,CAPTURE_MAGIC,4)
+			|| fh.version!=CAPTURE_VERSION) {
+		fprintf(stderr,"%s: not a capture file\n",argv[optind]);
+		return 1;
+	}
+
+	if (start_s) {
+		start_us = parse_time(start_s);
+	}
+	if (end_s) {
+		end_us = parse_time(end_s);
+	}
+
+	if (format==FORMAT_ASCIICAST) {
+		printf("{\"version\": 2, \"width\": 80, \"height\": 24, "
+			"\"timestamp\": %lu, \"title\": \"COM%u\"}\n",
+			(unsigned long)wall_time(start_us),fh.port);
+	}
+
+	fseek(f,seek_offset(argv[optind],start_us),SEEK_SET);
+
+	while (fread(&chunk,sizeof(chunk),1,f)==1) {
+		long next;
+
+		if (memcmp(chunk.magic,CAPTURE_CHUNK_MAGIC,4)) {
+			fprintf(stderr,"corrupt chunk at offset %ld\n",
+				ftell(f)-(long)sizeof(chunk));
+			return 1;
+		}
+		next = ftell(f) + chunk.bytes;
+
+		/* whole chunks can be skipped without reading the records */
+		if (chunk.last_us < start_us) {
+			fseek(f,next,SEEK_SET);
+			continue;
+		}
+		if (chunk.first_us > end_us) {
+			break;
+		}
+
+		while (ftell(f) < next && fread(&r,sizeof(r),1,f)==1) {
+			if (fread(data,1,r.length,f)!=r.length) {
+				break;
+			}
+			if (r.time_us < start_us || r.time_us > end_us) {
+				continue;
+			}
+			if ((conn_id && r.conn_id!=conn_id)
+					|| (!all && r.direction!=CAPTURE_DIR_RX)) {
+				continue;
+			}
+
+			if (format==FORMAT_ASCIICAST) {
+				printf("[%.6f, \"%s\", \"",
+					(double)(r.time_us-start_us)/1000000,
+					r.direction==CAPTURE_DIR_RX?"o":"i");
+				json_escape(data,r.length);
+				printf("\"]\n");
+			} else if (stamps) {
+				int i;
+				for (i=0;i<r.length;i++) {
+					if (bol) {
+						text_stamp(r.time_us);
+					}
+					putchar(data[i]);
+					bol = data[i]=='\n';
+				}
+			} else {
+				fwrite(data,1,r.length,stdout);
+			}
+		}
+		fseek(f,next,SEEK_SET);
+	}
+
+	fclose(f);
+	return 0;
+}
@@ -0,0 +1,380 @@
+/*
+ * capture.c - write timestamped binary session captures
+ *
+ * Copyright (c) 2010 Hamish Coleman <hamish@zot.org>
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * The data path only ever appends a record to an in-memory buffer for
+ * its port.  A single writer thread wakes every capture_flush ms (or
+ * sooner if a buffer is getting full), swaps the buffer for its spare and
+ * writes it out as one chunk.  If the disk cannot keep up, records are
+ * dropped and counted rather than blocking the serial reader.
+ *
+ * See capture.h for the file format.
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libcli/libcli/libcli.h"
+#include "module.h"
+#include "debug.h"
+#include "capture.h"
+
+#define MAXPORTS	16
+
+static char capture_dir[MAX_PATH];	/* empty means capture is disabled */
+static int capture_flush = 250;		/* ms between writes */
+static int capture_bufsize = 65536;	/* bytes buffered per port */
+
+struct capture_port {
+	CRITICAL_SECTION lock;
+	unsigned char *buf;	/* records being gathered */
+	unsigned char *spare;	/* buffer being written by the writer thread */
+	int used;
+	struct capture_chunk_header chunk;
+
+	/* only touched by the writer thread */
+	HANDLE file;
+	HANDLE index;
+	uint64_t offset;	/* current size of the capture file */
+	uint64_t last_index_us;
+	int failed;		/* could not open or write the files, dont keep trying */
+};
+static struct capture_port ports[MAXPORTS+1];
+
+static HANDLE flushEvent;
+static HANDLE writerThread;
+static volatile int writer_run;
+
+static LARGE_INTEGER start_count;	/* performance counter at time zero */
+static LARGE_INTEGER count_freq;
+static uint64_t start_epoch_us;		/* wall clock at time zero */
+
+static struct {
+	LONG records;
+	LONG dropped;
+	LONG chunks;
+	LONGLONG bytes;
+} counts;
+
+/* microseconds since the capture epoch */
+static uint64_t capture_now(void) {
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	return (uint64_t)(now.QuadPart - start_count.QuadPart) * 1000000
+		/ count_freq.QuadPart;
+}
+
+/*
+ * Called from the data path - must never block on anything but the
+ * per port lock, which is only held for memcpy sized amounts of time
+ */
+void capture_data(int port, int conn_id, int direction, const void *buf, int len) {
+	struct capture_port *p;
+	struct capture_record r;
+
+	if (!capture_dir[0] || len<=0 || port<1 || port>MAXPORTS) {
+		return;
+	}
+	p = &ports[port];
+
+	r.time_us = capture_now();
+	r.conn_id = conn_id;
+	r.length = len;
+	r.direction = direction;
+	r.reserved = 0;
+
+	EnterCriticalSection(&p->lock);
+	if (!p->buf) {
+		p->buf = malloc(capture_bufsize);
+		p->spare = malloc(capture_bufsize);
+		if (!p->buf || !p->spare) {
+			free(p->buf);
+			free(p->spare);
+			p->buf = p->spare = NULL;
+		}
+	}
+	if (!p->buf || p->used + sizeof(r) + len > capture_bufsize) {
+		LeaveCriticalSection(&p->lock);
+		InterlockedIncrement(&counts.dropped);
+		SetEvent(flushEvent);
+		return;
+	}
+
+	if (!p->chunk.records) {
+		p->chunk.first_us = r.time_us;
+	}
+	p->chunk.last_us = r.time_us;
+	p->chunk.records++;
+
+	memcpy(p->buf+p->used,&r,sizeof(r));
+	memcpy(p->buf+p->used+sizeof(r),buf,len);
+	p->used += sizeof(r)+len;
+
+	if (p->used > capture_bufsize/2) {
+		SetEvent(flushEvent);
+	}
+	LeaveCriticalSection(&p->lock);
+	InterlockedIncrement(&counts.records);
+}
+
+static int write_all(HANDLE h, const void *buf, DWORD len) {
+	DWORD written;
+	if (!WriteFile(h,buf,len,&written,NULL) || written!=len) {
+		return -1;
+	}
+	return 0;
+}
+
+/* open the capture and index files for a port, writer thread only */
+static int capture_open(int port) {
+	struct capture_port *p = &ports[port];
+	struct capture_file_header fh;
+	char name[MAX_PATH+64];	/* the directory, COMn-date-time, .wcap and .idx */
+	SYSTEMTIME t;
+
+	GetLocalTime(&t);
+	snprintf(name,sizeof(name),"%s/COM%i-%04i%02i%02i-%02i%02i%02i.wcap",
+		capture_dir,port,t.wYear,t.wMonth,t.wDay,
+		t.wHour,t.wMinute,t.wSecond);
+
+	p->file = CreateFile(name,FILE_APPEND_DATA,FILE_SHARE_READ,NULL,
+		OPEN_ALWAYS,FILE_ATTRIBUTE_NORMAL,NULL);
+	strcat(name,".idx");
+	p->index = CreateFile(name,FILE_APPEND_DATA,FILE_SHARE_READ,NULL,
+		OPEN_ALWAYS,FILE_ATTRIBUTE_NORMAL,NULL);
+	if (p->file==INVALID_HANDLE_VALUE || p->index==INVALID_HANDLE_VALUE) {
+		dprintf(1,"wconsd: cannot create capture file %s\n",name);
+		CloseHandle(p->file);
+		CloseHandle(p->index);
+		p->file = p->index = NULL;
+		return -1;
+	}
+
+	memcpy(fh.magic,CAPTURE_MAGIC,4);
+	fh.version = CAPTURE_VERSION;
+	fh.port = port;
+	fh.epoch_us = start_epoch_us;
+	if (write_all(p->file,&fh,sizeof(fh))) {
+		dprintf(1,"wconsd: cannot write capture header for COM%i\n",port);
+		CloseHandle(p->file);
+		CloseHandle(p->index);
+		p->file = p->index = NULL;
+		return -1;
+	}
+	p->offset = sizeof(fh);
+	p->last_index_us = 0;
+	return 0;
+}
+
+/*
+ * A write failed, maybe part way, so the offsets the index would be given
+ * from now on are wrong.  Stop capturing the port: what is on disk so far
+ * can still be read, up to the broken chunk.
+ */
+static void capture_fail(int port, int records) {
+	struct capture_port *p = &ports[port];
+
+	dprintf(1,"wconsd: capture write error %lu on COM%i, no longer capturing it\n",
+		GetLastError(),port);
+	CloseHandle(p->file);
+	CloseHandle(p->index);
+	p->file = p->index = NULL;
+	p->failed = 1;
+	InterlockedExchangeAdd(&counts.dropped,records);
+}
+
+/* write out whatever has been gathered for one port, writer thread only */
+static void capture_flush_port(int port) {
+	struct capture_port *p = &ports[port];
+	struct capture_chunk_header chunk;
+	unsigned char *buf;
+
+	EnterCriticalSection(&p->lock);
+	if (!p->used) {
+		LeaveCriticalSection(&p->lock);
+		return;
+	}
+	chunk = p->chunk;
+	chunk.bytes = p->used;
+	buf = p->buf;
+	p->buf = p->spare;
+	p->spare = buf;
+	p->used = 0;
+	p->chunk.records = 0;
+	LeaveCriticalSection(&p->lock);
+
+	if (!p->file && !p->failed && capture_open(port)) {
+		p->failed = 1;
+	}
+	if (p->failed) {
+		InterlockedExchangeAdd(&counts.dropped,chunk.records);
+		return;
+	}
+
+	memcpy(chunk.magic,CAPTURE_CHUNK_MAGIC,4);
+	chunk.reserved = 0;
+
+	if (!p->last_index_us || chunk.first_us - p->last_index_us >= CAPTURE_INDEX_US) {
+		struct capture_index idx;
+		idx.time_us = chunk.first_us;
+		idx.offset = p->offset;
+		if (write_all(p->index,&idx,sizeof(idx))) {
+			capture_fail(port,chunk.records);
+			return;
+		}
+		p->last_index_us = chunk.first_us;
+	}
+
+	if (write_all(p->file,&chunk,sizeof(chunk)) || write_all(p->file,buf,chunk.bytes)) {
+		capture_fail(port,chunk.records);
+		return;
+	}
+	p->offset += sizeof(chunk) + chunk.bytes;
+	InterlockedIncrement(&counts.chunks);
+	InterlockedExchangeAdd64(&counts.bytes,sizeof(chunk)+chunk.bytes);
+}
+
+static DWORD WINAPI capture_writer(LPVOID lpParam) {
+	int port;
+
+	while (writer_run) {
+		WaitForSingleObject(flushEvent,capture_flush);
+		for (port=1;port<=MAXPORTS;port++) {
+			capture_flush_port(port);
+		}
+	}
+	/* one last time, for anything written while we were busy */
+	for (port=1;port<=MAXPORTS;port++) {
+		capture_flush_port(port);
+		if (ports[port].file) {
+			CloseHandle(ports[port].file);
+			CloseHandle(ports[port].index);
+		}
+	}
+	return 0;
+}
+
+/* flush everything to disk and stop the writer thread */
+void capture_shutdown(void) {
+	if (!writerThread) {
+		return;
+	}
+	writer_run = 0;
+	SetEvent(flushEvent);
+	WaitForSingleObject(writerThread,5000);
+	CloseHandle(writerThread);
+	writerThread = NULL;
+}
+
+static int cmd_showcapture(struct cli_def *cli, char *command, char *argv[], int argc) {
+	cli_print(cli, "directory        %s",capture_dir[0]?capture_dir:"(disabled)");
+	cli_print(cli, "records          %li",counts.records);
+	cli_print(cli, "records dropped  %li",counts.dropped);
+	cli_print(cli, "chunks written   %li",counts.chunks);
+	cli_print(cli, "bytes written    %.0f",(double)counts.bytes);
+	return CLI_OK;
+}
+
+static int cmd_ccapture(struct cli_def *cli, char *command, char *argv[], int argc) {
+	if (argc!=1) {
+		cli_print(cli,"Need a single value");
+		return CLI_ERROR;
+	}
+
+	if (strstr(command,"directory")) {
+		if (writerThread) {
+			cli_print(cli,"The capture directory can only be set once");
+			return CLI_ERROR;
+		}
+		snprintf(capture_dir,sizeof(capture_dir),"%s",argv[0]);
+		writer_run = 1;
+		writerThread = CreateThread(NULL,0,capture_writer,NULL,0,NULL);
+	} else if (strstr(command,"flush")) {
+		if (atoi(argv[0])<10) {
+			cli_print(cli,"Flush interval must be at least 10ms");
+			return CLI_ERROR;
+		}
+		capture_flush = atoi(argv[0]);
+	} else {
+		if (atoi(argv[0])<4096 || capture_dir[0]) {
+			cli_print(cli,"Buffer must be at least 4096 and set before the directory");
+			return CLI_ERROR;
+		}
+		capture_bufsize = atoi(argv[0]);
+	}
+	return CLI_OK;
+}
+
+/* show the config for this module */
+static int this_showrun(struct cli_def *cli) {
+	cli_print(cli, "capture buffer %i",capture_bufsize);
+	cli_print(cli, "capture flush %i",capture_flush);
+	if (capture_dir[0]) {
+		cli_print(cli, "capture directory %s",capture_dir);
+	}
+	return CLI_OK;
+}
+
+/* Our local module definition */
+static struct module_def this_module = {
+	.name = "capture",
+	.desc = "Timestamped session capture",
+	.showrun = this_showrun,
+};
+
+/* initialise and register this module */
+int capture_init(struct cli_def *cli) {
+	FILETIME ft;
+	int i;
+
+	for (i=0;i<=MAXPORTS;i++) {
+		InitializeCriticalSection(&ports[i].lock);
+	}
+	flushEvent = CreateEvent(NULL,FALSE,FALSE,NULL);
+
+	/* FILETIME is in 100ns units since 1601 */
+	GetSystemTimeAsFileTime(&ft);
+	start_epoch_us = ((((uint64_t)ft.dwHighDateTime)<<32 | ft.dwLowDateTime) / 10)
+		- 11644473600000000ULL;
+	QueryPerformanceFrequency(&count_freq);
+	QueryPerformanceCounter(&start_count);
+
+	cli_register_command(cli, lookup_parent("show"), "capture", cmd_showcapture,
+		PRIVILEGE_UNPRIVILEGED, MODE_EXEC, "Session capture statistics");
+
+	register_parent("config capture",
+		cli_register_command(cli, NULL, "capture", NULL, PRIVILEGE_PRIVILEGED,
+		MODE_CONFIG, "Session capture"));
+
+	cli_register_command(cli, lookup_parent("config capture"), "directory", cmd_ccapture,
+		PRIVILEGE_PRIVILEGED, MODE_CONFIG, "Start capturing to this directory");
+
+	cli_register_command(cli, lookup_parent("config capture"), "flush", cmd_ccapture,
+		PRIVILEGE_PRIVILEGED, MODE_CONFIG, "ms between writes to disk");
+
+	cli_register_command(cli, lookup_parent("config capture"), "buffer", cmd_ccapture,
+		PRIVILEGE_PRIVILEGED, MODE_CONFIG, "bytes buffered per port");
+
+	register_module(&this_module);
+	return 0;
+}
@@ -0,0 +1,62 @@
+/*
+ * capture.h - timestamped binary session capture file format
+ *
+ * This file is shared between the wconsd writer and the capread tool, so
+ * it must only use portable types.  All values are little-endian.
+ *
+ * A capture file (COMn-yyyymmdd-hhmmss.wcap) is a capture_file_header
+ * followed by chunks.  Each chunk is a capture_chunk_header followed by
+ * 'bytes' bytes of records, each being a capture_record header and
+ * 'length' bytes of data.  Files are only ever appended to.
+ *
+ * Beside it is an index file (same name, with .idx appended) holding a
+ * capture_index entry for a chunk whenever at least CAPTURE_INDEX_US has
+ * passed since the last entry, allowing a reader to seek by time.
+ */
+
+#include <stdint.h>
+
+#define CAPTURE_MAGIC		"WCAP"
+#define CAPTURE_CHUNK_MAGIC	"WCHK"
+#define CAPTURE_VERSION		1
+
+#define CAPTURE_INDEX_US	1000000	/* sparse index granularity */
+
+/* record directions */
+#define CAPTURE_DIR_RX		0	/* read from the serial port */
+#define CAPTURE_DIR_TX		1	/* written to the serial port */
+
+struct capture_file_header {
+	char magic[4];
+	uint16_t version;
+	uint16_t port;		/* COM port number */
+	uint64_t epoch_us;	/* wall clock (us since 1970) at time_us zero */
+};
+
+struct capture_chunk_header {
+	char magic[4];
+	uint32_t records;
+	uint32_t bytes;		/* size of the records after this header */
+	uint32_t reserved;
+	uint64_t first_us;	/* time of the first record */
+	uint64_t last_us;	/* time of the last record */
+};
+
+struct capture_record {
+	uint64_t time_us;	/* monotonic us since the file epoch */
+	uint32_t conn_id;	/* wconsd connection id */
+	uint16_t length;	/* bytes of data following */
+	uint8_t direction;	/* CAPTURE_DIR_* */
+	uint8_t reserved;
+};
+
+struct capture_index {
+	uint64_t time_us;	/* first_us of the chunk */
+	uint64_t offset;	/* file offset of the chunk header */
+};
+
+/* the writer, inside wconsd */
+struct cli_def;
+void capture_data(int port, int conn_id, int direction, const void *buf, int len);
+void capture_shutdown(void);
+int capture_init(struct cli_def *);
@@ -0,0 +1,247 @@
+/*
+ * commtest.c - check the native build's serial calls against a pty
+ *
+ * Copyright (c) 2010 Hamish Coleman <hamish@zot.org>
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ *   commtest
+ *
+ * Opens a pty through posix/comm.c the way serial_open does, and checks
+ * that the line settings wconsd can ask for reach termios, that the ones
+ * it cannot are refused, and that reads and writes get through with the
+ * timeouts wconsd uses.  This process plays the device on the pty's
+ * master side.
+ *
+ * A pty keeps the speed and stop bits it is given, and GetCommState must
+ * report them back, but it forces 8 bits and no parity whatever it is
+ * asked for.  Those are checked in what SetCommState passed to tcsetattr,
+ * which is wrapped at link time (see the Makefile) to keep a copy.
+ *
+ * Each check prints a line, and the exit status is the number that
+ * failed, for 'make test-native'.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pty.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "winsock2.h"
+
+static int failed;
+static struct termios asked;	/* the last termios SetCommState set */
+
+int __real_tcsetattr(int fd, int action, const struct termios *t);
+
+int __wrap_tcsetattr(int fd, int action, const struct termios *t) {
+	asked = *t;
+	return __real_tcsetattr(fd,action,t);
+}
+
+static void check(int ok, const char *what) {
+	printf("%s %s\n",ok?"ok  ":"FAIL",what);
+	if (!ok) {
+		failed++;
+	}
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+/* set the line the way serial_setline does, and read it back */
+static int setline(HANDLE h, DWORD speed, BYTE data, BYTE parity, BYTE stop, DCB *got) {
+	DCB dcb;
+
+	memset(&dcb,0,sizeof(dcb));
+	dcb.DCBlength = sizeof(dcb);
+	if (!GetCommState(h,&dcb)) {
+		return 0;
+	}
+	dcb.BaudRate = speed;
+	dcb.ByteSize = data;
+	dcb.Parity = parity;
+	dcb.StopBits = stop;
+	dcb.fParity = parity!=NOPARITY;
+	if (!SetCommState(h,&dcb)) {
+		return 0;
+	}
+	return GetCommState(h,got);
+}
+
+static void line_settings(HANDLE h) {
+	static const DWORD speeds[] = { 300, 9600, 19200, 115200, 921600 };
+	static const struct {
+		BYTE parity;
+		tcflag_t cflag;
+	} parities[] = {
+		{ NOPARITY, 0 },
+		{ ODDPARITY, PARENB|PARODD },
+		{ EVENPARITY, PARENB },
+		{ MARKPARITY, PARENB|PARODD|CMSPAR },
+		{ SPACEPARITY, PARENB|CMSPAR },
+	};
+	static const tcflag_t sizes[] = { CS5, CS6, CS7, CS8 };
+	char what[80];
+	DCB got;
+	int i, p, d, s;
+
+	for (i=0;i<sizeof(speeds)/sizeof(speeds[0]);i++) {
+		snprintf(what,sizeof(what),"speed %lu",(unsigned long)speeds[i]);
+		check(setline(h,speeds[i],8,NOPARITY,ONESTOPBIT,&got)
+			&& got.BaudRate==speeds[i]
+			&& cfgetospeed(&asked)==cfgetispeed(&asked),what);
+	}
+
+	for (d=5;d<=8;d++) {
+		for (p=0;p<sizeof(parities)/sizeof(parities[0]);p++) {
+			for (s=0;s<2;s++) {
+				BYTE stop = s ? TWOSTOPBITS : ONESTOPBIT;
+
+				snprintf(what,sizeof(what),"data %i parity %i stop %s",
+					d,parities[p].parity,s?"2":"1");
+				check(setline(h,9600,d,parities[p].parity,stop,&got)
+					&& got.StopBits==stop
+					&& (asked.c_cflag&CSIZE)==sizes[d-5]
+					&& (asked.c_cflag&(PARENB|PARODD|CMSPAR))==parities[p].cflag
+					&& !!(asked.c_cflag&CSTOPB)==s,what);
+			}
+		}
+	}
+
+	setline(h,9600,8,NOPARITY,ONESTOPBIT,&got);
+	check(!setline(h,12345,8,NOPARITY,ONESTOPBIT,&got)
+		&& GetLastError()==ERROR_INVALID_PARAMETER,"odd speed refused");
+	check(!setline(h,9600,9,NOPARITY,ONESTOPBIT,&got)
+		&& GetLastError()==ERROR_INVALID_PARAMETER,"9 data bits refused");
+	check(!setline(h,9600,8,7,ONESTOPBIT,&got)
+		&& GetLastError()==ERROR_INVALID_PARAMETER,"unknown parity refused");
+	check(GetCommState(h,&got) && got.BaudRate==9600 && got.StopBits==ONESTOPBIT,
+		"refused settings leave the line alone");
+}
+
+/* a read as wconsd's readers do it, returning the bytes and the ms taken */
+static int timed_read(HANDLE h, unsigned char *buf, DWORD len, double *ms) {
+	OVERLAPPED o = {0};
+	DWORD size = 0;
+	double t = now();
+
+	o.hEvent = CreateEvent(NULL,TRUE,FALSE,NULL);
+	if (!ReadFile(h,buf,len,&size,&o)) {
+		if (GetLastError()!=ERROR_IO_PENDING
+				|| !GetOverlappedResult(h,&o,&size,TRUE)) {
+			size = 0;
+		}
+	}
+	CloseHandle(o.hEvent);
+	*ms = (now()-t)*1000;
+	return size;
+}
+
+static void read_write(HANDLE h, int master) {
+	COMMTIMEOUTS wait_first = { MAXDWORD, MAXDWORD, 200, 0, 0 };
+	COMMTIMEOUTS poll_only = { MAXDWORD, 0, 0, 0, 0 };
+	static const unsigned char hello[] = "from the device\r\n";
+	static const unsigned char typed[] = "typed at the client\r";
+	unsigned char buf[256];
+	struct pollfd pfd;
+	OVERLAPPED o = {0};
+	DWORD size;
+	double ms;
+	int n;
+
+	o.hEvent = CreateEvent(NULL,TRUE,FALSE,NULL);
+	check(WriteFile(h,typed,sizeof(typed)-1,&size,&o)
+		|| (GetLastError()==ERROR_IO_PENDING && GetOverlappedResult(h,&o,&size,TRUE)),
+		"write");
+	pfd.fd = master;
+	pfd.events = POLLIN;
+	n = poll(&pfd,1,1000)==1 ? read(master,buf,sizeof(buf)) : -1;
+	check(size==sizeof(typed)-1 && n==size && !memcmp(buf,typed,n),
+		"device gets what was written");
+	CloseHandle(o.hEvent);
+
+	SetCommTimeouts(h,&wait_first);
+	n = timed_read(h,buf,sizeof(buf),&ms);
+	check(n==0 && ms>=150 && ms<1000,"read with nothing waits for the timeout");
+
+	if (write(master,hello,sizeof(hello)-1)!=sizeof(hello)-1) {
+		failed++;
+	}
+	n = timed_read(h,buf,sizeof(buf),&ms);
+	check(n==sizeof(hello)-1 && !memcmp(buf,hello,n) && ms<150,
+		"read returns what the device sent at once");
+
+	SetCommTimeouts(h,&poll_only);
+	n = timed_read(h,buf,sizeof(buf),&ms);
+	check(n==0 && ms<50,"read with MAXDWORD,0,0 returns at once");
+
+	if (write(master,hello,sizeof(hello)-1)!=sizeof(hello)-1) {
+		failed++;
+	}
+	usleep(50000);
+	check(PurgeComm(h,PURGE_RXCLEAR|PURGE_RXABORT),"purge");
+	n = timed_read(h,buf,sizeof(buf),&ms);
+	check(n==0,"purge drops what was waiting");
+}
+
+int main(int argc, char **argv) {
+	char name[64], path[80];
+	int master, slave;
+	HANDLE h, h2;
+
+	setvbuf(stdout,NULL,_IOLBF,0);
+	if (openpty(&master,&slave,name,NULL,NULL)) {
+		perror("openpty");
+		return 1;
+	}
+	/* CreateFile opens the slave itself, the master is the device */
+	close(slave);
+
+	snprintf(path,sizeof(path),"\\\\.\\%s",name);
+	h = CreateFile(path,GENERIC_READ|GENERIC_WRITE,0,NULL,
+		OPEN_EXISTING,FILE_FLAG_OVERLAPPED,NULL);
+	check(h!=INVALID_HANDLE_VALUE,"open");
+	if (h==INVALID_HANDLE_VALUE) {
+		return 1;
+	}
+	h2 = CreateFile(path,GENERIC_READ|GENERIC_WRITE,0,NULL,
+		OPEN_EXISTING,FILE_FLAG_OVERLAPPED,NULL);
+	check(h2==INVALID_HANDLE_VALUE,"a second open is refused");
+	if (h2!=INVALID_HANDLE_VALUE) {
+		CloseHandle(h2);
+	}
+
+	line_settings(h);
+	read_write(h,master);
+
+	CloseHandle(h);
+	close(master);
+	printf("%i failed\n",failed);
+	return failed;
+}
@@ -6,3 +6,5 @@
 
 #define DD	printf("debug: %s(%i)\n",__FILE__,__LINE__);
 
+/* log a message, if severity is at or below the current debug level */
+int dprintf(unsigned char severity, const char *fmt, ...);
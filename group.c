@@ -0,0 +1,501 @@
+/*
+ * group.c - sessions on, or watching, a group of ports at once
+ *
+ * Copyright (c) 2010 Hamish Coleman <hamish@zot.org>
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * A group is a named list of ports from the config.  A session on a
+ * group attaches a cursor to each of its ports, and whatever the client
+ * types goes to all of them: an overlapped write is started on every
+ * port before any of them is waited for, and each is timed as it
+ * completes, so one slow port holds up the next line but not the others'
+ * copies of this one.  What the ports print comes back a line at a time,
+ * each line prefixed with its port.
+ *
+ * A watch session only follows a group's ports - or all the open ones -
+ * without being a session on any of them.  The output of all the ports
+ * is merged in the order it was read: each member keeps the next read
+ * from its port in hand, and the oldest of those is always the next to
+ * be taken, so a quiet port holds nothing up and a busy one only gets
+ * ahead by as much as it actually printed first.
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libcli/libcli/libcli.h"
+#include "module.h"
+#include "debug.h"
+#include "capture.h"
+#include "line.h"
+#include "port.h"
+#include "group.h"
+
+#define MAXGROUPS	16
+#define GROUP_NAME	16
+#define GROUP_LINE	256	/* longer lines are split */
+#define GROUP_PREFIX	16	/* room for "COMnn: " and the CR LF */
+#define GROUP_IDLE	100	/* ms before a partial line is sent as it is */
+#define GROUP_WRITE	5000	/* ms a port is given to take a write */
+
+static struct group {
+	char name[GROUP_NAME];
+	int nr;
+	int port[LINE_PORTS];
+} groups[MAXGROUPS];
+
+/* how each port took the writes to it, from any group */
+static struct group_stats {
+	LONG writes;
+	LONG timeouts;		/* writes that were abandoned */
+	double last_ms;
+	double max_ms;
+} stats[LINE_PORTS+1];
+
+struct member {
+	int port;
+	struct port_cursor cursor;
+	OVERLAPPED o;
+	int stopped;		/* no longer being read, and said so */
+	uint64_t lost;		/* as already reported */
+	unsigned char next[GROUP_LINE];	/* the next read, waiting its turn */
+	int nextlen;
+	LONGLONG when;		/* when it was read */
+	char line[GROUP_LINE];	/* the line being put together */
+	int len;
+	DWORD last;		/* when the line last grew */
+};
+
+struct group_session {
+	struct group *group;
+	struct group all;	/* what "all" was when the session started */
+	int id;			/* the connection's */
+	int watch;		/* following the ports, not writing */
+	int nr;
+	struct member m[LINE_PORTS];
+	HANDLE stopEvent;
+	int stop;
+};
+
+static struct group *group_find(const char *name) {
+	int i;
+
+	for (i=0;i<MAXGROUPS;i++) {
+		if (groups[i].nr && !strcmp(groups[i].name,name)) {
+			return &groups[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Attach to each of the group's ports that can be had - or for a watch
+ * session, watch each of them that is open, "all" being every port that
+ * is.  The ones that cannot be had are listed in why[], and if none can
+ * the session is not opened.
+ */
+struct group_session *group_open(const char *name, int id, int watch, char *why, int whylen) {
+	struct group *gr = group_find(name);
+	struct group_session *g;
+	int used = 0;
+	int i, ret;
+
+	why[0] = 0;
+	if (!gr && !(watch && !strcmp(name,"all"))) {
+		snprintf(why,whylen,"there is no group %s",name);
+		return NULL;
+	}
+	if (!(g = calloc(1,sizeof(*g)))) {
+		snprintf(why,whylen,"out of memory");
+		return NULL;
+	}
+	if (!gr) {
+		gr = &g->all;
+		strcpy(gr->name,"all");
+		for (i=1;i<=LINE_PORTS;i++) {
+			if (port_open_now(i)) {
+				gr->port[gr->nr++] = i;
+			}
+		}
+	}
+	g->group = gr;
+	g->id = id;
+	g->watch = watch;
+	g->stopEvent = CreateEvent(NULL,TRUE,FALSE,NULL);
+
+	for (i=0;i<gr->nr;i++) {
+		struct member *m = &g->m[g->nr];
+
+		m->port = gr->port[i];
+		m->cursor.id = id;
+		if (watch) {
+			ret = port_watch(m->port,&m->cursor);
+		} else {
+			ret = port_attach(m->port,line_default(m->port),&m->cursor);
+		}
+		if (ret) {
+			if (used < whylen-16) {
+				used += snprintf(why+used,whylen-used,"%sCOM%i",used?", ":"",m->port);
+			}
+			continue;
+		}
+		m->o.hEvent = CreateEvent(NULL,TRUE,FALSE,NULL);
+		g->nr++;
+	}
+	if (used) {
+		snprintf(why+used,whylen-used,watch?" not open":" could not be opened");
+	} else if (!gr->nr) {
+		snprintf(why,whylen,"no ports are open");
+	}
+	if (!g->nr) {
+		group_close(g,0);
+		return NULL;
+	}
+	dprintf(1,"wconsd[%i]: opened %i of the %i ports in group %s\n",id,g->nr,gr->nr,name);
+	return g;
+}
+
+static void member_wrote(struct member *m, LARGE_INTEGER *start, LARGE_INTEGER *freq) {
+	struct group_stats *s = &stats[m->port];
+	LARGE_INTEGER end;
+	double ms;
+
+	QueryPerformanceCounter(&end);
+	ms = (end.QuadPart-start->QuadPart)*1000.0/freq->QuadPart;
+	InterlockedIncrement(&s->writes);
+	s->last_ms = ms;
+	if (ms > s->max_ms) {
+		s->max_ms = ms;
+	}
+}
+
+/*
+ * Write to every port in the group at once, returning when they have all
+ * taken it, or the slow ones have been given up on.
+ */
+int group_write(struct group_session *g, const unsigned char *buf, int len) {
+	LARGE_INTEGER start, freq;
+	HANDLE events[LINE_PORTS];
+	struct member *pending[LINE_PORTS];
+	struct member *m;
+	int i, n = 0;
+	DWORD done, r;
+
+	if (g->watch) {
+		return 0;
+	}
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&start);
+
+	/* start all of them before waiting for any */
+	for (i=0;i<g->nr;i++) {
+		m = &g->m[i];
+		if (m->stopped || port_write_start(&m->cursor)) {
+			/* or a spectator has taken it over */
+			continue;
+		}
+		capture_data(m->port,g->id,CAPTURE_DIR_TX,buf,len);
+		ResetEvent(m->o.hEvent);
+		if (WriteFile(m->cursor.serial,buf,len,&done,&m->o)) {
+			member_wrote(m,&start,&freq);
+		} else if (GetLastError()==ERROR_IO_PENDING) {
+			/* the role is kept until it finishes */
+			events[n] = m->o.hEvent;
+			pending[n++] = m;
+			continue;
+		} else {
+			dprintf(1,"wconsd[%i]: error %d writing to COM%i\n",
+				g->id,GetLastError(),m->port);
+		}
+		port_write_done(&m->cursor);
+	}
+
+	/* and time each one as it finishes */
+	while (n) {
+		r = WaitForMultipleObjects(n,events,FALSE,GROUP_WRITE);
+		if (r==WAIT_TIMEOUT || r==WAIT_FAILED) {
+			break;
+		}
+		i = r-WAIT_OBJECT_0;
+		m = pending[i];
+		GetOverlappedResult(m->cursor.serial,&m->o,&done,FALSE);
+		port_write_done(&m->cursor);
+		member_wrote(m,&start,&freq);
+		events[i] = events[--n];
+		pending[i] = pending[n];
+	}
+	for (i=0;i<n;i++) {
+		m = pending[i];
+		dprintf(1,"wconsd[%i]: COM%i did not take a write in %i ms\n",
+			g->id,m->port,GROUP_WRITE);
+		InterlockedIncrement(&stats[m->port].timeouts);
+		CancelIoEx(m->cursor.serial,&m->o);
+		GetOverlappedResult(m->cursor.serial,&m->o,&done,TRUE);
+		port_write_done(&m->cursor);
+	}
+	return len;
+}
+
+/* put out the member's line so far, with its prefix */
+static int member_line(struct member *m, unsigned char *out) {
+	int n = sprintf((char *)out,"COM%i: ",m->port);
+
+	memcpy(out+n,m->line,m->len);
+	n += m->len;
+	out[n++] = '\r';
+	out[n++] = '\n';
+	m->len = 0;
+	return n;
+}
+
+/* a note from us about a member, as a line of its own */
+static int member_note(struct member *m, unsigned char *out, const char *note) {
+	return sprintf((char *)out,"COM%i: [wconsd: %s]\r\n",m->port,note);
+}
+
+/* add what a member printed to its line, putting out each one finished */
+static int member_add(struct member *m, const unsigned char *buf, int len, unsigned char *out) {
+	int used = 0;
+	int i;
+
+	for (i=0;i<len;i++) {
+		if (buf[i]=='\r') {
+			continue;
+		}
+		if (buf[i]=='\n') {
+			used += member_line(m,out+used);
+			continue;
+		}
+		m->line[m->len++] = buf[i];
+		if (m->len==GROUP_LINE) {
+			used += member_line(m,out+used);
+		}
+	}
+	return used;
+}
+
+/* the member whose next read is the oldest, topping up any without one */
+static struct member *member_oldest(struct group_session *g) {
+	struct member *first = NULL;
+	struct member *m;
+	int i;
+
+	for (i=0;i<g->nr;i++) {
+		m = &g->m[i];
+		if (!m->nextlen) {
+			m->nextlen = port_read_stamped(&m->cursor,m->next,GROUP_LINE,&m->when);
+		}
+		if (m->nextlen && (!first || m->when < first->when)) {
+			first = m;
+		}
+	}
+	return first;
+}
+
+/*
+ * Wait for the ports in the group to print something, and return it as
+ * whole lines, in the order the ports were read - or as much of a line
+ * as has been waiting for a while, which is how a prompt gets through.
+ * len must be a good deal more than GROUP_LINE.  Returns -1 once the
+ * session is stopped.
+ */
+int group_read(struct group_session *g, unsigned char *out, int len) {
+	HANDLE events[LINE_PORTS+1];
+	struct member *m;
+	char note[48];
+	DWORD now, wait;
+	int used, i;
+
+	while (!g->stop) {
+		used = 0;
+		now = GetTickCount();
+		wait = 1000;
+
+		/* at worst each byte ends a line, with one in hand and a note */
+		while ((m = member_oldest(g)) &&
+		       m->nextlen <= (len-used-GROUP_LINE-4*GROUP_PREFIX)/GROUP_PREFIX) {
+			if (m->cursor.lost!=m->lost) {
+				snprintf(note,sizeof(note),"%.0f bytes lost",
+					(double)(m->cursor.lost-m->lost));
+				used += member_note(m,out+used,note);
+				m->lost = m->cursor.lost;
+			}
+			used += member_add(m,m->next,m->nextlen,out+used);
+			m->nextlen = 0;
+			m->last = now;
+		}
+
+		for (i=0;i<g->nr;i++) {
+			m = &g->m[i];
+			if (m->len && len-used > GROUP_LINE+GROUP_PREFIX) {
+				if (now-m->last >= GROUP_IDLE) {
+					used += member_line(m,out+used);
+				} else if (GROUP_IDLE-(now-m->last) < wait) {
+					wait = GROUP_IDLE-(now-m->last);
+				}
+			}
+			if (!m->stopped && !m->nextlen && !port_alive(&m->cursor) &&
+			    len-used > 2*GROUP_PREFIX+32) {
+				used += member_note(m,out+used,"no longer being read");
+				m->stopped = 1;
+			}
+			events[i] = m->cursor.event;
+		}
+		if (used) {
+			return used;
+		}
+		events[g->nr] = g->stopEvent;
+		WaitForMultipleObjects(g->nr+1,events,FALSE,wait);
+	}
+	return -1;
+}
+
+/* the ports in the session and how writes to them have been going */
+int group_describe(struct group_session *g, char *buf, int len) {
+	int used = 0;
+	int i;
+
+	used += snprintf(buf,len,"  %s=%s  ports=%i of %i\r\n",
+		g->watch?"watch":"group",g->group->name,g->nr,g->group->nr);
+	for (i=0;i<g->nr && used<len;i++) {
+		struct group_stats *s = &stats[g->m[i].port];
+
+		used += snprintf(buf+used,len-used,
+			"  COM%-2i %s  writes=%li  last=%.1fms  slowest=%.1fms  timeouts=%li\r\n",
+			g->m[i].port,g->m[i].stopped?"stopped":"open   ",
+			s->writes,s->last_ms,s->max_ms,s->timeouts);
+	}
+	return used<len ? used : len-1;
+}
+
+/* is it a watch session? */
+int group_watching(struct group_session *g) {
+	return g->watch;
+}
+
+/* get group_read to return, from another thread */
+void group_stop(struct group_session *g) {
+	g->stop = 1;
+	SetEvent(g->stopEvent);
+}
+
+/* detach from the ports, once nothing is reading or writing */
+void group_close(struct group_session *g, DWORD timeout) {
+	int i;
+
+	for (i=0;i<g->nr;i++) {
+		port_detach(&g->m[i].cursor,timeout);
+		CloseHandle(g->m[i].o.hEvent);
+	}
+	CloseHandle(g->stopEvent);
+	free(g);
+}
+
+static int cmd_showgroups(struct cli_def *cli, char *command, char *argv[], int argc) {
+	int i, j;
+
+	cli_print(cli, "group            port    writes  last write  slowest write  timeouts");
+	for (i=0;i<MAXGROUPS;i++) {
+		struct group *gr = &groups[i];
+
+		for (j=0;j<gr->nr;j++) {
+			struct group_stats *s = &stats[gr->port[j]];
+
+			cli_print(cli, "%-16s COM%-2i %8li %9.1fms %12.1fms %9li",
+				j ? "" : gr->name,gr->port[j],s->writes,s->last_ms,s->max_ms,
+				s->timeouts);
+		}
+	}
+	return CLI_OK;
+}
+
+/* group <name> [<port>...], with no ports removing it */
+static int cmd_cgroup(struct cli_def *cli, char *command, char *argv[], int argc) {
+	struct group *gr;
+	int i, n;
+
+	if (argc<1 || strlen(argv[0])>=GROUP_NAME || argc-1>LINE_PORTS) {
+		/* a group cannot be larger than the number of ports */
+		cli_print(cli,"Need a name of up to %i characters and at most %i ports",
+			GROUP_NAME-1,LINE_PORTS);
+		return CLI_ERROR;
+	}
+	for (i=1;i<argc;i++) {
+		n = atoi(argv[i]);
+		if (n<1 || n>LINE_PORTS) {
+			cli_print(cli,"Ports are from 1 to %i",LINE_PORTS);
+			return CLI_ERROR;
+		}
+	}
+
+	if (!(gr = group_find(argv[0]))) {
+		for (i=0;i<MAXGROUPS && groups[i].nr;i++) {
+		}
+		if (i==MAXGROUPS) {
+			cli_print(cli,"There can only be %i groups",MAXGROUPS);
+			return CLI_ERROR;
+		}
+		gr = &groups[i];
+	}
+	/* sessions already open keep the ports they have */
+	gr->nr = 0;
+	strcpy(gr->name,argv[0]);
+	for (i=1;i<argc;i++) {
+		gr->port[gr->nr++] = atoi(argv[i]);
+	}
+	return CLI_OK;
+}
+
+/* show the config for this module */
+static int this_showrun(struct cli_def *cli) {
+	char ports[LINE_PORTS*4];
+	int i, j, n;
+
+	for (i=0;i<MAXGROUPS;i++) {
+		if (!groups[i].nr) {
+			continue;
+		}
+		for (j=n=0;j<groups[i].nr;j++) {
+			n += sprintf(ports+n," %i",groups[i].port[j]);
+		}
+		cli_print(cli, "group %s%s",groups[i].name,ports);
+	}
+	return CLI_OK;
+}
+
+/* Our local module definition */
+static struct module_def this_module = {
+	.name = "group",
+	.desc = "Sessions on a group of ports at once",
+	.showrun = this_showrun,
+};
+
+/* initialise and register this module */
+int group_init(struct cli_def *cli) {
+	cli_register_command(cli, lookup_parent("show"), "groups", cmd_showgroups,
+		PRIVILEGE_UNPRIVILEGED, MODE_EXEC, "Port groups and how their writes went");
+
+	cli_register_command(cli, NULL, "group", cmd_cgroup,
+		PRIVILEGE_PRIVILEGED, MODE_CONFIG, "Name a group of up to 16 ports: group <name> <port>...");
+
+	register_module(&this_module);
+	return 0;
+}
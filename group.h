@@ -0,0 +1,15 @@
+/*
+ * group.h - sessions on, or watching, a group of ports at once
+ *
+ */
+
+struct group_session;
+
+struct group_session *group_open(const char *name, int id, int watch, char *why, int whylen);
+int group_write(struct group_session *, const unsigned char *, int);
+int group_read(struct group_session *, unsigned char *, int);
+int group_describe(struct group_session *, char *, int);
+int group_watching(struct group_session *);
+void group_stop(struct group_session *);
+void group_close(struct group_session *, DWORD timeout);
+int group_init(struct cli_def *);
@@ -0,0 +1,540 @@
+/*
+ * iobench.c - compare the native build's epoll and io_uring engines
+ *
+ * Copyright (c) 2010 Hamish Coleman <hamish@zot.org>
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ *   iobench [ports [MB [KB/s]]]
+ *
+ * A child process copies between a pty and an accepted TCP connection
+ * for each port, in both directions, with the same calls and timeouts
+ * as wconsd_com_to_net and wconsd_net_to_com, on top of the posix layer.
+ * This process plays the devices and the telnet clients, pushing the
+ * given MB each way through every port, as fast as it can or at the
+ * given rate per port, and checking every byte.
+ *
+ * Each engine is run twice: once for the throughput, and once with the
+ * child's system calls counted by ptrace, which slows it down too much
+ * for the first.  The count starts once the ports are open and the
+ * connections accepted.
+ *
+ * Last, a pty is opened and set up the way port_open does it, over and
+ * over, for what a session on a cold port waits before its first byte;
+ * one on a warm port does none of it.
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+
+#include "winsock2.h"
+
+#define BUFSIZE		1024
+#define MAXPORTS	64
+#define CHUNK		4096
+#define OPENS		200
+
+struct port {
+	/* this end */
+	int master;		/* the device */
+	int client;		/* the telnet client */
+	uint64_t sent_com, got_com;
+	uint64_t sent_net, got_net;
+	uint64_t bad;
+
+	/* the child's end */
+	char name[64];
+	HANDLE serial;
+	SOCKET net;
+};
+
+static struct port ports[MAXPORTS];
+static int nr_ports;
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static inline unsigned char pattern(uint64_t seq) {
+	return seq ^ (seq>>8) ^ (seq>>16);
+}
+
+/* the child */
+
+static int send_all(SOCKET s, const unsigned char *buf, int len) {
+	fd_set set;
+	int n;
+
+	while (len>0) {
+		if ((n = send(s,(const char *)buf,len,0))==SOCKET_ERROR) {
+			if (WSAGetLastError()!=WSAEWOULDBLOCK) {
+				return -1;
+			}
+			FD_ZERO(&set);
+			FD_SET(s,&set);
+			select(s+1,NULL,&set,NULL,NULL);
+			continue;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static DWORD WINAPI com_to_net(LPVOID arg) {
+	struct port *pt = arg;
+	unsigned char buf[BUFSIZE];
+	OVERLAPPED o = {0};
+	DWORD size;
+
+	o.hEvent = CreateEvent(NULL,TRUE,FALSE,NULL);
+	for (;;) {
+		if (!ReadFile(pt->serial,buf,sizeof(buf),&size,&o)) {
+			if (GetLastError()!=ERROR_IO_PENDING
+					|| !GetOverlappedResult(pt->serial,&o,&size,TRUE)) {
+				break;
+			}
+		}
+		if (size && send_all(pt->net,buf,size)) {
+			break;
+		}
+	}
+	CloseHandle(o.hEvent);
+	return 0;
+}
+
+static DWORD WINAPI net_to_com(LPVOID arg) {
+	struct port *pt = arg;
+	unsigned char buf[BUFSIZE];
+	OVERLAPPED o = {0};
+	struct timeval tv;
+	fd_set set;
+	DWORD size;
+	int n;
+
+	o.hEvent = CreateEvent(NULL,TRUE,FALSE,NULL);
+	for (;;) {
+		FD_ZERO(&set);
+		FD_SET(pt->net,&set);
+		tv.tv_sec = 2;
+		tv.tv_usec = 0;
+		select(pt->net+1,&set,NULL,NULL,&tv);
+		n = recv(pt->net,(char *)buf,sizeof(buf),0);
+		if (n==0) {
+			break;
+		}
+		if (n==SOCKET_ERROR) {
+			if (WSAGetLastError()==WSAEWOULDBLOCK) {
+				continue;
+			}
+			break;
+		}
+		if (!WriteFile(pt->serial,buf,n,&size,&o)) {
+			break;
+		}
+	}
+	CancelIoEx(pt->serial,NULL);
+	CloseHandle(o.hEvent);
+	return 0;
+}
+
+static int pipeline(SOCKET ls, int ready, int traced) {
+	HANDLE threads[MAXPORTS*2];
+	COMMTIMEOUTS timeouts = { 20, 0, 50, 0, 0 };
+	WSAEVENT ev;
+	WSADATA wsa;
+	char path[80];
+	int i;
+
+	WSAStartup(MAKEWORD(2,2),&wsa);
+	ev = WSACreateEvent();
+	if (WSAEventSelect(ls,ev,FD_ACCEPT)==SOCKET_ERROR) {
+		return 1;
+	}
+	for (i=0;i<nr_ports;) {
+		SOCKET as = accept(ls,NULL,NULL);
+
+		if (as==INVALID_SOCKET) {
+			WaitForSingleObject(ev,1000);
+			WSAResetEvent(ev);
+			continue;
+		}
+		ports[i].net = as;
+		snprintf(path,sizeof(path),"\\\\.\\%s",ports[i].name);
+		ports[i].serial = CreateFile(path,GENERIC_READ|GENERIC_WRITE,0,NULL,
+			OPEN_EXISTING,FILE_FLAG_OVERLAPPED,NULL);
+		if (ports[i].serial==INVALID_HANDLE_VALUE) {
+			fprintf(stderr,"iobench: cannot open %s\n",ports[i].name);
+			return 1;
+		}
+		SetCommTimeouts(ports[i].serial,&timeouts);
+		i++;
+	}
+
+	if (traced) {
+		raise(SIGSTOP);
+	}
+	if (write(ready,"",1)!=1) {
+		return 1;
+	}
+	for (i=0;i<nr_ports;i++) {
+		threads[i*2] = CreateThread(NULL,0,com_to_net,&ports[i],0,NULL);
+		threads[i*2+1] = CreateThread(NULL,0,net_to_com,&ports[i],0,NULL);
+	}
+	for (i=0;i<nr_ports*2;i++) {
+		WaitForSingleObject(threads[i],INFINITE);
+	}
+	return 0;
+}
+
+/* count the system calls made by every thread of pid until it exits */
+static long trace(pid_t pid) {
+	char path[64];
+	struct dirent *de;
+	long stops = 0;
+	DIR *d;
+	int st;
+
+	if (waitpid(pid,&st,WUNTRACED)!=pid || !WIFSTOPPED(st)) {
+		return -1;
+	}
+	snprintf(path,sizeof(path),"/proc/%d/task",pid);
+	if (!(d = opendir(path))) {
+		return -1;
+	}
+	while ((de = readdir(d))) {
+		pid_t tid = atoi(de->d_name);
+
+		if (tid>0) {
+			ptrace(PTRACE_SEIZE,tid,0,PTRACE_O_TRACESYSGOOD
+				|PTRACE_O_TRACECLONE|PTRACE_O_EXITKILL);
+			ptrace(PTRACE_INTERRUPT,tid,0,0);
+		}
+	}
+	closedir(d);
+	kill(pid,SIGCONT);
+
+	for (;;) {
+		pid_t p = waitpid(-1,&st,__WALL);
+		int sig = 0;
+
+		if (p<0) {
+			break;
+		}
+		if (WIFEXITED(st) || WIFSIGNALED(st)) {
+			if (p==pid) {
+				break;
+			}
+			continue;
+		}
+		if (WSTOPSIG(st)==(SIGTRAP|0x80)) {
+			/* one stop going into the call, one coming out */
+			stops++;
+		} else if (WSTOPSIG(st)!=SIGTRAP && !(st>>16)) {
+			sig = WSTOPSIG(st);
+		}
+		ptrace(PTRACE_SYSCALL,p,0,sig);
+	}
+	return stops/2;
+}
+
+/* this end */
+
+static int load(uint64_t total, double rate, double *elapsed) {
+	struct pollfd pfd[MAXPORTS*2];
+	unsigned char buf[CHUNK];
+	double start = now(), t;
+	int i, j, busy;
+
+	do {
+		uint64_t allowed = rate ? (now()-start)*rate : total;
+
+		busy = 0;
+		for (i=0;i<nr_ports;i++) {
+			struct port *pt = &ports[i];
+
+			pfd[i*2].fd = pt->master;
+			pfd[i*2].events = POLLIN;
+			if (pt->sent_com<total && pt->sent_com<allowed) {
+				pfd[i*2].events |= POLLOUT;
+			}
+			pfd[i*2+1].fd = pt->client;
+			pfd[i*2+1].events = POLLIN;
+			if (pt->sent_net<total && pt->sent_net<allowed) {
+				pfd[i*2+1].events |= POLLOUT;
+			}
+			if (pt->got_com<total || pt->got_net<total) {
+				busy = 1;
+			}
+		}
+		if (!busy) {
+			break;
+		}
+		if (poll(pfd,nr_ports*2,rate?1:1000)<0 && errno!=EINTR) {
+			return -1;
+		}
+		if (now()-start>300) {
+			fprintf(stderr,"iobench: stalled\n");
+			return -1;
+		}
+
+		for (i=0;i<nr_ports;i++) {
+			struct port *pt = &ports[i];
+			uint64_t *sent[2] = { &pt->sent_com, &pt->sent_net };
+			uint64_t *got[2] = { &pt->got_net, &pt->got_com };
+
+			for (j=0;j<2;j++) {
+				struct pollfd *p = &pfd[i*2+j];
+				ssize_t n;
+				int k;
+
+				if (p->revents & POLLOUT) {
+					uint64_t len = total-*sent[j];
+
+					if (rate && len>allowed-*sent[j]) {
+						len = allowed-*sent[j];
+					}
+					if (len>CHUNK) {
+						len = CHUNK;
+					}
+					for (k=0;k<len;k++) {
+						buf[k] = pattern(*sent[j]+k);
+					}
+					if ((n = write(p->fd,buf,len))>0) {
+						*sent[j] += n;
+					}
+				}
+				if (p->revents & (POLLIN|POLLHUP|POLLERR)) {
+					if ((n = read(p->fd,buf,sizeof(buf)))<=0) {
+						if (n<0 && errno==EAGAIN) {
+							continue;
+						}
+						fprintf(stderr,"iobench: port %i lost its %s\n",
+							i,j?"connection":"device");
+						return -1;
+					}
+					for (k=0;k<n;k++) {
+						if (buf[k]!=pattern(*got[j]+k)) {
+							pt->bad++;
+						}
+					}
+					*got[j] += n;
+				}
+			}
+		}
+	} while (busy);
+	t = now()-start;
+	*elapsed = t;
+	return 0;
+}
+
+static int run(const char *engine, uint64_t total, double rate, int traced,
+		double *elapsed, long *calls) {
+	struct sockaddr_in sa;
+	socklen_t salen = sizeof(sa);
+	int ready[2], result[2];
+	int ls, i, st;
+	uint64_t bad = 0;
+	pid_t pid;
+	char c;
+
+	memset(ports,0,sizeof(ports));
+	for (i=0;i<nr_ports;i++) {
+		struct termios t;
+		int slave;
+
+		if (openpty(&ports[i].master,&slave,ports[i].name,NULL,NULL)) {
+			perror("openpty");
+			return -1;
+		}
+		tcgetattr(slave,&t);
+		cfmakeraw(&t);
+		tcsetattr(slave,TCSANOW,&t);
+		close(slave);
+		fcntl(ports[i].master,F_SETFL,O_NONBLOCK);
+	}
+
+	ls = socket(AF_INET,SOCK_STREAM,0);
+	memset(&sa,0,sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(ls,(struct sockaddr *)&sa,sizeof(sa)) || listen(ls,MAXPORTS)
+			|| getsockname(ls,(struct sockaddr *)&sa,&salen)
+			|| pipe(ready) || pipe(result)) {
+		perror("iobench");
+		return -1;
+	}
+
+	if (!(pid = fork())) {
+		long n = 0;
+
+		for (i=0;i<nr_ports;i++) {
+			close(ports[i].master);
+		}
+		close(ready[0]);
+		close(result[0]);
+		setenv("WCONSD_IO",engine,1);
+		if (traced) {
+			pid_t child = fork();
+
+			if (!child) {
+				_exit(pipeline(ls,ready[1],1));
+			}
+			n = trace(child);
+		} else {
+			pipeline(ls,ready[1],0);
+		}
+		if (write(result[1],&n,sizeof(n))!=sizeof(n)) {
+			_exit(1);
+		}
+		_exit(0);
+	}
+	close(ls);
+	close(ready[1]);
+	close(result[1]);
+
+	for (i=0;i<nr_ports;i++) {
+		ports[i].client = socket(AF_INET,SOCK_STREAM,0);
+		if (connect(ports[i].client,(struct sockaddr *)&sa,sizeof(sa))) {
+			perror("connect");
+			return -1;
+		}
+		fcntl(ports[i].client,F_SETFL,O_NONBLOCK);
+	}
+	if (read(ready[0],&c,1)!=1) {
+		fprintf(stderr,"iobench: the %s child failed\n",engine);
+		return -1;
+	}
+
+	if (load(total,rate,elapsed)) {
+		kill(pid,SIGKILL);
+	}
+	for (i=0;i<nr_ports;i++) {
+		bad += ports[i].bad;
+		close(ports[i].client);
+		close(ports[i].master);
+	}
+	if (read(result[0],calls,sizeof(*calls))!=sizeof(*calls)) {
+		*calls = -1;
+	}
+	waitpid(pid,&st,0);
+	close(ready[0]);
+	close(result[0]);
+	if (bad) {
+		fprintf(stderr,"iobench: %.0f bad bytes with %s\n",(double)bad,engine);
+		return -1;
+	}
+	return 0;
+}
+
+/* time the opening of a port, done last as it starts the posix layer here */
+static int open_latency(double *mean, double *max) {
+	COMMTIMEOUTS timeouts = { MAXDWORD, MAXDWORD, 1000, 0, 0 };
+	char name[64], path[80];
+	double t, total = 0;
+	int master, slave, i;
+	HANDLE h;
+	DCB dcb;
+
+	if (openpty(&master,&slave,name,NULL,NULL)) {
+		perror("openpty");
+		return -1;
+	}
+	snprintf(path,sizeof(path),"\\\\.\\%s",name);
+	*max = 0;
+	for (i=0;i<OPENS;i++) {
+		t = now();
+		h = CreateFile(path,GENERIC_READ|GENERIC_WRITE,0,NULL,
+			OPEN_EXISTING,FILE_FLAG_OVERLAPPED,NULL);
+		if (h==INVALID_HANDLE_VALUE) {
+			fprintf(stderr,"iobench: cannot open %s\n",name);
+			return -1;
+		}
+		memset(&dcb,0,sizeof(dcb));
+		dcb.DCBlength = sizeof(dcb);
+		GetCommState(h,&dcb);
+		dcb.BaudRate = 115200;
+		dcb.ByteSize = 8;
+		dcb.Parity = NOPARITY;
+		dcb.StopBits = ONESTOPBIT;
+		SetCommState(h,&dcb);
+		SetCommTimeouts(h,&timeouts);
+		PurgeComm(h,PURGE_RXCLEAR|PURGE_RXABORT);
+		t = now()-t;
+		CloseHandle(h);
+
+		total += t;
+		if (t>*max) {
+			*max = t;
+		}
+	}
+	close(slave);
+	close(master);
+	*mean = total/OPENS;
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	static const char *engines[] = { "epoll", "uring" };
+	double mb = argc>2 ? atof(argv[2]) : 8;
+	double rate = argc>3 ? atof(argv[3])*1e3 : 0;
+	uint64_t total = mb*1e6;
+	double moved, elapsed, traced_elapsed, mean, max;
+	long calls, unused;
+	int i;
+
+	nr_ports = argc>1 ? atoi(argv[1]) : 4;
+	if (nr_ports<1 || nr_ports>MAXPORTS) {
+		fprintf(stderr,"usage: iobench [ports [MB [KB/s]]]\n");
+		return 1;
+	}
+	signal(SIGPIPE,SIG_IGN);
+	moved = 2.0*nr_ports*total/1e6;
+
+	printf("%i ports, %.1f MB each way on each, %s\n",nr_ports,mb,
+		rate ? "rate limited" : "flat out");
+	for (i=0;i<2;i++) {
+		if (run(engines[i],total,rate,0,&elapsed,&unused)
+				|| run(engines[i],total,rate,1,&traced_elapsed,&calls)) {
+			return 1;
+		}
+		printf("%-6s %8.2f MB/s %10ld syscalls %10.0f syscalls/MB\n",
+			engines[i],moved/elapsed,calls,calls/moved);
+	}
+	if (open_latency(&mean,&max)) {
+		return 1;
+	}
+	printf("open   %8.1f us mean %8.1f us max, of %i cold opens\n",
+		mean*1e6,max*1e6,OPENS);
+	return 0;
+}
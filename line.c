@@ -0,0 +1,228 @@
+/*
+ * line.c - serial line settings, for each port and each session
+ *
+ * Copyright (c) 2010 Hamish Coleman <hamish@zot.org>
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Speed, data bits, parity and stop bits are kept as snapshots which are
+ * never changed once made.  Each port has a pointer to its defaults and
+ * each session one to its own settings; changing them means making a new
+ * snapshot and swapping the pointer, so a reader gets a consistent set
+ * with a single load and never takes a lock.
+ *
+ * Snapshots are interned - asking for one equal to an existing one gets
+ * that one back - so there are only ever as many as there are distinct
+ * settings in use.  That makes it safe never to free them: a reader that
+ * loaded an old pointer can go on using it for as long as it likes.
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libcli/libcli/libcli.h"
+#include "module.h"
+#include "debug.h"
+#include "line.h"
+#include "autobaud.h"
+
+struct interned {
+	struct line line;
+	struct interned *next;
+};
+
+/* what a port has until it is configured otherwise */
+static struct interned builtin = {
+	.line = { 9600, 8, NOPARITY, ONESTOPBIT, 0 },
+};
+
+static CRITICAL_SECTION intern_lock;
+static struct interned *interned = &builtin;
+
+/* NULL until a port has defaults of its own */
+static const struct line *volatile defaults[LINE_PORTS+1];
+
+static const char *parity_names[] = { "no", "odd", "even", "mark", "space" };
+
+const char *line_parity_name(BYTE parity) {
+	return parity<=SPACEPARITY ? parity_names[parity] : "?";
+}
+
+const char *line_stop_name(BYTE stop) {
+	return stop==ONESTOPBIT ? "1" : stop==ONE5STOPBITS ? "1.5" : "2";
+}
+
+/* the snapshot with these settings, made if it is the first */
+const struct line *line_make(const struct line *l) {
+	struct interned *i;
+
+	EnterCriticalSection(&intern_lock);
+	for (i=interned;i;i=i->next) {
+		if (i->line.speed==l->speed && i->line.data==l->data &&
+		    i->line.parity==l->parity && i->line.stop==l->stop &&
+		    i->line.autobaud==l->autobaud) {
+			break;
+		}
+	}
+	if (!i && (i = malloc(sizeof(*i)))) {
+		i->line = *l;
+		i->next = interned;
+		interned = i;
+	}
+	LeaveCriticalSection(&intern_lock);
+
+	return i ? &i->line : NULL;
+}
+
+/* the current defaults for a port */
+const struct line *line_default(int port) {
+	const struct line *l = NULL;
+
+	if (port>=1 && port<=LINE_PORTS) {
+		l = defaults[port];
+	}
+	return l ? l : &builtin.line;
+}
+
+void line_set_default(int port, const struct line *l) {
+	if (port>=1 && port<=LINE_PORTS && (l = line_make(l))) {
+		InterlockedExchangePointer((void *volatile *)&defaults[port],(void *)l);
+	}
+}
+
+static int cmd_showline(struct cli_def *cli, char *command, char *argv[], int argc) {
+	int port;
+
+	cli_print(cli, "port    speed data parity stop");
+	for (port=1;port<=LINE_PORTS;port++) {
+		const struct line *l = line_default(port);
+
+		cli_print(cli, "COM%-2i %8lu%s %4i %-6s %s",
+			port,l->speed,(l->autobaud||autobaud_enabled)?"(auto)":"      ",
+			l->data,line_parity_name(l->parity),line_stop_name(l->stop));
+	}
+	return CLI_OK;
+}
+
+/* line <setting> <port> <value> */
+static int cmd_cline(struct cli_def *cli, char *command, char *argv[], int argc) {
+	struct line l;
+	int port;
+	int v;
+
+	if (argc!=2 || (port = atoi(argv[0]))<1 || port>LINE_PORTS) {
+		cli_print(cli,"Need a port number from 1 to %i and a value",LINE_PORTS);
+		return CLI_ERROR;
+	}
+	l = *line_default(port);
+	v = atoi(argv[1]);
+
+	if (strstr(command,"speed")) {
+		if (!autobaud_valid(v)) {
+			cli_print(cli,"%s is not a standard speed",argv[1]);
+			return CLI_ERROR;
+		}
+		l.speed = v;
+	} else if (strstr(command,"data")) {
+		if (v<5 || v>8) {
+			cli_print(cli,"Data bits are 5, 6, 7 or 8");
+			return CLI_ERROR;
+		}
+		l.data = v;
+	} else if (strstr(command,"parity")) {
+		for (v=NOPARITY;v<=SPACEPARITY;v++) {
+			if (!strcmp(argv[1],parity_names[v])) {
+				break;
+			}
+		}
+		if (v>SPACEPARITY) {
+			cli_print(cli,"Parity is no, odd, even, mark or space");
+			return CLI_ERROR;
+		}
+		l.parity = v;
+	} else if (strstr(command,"stop")) {
+		if (!strcmp(argv[1],"1")) {
+			l.stop = ONESTOPBIT;
+		} else if (!strcmp(argv[1],"1.5")) {
+			l.stop = ONE5STOPBITS;
+		} else if (!strcmp(argv[1],"2")) {
+			l.stop = TWOSTOPBITS;
+		} else {
+			cli_print(cli,"Stop bits are 1, 1.5 or 2");
+			return CLI_ERROR;
+		}
+	} else {
+		l.autobaud = v!=0;
+	}
+	line_set_default(port,&l);
+	return CLI_OK;
+}
+
+/* show the config for this module */
+static int this_showrun(struct cli_def *cli) {
+	int port;
+
+	for (port=1;port<=LINE_PORTS;port++) {
+		const struct line *l = line_default(port);
+
+		if (l==&builtin.line) {
+			continue;
+		}
+		cli_print(cli, "line speed %i %lu",port,l->speed);
+		cli_print(cli, "line data %i %i",port,l->data);
+		cli_print(cli, "line parity %i %s",port,line_parity_name(l->parity));
+		cli_print(cli, "line stop %i %s",port,line_stop_name(l->stop));
+		cli_print(cli, "line auto %i %i",port,l->autobaud);
+	}
+	return CLI_OK;
+}
+
+/* Our local module definition */
+static struct module_def this_module = {
+	.name = "line",
+	.desc = "Serial line settings",
+	.showrun = this_showrun,
+};
+
+/* initialise and register this module */
+int line_init(struct cli_def *cli) {
+	InitializeCriticalSection(&intern_lock);
+
+	cli_register_command(cli, lookup_parent("show"), "line", cmd_showline,
+		PRIVILEGE_UNPRIVILEGED, MODE_EXEC, "Default line settings of each port");
+
+	register_parent("config line",
+		cli_register_command(cli, NULL, "line", NULL, PRIVILEGE_PRIVILEGED,
+		MODE_CONFIG, "Default line settings of a port"));
+
+	cli_register_command(cli, lookup_parent("config line"), "speed", cmd_cline,
+		PRIVILEGE_PRIVILEGED, MODE_CONFIG, "Bits per second");
+	cli_register_command(cli, lookup_parent("config line"), "data", cmd_cline,
+		PRIVILEGE_PRIVILEGED, MODE_CONFIG, "Data bits (5-8)");
+	cli_register_command(cli, lookup_parent("config line"), "parity", cmd_cline,
+		PRIVILEGE_PRIVILEGED, MODE_CONFIG, "Parity (no/odd/even/mark/space)");
+	cli_register_command(cli, lookup_parent("config line"), "stop", cmd_cline,
+		PRIVILEGE_PRIVILEGED, MODE_CONFIG, "Stop bits (1/1.5/2)");
+	cli_register_command(cli, lookup_parent("config line"), "auto", cmd_cline,
+		PRIVILEGE_PRIVILEGED, MODE_CONFIG, "Detect the speed when the port is opened (0/1)");
+
+	register_module(&this_module);
+	return 0;
+}
@@ -0,0 +1,23 @@
+/*
+ * line.h - serial line settings, for each port and each session
+ *
+ */
+
+#define LINE_PORTS	16
+
+/* an immutable snapshot, never changed or freed once it has been made */
+struct line {
+	DWORD speed;
+	BYTE data;
+	BYTE parity;
+	BYTE stop;
+	BYTE autobaud;		/* detect the speed when the port is opened */
+};
+
+const struct line *line_make(const struct line *);
+const struct line *line_default(int port);
+void line_set_default(int port, const struct line *);
+const char *line_parity_name(BYTE parity);
+const char *line_stop_name(BYTE stop);
+
+int line_init(struct cli_def *);
@@ -0,0 +1,249 @@
+/*
+ * mccp.c - telnet stream compression (MCCP2, telnet option 86)
+ *
+ * Copyright (c) 2010 Hamish Coleman <hamish@zot.org>
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Once the client has answered our IAC WILL COMPRESS2 with a DO, and we
+ * have sent IAC SB COMPRESS2 IAC SE, everything we send is one long zlib
+ * stream.  Each connection has its own deflate context, and its output
+ * goes out through the connection's own send function, so it waits for
+ * a slow client exactly as uncompressed output would.  A send that fails
+ * part way leaves the client unable to inflate anything after it, so
+ * the stream then refuses to send any more.
+ *
+ * Flush policy: the caller says whether more data is expected soon.  If
+ * it is, the output stays in the compressor to improve the ratio, else a
+ * Z_SYNC_FLUSH pushes everything so far to the client.  The serial reader
+ * flushes as soon as the line goes idle, which keeps interactive echo
+ * snappy while bulk output (routing tables, boot logs) compresses well.
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "libcli/libcli/libcli.h"
+#include "module.h"
+#include "mccp.h"
+
+#define MCCP_BUFSIZE	2048
+
+int mccp_enabled = 0;
+static int mccp_level = 6;
+
+struct mccp {
+	z_stream z;
+	int (*send)(void *, const void *, int);	/* the caller's, 0 once all of it went */
+	void *ctx;
+	int broken;		/* a send failed, so the client has lost its place */
+	int pending;		/* data has been compressed but not flushed */
+	double bytes_in;	/* uncompressed bytes given to us */
+	double bytes_out;	/* compressed bytes sent */
+};
+
+/* totals from all finished and running streams */
+static struct {
+	CRITICAL_SECTION lock;
+	double bytes_in;
+	double bytes_out;
+	LONGLONG ticks;		/* performance counter ticks spent in deflate */
+	LONG streams;
+} totals;
+
+/* run deflate over whatever is in the stream input and send the result */
+static int mccp_deflate(struct mccp *m, int flush) {
+	unsigned char out[MCCP_BUFSIZE];
+	LARGE_INTEGER start, end;
+	int have;
+	int err;
+
+	do {
+		m->z.next_out = out;
+		m->z.avail_out = sizeof(out);
+
+		QueryPerformanceCounter(&start);
+		err = deflate(&m->z,flush);
+		QueryPerformanceCounter(&end);
+
+		EnterCriticalSection(&totals.lock);
+		totals.ticks += end.QuadPart - start.QuadPart;
+		LeaveCriticalSection(&totals.lock);
+
+		if (err==Z_STREAM_ERROR) {
+			return -1;
+		}
+
+		have = sizeof(out) - m->z.avail_out;
+		if (have && m->send(m->ctx,out,have)) {
+			/* nothing after a gap can be inflated */
+			m->broken = 1;
+			return -1;
+		}
+		m->bytes_out += have;
+	} while (m->z.avail_out==0);
+
+	return 0;
+}
+
+/*
+ * Start a stream, whose output is given to send.  That is expected to
+ * wait for a slow client as long as the caller allows any output to,
+ * and to return nonzero if it could not send all of it, after which the
+ * stream is broken and will not send any more.
+ */
+struct mccp *mccp_new(int (*send)(void *, const void *, int), void *ctx) {
+	struct mccp *m = calloc(1,sizeof(struct mccp));
+
+	if (!m) {
+		return NULL;
+	}
+	if (deflateInit(&m->z,mccp_level)!=Z_OK) {
+		free(m);
+		return NULL;
+	}
+	m->send = send;
+	m->ctx = ctx;
+	InterlockedIncrement(&totals.streams);
+	return m;
+}
+
+/*
+ * Compress and send a buffer.  If flush is zero, the caller expects to
+ * send more very soon, so the output may be held back.  A zero length
+ * flush just pushes out anything held back earlier.
+ *
+ * Returns the number of uncompressed bytes consumed, or -1 on error
+ */
+int mccp_send(struct mccp *m, const void *buf, int len, int flush) {
+	if (m->broken) {
+		return -1;
+	}
+	if (!len && (!flush || !m->pending)) {
+		return 0;
+	}
+
+	m->z.next_in = (Bytef *)buf;
+	m->z.avail_in = len;
+	if (mccp_deflate(m,flush?Z_SYNC_FLUSH:Z_NO_FLUSH)) {
+		return -1;
+	}
+	m->pending = !flush;
+	m->bytes_in += len;
+	return len;
+}
+
+void mccp_counts(struct mccp *m, double *in, double *out) {
+	*in = m->bytes_in;
+	*out = m->bytes_out;
+}
+
+/* terminate the compressed stream if finish is set, and release its memory */
+void mccp_free(struct mccp *m, int finish) {
+	m->z.next_in = NULL;
+	m->z.avail_in = 0;
+	if (finish && !m->broken) {
+		mccp_deflate(m,Z_FINISH);
+	}
+	deflateEnd(&m->z);
+
+	EnterCriticalSection(&totals.lock);
+	totals.bytes_in += m->bytes_in;
+	totals.bytes_out += m->bytes_out;
+	LeaveCriticalSection(&totals.lock);
+
+	free(m);
+}
+
+static int cmd_showcompress(struct cli_def *cli, char *command, char *argv[], int argc) {
+	LARGE_INTEGER freq;
+	double ms;
+
+	QueryPerformanceFrequency(&freq);
+
+	EnterCriticalSection(&totals.lock);
+	ms = (double)totals.ticks * 1000 / freq.QuadPart;
+	cli_print(cli, "streams started      %li",totals.streams);
+	cli_print(cli, "bytes in (finished)  %.0f",totals.bytes_in);
+	cli_print(cli, "bytes out (finished) %.0f",totals.bytes_out);
+	if (totals.bytes_out) {
+		cli_print(cli, "compression ratio    %.2f",totals.bytes_in/totals.bytes_out);
+	}
+	cli_print(cli, "deflate cpu time     %.1f ms",ms);
+	if (totals.bytes_in) {
+		cli_print(cli, "deflate cost         %.1f ns/byte",ms*1000000/totals.bytes_in);
+	}
+	LeaveCriticalSection(&totals.lock);
+	return CLI_OK;
+}
+
+static int cmd_ccompress(struct cli_def *cli, char *command, char *argv[], int argc) {
+	if (argc!=1) {
+		cli_print(cli,"Need a single value");
+		return CLI_ERROR;
+	}
+
+	if (strstr(command,"level")) {
+		if (atoi(argv[0])<1 || atoi(argv[0])>9) {
+			cli_print(cli,"Level must be 1-9");
+			return CLI_ERROR;
+		}
+		mccp_level = atoi(argv[0]);
+	} else {
+		mccp_enabled = atoi(argv[0]);
+	}
+	return CLI_OK;
+}
+
+/* show the config for this module */
+static int this_showrun(struct cli_def *cli) {
+	cli_print(cli, "compress enable %i",mccp_enabled);
+	cli_print(cli, "compress level %i",mccp_level);
+	return CLI_OK;
+}
+
+/* Our local module definition */
+static struct module_def this_module = {
+	.name = "mccp",
+	.desc = "Telnet stream compression",
+	.showrun = this_showrun,
+};
+
+/* initialise and register this module */
+int mccp_init(struct cli_def *cli) {
+	InitializeCriticalSection(&totals.lock);
+
+	cli_register_command(cli, lookup_parent("show"), "compression", cmd_showcompress,
+		PRIVILEGE_UNPRIVILEGED, MODE_EXEC, "Telnet compression statistics");
+
+	register_parent("config compress",
+		cli_register_command(cli, NULL, "compress", NULL, PRIVILEGE_PRIVILEGED,
+		MODE_CONFIG, "Telnet stream compression"));
+
+	cli_register_command(cli, lookup_parent("config compress"), "enable", cmd_ccompress,
+		PRIVILEGE_PRIVILEGED, MODE_CONFIG, "Offer compression to new connections (0/1)");
+
+	cli_register_command(cli, lookup_parent("config compress"), "level", cmd_ccompress,
+		PRIVILEGE_PRIVILEGED, MODE_CONFIG, "zlib compression level");
+
+	register_module(&this_module);
+	return 0;
+}
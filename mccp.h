@@ -0,0 +1,18 @@
+/*
+ * mccp.h - telnet stream compression (MCCP2, telnet option 86)
+ *
+ */
+
+#define TELNET_OPTION_COMPRESS2	0x56
+
+/* set to nonzero to offer compression to new connections */
+extern int mccp_enabled;
+
+struct mccp;
+
+struct mccp *mccp_new(int (*send)(void *, const void *, int), void *ctx);
+int mccp_send(struct mccp *, const void *, int, int flush);
+void mccp_free(struct mccp *, int finish);
+void mccp_counts(struct mccp *, double *in, double *out);
+
+int mccp_init(struct cli_def *);
@@ -12,6 +12,7 @@ struct module_def {
 };
 
 int register_module(struct module_def *);
+int modules_init(struct cli_def *);
 
 int register_parent(char *, struct cli_command *);
 struct cli_command *lookup_parent(char *);
@@ -0,0 +1,660 @@
+/*
+ * mux.c - many serial ports over one TCP connection
+ *
+ * Copyright (c) 2010 Hamish Coleman <hamish@zot.org>
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * A collector watching many consoles would otherwise need a telnet
+ * connection, and so a menu thread, for each one.  A mux client instead
+ * opens channels to any number of ports over one connection, using the
+ * protocol described in mux.h.
+ *
+ * A channel is a cursor on its port, attached the way a session's is
+ * (see port.c), so the port is shared with the telnet sessions and
+ * watchers on it, and warm ports and the ring work for a channel as they
+ * do for them.  A channel writes only while it is the port's writer.
+ *
+ * Each mux client has two threads.  The reader parses frames from the
+ * socket and acts on them; writes to a port are done there, under the
+ * channel's write lock.  The pump copies out what is new on every
+ * channel that has credit, waits for any of their events, and sends
+ * everything as a batch of frames in one send().  Only the pump detaches
+ * a channel, so its reads never race the port going away.  It also ends
+ * breaks when they are due, so a BREAK frame does not hold up the reader.
+ */
+
+/* Note: winsock2.h MUST be included before windows.h */
+
+#include <winsock2.h>
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libcli/libcli/libcli.h"
+#include "module.h"
+#include "debug.h"
+#include "capture.h"
+#include "line.h"
+#include "port.h"
+#include "mux.h"
+
+#define MUX_CLIENTS	8
+#define MUX_CHANNELS	32	/* cursors plus the wake event must fit a wait */
+#define MUX_BATCH	16384
+#define MUX_TIMEOUT	3000	/* ms for a port's reader to exit on detaching */
+
+#define CHAN_FREE	0
+#define CHAN_OPEN	1
+#define CHAN_CLOSING	2
+
+static int mux_port = 0;	/* 0 means there is no listener */
+static SOCKET mux_ls = INVALID_SOCKET;
+static HANDLE listenThread;
+static int mux_ready;		/* winsock is up, the listener can start */
+
+struct mux_channel {
+	int state;		/* CHAN_*, changed under the client lock */
+	int port;
+	struct port_cursor cursor;	/* moved on by the pump only */
+	CRITICAL_SECTION wlock;	/* writes and line changes vs. closing */
+	OVERLAPPED wo;
+	LONG credit;		/* bytes the client will accept from us */
+	int owed;		/* bytes written that we have not credited */
+	int breaking;		/* a break is on until break_end */
+	DWORD break_end;
+	DWORD modem;		/* last modem status sent */
+	LONG rx, tx;
+};
+
+struct mux_client {
+	int active;
+	int run;
+	int id;
+	SOCKET net;
+	HANDLE thread;
+	HANDLE pump;
+	HANDLE wakeEvent;	/* the pump has something new to look at */
+	CRITICAL_SECTION lock;	/* channel states */
+	CRITICAL_SECTION sendlock;
+	struct mux_channel ch[MUX_CHANNELS];
+
+	/* the batch being built by the pump */
+	unsigned char out[MUX_BATCH];
+	int outlen;
+	LONG frames, sends;
+};
+
+static struct mux_client clients[MUX_CLIENTS];
+static int next_client_id = 1;
+
+static void put16(unsigned char *p, unsigned int v) {
+	p[0] = v>>8;
+	p[1] = v;
+}
+
+static void put32(unsigned char *p, unsigned long v) {
+	p[0] = v>>24;
+	p[1] = v>>16;
+	p[2] = v>>8;
+	p[3] = v;
+}
+
+static unsigned int get16(const unsigned char *p) {
+	return p[0]<<8 | p[1];
+}
+
+static unsigned long get32(const unsigned char *p) {
+	return (unsigned long)p[0]<<24 | p[1]<<16 | p[2]<<8 | p[3];
+}
+
+static int send_all(SOCKET s, const unsigned char *buf, int len) {
+	int n;
+
+	while (len>0) {
+		if ((n = send(s,(const char *)buf,len,0))==SOCKET_ERROR) {
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int recv_all(SOCKET s, unsigned char *buf, int len) {
+	int n;
+
+	while (len>0) {
+		if ((n = recv(s,(char *)buf,len,0))<=0) {
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void make_header(unsigned char *p, int channel, int type, int len) {
+	put16(p,channel);
+	p[2] = type;
+	p[3] = 0;
+	put16(p+4,len);
+}
+
+/* send a single frame straight away, used by the reader */
+static int send_frame(struct mux_client *c, int channel, int type, const unsigned char *buf, int len) {
+	unsigned char hdr[MUX_HEADER];
+	int err;
+
+	make_header(hdr,channel,type,len);
+	EnterCriticalSection(&c->sendlock);
+	err = send_all(c->net,hdr,MUX_HEADER) || (len && send_all(c->net,buf,len));
+	LeaveCriticalSection(&c->sendlock);
+	InterlockedIncrement(&c->frames);
+	InterlockedIncrement(&c->sends);
+	return err;
+}
+
+static void send_credit(struct mux_client *c, int channel, unsigned long credit) {
+	unsigned char buf[4];
+
+	put32(buf,credit);
+	send_frame(c,channel,MUX_CREDIT,buf,4);
+}
+
+/* send the pump's batch */
+static void batch_flush(struct mux_client *c) {
+	if (!c->outlen) {
+		return;
+	}
+	EnterCriticalSection(&c->sendlock);
+	send_all(c->net,c->out,c->outlen);
+	LeaveCriticalSection(&c->sendlock);
+	InterlockedIncrement(&c->sends);
+	c->outlen = 0;
+}
+
+/* add a frame to the pump's batch */
+static void batch_frame(struct mux_client *c, int channel, int type, const unsigned char *buf, int len) {
+	if (c->outlen+MUX_HEADER+len > MUX_BATCH) {
+		batch_flush(c);
+	}
+	make_header(c->out+c->outlen,channel,type,len);
+	memcpy(c->out+c->outlen+MUX_HEADER,buf,len);
+	c->outlen += MUX_HEADER+len;
+	InterlockedIncrement(&c->frames);
+}
+
+/* called by the pump, which is the only one reading the cursor */
+static void channel_close(struct mux_client *c, int n) {
+	struct mux_channel *ch = &c->ch[n];
+
+	EnterCriticalSection(&ch->wlock);
+	if (ch->breaking) {
+		ClearCommBreak(ch->cursor.serial);
+		ch->breaking = 0;
+	}
+	port_detach(&ch->cursor,MUX_TIMEOUT);
+	LeaveCriticalSection(&ch->wlock);
+
+	EnterCriticalSection(&c->lock);
+	ch->state = CHAN_FREE;
+	LeaveCriticalSection(&c->lock);
+	dprintf(1,"wconsd: mux[%i] channel %i closed COM%i\n",c->id,n,ch->port);
+	batch_frame(c,n,MUX_CLOSE,NULL,0);
+}
+
+/* end the channel's break if it is due, and say how long the pump may wait */
+static DWORD break_check(struct mux_channel *ch, DWORD timeout) {
+	LONG left;
+
+	if (!ch->breaking) {
+		return timeout;
+	}
+	EnterCriticalSection(&ch->wlock);
+	if (ch->breaking) {
+		left = ch->break_end - GetTickCount();
+		if (left<=0) {
+			/* our own break, so it is ended even if we lost the role */
+			ClearCommBreak(ch->cursor.serial);
+			ch->breaking = 0;
+		} else if (left<timeout) {
+			timeout = left;
+		}
+	}
+	LeaveCriticalSection(&ch->wlock);
+	return timeout;
+}
+
+static DWORD WINAPI mux_pump(LPVOID lpParam) {
+	struct mux_client *c = (struct mux_client *)lpParam;
+	HANDLE wait[MUX_CHANNELS+1];
+	unsigned char buf[MUX_MAXDATA];
+	unsigned char modem;
+	DWORD size, status, timeout;
+	int i, n;
+
+	while (1) {
+		/* hand over what is new, close what needs closing, check modem lines */
+		n = 0;
+		timeout = 100;
+		wait[n++] = c->wakeEvent;
+		for (i=0;i<MUX_CHANNELS;i++) {
+			struct mux_channel *ch = &c->ch[i];
+
+			if (ch->state==CHAN_FREE) {
+				continue;
+			}
+			if (ch->state==CHAN_CLOSING || !c->run) {
+				channel_close(c,i);
+				continue;
+			}
+			timeout = break_check(ch,timeout);
+
+			if (GetCommModemStatus(ch->cursor.serial,&status) && status!=ch->modem) {
+				ch->modem = status;
+				modem = status;
+				batch_frame(c,i,MUX_MODEM,&modem,1);
+			}
+
+			while (ch->credit>0 && (size = port_read(&ch->cursor,buf,
+					ch->credit<MUX_MAXDATA?ch->credit:MUX_MAXDATA))) {
+				InterlockedExchangeAdd(&ch->credit,-(LONG)size);
+				ch->rx += size;
+				batch_frame(c,i,MUX_DATA,buf,size);
+			}
+			if (!port_alive(&ch->cursor) && !port_backlog(&ch->cursor)) {
+				dprintf(1,"wconsd: mux[%i] COM%i is no longer being read\n",
+					c->id,ch->port);
+				ch->state = CHAN_CLOSING;
+				SetEvent(c->wakeEvent);
+				continue;
+			}
+			/* without credit it waits for a CREDIT frame instead */
+			if (ch->credit>0) {
+				wait[n++] = ch->cursor.event;
+			}
+		}
+		batch_flush(c);
+
+		if (!c->run) {
+			break;
+		}
+
+		/* the timeout is to keep the modem lines polled, and end breaks */
+		WaitForMultipleObjects(n,wait,FALSE,timeout);
+	}
+	return 0;
+}
+
+/* handle an OPEN frame from the client */
+static void mux_open(struct mux_client *c, int n, const unsigned char *buf, int len) {
+	struct mux_channel *ch = &c->ch[n];
+	unsigned char status = MUX_OK;
+	const struct line *l;
+	struct line want;
+	int port;
+
+	if (len<2) {
+		return;
+	}
+	port = get16(buf);
+	/* the port's own defaults, unless the client says otherwise */
+	want = *line_default(port);
+	if (len>=9) {
+		want.speed = get32(buf+2);
+		want.data = buf[6];
+		want.parity = buf[7];
+		want.stop = buf[8];
+		want.autobaud = 0;
+	}
+
+	EnterCriticalSection(&c->lock);
+	if (ch->state!=CHAN_FREE) {
+		status = MUX_EBUSY;
+	}
+	LeaveCriticalSection(&c->lock);
+
+	if (status==MUX_OK) {
+		/* not a connection, so there is no session id to capture under */
+		ch->cursor.id = 0;
+		if (!(l = line_make(&want)) || port_attach(port,l,&ch->cursor)) {
+			status = MUX_EPORT;
+		}
+	}
+	if (status==MUX_OK) {
+		ch->port = port;
+		ch->credit = MUX_WINDOW;
+		ch->owed = 0;
+		ch->breaking = 0;
+		ch->modem = 0;
+		ch->rx = ch->tx = 0;
+		EnterCriticalSection(&c->lock);
+		ch->state = CHAN_OPEN;
+		LeaveCriticalSection(&c->lock);
+		dprintf(1,"wconsd: mux[%i] channel %i %s COM%i\n",c->id,n,
+			ch->cursor.warm?"attached to warm":"opened",port);
+	}
+
+	send_frame(c,n,MUX_OPEN,&status,1);
+	if (status==MUX_OK) {
+		send_credit(c,n,MUX_WINDOW);
+		SetEvent(c->wakeEvent);
+	}
+}
+
+/* act on one frame from the client */
+static void mux_frame(struct mux_client *c, int n, int type, const unsigned char *buf, int len) {
+	struct mux_channel *ch = &c->ch[n];
+	const struct line *l;
+	struct line want;
+
+	if (type==MUX_OPEN) {
+		mux_open(c,n,buf,len);
+		return;
+	}
+
+	EnterCriticalSection(&ch->wlock);
+	if (ch->state!=CHAN_OPEN) {
+		LeaveCriticalSection(&ch->wlock);
+		return;
+	}
+
+	switch (type) {
+	case MUX_CLOSE:
+		EnterCriticalSection(&c->lock);
+		ch->state = CHAN_CLOSING;
+		LeaveCriticalSection(&c->lock);
+		SetEvent(c->wakeEvent);
+		break;
+	case MUX_DATA:
+		/* if a session has taken the port over, it is dropped */
+		if (port_write(&ch->cursor,&ch->wo,buf,len)>=0) {
+			capture_data(ch->port,0,CAPTURE_DIR_TX,buf,len);
+			ch->tx += len;
+		}
+		ch->owed += len;
+		if (ch->owed>=MUX_WINDOW/2) {
+			send_credit(c,n,ch->owed);
+			ch->owed = 0;
+		}
+		break;
+	case MUX_SETLINE:
+		if (len<7) {
+			break;
+		}
+		want = *port_line(&ch->cursor);
+		want.speed = get32(buf);
+		want.data = buf[4];
+		want.parity = buf[5];
+		want.stop = buf[6];
+		want.autobaud = 0;
+		if ((l = line_make(&want)) && !port_write_start(&ch->cursor)) {
+			port_setline(&ch->cursor,l);
+			port_write_done(&ch->cursor);
+		}
+		break;
+	case MUX_BREAK:
+		if (len>=2 && !port_write_start(&ch->cursor)) {
+			/* the pump ends it */
+			SetCommBreak(ch->cursor.serial);
+			port_write_done(&ch->cursor);
+			ch->break_end = GetTickCount()+get16(buf);
+			ch->breaking = 1;
+			SetEvent(c->wakeEvent);
+		}
+		break;
+	case MUX_MODEM:
+		if (len>=1 && !port_write_start(&ch->cursor)) {
+			EscapeCommFunction(ch->cursor.serial,buf[0]&MUX_MODEM_DTR?SETDTR:CLRDTR);
+			EscapeCommFunction(ch->cursor.serial,buf[0]&MUX_MODEM_RTS?SETRTS:CLRRTS);
+			port_write_done(&ch->cursor);
+		}
+		break;
+	case MUX_CREDIT:
+		if (len>=4) {
+			InterlockedExchangeAdd(&ch->credit,get32(buf));
+			SetEvent(c->wakeEvent);
+		}
+		break;
+	}
+	LeaveCriticalSection(&ch->wlock);
+}
+
+static DWORD WINAPI mux_client_thread(LPVOID lpParam) {
+	struct mux_client *c = (struct mux_client *)lpParam;
+	unsigned char hdr[MUX_HEADER];
+	unsigned char buf[MUX_MAXDATA];
+	int channel, type, len;
+
+	dprintf(1,"wconsd: mux[%i] connected\n",c->id);
+	c->pump = CreateThread(NULL,0,mux_pump,c,0,NULL);
+
+	while (recv_all(c->net,hdr,MUX_HEADER)==0) {
+		channel = get16(hdr);
+		type = hdr[2];
+		len = get16(hdr+4);
+		if (len>MUX_MAXDATA || recv_all(c->net,buf,len)) {
+			break;
+		}
+		if (channel>=MUX_CHANNELS) {
+			unsigned char status = MUX_EBUSY;
+			if (type==MUX_OPEN) {
+				send_frame(c,channel,MUX_OPEN,&status,1);
+			}
+			continue;
+		}
+		mux_frame(c,channel,type,buf,len);
+	}
+
+	/* the pump closes all the channels on its way out */
+	c->run = 0;
+	SetEvent(c->wakeEvent);
+	WaitForSingleObject(c->pump,INFINITE);
+	CloseHandle(c->pump);
+
+	closesocket(c->net);
+	c->net = INVALID_SOCKET;
+	dprintf(1,"wconsd: mux[%i] disconnected\n",c->id);
+	c->active = 0;
+	return 0;
+}
+
+static DWORD WINAPI mux_listen(LPVOID lpParam) {
+	SOCKET as;
+	int i;
+
+	while ((as = accept(mux_ls,NULL,NULL))!=INVALID_SOCKET) {
+		struct mux_client *c = NULL;
+
+		for (i=0;i<MUX_CLIENTS;i++) {
+			if (!clients[i].active) {
+				c = &clients[i];
+				break;
+			}
+		}
+		if (!c) {
+			dprintf(1,"wconsd: mux connection refused, too many clients\n");
+			closesocket(as);
+			continue;
+		}
+		if (c->thread) {
+			CloseHandle(c->thread);
+		}
+		c->active = 1;
+		c->run = 1;
+		c->id = next_client_id++;
+		c->net = as;
+		c->outlen = 0;
+		c->frames = c->sends = 0;
+		c->thread = CreateThread(NULL,0,mux_client_thread,c,0,NULL);
+	}
+	return 0;
+}
+
+/* stop listening, disconnect every mux client and wait for them to go */
+void mux_shutdown(DWORD timeout) {
+	int i;
+
+	if (mux_ls==INVALID_SOCKET) {
+		return;
+	}
+	closesocket(mux_ls);
+	mux_ls = INVALID_SOCKET;
+	WaitForSingleObject(listenThread,timeout);
+
+	for (i=0;i<MUX_CLIENTS;i++) {
+		if (clients[i].active) {
+			shutdown(clients[i].net,SD_BOTH);
+		}
+	}
+	for (i=0;i<MUX_CLIENTS;i++) {
+		if (clients[i].active && clients[i].thread) {
+			WaitForSingleObject(clients[i].thread,timeout);
+		}
+	}
+}
+
+/*
+ * Start the listener, if one is configured.  Config files are read before
+ * winsock is started, so until this is first called the port is only
+ * remembered.
+ */
+int mux_start(void) {
+	struct sockaddr_in sin;
+
+	mux_ready = 1;
+	if (!mux_port || mux_ls!=INVALID_SOCKET) {
+		return 0;
+	}
+
+	memset(&sin,0,sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = INADDR_ANY;
+	sin.sin_port = htons(mux_port);
+
+	mux_ls = socket(AF_INET,SOCK_STREAM,0);
+	if (mux_ls==INVALID_SOCKET) {
+		return -1;
+	}
+	if (bind(mux_ls,(struct sockaddr *)&sin,sizeof(sin))==SOCKET_ERROR
+			|| listen(mux_ls,SOMAXCONN)==SOCKET_ERROR) {
+		closesocket(mux_ls);
+		mux_ls = INVALID_SOCKET;
+		return -1;
+	}
+	listenThread = CreateThread(NULL,0,mux_listen,NULL,0,NULL);
+	dprintf(1,"wconsd: mux listening on port %i\n",mux_port);
+	return 0;
+}
+
+static int cmd_showmux(struct cli_def *cli, char *command, char *argv[], int argc) {
+	int i, n;
+
+	if (!mux_port) {
+		cli_print(cli, "mux disabled");
+		return CLI_OK;
+	}
+	cli_print(cli, "mux listening on port %i",mux_port);
+	for (i=0;i<MUX_CLIENTS;i++) {
+		struct mux_client *c = &clients[i];
+
+		if (!c->active) {
+			continue;
+		}
+		cli_print(cli, "client %i: %li frames in %li sends",c->id,c->frames,c->sends);
+		for (n=0;n<MUX_CHANNELS;n++) {
+			struct mux_channel *ch = &c->ch[n];
+
+			if (ch->state==CHAN_FREE) {
+				continue;
+			}
+			cli_print(cli, "  channel %2i COM%-2i credit %6li rx %9li tx %9li lost %9.0f%s%s",
+				n,ch->port,ch->credit,ch->rx,ch->tx,(double)ch->cursor.lost,
+				ch->cursor.watching?" taken over":"",
+				ch->state==CHAN_CLOSING?" closing":"");
+		}
+	}
+	return CLI_OK;
+}
+
+static int cmd_cmux(struct cli_def *cli, char *command, char *argv[], int argc) {
+	if (argc!=1 || atoi(argv[0])<1 || atoi(argv[0])>65535) {
+		cli_print(cli,"Need a TCP port number");
+		return CLI_ERROR;
+	}
+	if (mux_ls!=INVALID_SOCKET) {
+		cli_print(cli,"The mux port can only be set once");
+		return CLI_ERROR;
+	}
+	mux_port = atoi(argv[0]);
+	if (mux_ready && mux_start()) {
+		cli_print(cli,"Cannot listen on port %i",mux_port);
+		mux_port = 0;
+		return CLI_ERROR;
+	}
+	return CLI_OK;
+}
+
+/* show the config for this module */
+static int this_showrun(struct cli_def *cli) {
+	if (mux_port) {
+		cli_print(cli, "mux port %i",mux_port);
+	}
+	return CLI_OK;
+}
+
+/* Our local module definition */
+static struct module_def this_module = {
+	.name = "mux",
+	.desc = "Multiplexed serial ports over one connection",
+	.showrun = this_showrun,
+};
+
+/* initialise and register this module */
+int mux_init(struct cli_def *cli) {
+	int i, n;
+
+	for (i=0;i<MUX_CLIENTS;i++) {
+		struct mux_client *c = &clients[i];
+
+		c->net = INVALID_SOCKET;
+		c->wakeEvent = CreateEvent(NULL,FALSE,FALSE,NULL);
+		InitializeCriticalSection(&c->lock);
+		InitializeCriticalSection(&c->sendlock);
+		for (n=0;n<MUX_CHANNELS;n++) {
+			InitializeCriticalSection(&c->ch[n].wlock);
+			c->ch[n].cursor.serial = INVALID_HANDLE_VALUE;
+			c->ch[n].wo.hEvent = CreateEvent(NULL,TRUE,FALSE,NULL);
+		}
+	}
+
+	cli_register_command(cli, lookup_parent("show"), "mux", cmd_showmux,
+		PRIVILEGE_UNPRIVILEGED, MODE_EXEC, "Multiplexed connections and channels");
+
+	register_parent("config mux",
+		cli_register_command(cli, NULL, "mux", NULL, PRIVILEGE_PRIVILEGED,
+		MODE_CONFIG, "Multiplexed serial ports over one connection"));
+
+	cli_register_command(cli, lookup_parent("config mux"), "port", cmd_cmux,
+		PRIVILEGE_PRIVILEGED, MODE_CONFIG, "TCP port to listen on for mux clients");
+
+	register_module(&this_module);
+	return 0;
+}
@@ -0,0 +1,69 @@
+/*
+ * mux.h - many serial ports over one TCP connection
+ *
+ * The mux listener speaks a simple framed protocol instead of telnet.
+ * Every frame starts with a six byte header, all values big-endian:
+ *
+ *	uint16_t channel	chosen by the client when opening
+ *	uint8_t  type		MUX_*
+ *	uint8_t  reserved	zero
+ *	uint16_t length		bytes of payload following, at most MUX_MAXDATA
+ *
+ * Payloads, client to server:
+ *	OPEN	uint16_t port, optionally followed by uint32_t speed,
+ *		uint8_t data, uint8_t parity, uint8_t stop (default the port's line settings)
+ *	CLOSE	empty
+ *	DATA	bytes to write to the port
+ *	SETLINE	uint32_t speed, uint8_t data, uint8_t parity, uint8_t stop
+ *	BREAK	uint16_t milliseconds
+ *	MODEM	uint8_t MUX_MODEM_DTR|MUX_MODEM_RTS lines to raise
+ *	CREDIT	uint32_t more bytes of DATA the client will accept
+ *
+ * Payloads, server to client:
+ *	OPEN	uint8_t status, 0 on success
+ *	CLOSE	empty, the channel is closed (on request or on error)
+ *	DATA	bytes read from the port
+ *	MODEM	uint8_t MS_CTS_ON|MS_DSR_ON|MS_RING_ON|MS_RLSD_ON, on change
+ *	CREDIT	uint32_t more bytes of DATA the server will accept
+ *
+ * Both ends start a channel with MUX_WINDOW bytes of credit and top it
+ * up with CREDIT frames as they consume data.  The server stops sending
+ * a port's output while the client has granted it no credit; the port is
+ * still read, and what its ring cannot keep meanwhile is lost.
+ *
+ * A channel opens its port the way a telnet session does, so it cannot
+ * open one that a session is writing to.  A session spectating the port
+ * can take it over, after which DATA, SETLINE, BREAK and MODEM frames on
+ * the channel are ignored.
+ *
+ * The server does not queue DATA: each frame is written to the port
+ * before the next frame is read, so a client that sends faster than the
+ * port drains is held back by TCP.  Its CREDIT frames only say how much
+ * has been written, a client may use them to pace itself but nothing is
+ * refused if it does not.  A BREAK does not hold up the frames after it.
+ */
+
+#define MUX_HEADER	6
+#define MUX_MAXDATA	4096
+#define MUX_WINDOW	16384
+
+#define MUX_DATA	0
+#define MUX_OPEN	1
+#define MUX_CLOSE	2
+#define MUX_SETLINE	3
+#define MUX_BREAK	4
+#define MUX_MODEM	5
+#define MUX_CREDIT	6
+
+#define MUX_MODEM_DTR	0x01
+#define MUX_MODEM_RTS	0x02
+
+/* open status codes */
+#define MUX_OK		0
+#define MUX_EBUSY	1	/* channel already in use */
+#define MUX_EPORT	2	/* the port could not be opened, or is in use */
+
+struct cli_def;
+int mux_start(void);
+void mux_shutdown(DWORD timeout);
+int mux_init(struct cli_def *);
@@ -0,0 +1,514 @@
+/*
+ * pace.c - trickle client input out to slow serial devices
+ *
+ * Copyright (c) 2010 Hamish Coleman <hamish@zot.org>
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Old devices with no flow control lose characters when a big config is
+ * pasted at them.  For a port with pacing configured, each connection
+ * gets a pacer: client input is put on a queue and a pacer thread writes
+ * it out in small batches, scheduled with a waitable timer so that the
+ * configured rate is kept on average.  After each line it can also wait
+ * a fixed delay, and/or until the device has echoed the line or printed
+ * its prompt.
+ *
+ * The connection's own thread only ever queues, so telnet options and
+ * the menu keep working while a paste is trickling out.  Batches are
+ * written through the session's cursor, so they stop going out as soon
+ * as the session stops being the port's writer, and what was queued is
+ * then dropped.
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libcli/libcli/libcli.h"
+#include "module.h"
+#include "debug.h"
+#include "line.h"
+#include "port.h"
+#include "pace.h"
+
+#define MAXPORTS	16
+#define PACE_QUEUE	65536	/* enough for any sane paste */
+#define PACE_BATCH	256
+#define PACE_PROMPT	32
+
+/* the settings for each port, read afresh for every batch */
+static struct pace_config {
+	int rate;		/* chars per second, 0 for unlimited */
+	int line_delay;		/* ms after each line */
+	int echo;		/* wait for each line to be echoed */
+	char prompt[PACE_PROMPT];	/* or wait for this after each line */
+	int timeout;		/* ms to wait for the echo or prompt */
+} config[MAXPORTS+1];
+
+static struct pace_stats {
+	LONG chars;
+	LONG throttled;		/* chars that had to wait for the pacer */
+	LONG timeouts;		/* echo or prompt waits that gave up */
+	LONGLONG busy_us;	/* time spent with something queued */
+} stats[MAXPORTS+1];
+
+struct pacer {
+	int port;
+	struct port_cursor *cursor;	/* the session's, written through */
+	HANDLE thread;
+	HANDLE timer;
+	HANDLE dataEvent;	/* something was queued */
+	HANDLE spaceEvent;	/* something was dequeued */
+	HANDLE echoEvent;	/* the echo or prompt turned up */
+	HANDLE stopEvent;
+	int run;
+
+	CRITICAL_SECTION lock;
+	CRITICAL_SECTION write_lock;	/* held while writing, or held off */
+	unsigned char queue[PACE_QUEUE];
+	int head, count;
+	int purges;		/* a batch taken before a purge is not written */
+
+	/* matching the echo or prompt, protected by lock */
+	int waiting;
+	int match;
+};
+
+static LARGE_INTEGER count_freq;
+
+static LONGLONG now_us(void) {
+	LARGE_INTEGER now;
+
+	QueryPerformanceCounter(&now);
+	return now.QuadPart*1000000/count_freq.QuadPart;
+}
+
+static int pace_active(struct pace_config *c) {
+	return c->rate || c->line_delay || c->echo || c->prompt[0];
+}
+
+/*
+ * Take the next batch off the queue.  A batch never goes past the end of
+ * a line, so that the line waits happen in the right place, and is about
+ * 10ms worth of chars at the configured rate.  Returns the batch length,
+ * and sets *eol if the batch ends a line.
+ */
+static int take_batch(struct pacer *p, struct pace_config *c, unsigned char *buf, int *eol, int *purges) {
+	int max = c->rate ? c->rate/100 : PACE_BATCH;
+	int n = 0;
+
+	if (max<1) {
+		max = 1;
+	} else if (max>PACE_BATCH) {
+		max = PACE_BATCH;
+	}
+
+	*eol = 0;
+	EnterCriticalSection(&p->lock);
+	*purges = p->purges;
+	while (p->count && n<max) {
+		unsigned char ch = p->queue[p->head];
+
+		/* a CR LF or CR NUL pair is kept together */
+		if (*eol && ch!='\n' && ch!=0) {
+			break;
+		}
+		buf[n++] = ch;
+		p->head = (p->head+1) % PACE_QUEUE;
+		p->count--;
+		if (ch=='\r' || ch=='\n') {
+			if (*eol || ch=='\n') {
+				*eol = 1;
+				break;
+			}
+			*eol = 1;
+		}
+	}
+	if (*eol && (c->echo || c->prompt[0])) {
+		/* start looking before the line goes out */
+		p->waiting = 1;
+		p->match = 0;
+		ResetEvent(p->echoEvent);
+	}
+	LeaveCriticalSection(&p->lock);
+	SetEvent(p->spaceEvent);
+	return n;
+}
+
+/* returns -1 if the batch was dropped instead */
+static int write_batch(struct pacer *p, OVERLAPPED *o, unsigned char *buf, int len, int purges) {
+	int ret = -1;
+
+	EnterCriticalSection(&p->write_lock);
+	if (purges==p->purges) {
+		ret = port_write(p->cursor,o,buf,len);
+	}
+	LeaveCriticalSection(&p->write_lock);
+	return ret;
+}
+
+/*
+ * Drop everything queued, and any batch already taken, for a session
+ * that is no longer the port's writer.  A batch being written is
+ * finished first.  The pacer keeps running, for if the role comes back.
+ */
+void pace_purge(struct pacer *p) {
+	EnterCriticalSection(&p->write_lock);
+	EnterCriticalSection(&p->lock);
+	p->count = 0;
+	p->waiting = 0;
+	p->purges++;
+	LeaveCriticalSection(&p->lock);
+	LeaveCriticalSection(&p->write_lock);
+	SetEvent(p->echoEvent);
+	SetEvent(p->spaceEvent);
+}
+
+/*
+ * Keep the pacer from writing to the port, while its line settings are
+ * changed.  A batch already being written is finished first.
+ */
+void pace_hold(struct pacer *p) {
+	EnterCriticalSection(&p->write_lock);
+}
+
+void pace_resume(struct pacer *p) {
+	LeaveCriticalSection(&p->write_lock);
+}
+
+/* wait for the timer, or until told to stop.  Returns 0 if stopped */
+static int pace_sleep(struct pacer *p, LONGLONG us) {
+	HANDLE wait[2];
+	LARGE_INTEGER due;
+
+	due.QuadPart = -us*10;	/* relative, in 100ns units */
+	SetWaitableTimer(p->timer,&due,0,NULL,NULL,FALSE);
+	wait[0] = p->stopEvent;
+	wait[1] = p->timer;
+	return WaitForMultipleObjects(2,wait,FALSE,INFINITE)!=WAIT_OBJECT_0;
+}
+
+static DWORD WINAPI pace_thread(LPVOID lpParam) {
+	struct pacer *p = (struct pacer *)lpParam;
+	struct pace_config *c = &config[p->port];
+	struct pace_stats *s = &stats[p->port];
+	unsigned char buf[PACE_BATCH];
+	OVERLAPPED o = {0};
+	HANDLE wait[2];
+	LONGLONG start, burst, sent, late;
+	int len, eol, held, purges;
+
+	o.hEvent = CreateEvent(NULL,TRUE,FALSE,NULL);
+	wait[0] = p->stopEvent;
+
+	while (p->run) {
+		wait[1] = p->dataEvent;
+		if (WaitForMultipleObjects(2,wait,FALSE,INFINITE)==WAIT_OBJECT_0) {
+			break;
+		}
+
+		/*
+		 * Each batch is due when the chars sent so far in this
+		 * burst would have taken at the configured rate.
+		 */
+		burst = start = now_us();
+		sent = 0;
+		held = 0;
+		while (p->run && (len = take_batch(p,c,buf,&eol,&purges))) {
+			if (write_batch(p,&o,buf,len,purges)<0) {
+				/* the writer's role was taken away */
+				pace_purge(p);
+				break;
+			}
+			InterlockedExchangeAdd(&s->chars,len);
+			if (held) {
+				InterlockedExchangeAdd(&s->throttled,len);
+			}
+			sent += len;
+
+			if (eol && p->waiting) {
+				wait[1] = p->echoEvent;
+				if (WaitForMultipleObjects(2,wait,FALSE,c->timeout)==WAIT_TIMEOUT) {
+					InterlockedIncrement(&s->timeouts);
+				}
+				EnterCriticalSection(&p->lock);
+				p->waiting = 0;
+				LeaveCriticalSection(&p->lock);
+				held = 1;
+			}
+			if (eol && c->line_delay) {
+				if (!pace_sleep(p,(LONGLONG)c->line_delay*1000)) {
+					break;
+				}
+				held = 1;
+			}
+			if (eol) {
+				/* the line waits do not count towards the rate */
+				start = now_us();
+				sent = 0;
+			}
+
+			if (c->rate && p->count) {
+				late = start + sent*1000000/c->rate - now_us();
+				if (late>0) {
+					if (!pace_sleep(p,late)) {
+						break;
+					}
+					held = 1;
+				}
+			}
+		}
+		InterlockedExchangeAdd64(&s->busy_us,now_us()-burst);
+	}
+	CloseHandle(o.hEvent);
+	return 0;
+}
+
+/* start a pacer for a session's newly opened port, if the port wants one */
+struct pacer *pace_new(int port, struct port_cursor *cursor) {
+	struct pacer *p;
+
+	if (port<1 || port>MAXPORTS || !pace_active(&config[port])) {
+		return NULL;
+	}
+	if (!(p = calloc(1,sizeof(struct pacer)))) {
+		return NULL;
+	}
+	p->port = port;
+	p->cursor = cursor;
+	p->run = 1;
+	InitializeCriticalSection(&p->lock);
+	InitializeCriticalSection(&p->write_lock);
+	p->timer = CreateWaitableTimer(NULL,FALSE,NULL);
+	p->dataEvent = CreateEvent(NULL,FALSE,FALSE,NULL);
+	p->spaceEvent = CreateEvent(NULL,FALSE,FALSE,NULL);
+	p->echoEvent = CreateEvent(NULL,TRUE,FALSE,NULL);
+	p->stopEvent = CreateEvent(NULL,TRUE,FALSE,NULL);
+	p->thread = CreateThread(NULL,0,pace_thread,p,0,NULL);
+	return p;
+}
+
+/*
+ * Queue client input.  This only blocks if the queue is full, which
+ * pushes back on the client through TCP.
+ */
+void pace_write(struct pacer *p, const unsigned char *buf, int len) {
+	int n, tail;
+
+	while (len && p->run) {
+		EnterCriticalSection(&p->lock);
+		n = PACE_QUEUE - p->count;
+		if (n>len) {
+			n = len;
+		}
+		tail = (p->head+p->count) % PACE_QUEUE;
+		if (n>PACE_QUEUE-tail) {
+			n = PACE_QUEUE-tail;
+		}
+		memcpy(p->queue+tail,buf,n);
+		p->count += n;
+		LeaveCriticalSection(&p->lock);
+
+		if (n) {
+			SetEvent(p->dataEvent);
+			buf += n;
+			len -= n;
+		} else {
+			HANDLE wait[2] = { p->stopEvent, p->spaceEvent };
+			WaitForMultipleObjects(2,wait,FALSE,INFINITE);
+		}
+	}
+}
+
+/* look at the device output for the echo or prompt we are waiting for */
+void pace_echo(struct pacer *p, const unsigned char *buf, int len) {
+	struct pace_config *c = &config[p->port];
+
+	if (!p->waiting) {
+		return;
+	}
+	EnterCriticalSection(&p->lock);
+	while (p->waiting && len--) {
+		unsigned char ch = *buf++;
+
+		if (!c->prompt[0]) {
+			if (ch=='\r' || ch=='\n') {
+				SetEvent(p->echoEvent);
+			}
+			continue;
+		}
+		if (ch==(unsigned char)c->prompt[p->match]) {
+			p->match++;
+		} else {
+			p->match = (ch==(unsigned char)c->prompt[0]);
+		}
+		if (!c->prompt[p->match]) {
+			p->match = 0;
+			SetEvent(p->echoEvent);
+		}
+	}
+	LeaveCriticalSection(&p->lock);
+}
+
+/* stop writing to the port, dropping anything still queued */
+void pace_stop(struct pacer *p) {
+	if (!p->thread) {
+		return;
+	}
+	p->run = 0;
+	SetEvent(p->stopEvent);
+	WaitForSingleObject(p->thread,INFINITE);
+	CloseHandle(p->thread);
+	p->thread = NULL;
+	p->count = 0;
+}
+
+/* must not be called while the serial reader can still call pace_echo */
+void pace_free(struct pacer *p) {
+	pace_stop(p);
+	CloseHandle(p->timer);
+	CloseHandle(p->dataEvent);
+	CloseHandle(p->spaceEvent);
+	CloseHandle(p->echoEvent);
+	CloseHandle(p->stopEvent);
+	DeleteCriticalSection(&p->lock);
+	DeleteCriticalSection(&p->write_lock);
+	free(p);
+}
+
+static int cmd_showpace(struct cli_def *cli, char *command, char *argv[], int argc) {
+	int port;
+
+	cli_print(cli, "port   rate delay wait     chars throttled timeouts  achieved");
+	for (port=1;port<=MAXPORTS;port++) {
+		struct pace_config *c = &config[port];
+		struct pace_stats *s = &stats[port];
+
+		if (!pace_active(c) && !s->chars) {
+			continue;
+		}
+		cli_print(cli, "COM%-2i %6i %5i %-6s %9li %9li %8li %7.0f/s",
+			port,c->rate,c->line_delay,
+			c->prompt[0]?"prompt":c->echo?"echo":"-",
+			s->chars,s->throttled,s->timeouts,
+			s->busy_us ? s->chars*1000000.0/s->busy_us : 0);
+	}
+	return CLI_OK;
+}
+
+/* pace <setting> <port> [value] */
+static int cmd_cpace(struct cli_def *cli, char *command, char *argv[], int argc) {
+	struct pace_config *c;
+	int port;
+
+	if (argc<1 || (port = atoi(argv[0]))<1 || port>MAXPORTS) {
+		cli_print(cli,"Need a port number from 1 to %i",MAXPORTS);
+		return CLI_ERROR;
+	}
+	c = &config[port];
+
+	if (strstr(command,"off")) {
+		memset(c,0,sizeof(*c));
+		c->timeout = 2000;
+		return CLI_OK;
+	}
+	if (argc!=2) {
+		cli_print(cli,"Need a port number and a value");
+		return CLI_ERROR;
+	}
+	if (strstr(command,"prompt")) {
+		snprintf(c->prompt,sizeof(c->prompt),"%s",argv[1]);
+		return CLI_OK;
+	}
+	if (atoi(argv[1])<0) {
+		cli_print(cli,"Value cannot be negative");
+		return CLI_ERROR;
+	}
+	if (strstr(command,"rate")) {
+		c->rate = atoi(argv[1]);
+	} else if (strstr(command,"line-delay")) {
+		c->line_delay = atoi(argv[1]);
+	} else if (strstr(command,"echo")) {
+		c->echo = atoi(argv[1])!=0;
+	} else {
+		c->timeout = atoi(argv[1]);
+	}
+	return CLI_OK;
+}
+
+/* show the config for this module */
+static int this_showrun(struct cli_def *cli) {
+	int port;
+
+	for (port=1;port<=MAXPORTS;port++) {
+		struct pace_config *c = &config[port];
+
+		if (!pace_active(c)) {
+			continue;
+		}
+		cli_print(cli, "pace rate %i %i",port,c->rate);
+		cli_print(cli, "pace line-delay %i %i",port,c->line_delay);
+		cli_print(cli, "pace echo %i %i",port,c->echo);
+		if (c->prompt[0]) {
+			cli_print(cli, "pace prompt %i %s",port,c->prompt);
+		}
+		cli_print(cli, "pace timeout %i %i",port,c->timeout);
+	}
+	return CLI_OK;
+}
+
+/* Our local module definition */
+static struct module_def this_module = {
+	.name = "pace",
+	.desc = "Paced writes to slow serial devices",
+	.showrun = this_showrun,
+};
+
+/* initialise and register this module */
+int pace_init(struct cli_def *cli) {
+	int port;
+
+	for (port=0;port<=MAXPORTS;port++) {
+		config[port].timeout = 2000;
+	}
+	QueryPerformanceFrequency(&count_freq);
+
+	cli_register_command(cli, lookup_parent("show"), "pace", cmd_showpace,
+		PRIVILEGE_UNPRIVILEGED, MODE_EXEC, "Paced write statistics");
+
+	register_parent("config pace",
+		cli_register_command(cli, NULL, "pace", NULL, PRIVILEGE_PRIVILEGED,
+		MODE_CONFIG, "Pace writes to slow devices"));
+
+	cli_register_command(cli, lookup_parent("config pace"), "rate", cmd_cpace,
+		PRIVILEGE_PRIVILEGED, MODE_CONFIG, "Chars per second for a port, 0 for unlimited");
+	cli_register_command(cli, lookup_parent("config pace"), "line-delay", cmd_cpace,
+		PRIVILEGE_PRIVILEGED, MODE_CONFIG, "Milliseconds to wait after each line");
+	cli_register_command(cli, lookup_parent("config pace"), "echo", cmd_cpace,
+		PRIVILEGE_PRIVILEGED, MODE_CONFIG, "Wait for each line to be echoed (0/1)");
+	cli_register_command(cli, lookup_parent("config pace"), "prompt", cmd_cpace,
+		PRIVILEGE_PRIVILEGED, MODE_CONFIG, "Wait for this prompt after each line");
+	cli_register_command(cli, lookup_parent("config pace"), "timeout", cmd_cpace,
+		PRIVILEGE_PRIVILEGED, MODE_CONFIG, "Milliseconds to wait for an echo or prompt");
+	cli_register_command(cli, lookup_parent("config pace"), "off", cmd_cpace,
+		PRIVILEGE_PRIVILEGED, MODE_CONFIG, "Stop pacing a port");
+
+	register_module(&this_module);
+	return 0;
+}
@@ -0,0 +1,17 @@
+/*
+ * pace.h - trickle client input out to slow serial devices
+ *
+ */
+
+struct pacer;
+struct port_cursor;
+
+struct pacer *pace_new(int port, struct port_cursor *cursor);
+void pace_write(struct pacer *, const unsigned char *, int);
+void pace_echo(struct pacer *, const unsigned char *, int);
+void pace_hold(struct pacer *);
+void pace_resume(struct pacer *);
+void pace_purge(struct pacer *);
+void pace_stop(struct pacer *);
+void pace_free(struct pacer *);
+int pace_init(struct cli_def *);
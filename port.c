@@ -0,0 +1,1128 @@
+/*
+ * port.c - serial ports, opened once and shared by the sessions on them
+ *
+ * Copyright (c) 2010 Hamish Coleman <hamish@zot.org>
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * An open port has a reader thread of its own, which reads into a ring -
+ * the port's shared memory ring if there is one, otherwise one of ours
+ * laid out the same way (see shmring.h).  A session attaches a cursor to
+ * the ring and copies out what is new whenever its event is set, so the
+ * session never reads the port itself and the reader never waits for a
+ * session.
+ *
+ * A port is normally opened when a session attaches and closed when the
+ * last one detaches.  A port configured warm is opened straight away and
+ * kept open with its reader running, so attaching to it is no more than
+ * adding a cursor, and what it printed while nobody was attached is
+ * waiting in the ring for the next session.
+ *
+ * A session whose client goes away can be held: its cursor stays on the
+ * port, which stays open with the session's settings, and a client that
+ * reattaches takes the cursor over and is given everything since - as
+ * much as the ring still has.  Held sessions are let go once they have
+ * been idle for the configured time.
+ *
+ * A port can also be watched: a watcher's cursor follows the output of a
+ * port that is already open, without being a session on it.  Each read
+ * is stamped with when it completed, so what several ports printed can
+ * be put back in order.
+ *
+ * So a port has at most one writer - the session attached to it - and
+ * any number of watchers, which is all a spectator is.  Watching costs
+ * the reader no more than setting one more event per read.  The writer's
+ * role can be handed to a spectator, or taken by one; a session that
+ * loses it becomes a spectator.  Writes go through port_write_start,
+ * which checks the role and holds it until the write is done, so the
+ * one that lost it cannot get another write to the device.
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libcli/libcli/libcli.h"
+#include "module.h"
+#include "debug.h"
+#include "serial.h"
+#include "capture.h"
+#include "trigger.h"
+#include "autobaud.h"
+#include "line.h"
+#include "shmring.h"
+#include "port.h"
+
+#define PORT_REPLAY	65536	/* most that is replayed on attaching */
+#define PORT_READ	4096
+#define PORT_TIMEOUT	3000	/* ms for a reader to exit, from the config */
+#define PORT_STAMPS	1024	/* reads whose time is remembered */
+
+/* when the reads that ended at 'end' completed */
+struct port_stamp {
+	uint64_t end;
+	LONGLONG when;		/* QueryPerformanceCounter() */
+};
+
+struct port {
+	int n;
+	int warm;		/* keep it open between sessions */
+	HANDLE serial;		/* INVALID_HANDLE_VALUE while closed */
+	HANDLE reader;
+	HANDLE stale;		/* a reader that did not exit when it was closed */
+	HANDLE readEvent;
+	int closing;		/* tells the reader to stop */
+	int dead;		/* the reader gave up on the port */
+	struct shmring_header *ring;	/* chosen on the first open, then kept */
+	const struct line *line;	/* in force while open */
+	const struct line *rest;	/* what a warm port goes back to, if not the defaults */
+	uint64_t left;		/* where the last session got to */
+	CRITICAL_SECTION lock;	/* opening, closing and attaching */
+	CRITICAL_SECTION cursor_lock;	/* the cursors, which the reader wakes */
+	CRITICAL_SECTION write_lock;	/* a write, or a change of writer */
+	struct port_cursor *cursors;
+	struct port_stamp stamp[PORT_STAMPS];
+	uint32_t stamps;	/* how many there have been */
+
+	LONG opens;		/* cold opens */
+	LONG attaches;		/* attaches to a port that was already open */
+	double open_ms;		/* the last of each */
+	double attach_ms;
+};
+
+static struct port ports[LINE_PORTS+1];
+
+/* a session whose client has gone, waiting for it to come back */
+struct held {
+	int id;			/* the session's connection id */
+	struct port_cursor c;	/* still on the port's list */
+	const struct line *line;	/* the session's own settings, or NULL */
+	DWORD since;		/* GetTickCount() when it was left */
+	struct held *next;
+};
+
+static struct held *held;
+static CRITICAL_SECTION held_lock;	/* taken before any port's lock */
+HANDLE port_held_event;		/* set when port_expire has a new deadline */
+
+static DWORD port_ring = 65536;	/* bytes of output kept by a port of ours */
+static DWORD hold_time = 3600;	/* seconds a held session is kept, 0 for ever */
+
+static double elapsed_ms(LARGE_INTEGER *start) {
+	LARGE_INTEGER end, freq;
+
+	QueryPerformanceCounter(&end);
+	QueryPerformanceFrequency(&freq);
+	return (end.QuadPart-start->QuadPart)*1000.0/freq.QuadPart;
+}
+
+/* a ring for a port that has no shared one */
+static struct shmring_header *ring_new(int n) {
+	struct shmring_header *h = calloc(1,SHMRING_DATA+port_ring);
+
+	if (h) {
+		memcpy(h->magic,SHMRING_MAGIC,4);
+		h->version = SHMRING_VERSION;
+		h->port = n;
+		h->size = port_ring;
+	}
+	return h;
+}
+
+static DWORD WINAPI port_reader(LPVOID lpParam) {
+	struct port *pt = (struct port *)lpParam;
+	struct shmring_header *shared = shmring_get(pt->n);
+	struct port_cursor *c;
+	struct port_stamp *st;
+	LARGE_INTEGER now;
+	OVERLAPPED o={0};
+	unsigned char *p;
+	uint32_t room;
+	DWORD size;
+	int id;
+
+	o.hEvent = pt->readEvent;
+	dprintf(1,"wconsd: debug: start port_reader COM%i\n",pt->n);
+
+	while (!pt->closing) {
+		/* what is reserved is lost to the cursors, so not too much of it */
+		room = PORT_READ < pt->ring->size/4 ? PORT_READ : pt->ring->size/4;
+		p = shmring_reserve(pt->ring,&room);
+		if (!ReadFile(pt->serial,p,room,&size,&o)) {
+			if (GetLastError()!=ERROR_IO_PENDING) {
+				dprintf(1,"wconsd: error %d reading COM%i\n",GetLastError(),pt->n);
+				pt->dead = 1;
+				break;
+			}
+			if (!GetOverlappedResult(pt->serial,&o,&size,TRUE)) {
+				if (GetLastError()==ERROR_OPERATION_ABORTED) {
+					/* closing, or a session cancelled its own I/O */
+					continue;
+				}
+				dprintf(1,"wconsd: error %d (overlapped) reading COM%i\n",
+					GetLastError(),pt->n);
+				pt->dead = 1;
+				break;
+			}
+		}
+		if (!size) {
+			continue;
+		}
+		/* stamped before it can be read */
+		QueryPerformanceCounter(&now);
+		st = &pt->stamp[pt->stamps % PORT_STAMPS];
+		st->end = pt->ring->head+size;
+		st->when = now.QuadPart;
+		__atomic_store_n(&pt->stamps,pt->stamps+1,__ATOMIC_RELEASE);
+		shmring_commit(pt->ring,size);
+		if (pt->ring==shared) {
+			shmring_wrote(pt->n);
+		}
+
+		EnterCriticalSection(&pt->cursor_lock);
+		id = 0;
+		for (c=pt->cursors;c;c=c->next) {
+			if (!c->watching) {
+				id = c->id;
+			}
+			SetEvent(c->event);
+		}
+		LeaveCriticalSection(&pt->cursor_lock);
+
+		capture_data(pt->n,id,CAPTURE_DIR_RX,p,size);
+		trigger_scan(pt->n,p,size);
+	}
+
+	/* let the sessions see that it has gone */
+	EnterCriticalSection(&pt->cursor_lock);
+	for (c=pt->cursors;c;c=c->next) {
+		SetEvent(c->event);
+	}
+	LeaveCriticalSection(&pt->cursor_lock);
+
+	dprintf(1,"wconsd: debug: finish port_reader COM%i\n",pt->n);
+	return 0;
+}
+
+/* open a closed port and start its reader, called with the lock held */
+static int port_open(struct port *pt, const struct line *l) {
+	COMMTIMEOUTS timeouts = {0};
+	DCB dcb;
+	HANDLE serial;
+	DWORD speed;
+
+	/* it would read into the same ring, with the same event, as the new one */
+	if (pt->stale) {
+		if (WaitForSingleObject(pt->stale,0)==WAIT_TIMEOUT) {
+			dprintf(1,"wconsd: COM%i reader from the last open is still running\n",pt->n);
+			return -1;
+		}
+		CloseHandle(pt->stale);
+		pt->stale = NULL;
+	}
+
+	serial = serial_open(pt->n,&dcb,l->speed,l->data,l->parity,l->stop);
+	if (serial==INVALID_HANDLE_VALUE) {
+		return -1;
+	}
+
+	if (l->autobaud || autobaud_enabled) {
+		if ((speed = autobaud_detect(serial,&dcb,pt->n))) {
+			struct line found = *l;
+			const struct line *made;
+
+			found.speed = speed;
+			if ((made = line_make(&found))) {
+				l = made;
+			}
+		}
+	}
+
+	/*
+	 * The reader is the only one reading, and with nobody else to wake
+	 * for, its reads return as soon as anything has arrived rather than
+	 * every 50ms when there is nothing.
+	 */
+	timeouts.ReadIntervalTimeout = MAXDWORD;
+	timeouts.ReadTotalTimeoutMultiplier = MAXDWORD;
+	timeouts.ReadTotalTimeoutConstant = 1000;
+	SetCommTimeouts(serial,&timeouts);
+	PurgeComm(serial,PURGE_RXCLEAR|PURGE_RXABORT);
+
+	if (!pt->ring && !(pt->ring = shmring_get(pt->n)) && !(pt->ring = ring_new(pt->n))) {
+		CloseHandle(serial);
+		return -1;
+	}
+
+	pt->serial = serial;
+	pt->line = l;
+	pt->closing = 0;
+	pt->dead = 0;
+	pt->left = shmring_head(pt->ring);
+	pt->reader = CreateThread(NULL,0,port_reader,pt,0,NULL);
+	if (pt->reader==NULL) {
+		CloseHandle(serial);
+		pt->serial = INVALID_HANDLE_VALUE;
+		return -1;
+	}
+	dprintf(1,"wconsd: opened COM%i\n",pt->n);
+	return 0;
+}
+
+/* stop the reader and close the port, called with the lock held */
+static void port_close(struct port *pt, DWORD timeout) {
+	pt->closing = 1;
+	CancelIoEx(pt->serial,NULL);
+	if (WaitForSingleObject(pt->reader,timeout)==WAIT_TIMEOUT) {
+		dprintf(1,"wconsd: COM%i reader did not exit, abandoning it\n",pt->n);
+		/* the port is not opened again until it has gone */
+		pt->stale = pt->reader;
+	} else {
+		CloseHandle(pt->reader);
+	}
+	pt->reader = NULL;
+	CloseHandle(pt->serial);
+	pt->serial = INVALID_HANDLE_VALUE;
+	dprintf(1,"wconsd: closed COM%i\n",pt->n);
+}
+
+/* set the line, called with the lock held */
+static int port_setline_locked(struct port *pt, const struct line *l) {
+	DCB dcb;
+
+	if (!(l = line_make(l)) ||
+	    serial_setline(pt->serial,&dcb,l->speed,l->data,l->parity,l->stop)) {
+		return -1;
+	}
+	pt->line = l;
+	return 0;
+}
+
+/* the session on a port, rather than a watcher */
+static struct port_cursor *port_session(struct port *pt) {
+	struct port_cursor *c;
+
+	for (c=pt->cursors;c && c->watching;c=c->next) {
+	}
+	return c;
+}
+
+/*
+ * Attach a session to port n, opening it with the session's settings if
+ * it is not open yet.  If it is, the session's settings are put into
+ * force - except for the speed if that is to be detected, as it was when
+ * the port was opened.  One session at a time may be attached, as when
+ * each opened the port for itself.
+ */
+int port_attach(int n, const struct line *l, struct port_cursor *c) {
+	LARGE_INTEGER start;
+	struct port *pt;
+	uint64_t head, reserve;
+	int ret = 0;
+
+	if (n<1 || n>LINE_PORTS) {
+		return -1;
+	}
+	pt = &ports[n];
+
+	QueryPerformanceCounter(&start);
+	EnterCriticalSection(&pt->lock);
+	if (port_session(pt)) {
+		ret = -1;
+	} else {
+		if (pt->serial!=INVALID_HANDLE_VALUE && pt->dead) {
+			/* start again with a port whose reader failed */
+			port_close(pt,PORT_TIMEOUT);
+		}
+		c->warm = pt->serial!=INVALID_HANDLE_VALUE;
+		if (!c->warm) {
+			ret = port_open(pt,l);
+		} else {
+			struct line want = *l;
+
+			if (l->autobaud || autobaud_enabled) {
+				want.speed = pt->line->speed;
+			}
+			if (want.speed!=pt->line->speed || want.data!=pt->line->data ||
+			    want.parity!=pt->line->parity || want.stop!=pt->line->stop) {
+				ret = port_setline_locked(pt,&want);
+			}
+		}
+	}
+	if (ret==0) {
+		/* what it printed since the last session, within reason */
+		head = shmring_head(pt->ring);
+		c->pos = head-pt->left > PORT_REPLAY ? head-PORT_REPLAY : pt->left;
+		/* and no further back than the ring goes, or it starts with a loss */
+		reserve = __atomic_load_n(&pt->ring->reserve,__ATOMIC_RELAXED);
+		if (reserve-c->pos > pt->ring->size) {
+			c->pos = reserve-pt->ring->size;
+		}
+		c->lost = 0;
+		c->watching = 0;
+		c->port = pt;
+		c->serial = pt->serial;
+		c->event = CreateEvent(NULL,FALSE,FALSE,NULL);
+		EnterCriticalSection(&pt->cursor_lock);
+		c->next = pt->cursors;
+		pt->cursors = c;
+		LeaveCriticalSection(&pt->cursor_lock);
+
+		c->ms = elapsed_ms(&start);
+		if (c->warm) {
+			pt->attaches++;
+			pt->attach_ms = c->ms;
+		} else {
+			pt->opens++;
+			pt->open_ms = c->ms;
+		}
+	}
+	LeaveCriticalSection(&pt->lock);
+	return ret;
+}
+
+/*
+ * Watch port n, following its output from now on.  Only an open port
+ * can be watched; it is kept open while it is, but its settings are the
+ * writer's, and a watcher is given the handle only to have it ready for
+ * when it becomes the writer.
+ */
+int port_watch(int n, struct port_cursor *c) {
+	struct port *pt;
+	int ret = -1;
+
+	if (n<1 || n>LINE_PORTS) {
+		return -1;
+	}
+	pt = &ports[n];
+
+	EnterCriticalSection(&pt->lock);
+	if (pt->serial!=INVALID_HANDLE_VALUE) {
+		c->pos = shmring_head(pt->ring);
+		c->lost = 0;
+		c->watching = 1;
+		c->warm = 1;
+		c->ms = 0;
+		c->port = pt;
+		c->serial = pt->serial;
+		c->event = CreateEvent(NULL,FALSE,FALSE,NULL);
+		EnterCriticalSection(&pt->cursor_lock);
+		c->next = pt->cursors;
+		pt->cursors = c;
+		LeaveCriticalSection(&pt->cursor_lock);
+		ret = 0;
+	}
+	LeaveCriticalSection(&pt->lock);
+	return ret;
+}
+
+/* the connection id of port n's writer, or 0 if it has none */
+int port_writer(int n) {
+	struct port_cursor *c;
+	int id = 0;
+
+	if (n<1 || n>LINE_PORTS) {
+		return 0;
+	}
+	EnterCriticalSection(&ports[n].cursor_lock);
+	if ((c = port_session(&ports[n]))) {
+		id = c->id;
+	}
+	LeaveCriticalSection(&ports[n].cursor_lock);
+	return id;
+}
+
+/* is c a held session's cursor? */
+static int cursor_held(struct port_cursor *c) {
+	struct held *h;
+
+	for (h=held;h;h=h->next) {
+		if (&h->c==c) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Make the watcher c its port's writer, the writer there was (if any)
+ * becoming a watcher.  A held session is not taken from, as it has
+ * nobody to watch.  Returns the old writer's connection id, 0 if there
+ * was none, or -1.
+ */
+int port_take(struct port_cursor *c) {
+	struct port *pt = c->port;
+	struct port_cursor *w;
+	int id = -1;
+
+	if (!pt || !c->watching) {
+		return -1;
+	}
+	EnterCriticalSection(&held_lock);
+	EnterCriticalSection(&pt->write_lock);
+	EnterCriticalSection(&pt->cursor_lock);
+	w = port_session(pt);
+	if (!w || !cursor_held(w)) {
+		id = 0;
+		if (w) {
+			w->watching = 1;
+			id = w->id;
+		}
+		c->watching = 0;
+	}
+	LeaveCriticalSection(&pt->cursor_lock);
+	LeaveCriticalSection(&pt->write_lock);
+	LeaveCriticalSection(&held_lock);
+	return id;
+}
+
+/* the writer c hands its role to the watcher to, on the same port */
+int port_handoff(struct port_cursor *c, struct port_cursor *to) {
+	struct port *pt = c->port;
+	int ret = -1;
+
+	if (!pt || to->port!=pt) {
+		return -1;
+	}
+	EnterCriticalSection(&pt->write_lock);
+	EnterCriticalSection(&pt->cursor_lock);
+	if (!c->watching && to->watching) {
+		c->watching = 1;
+		to->watching = 0;
+		ret = 0;
+	}
+	LeaveCriticalSection(&pt->cursor_lock);
+	LeaveCriticalSection(&pt->write_lock);
+	return ret;
+}
+
+/*
+ * Start a write to the port, if c is its writer, and keep the role from
+ * changing until port_write_done.  The writer is only changed under
+ * write_lock, so once port_take or port_handoff has returned, the
+ * session they took the role from cannot start another write.  Returns
+ * -1, with nothing held, if c is not the writer.
+ */
+int port_write_start(struct port_cursor *c) {
+	struct port *pt = c->port;
+
+	if (!pt) {
+		return -1;
+	}
+	EnterCriticalSection(&pt->write_lock);
+	if (c->watching) {
+		LeaveCriticalSection(&pt->write_lock);
+		return -1;
+	}
+	return 0;
+}
+
+void port_write_done(struct port_cursor *c) {
+	LeaveCriticalSection(&c->port->write_lock);
+}
+
+/* write to the port if c is its writer, returning the bytes written or -1 */
+int port_write(struct port_cursor *c, OVERLAPPED *o, const unsigned char *buf, DWORD len) {
+	DWORD wsize = 0;
+
+	if (port_write_start(c)) {
+		return -1;
+	}
+	if (!WriteFile(c->serial,buf,len,&wsize,o)) {
+		if (GetLastError()!=ERROR_IO_PENDING) {
+			dprintf(1,"wconsd[%i]: error %d writing to COM%i\n",c->id,GetLastError(),c->port->n);
+		} else if (!GetOverlappedResult(c->serial,o,&wsize,TRUE)) {
+			dprintf(1,"wconsd[%i]: error %d (overlapped) writing to COM%i\n",
+				c->id,GetLastError(),c->port->n);
+		}
+	}
+	port_write_done(c);
+	return wsize;
+}
+
+/* is port n open, and so can be watched? */
+int port_open_now(int n) {
+	return n>=1 && n<=LINE_PORTS && ports[n].serial!=INVALID_HANDLE_VALUE;
+}
+
+/*
+ * Detach a session, or a watcher.  The last one out closes the port,
+ * unless it is warm, in which case it is put back to its own settings
+ * and kept open.  The session must have stopped using the handle.
+ */
+static void port_unlink(struct port *pt, struct port_cursor *c, DWORD timeout) {
+	struct port_cursor **pp;
+
+	EnterCriticalSection(&pt->lock);
+	EnterCriticalSection(&pt->cursor_lock);
+	for (pp=&pt->cursors;*pp;pp=&(*pp)->next) {
+		if (*pp==c) {
+			*pp = c->next;
+			break;
+		}
+	}
+	LeaveCriticalSection(&pt->cursor_lock);
+
+	if (!c->watching) {
+		pt->left = c->pos;
+	}
+	if (!pt->cursors) {
+		if (pt->warm && !pt->dead) {
+			/* that also raises DTR and RTS again */
+			ClearCommBreak(pt->serial);
+			port_setline_locked(pt,pt->rest?pt->rest:line_default(pt->n));
+		} else {
+			port_close(pt,timeout);
+		}
+	}
+	LeaveCriticalSection(&pt->lock);
+
+	CloseHandle(c->event);
+	c->event = NULL;
+	c->port = NULL;
+	c->serial = INVALID_HANDLE_VALUE;
+}
+
+void port_detach(struct port_cursor *c, DWORD timeout) {
+	if (c->port) {
+		port_unlink(c->port,c,timeout);
+	}
+}
+
+/* if the reader has lapped the cursor, count what was lost and move it on */
+static void cursor_catchup(struct port_cursor *c) {
+	struct shmring_header *h = c->port->ring;
+	uint64_t reserve = __atomic_load_n(&h->reserve,__ATOMIC_RELAXED);
+
+	if (reserve-c->pos > h->size) {
+		c->lost += reserve-h->size-c->pos;
+		c->pos = reserve-h->size;
+	}
+}
+
+/* put one cursor in another's place on its port's list */
+static void cursor_move(struct port_cursor *to, struct port_cursor *from) {
+	struct port *pt = from->port;
+	struct port_cursor **pp;
+
+	EnterCriticalSection(&pt->cursor_lock);
+	for (pp=&pt->cursors;*pp;pp=&(*pp)->next) {
+		if (*pp==from) {
+			break;
+		}
+	}
+	*to = *from;
+	if (*pp) {
+		*pp = to;
+	}
+	LeaveCriticalSection(&pt->cursor_lock);
+	from->port = NULL;
+	from->event = NULL;
+	from->serial = INVALID_HANDLE_VALUE;
+}
+
+/*
+ * Hold the session with connection id 'id' for its client to come back
+ * to: the cursor is kept on the port, with the port left as it is.  The
+ * session must have stopped using the cursor and the handle.  Returns -1
+ * if the port is not worth holding, when the caller should detach.
+ */
+int port_hold(struct port_cursor *c, int id, const struct line *l) {
+	struct held *h;
+
+	if (!port_alive(c) || !(h = calloc(1,sizeof(*h)))) {
+		return -1;
+	}
+	h->id = id;
+	h->line = l;
+	h->since = GetTickCount();
+
+	EnterCriticalSection(&held_lock);
+	cursor_move(&h->c,c);
+	h->next = held;
+	held = h;
+	LeaveCriticalSection(&held_lock);
+	SetEvent(port_held_event);
+
+	dprintf(1,"wconsd[%i]: held on COM%i\n",id,h->c.port->n);
+	return 0;
+}
+
+/*
+ * Take over a held session - the one with connection id 'id', or if that
+ * is 0 the one on port n.  The cursor carries on from where the session
+ * got to.  Returns the session's port, and its own settings in *l, or -1
+ * if there is no such session.
+ */
+int port_reattach(int id, int n, struct port_cursor *c, const struct line **l) {
+	struct held **hp, *h;
+
+	EnterCriticalSection(&held_lock);
+	for (hp=&held;(h = *hp);hp=&h->next) {
+		if (id ? h->id==id : h->c.port->n==n) {
+			*hp = h->next;
+			break;
+		}
+	}
+	if (h) {
+		cursor_move(c,&h->c);
+		/* so that what it is told was lost while held is right */
+		cursor_catchup(c);
+	}
+	LeaveCriticalSection(&held_lock);
+
+	if (!h) {
+		return -1;
+	}
+	n = c->port->n;
+	*l = h->line;
+	free(h);
+	return n;
+}
+
+/* the connection id of a session held on port n, or 0 */
+int port_held(int n) {
+	struct held *h;
+	int id = 0;
+
+	EnterCriticalSection(&held_lock);
+	for (h=held;h;h=h->next) {
+		if (h->c.port->n==n) {
+			id = h->id;
+		}
+	}
+	LeaveCriticalSection(&held_lock);
+	return id;
+}
+
+/*
+ * Let go of the held sessions that have been idle for too long.  Returns
+ * how long until the next one is due, for the caller to come back then.
+ */
+DWORD port_expire(void) {
+	struct held **hp, *h, *gone = NULL;
+	DWORD now = GetTickCount();
+	DWORD next = INFINITE;
+	DWORD idle;
+
+	if (!hold_time) {
+		return INFINITE;
+	}
+	EnterCriticalSection(&held_lock);
+	for (hp=&held;(h = *hp);) {
+		idle = now-h->since;
+		if (idle >= hold_time*1000) {
+			*hp = h->next;
+			h->next = gone;
+			gone = h;
+			continue;
+		}
+		if (hold_time*1000-idle < next) {
+			next = hold_time*1000-idle;
+		}
+		hp = &h->next;
+	}
+	LeaveCriticalSection(&held_lock);
+
+	while ((h = gone)) {
+		gone = h->next;
+		dprintf(1,"wconsd[%i]: held session on COM%i expired\n",h->id,h->c.port->n);
+		port_unlink(h->c.port,&h->c,PORT_TIMEOUT);
+		free(h);
+	}
+	return next;
+}
+
+/*
+ * Copy out up to len bytes of the port's output from where the cursor
+ * is, moving it on.  If the reader has lapped the cursor, what was lost
+ * is counted and it carries on from the oldest byte still in the ring.
+ */
+DWORD port_read(struct port_cursor *c, unsigned char *buf, DWORD len) {
+	struct shmring_header *h = c->port->ring;
+	uint64_t head;
+	DWORD n, offset;
+
+	while (1) {
+		cursor_catchup(c);
+		head = shmring_head(h);
+		if (head==c->pos) {
+			return 0;
+		}
+		n = head-c->pos < len ? head-c->pos : len;
+		offset = c->pos & (h->size-1);
+		if (n > h->size-offset) {
+			n = h->size-offset;
+		}
+		memcpy(buf,shmring_data(h)+offset,n);
+		if (shmring_intact(h,c->pos)) {
+			c->pos += n;
+			return n;
+		}
+		/* overwritten while we copied it, go round and count it */
+	}
+}
+
+/*
+ * Find the read that byte pos came in, returning where it ended and
+ * setting *when to when it completed - or if the reads remembered do not
+ * go back that far, the oldest one, and *exact to 0.  Returns 0 if there
+ * is none.
+ */
+static uint64_t stamp_find(struct port *pt, uint64_t pos, LONGLONG *when, int *exact) {
+	struct port_stamp st;
+	uint32_t n, i;
+	uint64_t end = 0;
+
+	n = __atomic_load_n(&pt->stamps,__ATOMIC_ACQUIRE);
+	*when = 0;
+	*exact = 0;
+	/* the earliest read that ended after pos, newest first */
+	for (i=n;i!=0 && n-i<PORT_STAMPS;i--) {
+		st = pt->stamp[(i-1) % PORT_STAMPS];
+		if (__atomic_load_n(&pt->stamps,__ATOMIC_ACQUIRE)-(i-1) >= PORT_STAMPS) {
+			/* the reader has been round since */
+			break;
+		}
+		if (st.end <= pos) {
+			*exact = 1;
+			break;
+		}
+		end = st.end;
+		*when = st.when;
+	}
+	if (i==0) {
+		/* every read there has been */
+		*exact = 1;
+	}
+	return end;
+}
+
+/*
+ * As port_read, but handing over no more than came in one read of the
+ * port, and setting *when to when that read completed.  Output older
+ * than the reads that are remembered is given the oldest one's time.
+ */
+DWORD port_read_stamped(struct port_cursor *c, unsigned char *buf, DWORD len, LONGLONG *when) {
+	uint64_t end;
+	int exact;
+
+	cursor_catchup(c);
+	end = stamp_find(c->port,c->pos,when,&exact);
+	if (end && end-c->pos < len) {
+		len = end-c->pos;
+	}
+	return port_read(c,buf,len);
+}
+
+/*
+ * Move the cursor to byte number seq of the port's output, or as near as
+ * the ring allows: the oldest byte it still has, or the head.
+ */
+void port_seek(struct port_cursor *c, uint64_t seq) {
+	struct shmring_header *h = c->port->ring;
+	uint64_t reserve = __atomic_load_n(&h->reserve,__ATOMIC_RELAXED);
+	uint64_t head = shmring_head(h);
+
+	if (seq > head) {
+		seq = head;
+	}
+	if (reserve > h->size && seq < reserve-h->size) {
+		seq = reserve-h->size;
+	}
+	c->pos = seq;
+}
+
+/*
+ * How much of the port's output the cursor has still to hand over - as
+ * much as the ring has, if the reader has lapped it.  It may be another
+ * thread's cursor, so it is left where it is.
+ */
+uint64_t port_backlog(struct port_cursor *c) {
+	struct shmring_header *h = c->port->ring;
+	uint64_t reserve = __atomic_load_n(&h->reserve,__ATOMIC_RELAXED);
+	uint64_t pos = c->pos;
+
+	if (reserve-pos > h->size) {
+		pos = reserve-h->size;
+	}
+	return shmring_head(h)-pos;
+}
+
+/* how much output the port's ring keeps */
+uint64_t port_ringsize(struct port_cursor *c) {
+	return c->port->ring->size;
+}
+
+/*
+ * How many ms the oldest byte the cursor has still to hand over has
+ * waited, or -1 if it is older than the reads remembered.
+ */
+double port_lag(struct port_cursor *c) {
+	LARGE_INTEGER now, freq;
+	LONGLONG when;
+	int exact;
+
+	if (!c->port || !port_backlog(c) || !stamp_find(c->port,c->pos,&when,&exact)) {
+		return 0;
+	}
+	if (!exact) {
+		return -1;
+	}
+	QueryPerformanceCounter(&now);
+	QueryPerformanceFrequency(&freq);
+	return (now.QuadPart-when)*1000.0/freq.QuadPart;
+}
+
+/*
+ * Drop all but the newest keep bytes the cursor has still to hand over,
+ * counting them as lost, as if the reader had lapped it.  Returns how
+ * many were dropped.
+ */
+uint64_t port_skip(struct port_cursor *c, uint64_t keep) {
+	uint64_t head = shmring_head(c->port->ring);
+	uint64_t n = 0;
+
+	cursor_catchup(c);
+	if (head-c->pos > keep) {
+		n = head-keep-c->pos;
+		c->pos = head-keep;
+		c->lost += n;
+	}
+	return n;
+}
+
+/* is the port still being read? */
+int port_alive(struct port_cursor *c) {
+	return c->port && !c->port->dead;
+}
+
+/* will the port stay open when this session detaches? */
+int port_kept(struct port_cursor *c) {
+	return c->port && c->port->warm;
+}
+
+/* the settings in force on the port */
+const struct line *port_line(struct port_cursor *c) {
+	return c->port->line;
+}
+
+/* new settings for an attached session's port */
+int port_setline(struct port_cursor *c, const struct line *l) {
+	struct port *pt = c->port;
+	int ret;
+
+	EnterCriticalSection(&pt->lock);
+	ret = port_setline_locked(pt,l);
+	LeaveCriticalSection(&pt->lock);
+	return ret;
+}
+
+/* close every port, once the sessions have all detached */
+void port_shutdown(DWORD timeout) {
+	struct held *h;
+	int n;
+
+	EnterCriticalSection(&held_lock);
+	while ((h = held)) {
+		held = h->next;
+		port_unlink(h->c.port,&h->c,timeout);
+		free(h);
+	}
+	LeaveCriticalSection(&held_lock);
+
+	for (n=1;n<=LINE_PORTS;n++) {
+		struct port *pt = &ports[n];
+
+		EnterCriticalSection(&pt->lock);
+		if (pt->serial!=INVALID_HANDLE_VALUE) {
+			port_close(pt,timeout);
+		}
+		LeaveCriticalSection(&pt->lock);
+	}
+}
+
+static int cmd_showports(struct cli_def *cli, char *command, char *argv[], int argc) {
+	int n;
+
+	cli_print(cli, "port  state    sessions watchers   opens  last open  attaches  last attach       output");
+	for (n=1;n<=LINE_PORTS;n++) {
+		struct port *pt = &ports[n];
+		const char *state;
+		int sessions = 0;
+		int watchers = 0;
+		struct port_cursor *c;
+
+		if (!pt->warm && !pt->opens) {
+			continue;
+		}
+		EnterCriticalSection(&pt->cursor_lock);
+		for (c=pt->cursors;c;c=c->next) {
+			if (c->watching) {
+				watchers++;
+			} else {
+				sessions++;
+			}
+		}
+		LeaveCriticalSection(&pt->cursor_lock);
+
+		if (pt->serial==INVALID_HANDLE_VALUE) {
+			state = pt->warm ? "failed" : "cold";
+		} else if (pt->dead) {
+			state = "dead";
+		} else {
+			state = pt->warm ? "warm" : "open";
+		}
+		cli_print(cli, "COM%-2i %-8s %8i %8i %7li %7.1fms %9li %9.1fms %12.0f",
+			n,state,sessions,watchers,pt->opens,pt->open_ms,pt->attaches,pt->attach_ms,
+			pt->ring ? (double)shmring_head(pt->ring) : 0.0);
+	}
+	return CLI_OK;
+}
+
+static int cmd_showheld(struct cli_def *cli, char *command, char *argv[], int argc) {
+	DWORD now = GetTickCount();
+	struct held *h;
+
+	cli_print(cli, "  id port     idle      waiting         lost");
+	EnterCriticalSection(&held_lock);
+	for (h=held;h;h=h->next) {
+		/* nobody else moves a held cursor */
+		cursor_catchup(&h->c);
+		cli_print(cli, "%4i COM%-2i %7lus %12.0f %12.0f",
+			h->id,h->c.port->n,(now-h->since)/1000,
+			(double)port_backlog(&h->c),(double)h->c.lost);
+	}
+	LeaveCriticalSection(&held_lock);
+	return CLI_OK;
+}
+
+/* port warm <port> <0|1> */
+static int cmd_cport(struct cli_def *cli, char *command, char *argv[], int argc) {
+	struct port *pt;
+	int n;
+
+	if (argc!=2 || (n = atoi(argv[0]))<1 || n>LINE_PORTS) {
+		cli_print(cli,"Need a port number from 1 to %i and 0 or 1",LINE_PORTS);
+		return CLI_ERROR;
+	}
+	pt = &ports[n];
+
+	EnterCriticalSection(&pt->lock);
+	pt->warm = atoi(argv[1])!=0;
+	if (pt->warm && pt->serial==INVALID_HANDLE_VALUE) {
+		if (port_open(pt,line_default(n))) {
+			cli_print(cli,"Cannot open COM%i now, it will be kept open once it has been",n);
+		} else {
+			pt->opens++;
+		}
+	} else if (!pt->warm && pt->serial!=INVALID_HANDLE_VALUE && !pt->cursors) {
+		port_close(pt,PORT_TIMEOUT);
+	}
+	if (pt->warm && pt->serial!=INVALID_HANDLE_VALUE) {
+		pt->rest = pt->line;
+	}
+	LeaveCriticalSection(&pt->lock);
+	return CLI_OK;
+}
+
+/* port buffer <bytes> */
+static int cmd_cbuffer(struct cli_def *cli, char *command, char *argv[], int argc) {
+	DWORD size;
+
+	if (argc!=1 || (size = strtoul(argv[0],NULL,0))<4096 || (size & (size-1))) {
+		cli_print(cli,"Need a power of two, 4096 or more");
+		return CLI_ERROR;
+	}
+	/* a port keeps the ring it has, this is for the ones opened from now */
+	port_ring = size;
+	return CLI_OK;
+}
+
+/* port hold <seconds> */
+static int cmd_chold(struct cli_def *cli, char *command, char *argv[], int argc) {
+	if (argc!=1 || atoi(argv[0])<0 || atoi(argv[0])>1000000) {
+		cli_print(cli,"Need a number of seconds, or 0 to hold sessions for ever");
+		return CLI_ERROR;
+	}
+	hold_time = atoi(argv[0]);
+	SetEvent(port_held_event);
+	return CLI_OK;
+}
+
+/* show the config for this module */
+static int this_showrun(struct cli_def *cli) {
+	int n;
+
+	cli_print(cli, "port buffer %lu",port_ring);
+	cli_print(cli, "port hold %lu",hold_time);
+	for (n=1;n<=LINE_PORTS;n++) {
+		if (ports[n].warm) {
+			cli_print(cli, "port warm %i 1",n);
+		}
+	}
+	return CLI_OK;
+}
+
+/* Our local module definition */
+static struct module_def this_module = {
+	.name = "port",
+	.desc = "Serial ports shared by sessions",
+	.showrun = this_showrun,
+};
+
+/* initialise and register this module */
+int port_init(struct cli_def *cli) {
+	int n;
+
+	for (n=1;n<=LINE_PORTS;n++) {
+		struct port *pt = &ports[n];
+
+		pt->n = n;
+		pt->serial = INVALID_HANDLE_VALUE;
+		pt->readEvent = CreateEvent(NULL,TRUE,FALSE,NULL);
+		InitializeCriticalSection(&pt->lock);
+		InitializeCriticalSection(&pt->cursor_lock);
+		InitializeCriticalSection(&pt->write_lock);
+	}
+	InitializeCriticalSection(&held_lock);
+	port_held_event = CreateEvent(NULL,FALSE,FALSE,NULL);
+
+	cli_register_command(cli, lookup_parent("show"), "ports", cmd_showports,
+		PRIVILEGE_UNPRIVILEGED, MODE_EXEC, "Open and warm serial ports");
+
+	cli_register_command(cli, lookup_parent("show"), "held", cmd_showheld,
+		PRIVILEGE_UNPRIVILEGED, MODE_EXEC, "Sessions held for their clients to come back");
+
+	register_parent("config port",
+		cli_register_command(cli, NULL, "port", NULL, PRIVILEGE_PRIVILEGED,
+		MODE_CONFIG, "Serial ports shared by sessions"));
+
+	cli_register_command(cli, lookup_parent("config port"), "warm", cmd_cport,
+		PRIVILEGE_PRIVILEGED, MODE_CONFIG, "Keep a port open between sessions (0/1)");
+
+	cli_register_command(cli, lookup_parent("config port"), "buffer", cmd_cbuffer,
+		PRIVILEGE_PRIVILEGED, MODE_CONFIG, "Bytes of output a port keeps, without a shared ring");
+
+	cli_register_command(cli, lookup_parent("config port"), "hold", cmd_chold,
+		PRIVILEGE_PRIVILEGED, MODE_CONFIG, "Seconds a session is held after its client goes");
+
+	register_module(&this_module);
+	return 0;
+}
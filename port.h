@@ -0,0 +1,52 @@
+/*
+ * port.h - serial ports, opened once and shared by the sessions on them
+ *
+ */
+
+#include <stdint.h>
+
+struct port;
+
+/* where a session has got to in a port's output */
+struct port_cursor {
+	struct port *port;	/* NULL while not attached */
+	HANDLE serial;		/* the port's handle, for writing */
+	uint64_t pos;		/* the next byte to hand over */
+	uint64_t lost;		/* bytes overwritten before they were handed over */
+	HANDLE event;		/* set when the port has more */
+	int id;			/* connection id, for the capture */
+	int warm;		/* the port was already open */
+	int watching;		/* following the output, not writing */
+	double ms;		/* how long attaching took */
+	struct port_cursor *next;
+};
+
+extern HANDLE port_held_event;	/* set when port_expire has a new deadline */
+
+int port_attach(int n, const struct line *l, struct port_cursor *c);
+int port_watch(int n, struct port_cursor *c);
+int port_open_now(int n);
+int port_writer(int n);
+int port_take(struct port_cursor *c);
+int port_handoff(struct port_cursor *c, struct port_cursor *to);
+int port_write_start(struct port_cursor *c);
+void port_write_done(struct port_cursor *c);
+int port_write(struct port_cursor *c, OVERLAPPED *o, const unsigned char *buf, DWORD len);
+void port_detach(struct port_cursor *c, DWORD timeout);
+int port_hold(struct port_cursor *c, int id, const struct line *l);
+int port_reattach(int id, int n, struct port_cursor *c, const struct line **l);
+int port_held(int n);
+DWORD port_expire(void);
+DWORD port_read(struct port_cursor *c, unsigned char *buf, DWORD len);
+DWORD port_read_stamped(struct port_cursor *c, unsigned char *buf, DWORD len, LONGLONG *when);
+void port_seek(struct port_cursor *c, uint64_t seq);
+uint64_t port_backlog(struct port_cursor *c);
+uint64_t port_ringsize(struct port_cursor *c);
+double port_lag(struct port_cursor *c);
+uint64_t port_skip(struct port_cursor *c, uint64_t keep);
+int port_alive(struct port_cursor *c);
+int port_kept(struct port_cursor *c);
+const struct line *port_line(struct port_cursor *c);
+int port_setline(struct port_cursor *c, const struct line *l);
+void port_shutdown(DWORD timeout);
+int port_init(struct cli_def *);
@@ -0,0 +1,11 @@
+/* afunix.h - AF_UNIX sockets are native, only the path limit is missing */
+#ifndef POSIX_AFUNIX_H
+#define POSIX_AFUNIX_H
+
+#include <sys/un.h>
+
+#ifndef UNIX_PATH_MAX
+#define UNIX_PATH_MAX	108
+#endif
+
+#endif
@@ -0,0 +1,502 @@
+/*
+ * comm.c - win32 serial port calls on top of termios
+ *
+ * Copyright (c) 2010 Hamish Coleman <hamish@zot.org>
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * The DCB is translated to and from termios each time, rather than kept
+ * alongside it, so that GetCommState always reports what the driver is
+ * actually doing.  Only the standard speeds are supported, which is what
+ * the speed command accepts anyway.  Line errors come from the driver's
+ * interrupt counters where it keeps them; many USB adaptors do not, and
+ * ClearCommError then never reports any.
+ *
+ * WaitCommEvent blocks in TIOCMIWAIT, which only wakes for the modem
+ * lines; line errors and breaks are reported along with the next change
+ * of those.  It always completes before returning, and CancelIoEx or
+ * SetCommMask gets it out of the ioctl with a signal.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/serial.h>
+
+#include "windows.h"
+#include "compat.h"
+
+static const struct {
+	DWORD baud;
+	speed_t speed;
+} speeds[] = {
+	{ 110, B110 }, { 300, B300 }, { 600, B600 }, { 1200, B1200 },
+	{ 2400, B2400 }, { 4800, B4800 }, { 9600, B9600 }, { 19200, B19200 },
+	{ 38400, B38400 }, { 57600, B57600 }, { 115200, B115200 },
+	{ 230400, B230400 }, { 460800, B460800 }, { 921600, B921600 },
+	{ 0, 0 }
+};
+
+/* a freshly opened port is raw, and ignores the modem lines */
+int comm_open(struct object *obj) {
+	struct termios t;
+
+	if (tcgetattr(obj->fd,&t)) {
+		return -1;
+	}
+	cfmakeraw(&t);
+	t.c_cflag |= CLOCAL|CREAD;
+	/* so that a non-blocking read with nothing to read is EAGAIN, not 0 */
+	t.c_cc[VMIN] = 1;
+	t.c_cc[VTIME] = 0;
+	return tcsetattr(obj->fd,TCSANOW,&t);
+}
+
+static struct object *serial(HANDLE h) {
+	return compat_object(h,OBJ_SERIAL);
+}
+
+static BOOL modem_lines(struct object *obj, int set, int lines) {
+	if (ioctl(obj->fd,set?TIOCMBIS:TIOCMBIC,&lines)) {
+		SetLastError(errno);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+BOOL GetCommState(HANDLE h, DCB *dcb) {
+	struct object *obj = serial(h);
+	struct termios t;
+	speed_t speed;
+	int lines = 0;
+	int i;
+
+	if (!obj) {
+		return FALSE;
+	}
+	if (tcgetattr(obj->fd,&t)) {
+		SetLastError(errno);
+		return FALSE;
+	}
+	ioctl(obj->fd,TIOCMGET,&lines);
+
+	memset(dcb,0,sizeof(*dcb));
+	dcb->DCBlength = sizeof(*dcb);
+	speed = cfgetospeed(&t);
+	for (i=0;speeds[i].baud;i++) {
+		if (speeds[i].speed==speed) {
+			dcb->BaudRate = speeds[i].baud;
+		}
+	}
+	switch (t.c_cflag&CSIZE) {
+	case CS5: dcb->ByteSize = 5; break;
+	case CS6: dcb->ByteSize = 6; break;
+	case CS7: dcb->ByteSize = 7; break;
+	default: dcb->ByteSize = 8; break;
+	}
+	if (!(t.c_cflag&PARENB)) {
+		dcb->Parity = NOPARITY;
+	} else if (t.c_cflag&CMSPAR) {
+		dcb->Parity = (t.c_cflag&PARODD) ? MARKPARITY : SPACEPARITY;
+	} else {
+		dcb->Parity = (t.c_cflag&PARODD) ? ODDPARITY : EVENPARITY;
+	}
+	dcb->fParity = !!(t.c_cflag&PARENB);
+	dcb->StopBits = (t.c_cflag&CSTOPB) ? TWOSTOPBITS : ONESTOPBIT;
+	dcb->fBinary = TRUE;
+	dcb->fOutxCtsFlow = !!(t.c_cflag&CRTSCTS);
+	if (t.c_cflag&CRTSCTS) {
+		dcb->fRtsControl = RTS_CONTROL_HANDSHAKE;
+	} else {
+		dcb->fRtsControl = (lines&TIOCM_RTS) ? RTS_CONTROL_ENABLE : RTS_CONTROL_DISABLE;
+	}
+	dcb->fDtrControl = (lines&TIOCM_DTR) ? DTR_CONTROL_ENABLE : DTR_CONTROL_DISABLE;
+	dcb->fOutX = !!(t.c_iflag&IXON);
+	dcb->fInX = !!(t.c_iflag&IXOFF);
+	dcb->XonChar = t.c_cc[VSTART];
+	dcb->XoffChar = t.c_cc[VSTOP];
+	return TRUE;
+}
+
+BOOL SetCommState(HANDLE h, DCB *dcb) {
+	struct object *obj = serial(h);
+	struct termios t;
+	int i;
+
+	if (!obj) {
+		return FALSE;
+	}
+	if (tcgetattr(obj->fd,&t)) {
+		SetLastError(errno);
+		return FALSE;
+	}
+	for (i=0;speeds[i].baud && speeds[i].baud!=dcb->BaudRate;i++);
+	if (!speeds[i].baud) {
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+	cfsetispeed(&t,speeds[i].speed);
+	cfsetospeed(&t,speeds[i].speed);
+
+	t.c_cflag &= ~(CSIZE|PARENB|PARODD|CMSPAR|CSTOPB|CRTSCTS);
+	switch (dcb->ByteSize) {
+	case 5: t.c_cflag |= CS5; break;
+	case 6: t.c_cflag |= CS6; break;
+	case 7: t.c_cflag |= CS7; break;
+	case 8: t.c_cflag |= CS8; break;
+	default:
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+	switch (dcb->Parity) {
+	case NOPARITY: break;
+	case ODDPARITY: t.c_cflag |= PARENB|PARODD; break;
+	case EVENPARITY: t.c_cflag |= PARENB; break;
+	case MARKPARITY: t.c_cflag |= PARENB|PARODD|CMSPAR; break;
+	case SPACEPARITY: t.c_cflag |= PARENB|CMSPAR; break;
+	default:
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+	/* termios has no 1.5 stop bits, the UART uses it for 5 bit data */
+	if (dcb->StopBits!=ONESTOPBIT) {
+		t.c_cflag |= CSTOPB;
+	}
+	if (dcb->fOutxCtsFlow || dcb->fRtsControl==RTS_CONTROL_HANDSHAKE) {
+		t.c_cflag |= CRTSCTS;
+	}
+	t.c_iflag &= ~(IXON|IXOFF|IXANY);
+	if (dcb->fOutX) {
+		t.c_iflag |= IXON;
+	}
+	if (dcb->fInX) {
+		t.c_iflag |= IXOFF;
+	}
+	if (dcb->XonChar || dcb->XoffChar) {
+		t.c_cc[VSTART] = dcb->XonChar;
+		t.c_cc[VSTOP] = dcb->XoffChar;
+	}
+	if (tcsetattr(obj->fd,TCSANOW,&t)) {
+		SetLastError(errno);
+		return FALSE;
+	}
+
+	modem_lines(obj,dcb->fDtrControl!=DTR_CONTROL_DISABLE,TIOCM_DTR);
+	if (dcb->fRtsControl!=RTS_CONTROL_HANDSHAKE) {
+		modem_lines(obj,dcb->fRtsControl!=RTS_CONTROL_DISABLE,TIOCM_RTS);
+	}
+	return TRUE;
+}
+
+/* the reads in progress look at these when they start, as on win32 */
+BOOL SetCommTimeouts(HANDLE h, COMMTIMEOUTS *t) {
+	struct object *obj = serial(h);
+
+	if (!obj) {
+		return FALSE;
+	}
+	obj->timeouts = *t;
+	return TRUE;
+}
+
+BOOL GetCommTimeouts(HANDLE h, COMMTIMEOUTS *t) {
+	struct object *obj = serial(h);
+
+	if (!obj) {
+		return FALSE;
+	}
+	*t = obj->timeouts;
+	return TRUE;
+}
+
+BOOL PurgeComm(HANDLE h, DWORD flags) {
+	struct object *obj = serial(h);
+
+	if (!obj) {
+		return FALSE;
+	}
+	if (flags&(PURGE_TXABORT|PURGE_RXABORT)) {
+		CancelIoEx(h,NULL);
+	}
+	if ((flags&PURGE_RXCLEAR) && (flags&PURGE_TXCLEAR)) {
+		tcflush(obj->fd,TCIOFLUSH);
+	} else if (flags&PURGE_RXCLEAR) {
+		tcflush(obj->fd,TCIFLUSH);
+	} else if (flags&PURGE_TXCLEAR) {
+		tcflush(obj->fd,TCOFLUSH);
+	}
+	return TRUE;
+}
+
+/* the errors since the last call, and how much is queued each way */
+BOOL ClearCommError(HANDLE h, DWORD *errors, COMSTAT *cs) {
+	struct object *obj = serial(h);
+	struct serial_icounter_struct ic;
+	int n;
+
+	if (!obj) {
+		return FALSE;
+	}
+	if (errors) {
+		*errors = 0;
+		if (!ioctl(obj->fd,TIOCGICOUNT,&ic)) {
+			if (ic.frame!=obj->icount[0]) *errors |= CE_FRAME;
+			if (ic.overrun!=obj->icount[1]) *errors |= CE_OVERRUN;
+			if (ic.parity!=obj->icount[2]) *errors |= CE_RXPARITY;
+			if (ic.brk!=obj->icount[3]) *errors |= CE_BREAK;
+			if (ic.buf_overrun!=obj->icount[4]) *errors |= CE_RXOVER;
+			obj->icount[0] = ic.frame;
+			obj->icount[1] = ic.overrun;
+			obj->icount[2] = ic.parity;
+			obj->icount[3] = ic.brk;
+			obj->icount[4] = ic.buf_overrun;
+		}
+	}
+	if (cs) {
+		memset(cs,0,sizeof(*cs));
+		if (!ioctl(obj->fd,FIONREAD,&n)) {
+			cs->cbInQue = n;
+		}
+		if (!ioctl(obj->fd,TIOCOUTQ,&n)) {
+			cs->cbOutQue = n;
+		}
+	}
+	return TRUE;
+}
+
+BOOL SetCommBreak(HANDLE h) {
+	struct object *obj = serial(h);
+
+	if (!obj || ioctl(obj->fd,TIOCSBRK)) {
+		SetLastError(obj ? errno : EBADF);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+BOOL ClearCommBreak(HANDLE h) {
+	struct object *obj = serial(h);
+
+	if (!obj || ioctl(obj->fd,TIOCCBRK)) {
+		SetLastError(obj ? errno : EBADF);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+BOOL EscapeCommFunction(HANDLE h, DWORD func) {
+	struct object *obj = serial(h);
+
+	if (!obj) {
+		return FALSE;
+	}
+	switch (func) {
+	case SETDTR: return modem_lines(obj,1,TIOCM_DTR);
+	case CLRDTR: return modem_lines(obj,0,TIOCM_DTR);
+	case SETRTS: return modem_lines(obj,1,TIOCM_RTS);
+	case CLRRTS: return modem_lines(obj,0,TIOCM_RTS);
+	case SETBREAK: return SetCommBreak(h);
+	case CLRBREAK: return ClearCommBreak(h);
+	case SETXOFF: return !tcflow(obj->fd,TCOOFF);
+	case SETXON: return !tcflow(obj->fd,TCOON);
+	}
+	SetLastError(ERROR_INVALID_PARAMETER);
+	return FALSE;
+}
+
+BOOL GetCommModemStatus(HANDLE h, DWORD *status) {
+	struct object *obj = serial(h);
+	int lines;
+
+	if (!obj) {
+		return FALSE;
+	}
+	if (ioctl(obj->fd,TIOCMGET,&lines)) {
+		SetLastError(errno);
+		return FALSE;
+	}
+	*status = 0;
+	if (lines&TIOCM_CTS) *status |= MS_CTS_ON;
+	if (lines&TIOCM_DSR) *status |= MS_DSR_ON;
+	if (lines&TIOCM_RNG) *status |= MS_RING_ON;
+	if (lines&TIOCM_CD) *status |= MS_RLSD_ON;
+	return TRUE;
+}
+
+BOOL SetCommMask(HANDLE h, DWORD mask) {
+	struct object *obj = serial(h);
+
+	if (!obj) {
+		return FALSE;
+	}
+	/* as on windows, a wait in progress returns with no events */
+	compat_lock();
+	obj->evmask = mask;
+	if (obj->waiting) {
+		obj->mask_changed = 1;
+		comm_cancel(obj);
+	}
+	compat_unlock();
+	return TRUE;
+}
+
+BOOL GetCommMask(HANDLE h, DWORD *mask) {
+	struct object *obj = serial(h);
+
+	if (!obj) {
+		return FALSE;
+	}
+	*mask = obj->evmask;
+	return TRUE;
+}
+
+/*
+ * A cancel sends the waiting thread this signal.  If it arrives while
+ * the thread is between checking for a cancel and being in the ioctl,
+ * or in it, the handler jumps out; any earlier and the check sees it.
+ */
+#define WAIT_SIGNAL	SIGRTMIN
+
+static __thread sigjmp_buf wait_env;
+static __thread volatile sig_atomic_t wait_armed;
+
+static void wait_interrupt(int sig) {
+	if (wait_armed) {
+		wait_armed = 0;
+		siglongjmp(wait_env,1);
+	}
+}
+
+static void wait_init(void) {
+	struct sigaction sa;
+
+	memset(&sa,0,sizeof(sa));
+	sa.sa_handler = wait_interrupt;
+	sigemptyset(&sa.sa_mask);
+	sigaction(WAIT_SIGNAL,&sa,NULL);
+}
+
+/* with the lock held, from compat_cancel */
+void comm_cancel(struct object *obj) {
+	if (obj->waiting) {
+		pthread_kill(obj->waiter,WAIT_SIGNAL);
+	}
+}
+
+/* what changed between two readings of the interrupt counters */
+static DWORD icount_events(struct serial_icounter_struct *a, struct serial_icounter_struct *b) {
+	DWORD events = 0;
+
+	if (a->cts!=b->cts) events |= EV_CTS;
+	if (a->dsr!=b->dsr) events |= EV_DSR;
+	if (a->dcd!=b->dcd) events |= EV_RLSD;
+	if (a->rng!=b->rng) events |= EV_RING;
+	if (a->brk!=b->brk) events |= EV_BREAK;
+	if (a->frame!=b->frame || a->parity!=b->parity || a->overrun!=b->overrun
+			|| a->buf_overrun!=b->buf_overrun) {
+		events |= EV_ERR;
+	}
+	return events;
+}
+
+BOOL WaitCommEvent(HANDLE h, DWORD *mask, OVERLAPPED *o) {
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	struct object *obj = serial(h);
+	struct serial_icounter_struct before, after;
+	volatile DWORD events = 0;
+	volatile DWORD err = NO_ERROR;
+	int lines = 0;
+	unsigned gen;
+
+	if (!obj) {
+		return FALSE;
+	}
+	pthread_once(&once,wait_init);
+	if (obj->evmask&EV_CTS) lines |= TIOCM_CTS;
+	if (obj->evmask&EV_DSR) lines |= TIOCM_DSR;
+	if (obj->evmask&EV_RLSD) lines |= TIOCM_CD;
+	if (obj->evmask&EV_RING) lines |= TIOCM_RNG;
+	if (!lines) {
+		/* the errors are only noticed when a line changes */
+		lines = TIOCM_CTS|TIOCM_DSR|TIOCM_CD|TIOCM_RNG;
+	}
+	if (ioctl(obj->fd,TIOCGICOUNT,&before)) {
+		SetLastError(errno);
+		return FALSE;
+	}
+
+	compat_lock();
+	gen = obj->write_gen;
+	obj->refs++;
+	obj->waiter = pthread_self();
+	obj->waiting = 1;
+	obj->mask_changed = 0;
+	compat_unlock();
+
+	if (sigsetjmp(wait_env,1)) {
+		err = ERROR_OPERATION_ABORTED;
+	} else while (!events) {
+		int r;
+
+		wait_armed = 1;
+		if (obj->write_gen!=gen || obj->mask_changed) {
+			wait_armed = 0;
+			err = ERROR_OPERATION_ABORTED;
+			break;
+		}
+		r = ioctl(obj->fd,TIOCMIWAIT,lines);
+		wait_armed = 0;
+		if (r) {
+			if (errno==EINTR) {
+				continue;
+			}
+			err = errno;
+			break;
+		}
+		if (ioctl(obj->fd,TIOCGICOUNT,&after)) {
+			err = errno;
+			break;
+		}
+		events = icount_events(&before,&after) & obj->evmask;
+		before = after;
+	}
+
+	compat_lock();
+	obj->waiting = 0;
+	if (obj->mask_changed) {
+		err = NO_ERROR;
+		events = 0;
+	}
+	compat_unlock();
+	compat_put(obj);
+
+	if (err!=NO_ERROR) {
+		SetLastError(err);
+		return FALSE;
+	}
+	*mask = events;
+	if (o) {
+		o->Internal = NO_ERROR;
+		o->InternalHigh = 0;
+	}
+	return TRUE;
+}
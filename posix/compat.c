@@ -0,0 +1,1398 @@
+/*
+ * compat.c - win32 handles, events and overlapped I/O on top of posix
+ *
+ * Copyright (c) 2010 Hamish Coleman <hamish@zot.org>
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Every waitable thing - events, timers, threads - is a struct object
+ * whose state is protected by one global lock.  A thread that has to wait
+ * sleeps on its own condition, listed with the objects it is waiting for,
+ * and a change of state wakes only the threads waiting for that object.
+ * WaitForMultipleObjects is then just a loop of checking the handles and
+ * sleeping, with the sleep cut short by the earliest timer among the
+ * handles.  wconsd never waits on more than a handful of handles, so this
+ * is cheap enough.
+ *
+ * The things that need the kernel to tell us about them - a listening
+ * socket given to WSAEventSelect, an overlapped ReadFile on a serial port
+ * - are handed to a single reactor thread running epoll.  It sets the
+ * socket's event, or completes the pending read once the COMMTIMEOUTS
+ * rules say the read is finished, exactly as the serial driver would.
+ *
+ * With WCONSD_IO=uring in the environment the reactor is built on
+ * io_uring instead, see uring.c.  The struct engine hooks are where the
+ * two differ.
+ *
+ * Overlapped writes are done synchronously, which win32 is also allowed
+ * to do; they can still be aborted by CancelIoEx or PurgeComm.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "winsock2.h"
+#include "mstcpip.h"
+#include "compat.h"
+
+/* the real ones, not the wrappers the daemon sees */
+#undef accept
+#undef recv
+#undef select
+
+#define MAXKEYS	8
+
+/* a thread in compat_sleep(), and what it is waiting for */
+struct sleeper {
+	pthread_cond_t cond;
+	int init;
+	const void *keys[MAXKEYS];
+	int nkeys;		/* or 0 to be woken by anything */
+	struct sleeper *next;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static struct sleeper *sleepers;
+static __thread struct sleeper self;
+
+static const struct engine epoll_engine;
+static const struct engine *engine = &epoll_engine;
+
+static int epfd = -1;
+static int wakefd = -1;
+struct pending *compat_pending;
+static struct watch *watches;
+static struct watch *dead_watches;
+static struct object *graveyard;
+
+/* sockets that are event selected, and so can not be made blocking */
+static unsigned char *selected;
+static int nr_selected;
+
+static __thread DWORD last_error;
+
+static void compat_start(void) {
+	const char *io = getenv("WCONSD_IO");
+
+	/* the config file has not been read yet, so this is chosen by hand */
+	if (io && !strcmp(io,"uring")) {
+		if (!uring_engine.start()) {
+			engine = &uring_engine;
+			return;
+		}
+		fprintf(stderr,"wconsd: io_uring unavailable (%s), using epoll\n",
+			strerror(errno));
+	}
+	epoll_engine.start();
+}
+
+/* everything that touches objects comes through here first */
+void compat_lock(void) {
+	pthread_once(&once,compat_start);
+	pthread_mutex_lock(&lock);
+}
+
+void compat_unlock(void) {
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Wait for a change to one of the keys - an object, an OVERLAPPED, or
+ * whatever the engine wakes - or until the deadline, with the lock held
+ */
+void compat_sleep(const void *const *keys, int n, uint64_t until) {
+	struct sleeper *s = &self, **ps;
+	struct timespec ts;
+
+	if (!s->init) {
+		pthread_condattr_t attr;
+
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr,CLOCK_MONOTONIC);
+		pthread_cond_init(&s->cond,&attr);
+		pthread_condattr_destroy(&attr);
+		s->init = 1;
+	}
+	/* the callers all check again, so this may return early */
+	if (engine->flush && engine->flush()) {
+		return;
+	}
+	s->nkeys = n>MAXKEYS ? 0 : n;
+	memcpy(s->keys,keys,s->nkeys*sizeof(*keys));
+	s->next = sleepers;
+	sleepers = s;
+
+	if (until==UINT64_MAX) {
+		pthread_cond_wait(&s->cond,&lock);
+	} else {
+		ts.tv_sec = until/1000000000ULL;
+		ts.tv_nsec = until%1000000000ULL;
+		pthread_cond_timedwait(&s->cond,&lock,&ts);
+	}
+
+	for (ps=&sleepers;*ps;ps=&(*ps)->next) {
+		if (*ps==s) {
+			*ps = s->next;
+			break;
+		}
+	}
+}
+
+/* wake the threads waiting for key, with the lock held */
+void compat_wake(const void *key) {
+	struct sleeper *s;
+	int i;
+
+	for (s=sleepers;s;s=s->next) {
+		for (i=0;i<s->nkeys && s->keys[i]!=key;i++);
+		if (!s->nkeys || i<s->nkeys) {
+			pthread_cond_signal(&s->cond);
+		}
+	}
+}
+
+static void reactor_wake(void) {
+	uint64_t one = 1;
+
+	if (write(wakefd,&one,sizeof(one))<0) {
+		/* the counter is already non-zero, the reactor will wake */
+	}
+}
+
+uint64_t compat_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+DWORD GetLastError(void) {
+	return last_error;
+}
+
+void SetLastError(DWORD err) {
+	last_error = err;
+}
+
+void OutputDebugStringA(LPCSTR s) {
+	fputs(s,stderr);
+}
+
+void Sleep(DWORD ms) {
+	struct timespec ts;
+
+	if (!ms) {
+		sched_yield();
+		return;
+	}
+	ts.tv_sec = ms/1000;
+	ts.tv_nsec = (ms%1000)*1000000L;
+	while (nanosleep(&ts,&ts) && errno==EINTR);
+}
+
+/* milliseconds, and unlike win32 this does not wrap */
+DWORD GetTickCount(void) {
+	return compat_now()/1000000;
+}
+
+BOOL QueryPerformanceCounter(LARGE_INTEGER *count) {
+	count->QuadPart = compat_now();
+	return TRUE;
+}
+
+BOOL QueryPerformanceFrequency(LARGE_INTEGER *freq) {
+	freq->QuadPart = 1000000000LL;
+	return TRUE;
+}
+
+/* 100ns units since 1601 */
+static uint64_t filetime_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME,&ts);
+	return ((uint64_t)ts.tv_sec+11644473600ULL)*10000000ULL + ts.tv_nsec/100;
+}
+
+void GetSystemTimeAsFileTime(FILETIME *ft) {
+	uint64_t t = filetime_now();
+
+	ft->dwLowDateTime = (DWORD)(t & 0xffffffff);
+	ft->dwHighDateTime = (DWORD)(t >> 32);
+}
+
+void GetLocalTime(SYSTEMTIME *st) {
+	struct timespec ts;
+	struct tm tm;
+
+	clock_gettime(CLOCK_REALTIME,&ts);
+	localtime_r(&ts.tv_sec,&tm);
+	st->wYear = tm.tm_year+1900;
+	st->wMonth = tm.tm_mon+1;
+	st->wDayOfWeek = tm.tm_wday;
+	st->wDay = tm.tm_mday;
+	st->wHour = tm.tm_hour;
+	st->wMinute = tm.tm_min;
+	st->wSecond = tm.tm_sec;
+	st->wMilliseconds = ts.tv_nsec/1000000;
+}
+
+void InitializeCriticalSection(CRITICAL_SECTION *cs) {
+	pthread_mutexattr_t attr;
+
+	/* win32 critical sections may be entered again by their owner */
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr,PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&cs->m,&attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+void DeleteCriticalSection(CRITICAL_SECTION *cs) {
+	pthread_mutex_destroy(&cs->m);
+}
+
+void EnterCriticalSection(CRITICAL_SECTION *cs) {
+	pthread_mutex_lock(&cs->m);
+}
+
+void LeaveCriticalSection(CRITICAL_SECTION *cs) {
+	pthread_mutex_unlock(&cs->m);
+}
+
+BOOL TryEnterCriticalSection(CRITICAL_SECTION *cs) {
+	return !pthread_mutex_trylock(&cs->m);
+}
+
+static struct object *object_new(int type) {
+	struct object *obj = calloc(1,sizeof(*obj));
+
+	if (!obj) {
+		last_error = ENOMEM;
+		return NULL;
+	}
+	obj->kind = KIND_OBJECT;
+	obj->type = type;
+	obj->refs = 1;
+	obj->fd = -1;
+	return obj;
+}
+
+/* the handle, if it is a live object of the given type (or any, for 0) */
+struct object *compat_object(HANDLE h, int type) {
+	struct object *obj = h;
+
+	if (!obj || h==INVALID_HANDLE_VALUE || obj->kind!=KIND_OBJECT
+			|| (type && obj->type!=type)) {
+		last_error = EBADF;
+		return NULL;
+	}
+	return obj;
+}
+
+/* drop a reference, with the lock held */
+static void object_release(struct object *obj) {
+	if (--obj->refs) {
+		return;
+	}
+	if (obj->fd!=-1) {
+		close(obj->fd);
+	}
+	if (obj->in_epoll) {
+		/* the reactor may have an event for it in hand */
+		obj->next = graveyard;
+		graveyard = obj;
+		reactor_wake();
+		return;
+	}
+	free(obj);
+}
+
+HANDLE CreateEvent(void *sa, BOOL manual, BOOL initial, LPCSTR name) {
+	struct object *obj = object_new(OBJ_EVENT);
+
+	if (obj) {
+		obj->manual = manual;
+		obj->signalled = initial;
+	}
+	return obj;
+}
+
+void compat_event_set(HANDLE h) {
+	struct object *obj = h;
+
+	if (obj) {
+		obj->signalled = 1;
+		compat_wake(obj);
+	}
+}
+
+BOOL SetEvent(HANDLE h) {
+	struct object *obj = compat_object(h,OBJ_EVENT);
+
+	if (!obj) {
+		return FALSE;
+	}
+	compat_lock();
+	compat_event_set(obj);
+	compat_unlock();
+	return TRUE;
+}
+
+BOOL ResetEvent(HANDLE h) {
+	struct object *obj = compat_object(h,OBJ_EVENT);
+
+	if (!obj) {
+		return FALSE;
+	}
+	compat_lock();
+	obj->signalled = 0;
+	compat_unlock();
+	return TRUE;
+}
+
+HANDLE CreateWaitableTimer(void *sa, BOOL manual, LPCSTR name) {
+	struct object *obj = object_new(OBJ_TIMER);
+
+	if (obj) {
+		obj->manual = manual;
+	}
+	return obj;
+}
+
+/* due is in 100ns units, negative for relative and positive for a FILETIME */
+BOOL SetWaitableTimer(HANDLE h, const LARGE_INTEGER *due, LONG period,
+		void *fn, void *arg, BOOL resume) {
+	struct object *obj = compat_object(h,OBJ_TIMER);
+	int64_t rel;
+
+	if (!obj) {
+		return FALSE;
+	}
+	rel = due->QuadPart<0 ? -due->QuadPart : due->QuadPart-(int64_t)filetime_now();
+	if (rel<0) {
+		rel = 0;
+	}
+	compat_lock();
+	obj->due = compat_now() + rel*100;
+	obj->period = (uint64_t)period*1000000;
+	obj->signalled = 1;	/* armed */
+	compat_wake(obj);
+	compat_unlock();
+	return TRUE;
+}
+
+static void *thread_start(void *arg) {
+	struct object *obj = arg;
+
+	obj->fn(obj->arg);
+
+	compat_lock();
+	obj->signalled = 1;
+	compat_wake(obj);
+	object_release(obj);
+	compat_unlock();
+	return NULL;
+}
+
+HANDLE CreateThread(void *sa, size_t stack, LPTHREAD_START_ROUTINE fn,
+		LPVOID arg, DWORD flags, DWORD *id) {
+	struct object *obj = object_new(OBJ_THREAD);
+	pthread_t tid;
+
+	if (!obj) {
+		return NULL;
+	}
+	/* one reference for the handle, one for the thread itself */
+	obj->refs = 2;
+	obj->fn = fn;
+	obj->arg = arg;
+	if ((errno = pthread_create(&tid,NULL,thread_start,obj))) {
+		last_error = errno;
+		free(obj);
+		return NULL;
+	}
+	pthread_detach(tid);
+	if (id) {
+		*id = (DWORD)tid;
+	}
+	return obj;
+}
+
+/* with the lock held */
+static int object_signalled(struct object *obj, uint64_t now) {
+	switch (obj->type) {
+	case OBJ_EVENT:
+	case OBJ_THREAD:
+		return obj->signalled;
+	case OBJ_TIMER:
+		return obj->signalled && now>=obj->due;
+	}
+	return 0;
+}
+
+/* a successful wait consumes an auto reset object */
+static void object_acquired(struct object *obj, uint64_t now) {
+	if (obj->manual) {
+		return;
+	}
+	if (obj->type==OBJ_EVENT) {
+		obj->signalled = 0;
+	} else if (obj->type==OBJ_TIMER) {
+		if (obj->period) {
+			obj->due = now+obj->period;
+		} else {
+			obj->signalled = 0;
+		}
+	}
+}
+
+DWORD WaitForMultipleObjects(DWORD n, const HANDLE *h, BOOL all, DWORD ms) {
+	uint64_t now = compat_now();
+	uint64_t deadline = ms==INFINITE ? UINT64_MAX : now+(uint64_t)ms*1000000;
+	DWORD i, count;
+
+	for (i=0;i<n;i++) {
+		if (!compat_object(h[i],0)) {
+			return WAIT_FAILED;
+		}
+	}
+
+	compat_lock();
+	for (;;) {
+		uint64_t wake = deadline;
+
+		now = compat_now();
+		count = 0;
+		for (i=0;i<n;i++) {
+			struct object *obj = h[i];
+
+			if (object_signalled(obj,now)) {
+				if (!all) {
+					object_acquired(obj,now);
+					compat_unlock();
+					return WAIT_OBJECT_0+i;
+				}
+				count++;
+			} else if (obj->type==OBJ_TIMER && obj->signalled && obj->due<wake) {
+				wake = obj->due;
+			}
+		}
+		if (all && count==n) {
+			for (i=0;i<n;i++) {
+				object_acquired(h[i],now);
+			}
+			compat_unlock();
+			return WAIT_OBJECT_0;
+		}
+		if (now>=deadline) {
+			compat_unlock();
+			return WAIT_TIMEOUT;
+		}
+		compat_sleep((const void *const *)h,n,wake);
+	}
+}
+
+DWORD WaitForSingleObject(HANDLE h, DWORD ms) {
+	return WaitForMultipleObjects(1,&h,FALSE,ms);
+}
+
+/* finish an overlapped read, with the lock held */
+void compat_complete(struct pending *p, DWORD status) {
+	struct pending **pp;
+
+	for (pp=&compat_pending;*pp;pp=&(*pp)->next) {
+		if (*pp==p) {
+			*pp = p->next;
+			break;
+		}
+	}
+	p->o->InternalHigh = p->done;
+	p->o->Internal = status;
+	compat_event_set(p->o->hEvent);
+	compat_wake(p->o);
+	object_release(p->obj);
+	free(p);
+}
+
+/*
+ * More data has landed in a pending read.  Returns 1 if that finished
+ * it, otherwise the interval timeout starts again.
+ */
+int compat_arrived(struct pending *p, DWORD n, uint64_t now) {
+	p->done += n;
+	if (p->done==p->len || p->first_byte) {
+		compat_complete(p,NO_ERROR);
+		return 1;
+	}
+	if (p->obj->timeouts.ReadIntervalTimeout) {
+		p->interval = now+(uint64_t)p->obj->timeouts.ReadIntervalTimeout*1000000;
+	}
+	return 0;
+}
+
+static void epoll_arm(int fd, void *ptr, uint32_t events, int *in_epoll) {
+	struct epoll_event e = { .events = events|EPOLLONESHOT, .data.ptr = ptr };
+
+	if (epoll_ctl(epfd,*in_epoll?EPOLL_CTL_MOD:EPOLL_CTL_ADD,fd,&e)==0) {
+		*in_epoll = 1;
+	}
+}
+
+/*
+ * Take what the port has for a pending read, once it is readable.
+ * Returns 1 if that finished the read, one way or another.
+ */
+int compat_take(struct pending *p, uint64_t now) {
+	ssize_t n = read(p->obj->fd,p->buf+p->done,p->len-p->done);
+
+	if (n<0 && (errno==EAGAIN || errno==EINTR)) {
+		return 0;
+	}
+	if (n<=0) {
+		/* the device has gone, a USB adaptor being unplugged */
+		compat_complete(p,n<0?errno:EIO);
+		return 1;
+	}
+	return compat_arrived(p,n,now);
+}
+
+static void epoll_read(struct pending *p) {
+	epoll_arm(p->obj->fd,p->obj,EPOLLIN,&p->obj->in_epoll);
+	/* there is a new deadline */
+	reactor_wake();
+}
+
+static void epoll_cancel(struct pending *p, DWORD status) {
+	compat_complete(p,status);
+}
+
+static void epoll_closed(struct object *obj) {
+	if (obj->in_epoll) {
+		epoll_ctl(epfd,EPOLL_CTL_DEL,obj->fd,NULL);
+	}
+}
+
+static void epoll_watch(struct watch *w) {
+	epoll_arm(w->s,w,w->events,&w->armed);
+}
+
+static void epoll_unwatch(struct watch *w) {
+	epoll_ctl(epfd,EPOLL_CTL_DEL,w->s,NULL);
+	w->dead = dead_watches;
+	dead_watches = w;
+	reactor_wake();
+}
+
+static void *reactor(void *arg) {
+	struct epoll_event ev[32];
+	struct pending *p, *next;
+	uint64_t now, deadline;
+	int timeout, n, i;
+
+	for (;;) {
+		compat_lock();
+		deadline = UINT64_MAX;
+		for (p=compat_pending;p;p=p->next) {
+			if (p->total && p->total<deadline) {
+				deadline = p->total;
+			}
+			if (p->interval && p->interval<deadline) {
+				deadline = p->interval;
+			}
+		}
+		now = compat_now();
+		if (deadline==UINT64_MAX) {
+			timeout = -1;
+		} else if (deadline<=now) {
+			timeout = 0;
+		} else if (deadline-now>(uint64_t)INT_MAX*1000000) {
+			timeout = INT_MAX;
+		} else {
+			timeout = (deadline-now+999999)/1000000;
+		}
+		compat_unlock();
+
+		n = epoll_wait(epfd,ev,32,timeout);
+
+		compat_lock();
+		now = compat_now();
+		for (i=0;i<n;i++) {
+			int *kind = ev[i].data.ptr;
+
+			if (!kind) {
+				uint64_t count;
+				if (read(wakefd,&count,sizeof(count))<0) {
+					/* already drained */
+				}
+			} else if (*kind==KIND_WATCH) {
+				struct watch *w = (struct watch *)kind;
+				if (w->ev) {
+					compat_event_set(w->ev);
+				}
+			} else {
+				struct object *obj = (struct object *)kind;
+				for (p=compat_pending;p;p=p->next) {
+					if (p->obj==obj) {
+						if (!compat_take(p,now)) {
+							epoll_arm(obj->fd,obj,EPOLLIN,&obj->in_epoll);
+						}
+						break;
+					}
+				}
+			}
+		}
+
+		/* reads that have run out of time */
+		for (p=compat_pending;p;p=next) {
+			next = p->next;
+			if ((p->total && now>=p->total) || (p->interval && now>=p->interval)) {
+				compat_complete(p,NO_ERROR);
+			}
+		}
+
+		/* nothing in hand can refer to these any more */
+		while (graveyard) {
+			struct object *obj = graveyard;
+			graveyard = obj->next;
+			free(obj);
+		}
+		while (dead_watches) {
+			struct watch *w = dead_watches;
+			dead_watches = w->dead;
+			free(w);
+		}
+		compat_unlock();
+	}
+	return NULL;
+}
+
+static int epoll_start(void) {
+	pthread_t tid;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	wakefd = eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+	if (epfd!=-1 && wakefd!=-1) {
+		struct epoll_event e = { .events = EPOLLIN, .data.ptr = NULL };
+		epoll_ctl(epfd,EPOLL_CTL_ADD,wakefd,&e);
+		pthread_create(&tid,NULL,reactor,NULL);
+		pthread_detach(tid);
+		return 0;
+	}
+	return -1;
+}
+
+static const struct engine epoll_engine = {
+	.name = "epoll",
+	.peek = 1,
+	.start = epoll_start,
+	.read = epoll_read,
+	.cancel = epoll_cancel,
+	.closed = epoll_closed,
+	.watch = epoll_watch,
+	.unwatch = epoll_unwatch,
+};
+
+/* abort one, or all, of the overlapped I/O on a port, with the lock held */
+void compat_cancel(struct object *obj, OVERLAPPED *o) {
+	struct pending *p, *next;
+
+	for (p=compat_pending;p;p=next) {
+		next = p->next;
+		if (p->obj==obj && (!o || p->o==o) && p->status==STATUS_PENDING) {
+			engine->cancel(p,ERROR_OPERATION_ABORTED);
+		}
+	}
+	if (!o) {
+		obj->write_gen++;
+		if (obj->type==OBJ_SERIAL) {
+			comm_cancel(obj);
+		}
+	}
+}
+
+/* drop a reference that comm.c took, without the lock */
+void compat_put(struct object *obj) {
+	compat_lock();
+	object_release(obj);
+	compat_unlock();
+}
+
+BOOL CancelIoEx(HANDLE h, OVERLAPPED *o) {
+	struct object *obj = compat_object(h,0);
+
+	if (!obj) {
+		return FALSE;
+	}
+	compat_lock();
+	compat_cancel(obj,o);
+	compat_unlock();
+	return TRUE;
+}
+
+BOOL CloseHandle(HANDLE h) {
+	struct object *obj = compat_object(h,0);
+
+	if (!obj) {
+		return FALSE;
+	}
+	compat_lock();
+	obj->closed = 1;
+	if (obj->type==OBJ_SERIAL) {
+		compat_cancel(obj,NULL);
+		if (engine->closed) {
+			engine->closed(obj);
+		}
+	}
+	object_release(obj);
+	compat_unlock();
+	return TRUE;
+}
+
+/* COMn is /dev/COMn if a udev rule made one, else the nth USB adaptor */
+static void device_path(const char *name, char *path, size_t len) {
+	struct stat st;
+	int n;
+
+	if (sscanf(name,"COM%d",&n)!=1 || n<1) {
+		snprintf(path,len,"%s",name);
+		return;
+	}
+	snprintf(path,len,"/dev/COM%d",n);
+	if (!stat(path,&st)) {
+		return;
+	}
+	snprintf(path,len,"/dev/ttyUSB%d",n-1);
+	if (!stat(path,&st)) {
+		return;
+	}
+	snprintf(path,len,"/dev/ttyS%d",n-1);
+}
+
+HANDLE CreateFile(LPCSTR name, DWORD access, DWORD share, void *sa,
+		DWORD disposition, DWORD flags, HANDLE template) {
+	struct object *obj;
+	char path[MAX_PATH];
+	int oflags = O_CLOEXEC|O_NOCTTY;
+
+	if (!strncmp(name,"\\\\.\\",4)) {
+		device_path(name+4,path,sizeof(path));
+		oflags |= O_RDWR|O_NONBLOCK;
+	} else {
+		snprintf(path,sizeof(path),"%s",name);
+		if ((access&GENERIC_READ) && (access&(GENERIC_WRITE|FILE_APPEND_DATA))) {
+			oflags |= O_RDWR;
+		} else if (access&(GENERIC_WRITE|FILE_APPEND_DATA)) {
+			oflags |= O_WRONLY;
+		}
+		if (access==FILE_APPEND_DATA) {
+			oflags |= O_APPEND;
+		}
+		switch (disposition) {
+		case CREATE_NEW:	oflags |= O_CREAT|O_EXCL; break;
+		case CREATE_ALWAYS:	oflags |= O_CREAT|O_TRUNC; break;
+		case OPEN_ALWAYS:	oflags |= O_CREAT; break;
+		}
+	}
+
+	if (!(obj = object_new(OBJ_FILE))) {
+		return INVALID_HANDLE_VALUE;
+	}
+	if ((obj->fd = open(path,oflags,0644))==-1) {
+		last_error = errno;
+		free(obj);
+		return INVALID_HANDLE_VALUE;
+	}
+	if (isatty(obj->fd)) {
+		obj->type = OBJ_SERIAL;
+		/* win32 serial ports are exclusive to one handle */
+		if ((!share && flock(obj->fd,LOCK_EX|LOCK_NB)) || comm_open(obj)) {
+			last_error = errno==EWOULDBLOCK ? EBUSY : errno;
+			close(obj->fd);
+			free(obj);
+			return INVALID_HANDLE_VALUE;
+		}
+	}
+	return obj;
+}
+
+BOOL DeleteFile(LPCSTR name) {
+	if (unlink(name)) {
+		last_error = errno;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/* an overlapped operation that finished straight away */
+static BOOL overlapped_done(OVERLAPPED *o, DWORD done, DWORD *pdone) {
+	if (pdone) {
+		*pdone = done;
+	}
+	if (o) {
+		compat_lock();
+		o->Internal = NO_ERROR;
+		o->InternalHigh = done;
+		compat_event_set(o->hEvent);
+		compat_wake(o);
+		compat_unlock();
+	}
+	return TRUE;
+}
+
+/*
+ * Start a read from a serial port.  Whatever is already there is taken
+ * straight away, and the COMMTIMEOUTS then decide whether that is enough
+ * or the reactor has to finish the job.  The io_uring engine skips the
+ * first look unless the timeouts say not to wait at all, the read it
+ * queues returns at once if there is data.
+ */
+static BOOL serial_read(struct object *obj, unsigned char *buf, DWORD len, DWORD *pdone, OVERLAPPED *o) {
+	COMMTIMEOUTS t;
+	struct pending *p;
+	uint64_t now;
+	ssize_t n = 0;
+	int nowait;
+
+	compat_lock();
+	t = obj->timeouts;
+	nowait = t.ReadIntervalTimeout==MAXDWORD
+		&& !t.ReadTotalTimeoutMultiplier && !t.ReadTotalTimeoutConstant;
+	if (engine->peek || nowait) {
+		n = read(obj->fd,buf,len);
+		if (n<0 && errno!=EAGAIN && errno!=EINTR) {
+			last_error = errno;
+			compat_unlock();
+			return FALSE;
+		}
+		if (n==0 && len) {
+			last_error = EIO;
+			compat_unlock();
+			return FALSE;
+		}
+		if (n<0) {
+			n = 0;
+		}
+	}
+	compat_unlock();
+
+	if (n==len) {
+		return overlapped_done(o,n,pdone);
+	}
+	/* MAXDWORD,0,0 returns at once, MAXDWORD,x,y waits for one byte */
+	if (nowait || (t.ReadIntervalTimeout==MAXDWORD && n)) {
+		return overlapped_done(o,n,pdone);
+	}
+
+	if (!(p = calloc(1,sizeof(*p)))) {
+		last_error = ENOMEM;
+		return FALSE;
+	}
+	now = compat_now();
+	p->obj = obj;
+	p->o = o;
+	p->buf = buf;
+	p->len = len;
+	p->done = n;
+	p->status = STATUS_PENDING;
+	if (t.ReadIntervalTimeout==MAXDWORD && t.ReadTotalTimeoutMultiplier==MAXDWORD) {
+		/* the special case: only the constant counts */
+		p->total = now + (uint64_t)t.ReadTotalTimeoutConstant*1000000;
+	} else if (t.ReadTotalTimeoutMultiplier || t.ReadTotalTimeoutConstant) {
+		p->total = now + ((uint64_t)t.ReadTotalTimeoutMultiplier*len
+			+ t.ReadTotalTimeoutConstant)*1000000;
+	}
+	if (t.ReadIntervalTimeout==MAXDWORD) {
+		p->first_byte = 1;
+	} else if (n && t.ReadIntervalTimeout) {
+		p->interval = now + (uint64_t)t.ReadIntervalTimeout*1000000;
+	}
+
+	compat_lock();
+	o->Internal = STATUS_PENDING;
+	o->InternalHigh = 0;
+	if (o->hEvent) {
+		((struct object *)o->hEvent)->signalled = 0;
+	}
+	obj->refs++;
+	p->next = compat_pending;
+	compat_pending = p;
+	engine->read(p);
+	compat_unlock();
+
+	last_error = ERROR_IO_PENDING;
+	return FALSE;
+}
+
+/*
+ * Write everything to a serial port, or until the write timeouts expire
+ * (which is not an error).  Checked every so often for being aborted.
+ */
+static BOOL serial_write(struct object *obj, const unsigned char *buf, DWORD len, DWORD *pdone, OVERLAPPED *o) {
+	COMMTIMEOUTS t;
+	uint64_t deadline = 0;
+	unsigned gen;
+	DWORD done = 0;
+	DWORD err = NO_ERROR;
+	struct pollfd pfd;
+
+	compat_lock();
+	t = obj->timeouts;
+	gen = obj->write_gen;
+	obj->refs++;
+	compat_unlock();
+
+	if (t.WriteTotalTimeoutMultiplier || t.WriteTotalTimeoutConstant) {
+		deadline = compat_now() + ((uint64_t)t.WriteTotalTimeoutMultiplier*len
+			+ t.WriteTotalTimeoutConstant)*1000000;
+	}
+	pfd.fd = obj->fd;
+	pfd.events = POLLOUT;
+	while (done<len) {
+		ssize_t n = write(obj->fd,buf+done,len-done);
+
+		if (n>0) {
+			done += n;
+			continue;
+		}
+		if (n<0 && errno!=EAGAIN && errno!=EINTR) {
+			err = errno;
+			break;
+		}
+		if (obj->write_gen!=gen) {
+			err = ERROR_OPERATION_ABORTED;
+			break;
+		}
+		if (deadline && compat_now()>=deadline) {
+			break;
+		}
+		poll(&pfd,1,100);
+	}
+
+	compat_lock();
+	object_release(obj);
+	compat_unlock();
+	if (err==NO_ERROR) {
+		return overlapped_done(o,done,pdone);
+	}
+
+	last_error = err;
+	if (pdone) {
+		*pdone = done;
+	}
+	if (o) {
+		compat_lock();
+		o->Internal = err;
+		o->InternalHigh = done;
+		compat_event_set(o->hEvent);
+		compat_wake(o);
+		compat_unlock();
+	}
+	return FALSE;
+}
+
+BOOL ReadFile(HANDLE h, void *buf, DWORD len, DWORD *pdone, OVERLAPPED *o) {
+	struct object *obj = compat_object(h,0);
+	DWORD done = 0;
+	ssize_t n;
+
+	if (!obj) {
+		return FALSE;
+	}
+	if (obj->type==OBJ_SERIAL) {
+		OVERLAPPED local = {0};
+		BOOL r;
+
+		if (o) {
+			return serial_read(obj,buf,len,pdone,o);
+		}
+		/* a synchronous read is an overlapped one waited for */
+		r = serial_read(obj,buf,len,pdone,&local);
+		if (!r && last_error==ERROR_IO_PENDING) {
+			r = GetOverlappedResult(h,&local,pdone,TRUE);
+		}
+		return r;
+	}
+	while (done<len && (n = read(obj->fd,(char *)buf+done,len-done))) {
+		if (n<0) {
+			if (errno==EINTR) {
+				continue;
+			}
+			last_error = errno;
+			return FALSE;
+		}
+		done += n;
+	}
+	return overlapped_done(o,done,pdone);
+}
+
+BOOL WriteFile(HANDLE h, const void *buf, DWORD len, DWORD *pdone, OVERLAPPED *o) {
+	struct object *obj = compat_object(h,0);
+	DWORD done = 0;
+	ssize_t n;
+
+	if (!obj) {
+		return FALSE;
+	}
+	if (obj->type==OBJ_SERIAL) {
+		return serial_write(obj,buf,len,pdone,o);
+	}
+	while (done<len) {
+		if ((n = write(obj->fd,(const char *)buf+done,len-done))<0) {
+			if (errno==EINTR) {
+				continue;
+			}
+			last_error = errno;
+			return FALSE;
+		}
+		done += n;
+	}
+	return overlapped_done(o,done,pdone);
+}
+
+BOOL GetOverlappedResult(HANDLE h, OVERLAPPED *o, DWORD *pdone, BOOL wait) {
+	DWORD status;
+
+	compat_lock();
+	while (o->Internal==STATUS_PENDING) {
+		if (!wait) {
+			compat_unlock();
+			last_error = ERROR_IO_INCOMPLETE;
+			return FALSE;
+		}
+		compat_sleep((const void *const *)&o,1,UINT64_MAX);
+	}
+	status = o->Internal;
+	*pdone = o->InternalHigh;
+	compat_unlock();
+
+	if (status!=NO_ERROR) {
+		last_error = status;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+HANDLE CreateFileMapping(HANDLE file, void *sa, DWORD protect,
+		DWORD sizehigh, DWORD sizelow, LPCSTR name) {
+	struct object *f = compat_object(file,OBJ_FILE);
+	struct object *obj;
+	struct stat st;
+
+	if (!f || fstat(f->fd,&st)) {
+		return NULL;
+	}
+	if (!(obj = object_new(OBJ_MAPPING))) {
+		return NULL;
+	}
+	obj->size = (uint64_t)sizehigh<<32 | sizelow;
+	if (!obj->size) {
+		obj->size = st.st_size;
+	} else if ((uint64_t)st.st_size<obj->size && ftruncate(f->fd,obj->size)) {
+		last_error = errno;
+		free(obj);
+		return NULL;
+	}
+	/* the mapping outlives the file handle */
+	if ((obj->fd = dup(f->fd))==-1) {
+		last_error = errno;
+		free(obj);
+		return NULL;
+	}
+	return obj;
+}
+
+void *MapViewOfFile(HANDLE map, DWORD access, DWORD offhigh, DWORD offlow,
+		size_t len) {
+	struct object *obj = compat_object(map,OBJ_MAPPING);
+	off_t off = (off_t)offhigh<<32 | offlow;
+	int prot = PROT_READ;
+	void *p;
+
+	if (!obj) {
+		return NULL;
+	}
+	if (access&FILE_MAP_WRITE) {
+		prot |= PROT_WRITE;
+	}
+	if (!len) {
+		len = obj->size-off;
+	}
+	if ((p = mmap(NULL,len,prot,MAP_SHARED,obj->fd,off))==MAP_FAILED) {
+		last_error = errno;
+		return NULL;
+	}
+	return p;
+}
+
+/* sockets */
+
+static void set_selected(SOCKET s, int on) {
+	if (s>=nr_selected) {
+		int n = s+64;
+		unsigned char *p;
+
+		if (!on || !(p = realloc(selected,n))) {
+			return;
+		}
+		memset(p+nr_selected,0,n-nr_selected);
+		selected = p;
+		nr_selected = n;
+	}
+	selected[s] = on;
+}
+
+static int is_selected(SOCKET s) {
+	return s>=0 && s<nr_selected && selected[s];
+}
+
+static struct watch *find_watch(SOCKET s) {
+	struct watch *w;
+
+	for (w=watches;w;w=w->next) {
+		if (w->s==s) {
+			return w;
+		}
+	}
+	return NULL;
+}
+
+/* with the lock held */
+static void remove_watch(SOCKET s) {
+	struct watch **pw, *w;
+
+	if (engine->release) {
+		engine->release(s);
+	}
+	for (pw=&watches;(w=*pw);pw=&w->next) {
+		if (w->s==s) {
+			*pw = w->next;
+			w->ev = NULL;
+			engine->unwatch(w);
+			return;
+		}
+	}
+}
+
+int WSAStartup(WORD version, WSADATA *data) {
+	/* a peer going away is reported by send(), not by a signal */
+	signal(SIGPIPE,SIG_IGN);
+	data->wVersion = version;
+	data->wHighVersion = MAKEWORD(2,2);
+	return 0;
+}
+
+int WSACleanup(void) {
+	return 0;
+}
+
+int WSAGetLastError(void) {
+	switch (errno) {
+	case EAGAIN:		return WSAEWOULDBLOCK;
+	case EINTR:		return WSAEINTR;
+	case EINVAL:		return WSAEINVAL;
+	case ENOTSOCK:		return WSAENOTSOCK;
+	case EBADF:		return WSAENOTSOCK;
+	case ECONNABORTED:	return WSAECONNABORTED;
+	case EPIPE:
+	case ECONNRESET:	return WSAECONNRESET;
+	case ENOTCONN:		return WSAENOTCONN;
+	case ESHUTDOWN:		return WSAESHUTDOWN;
+	case ETIMEDOUT:		return WSAETIMEDOUT;
+	}
+	return errno;
+}
+
+WSAEVENT WSACreateEvent(void) {
+	return CreateEvent(NULL,TRUE,FALSE,NULL);
+}
+
+BOOL WSAResetEvent(WSAEVENT ev) {
+	return ResetEvent(ev);
+}
+
+/*
+ * The event is set whenever the socket is readable - for a listening
+ * socket, when there is a connection to accept.  Like win32, it is not
+ * set again until the socket has been accepted from.
+ */
+int WSAEventSelect(SOCKET s, WSAEVENT ev, long events) {
+	struct watch *w;
+	uint32_t e = 0;
+
+	compat_lock();
+	if (!events) {
+		remove_watch(s);
+		set_selected(s,0);
+		compat_unlock();
+		return 0;
+	}
+	if (events&(FD_READ|FD_ACCEPT)) {
+		e |= EPOLLIN;
+	}
+	if (events&FD_CLOSE) {
+		e |= EPOLLRDHUP;
+	}
+	if (!(w = find_watch(s))) {
+		if (!(w = calloc(1,sizeof(*w)))) {
+			compat_unlock();
+			errno = ENOMEM;
+			return SOCKET_ERROR;
+		}
+		w->kind = KIND_WATCH;
+		w->s = s;
+		w->next = watches;
+		watches = w;
+	}
+	w->ev = ev;
+	w->events = e;
+	set_selected(s,1);
+	fcntl(s,F_SETFL,fcntl(s,F_GETFL)|O_NONBLOCK);
+	engine->watch(w);
+	compat_unlock();
+	return 0;
+}
+
+SOCKET wconsd_accept(SOCKET s, struct sockaddr *sa, int *salen) {
+	socklen_t len = salen ? *salen : 0;
+	SOCKET as;
+	struct watch *w;
+
+	as = accept(s,sa,salen?&len:NULL);
+	if (salen) {
+		*salen = len;
+	}
+
+	compat_lock();
+	if (is_selected(s)) {
+		if ((w = find_watch(s))) {
+			engine->watch(w);
+		}
+		/* the accepted socket inherits the event selection */
+		if (as!=INVALID_SOCKET) {
+			set_selected(as,1);
+			fcntl(as,F_SETFL,fcntl(as,F_GETFL)|O_NONBLOCK);
+			if (engine->adopt) {
+				engine->adopt(as);
+			}
+		}
+	}
+	compat_unlock();
+	return as;
+}
+
+int wconsd_recv(SOCKET s, char *buf, int len, int flags) {
+	if (engine->recv) {
+		return engine->recv(s,buf,len,flags);
+	}
+	return recv(s,buf,len,flags);
+}
+
+int wconsd_select(fd_set *r, fd_set *w, fd_set *e, struct timeval *tv) {
+	if (engine->select) {
+		return engine->select(r,w,e,tv);
+	}
+	return select(FD_SETSIZE,r,w,e,tv);
+}
+
+int ioctlsocket(SOCKET s, long cmd, unsigned long *arg) {
+	int v;
+
+	if (cmd==FIONBIO) {
+		int flags = fcntl(s,F_GETFL);
+		int sel;
+
+		compat_lock();
+		sel = is_selected(s);
+		compat_unlock();
+		if (sel) {
+			/* win32 refuses while WSAEventSelect is in effect */
+			errno = EINVAL;
+			return SOCKET_ERROR;
+		}
+		flags = *arg ? flags|O_NONBLOCK : flags&~O_NONBLOCK;
+		return fcntl(s,F_SETFL,flags)==-1 ? SOCKET_ERROR : 0;
+	}
+	if (cmd==FIONREAD) {
+		if (ioctl(s,FIONREAD,&v)) {
+			return SOCKET_ERROR;
+		}
+		*arg = v;
+		return 0;
+	}
+	errno = EINVAL;
+	return SOCKET_ERROR;
+}
+
+int WSAIoctl(SOCKET s, DWORD code, void *in, DWORD inlen, void *out,
+		DWORD outlen, DWORD *bytes, void *o, void *fn) {
+	struct tcp_keepalive *ka = in;
+	int idle, intvl;
+
+	if (code!=SIO_KEEPALIVE_VALS || inlen<sizeof(*ka)) {
+		errno = EINVAL;
+		return SOCKET_ERROR;
+	}
+	idle = ka->keepalivetime/1000;
+	intvl = ka->keepaliveinterval/1000;
+	if (idle<1) {
+		idle = 1;
+	}
+	if (intvl<1) {
+		intvl = 1;
+	}
+	if (setsockopt(s,SOL_SOCKET,SO_KEEPALIVE,&ka->onoff,sizeof(int))
+			|| setsockopt(s,IPPROTO_TCP,TCP_KEEPIDLE,&idle,sizeof(idle))
+			|| setsockopt(s,IPPROTO_TCP,TCP_KEEPINTVL,&intvl,sizeof(intvl))) {
+		return SOCKET_ERROR;
+	}
+	if (bytes) {
+		*bytes = 0;
+	}
+	return 0;
+}
+
+/*
+ * Unlike win32, close() does not wake a thread blocked in accept() or
+ * recv() on the socket, but shutdown() does
+ */
+int closesocket(SOCKET s) {
+	compat_lock();
+	remove_watch(s);
+	if (is_selected(s)) {
+		selected[s] = 0;
+	}
+	compat_unlock();
+	shutdown(s,SHUT_RDWR);
+	return close(s);
+}
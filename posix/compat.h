@@ -0,0 +1,134 @@
+/*
+ * compat.h - handle objects shared by compat.c and comm.c
+ *
+ * Copyright (c) 2010 Hamish Coleman <hamish@zot.org>
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdint.h>
+#include <sys/select.h>
+
+#define OBJ_EVENT	1
+#define OBJ_TIMER	2
+#define OBJ_THREAD	3
+#define OBJ_FILE	4
+#define OBJ_SERIAL	5
+#define OBJ_MAPPING	6
+
+/* what a HANDLE points at */
+struct object {
+	int kind;		/* must be first, the reactor looks at it */
+	int type;
+	int refs;
+	int closed;
+	struct object *next;	/* on the graveyard */
+
+	/* events, timers and threads */
+	int signalled;
+	int manual;
+	uint64_t due;		/* timers, in ns */
+	uint64_t period;
+	LPTHREAD_START_ROUTINE fn;
+	void *arg;
+
+	/* files, serial ports and mappings */
+	int fd;
+	uint64_t size;
+	int in_epoll;
+	COMMTIMEOUTS timeouts;
+	unsigned write_gen;	/* bumped to abort the writes in progress */
+	int icount[5];		/* line errors already reported */
+	DWORD evmask;		/* SetCommMask */
+	int waiting;		/* a thread is in WaitCommEvent */
+	int mask_changed;	/* SetCommMask during it, which ends it */
+	pthread_t waiter;
+};
+
+#define STATUS_PENDING	0x103
+#define ERROR_NOT_FOUND	1168
+
+#define KIND_OBJECT	1
+#define KIND_WATCH	2
+
+/* a socket given to WSAEventSelect */
+struct watch {
+	int kind;
+	int s;
+	HANDLE ev;
+	uint32_t events;	/* EPOLLIN and friends, which poll() shares */
+	int armed;		/* the engine still holds a reference */
+	struct watch *next;
+	struct watch *dead;
+};
+
+/* an overlapped read waiting for data or its timeouts */
+struct pending {
+	struct object *obj;
+	OVERLAPPED *o;
+	unsigned char *buf;
+	DWORD len;
+	DWORD done;
+	uint64_t total;		/* deadline for the whole read, or 0 */
+	uint64_t interval;	/* deadline for the next byte, or 0 */
+	int first_byte;		/* complete as soon as anything arrives */
+	int inflight;		/* the kernel is reading (1) or polling (2) */
+	DWORD status;		/* how to complete once it lets go */
+	int64_t ts[2];		/* total, as a timespec for the kernel */
+	struct pending *next;
+};
+
+/*
+ * What the reactor is built on.  Each hook is called with the lock held;
+ * the ones a backend does not need are left NULL.
+ */
+struct engine {
+	const char *name;
+	int peek;		/* try the port before queueing a read */
+	int (*start)(void);
+	void (*read)(struct pending *p);
+	void (*cancel)(struct pending *p, DWORD status);
+	void (*closed)(struct object *obj);
+	void (*watch)(struct watch *w);
+	void (*unwatch)(struct watch *w);
+	void (*adopt)(int s);		/* accepted from a watched listener */
+	void (*release)(int s);		/* before it is closed or unwatched */
+	int (*flush)(void);		/* before a thread sleeps, 1 to not */
+	int (*recv)(int s, char *buf, int len, int flags);
+	int (*select)(fd_set *r, fd_set *w, fd_set *e, struct timeval *tv);
+};
+
+extern struct pending *compat_pending;
+
+uint64_t compat_now(void);
+void compat_lock(void);
+void compat_unlock(void);
+void compat_sleep(const void *const *keys, int n, uint64_t until);
+void compat_wake(const void *key);
+void compat_event_set(HANDLE h);
+struct object *compat_object(HANDLE h, int type);
+void compat_cancel(struct object *obj, OVERLAPPED *o);
+void compat_complete(struct pending *p, DWORD status);
+int compat_arrived(struct pending *p, DWORD n, uint64_t now);
+int compat_take(struct pending *p, uint64_t now);
+void compat_put(struct object *obj);
+
+/* uring.c */
+extern const struct engine uring_engine;
+
+/* comm.c */
+int comm_open(struct object *obj);
+void comm_cancel(struct object *obj);
@@ -0,0 +1,15 @@
+/* mstcpip.h - SIO_KEEPALIVE_VALS, mapped onto the linux TCP_KEEP* options */
+#ifndef POSIX_MSTCPIP_H
+#define POSIX_MSTCPIP_H
+
+#include "winsock2.h"
+
+struct tcp_keepalive {
+	ULONG onoff;
+	ULONG keepalivetime;		/* milliseconds */
+	ULONG keepaliveinterval;	/* milliseconds */
+};
+
+#define SIO_KEEPALIVE_VALS	0x98000004
+
+#endif
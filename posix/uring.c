@@ -0,0 +1,792 @@
+/*
+ * uring.c - the compat reactor on io_uring
+ *
+ * Copyright (c) 2010 Hamish Coleman <hamish@zot.org>
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Used instead of epoll when WCONSD_IO=uring is in the environment.
+ *
+ * An overlapped ReadFile on a serial port becomes a read queued straight
+ * into the caller's buffer, linked to a timeout for whichever of the
+ * COMMTIMEOUTS total and interval deadlines comes first, so a port that
+ * is streaming costs no readiness events and the reactor keeps no timers.
+ * The buffer belongs to the kernel until the read's completion has been
+ * seen; a CancelIoEx only asks for it back, and the OVERLAPPED completes
+ * when it arrives.
+ *
+ * A socket accepted from a watched listener gets one multishot recv,
+ * which fills buffers from a ring registered with the kernel and shared
+ * by all the sockets.  recv() and select() in compat.c come here to take
+ * from what has already been received.  A socket sitting on too many
+ * buffers has its recv cancelled until it has caught up, which leaves
+ * the rest in the socket and so pushes back on the peer as before.
+ * Sends stay plain send() calls: the daemon has always sent from the
+ * buffer it is about to reuse, and send() on a socket with room is
+ * already one system call.
+ *
+ * Any thread may queue work, always with the lock held.  It is handed to
+ * the kernel in one batch when a thread is about to sleep, or by the
+ * reactor along with its own work as it goes back to waiting.  Whoever
+ * holds the lock may reap completions, so a read of data that was already
+ * there is finished by the thread that submitted it, without waking the
+ * reactor at all.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "winsock2.h"
+#include "compat.h"
+
+/* the real ones, not the wrappers the daemon sees */
+#undef recv
+#undef select
+
+#define RING_ENTRIES	256
+#define CQ_ENTRIES	4096
+#define NR_BUFS		256	/* receive buffers, shared by the sockets */
+#define BUF_SIZE	4096
+#define SOCK_MAX	64	/* buffers one socket may sit on */
+#define BGID		0
+
+/* what a completion is for, in the low bits of its user_data */
+#define TAG_READ	0	/* struct pending */
+#define TAG_WATCH	1	/* struct watch */
+#define TAG_RECV	2	/* struct sock */
+#define TAG_NONE	3	/* timeouts and cancels */
+#define TAG_MASK	7
+
+/* part of a receive buffer that recv() has not taken yet */
+struct chunk {
+	unsigned short bid;
+	unsigned short off;
+	unsigned short len;
+};
+
+/* an accepted socket being received on by the ring */
+struct sock {
+	int s;
+	int armed;		/* the multishot recv is in the kernel */
+	int throttled;		/* and it has been asked to stop */
+	int eof;
+	int err;
+	int released;
+	unsigned head;
+	unsigned count;
+	struct chunk q[NR_BUFS];
+	struct sock *next;
+};
+
+static int ringfd = -1;
+static unsigned *sq_head, *sq_tail, *sq_array;
+static unsigned *cq_head, *cq_tail;
+static unsigned sq_mask, cq_mask, sq_entries;
+static unsigned sq_local;		/* tail, including what is not published */
+static struct io_uring_sqe *sqes;
+static struct io_uring_cqe *cqes;
+
+static struct io_uring_buf_ring *br;
+static unsigned char *bufs;
+static unsigned short br_tail;
+static int bufs_free;
+
+static struct sock **socks;
+static int nr_socks;
+static struct sock *sock_list;
+static struct watch *dead;
+static int poll_reads;		/* the kernel will not wait in a tty read */
+
+static int reap(uint64_t now);
+
+static int ring_enter(unsigned submit, unsigned wait, unsigned flags) {
+	return syscall(__NR_io_uring_enter,ringfd,submit,wait,flags,NULL,0);
+}
+
+/* hand everything queued to the kernel, with the lock held */
+static void ring_submit(void) {
+	unsigned todo;
+
+	__atomic_store_n(sq_tail,sq_local,__ATOMIC_RELEASE);
+	todo = sq_local-__atomic_load_n(sq_head,__ATOMIC_ACQUIRE);
+	if (todo) {
+		ring_enter(todo,0,0);
+	}
+}
+
+/* room for n more entries, submitting to make it if need be */
+static int sqe_room(unsigned n) {
+	if (sq_local-__atomic_load_n(sq_head,__ATOMIC_ACQUIRE)+n > sq_entries) {
+		ring_submit();
+	}
+	return sq_local-__atomic_load_n(sq_head,__ATOMIC_ACQUIRE)+n <= sq_entries;
+}
+
+static struct io_uring_sqe *sqe_get(void) {
+	struct io_uring_sqe *sqe = &sqes[sq_local & sq_mask];
+
+	memset(sqe,0,sizeof(*sqe));
+	sq_local++;
+	return sqe;
+}
+
+static void cancel_ud(uint64_t ud) {
+	struct io_uring_sqe *sqe;
+
+	if (!sqe_room(1)) {
+		return;
+	}
+	sqe = sqe_get();
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = ud;
+	sqe->user_data = TAG_NONE;
+	ring_submit();
+}
+
+/* serial ports */
+
+/* queue the rest of a pending read, or a poll for it on older kernels */
+static void read_arm(struct pending *p) {
+	uint64_t deadline = p->total;
+	struct io_uring_sqe *sqe;
+
+	if (!sqe_room(2)) {
+		compat_complete(p,EBUSY);
+		return;
+	}
+	sqe = sqe_get();
+	sqe->fd = p->obj->fd;
+	sqe->user_data = (uintptr_t)p | TAG_READ;
+	if (poll_reads) {
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->poll32_events = POLLIN;
+		p->inflight = 2;
+	} else {
+		sqe->opcode = IORING_OP_READ;
+		sqe->addr = (uintptr_t)(p->buf+p->done);
+		sqe->len = p->len-p->done;
+		sqe->off = (uint64_t)-1;
+		p->inflight = 1;
+	}
+	if (p->interval && (!deadline || p->interval<deadline)) {
+		deadline = p->interval;
+	}
+	if (deadline) {
+		sqe->flags |= IOSQE_IO_LINK;
+		p->ts[0] = deadline/1000000000ULL;
+		p->ts[1] = deadline%1000000000ULL;
+		sqe = sqe_get();
+		sqe->opcode = IORING_OP_LINK_TIMEOUT;
+		sqe->addr = (uintptr_t)p->ts;
+		sqe->len = 1;
+		sqe->timeout_flags = IORING_TIMEOUT_ABS;
+		sqe->user_data = TAG_NONE;
+	}
+}
+
+static void uring_read(struct pending *p) {
+	read_arm(p);
+}
+
+static void uring_cancel(struct pending *p, DWORD status) {
+	if (!p->inflight) {
+		compat_complete(p,status);
+		return;
+	}
+	p->status = status;
+	cancel_ud((uintptr_t)p | TAG_READ);
+}
+
+static void read_done(struct pending *p, int res, uint64_t now) {
+	int polled = p->inflight==2;
+
+	p->inflight = 0;
+	if (res==-EAGAIN && !polled) {
+		/* this kernel hands back EAGAIN for a non-blocking tty */
+		poll_reads = 1;
+		res = -EINTR;
+	}
+	if (p->status!=STATUS_PENDING) {
+		if (res>0 && !polled) {
+			p->done += res;
+		}
+		compat_complete(p,p->status);
+		return;
+	}
+	if (res==-ECANCELED || res==-ETIME) {
+		/* the linked timeout, one deadline or the other */
+		compat_complete(p,NO_ERROR);
+		return;
+	}
+	if (res==-EINTR) {
+		read_arm(p);
+		return;
+	}
+	if (polled && res>0) {
+		if (!compat_take(p,now)) {
+			read_arm(p);
+		}
+		return;
+	}
+	if (res<=0) {
+		/* the device has gone, a USB adaptor being unplugged */
+		compat_complete(p,res<0?-res:EIO);
+		return;
+	}
+	if (!compat_arrived(p,res,now)) {
+		read_arm(p);
+	}
+}
+
+/* listening sockets */
+
+static void uring_watch(struct watch *w) {
+	struct io_uring_sqe *sqe;
+
+	if (w->armed || !sqe_room(1)) {
+		return;
+	}
+	sqe = sqe_get();
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = w->s;
+	sqe->poll32_events = w->events;
+	sqe->user_data = (uintptr_t)w | TAG_WATCH;
+	w->armed = 1;
+	ring_submit();
+}
+
+static void uring_unwatch(struct watch *w) {
+	if (w->armed) {
+		cancel_ud((uintptr_t)w | TAG_WATCH);
+	}
+	/* freed by the reactor once the kernel has let go */
+	w->dead = dead;
+	dead = w;
+}
+
+static void watch_done(struct watch *w, int res) {
+	w->armed = 0;
+	if (res>0 && w->ev) {
+		compat_event_set(w->ev);
+	}
+}
+
+/* accepted sockets */
+
+static struct sock *find_sock(int s) {
+	return s>=0 && s<nr_socks ? socks[s] : NULL;
+}
+
+static void buf_return(unsigned short bid) {
+	struct io_uring_buf *b = &br->bufs[br_tail & (NR_BUFS-1)];
+
+	b->addr = (uintptr_t)(bufs+(size_t)bid*BUF_SIZE);
+	b->len = BUF_SIZE;
+	b->bid = bid;
+	br_tail++;
+	__atomic_store_n(&br->tail,br_tail,__ATOMIC_RELEASE);
+	bufs_free++;
+}
+
+static void recv_arm(struct sock *ms) {
+	struct io_uring_sqe *sqe;
+
+	if (!sqe_room(1)) {
+		return;
+	}
+	sqe = sqe_get();
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = ms->s;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = BGID;
+	sqe->user_data = (uintptr_t)ms | TAG_RECV;
+	ms->armed = 1;
+	ms->throttled = 0;
+}
+
+/* start receiving again on the sockets that had stopped for buffers */
+static int rearm_all(void) {
+	struct sock *ms;
+	int n = 0;
+
+	for (ms=sock_list;ms && bufs_free;ms=ms->next) {
+		if (!ms->armed && !ms->eof && !ms->err && ms->count<SOCK_MAX/2) {
+			recv_arm(ms);
+			n++;
+		}
+	}
+	return n;
+}
+
+static void sock_free(struct sock *ms) {
+	while (ms->count) {
+		buf_return(ms->q[ms->head % NR_BUFS].bid);
+		ms->head++;
+		ms->count--;
+	}
+	free(ms);
+}
+
+/* stop managing a socket, the kernel can have it back */
+static void sock_forget(struct sock *ms) {
+	struct sock **pms;
+
+	socks[ms->s] = NULL;
+	for (pms=&sock_list;*pms;pms=&(*pms)->next) {
+		if (*pms==ms) {
+			*pms = ms->next;
+			break;
+		}
+	}
+	ms->released = 1;
+	/* a select() on it has to go and find out */
+	compat_wake(ms);
+}
+
+static void uring_adopt(int s) {
+	struct sock *ms;
+
+	if (s>=nr_socks) {
+		int n = s+64;
+		struct sock **p = realloc(socks,n*sizeof(*p));
+
+		if (!p) {
+			return;
+		}
+		memset(p+nr_socks,0,(n-nr_socks)*sizeof(*p));
+		socks = p;
+		nr_socks = n;
+	}
+	if (!(ms = calloc(1,sizeof(*ms)))) {
+		return;
+	}
+	ms->s = s;
+	ms->next = sock_list;
+	sock_list = ms;
+	socks[s] = ms;
+	recv_arm(ms);
+	ring_submit();
+}
+
+/*
+ * Before the socket is closed, or given to something that reads it
+ * directly.  Whatever had been received and not yet taken is lost.
+ */
+static void uring_release(int s) {
+	struct sock *ms = find_sock(s);
+
+	if (!ms) {
+		return;
+	}
+	sock_forget(ms);
+	if (ms->armed) {
+		cancel_ud((uintptr_t)ms | TAG_RECV);
+		while (ms->armed) {
+			compat_sleep((const void *const *)&ms,1,UINT64_MAX);
+		}
+	}
+	sock_free(ms);
+	if (rearm_all()) {
+		ring_submit();
+	}
+}
+
+static void recv_done(struct sock *ms, int res, unsigned flags) {
+	if (flags & IORING_CQE_F_BUFFER) {
+		unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+
+		bufs_free--;
+		if (res>0 && !ms->released) {
+			struct chunk *c = &ms->q[(ms->head+ms->count) % NR_BUFS];
+			c->bid = bid;
+			c->off = 0;
+			c->len = res;
+			ms->count++;
+		} else {
+			buf_return(bid);
+		}
+	}
+	if (!(flags & IORING_CQE_F_MORE)) {
+		ms->armed = 0;
+		if (res==-EINVAL && !ms->released) {
+			/* no multishot recv in this kernel, recv() as before */
+			sock_forget(ms);
+			sock_free(ms);
+			return;
+		}
+		if (res==0) {
+			ms->eof = 1;
+		} else if (res<0 && res!=-ENOBUFS && res!=-ECANCELED) {
+			ms->err = -res;
+		}
+	}
+	if (ms->released) {
+		/* uring_release() is waiting for this */
+		compat_wake(ms);
+		return;
+	}
+	if (!ms->armed) {
+		rearm_all();
+	} else if (ms->count>=SOCK_MAX && !ms->throttled) {
+		ms->throttled = 1;
+		cancel_ud((uintptr_t)ms | TAG_RECV);
+	}
+	compat_wake(ms);
+}
+
+static int sock_readable(int fd) {
+	struct sock *ms = find_sock(fd);
+
+	/* one that is no longer ours is left for recv() to report on */
+	return !ms || ms->count || ms->eof || ms->err;
+}
+
+static int uring_recv(int s, char *buf, int len, int flags) {
+	struct sock *ms;
+	unsigned head, count, off;
+	int n = 0, returned = 0;
+
+	compat_lock();
+	if (!(ms = find_sock(s))) {
+		compat_unlock();
+		return recv(s,buf,len,flags);
+	}
+	head = ms->head;
+	count = ms->count;
+	off = count ? ms->q[head % NR_BUFS].off : 0;
+	while (n<len && count) {
+		struct chunk *c = &ms->q[head % NR_BUFS];
+		int k = c->len-(off-c->off);
+
+		if (k>len-n) {
+			k = len-n;
+		}
+		memcpy(buf+n,bufs+(size_t)c->bid*BUF_SIZE+off,k);
+		n += k;
+		off += k;
+		if (off==c->off+c->len) {
+			head++;
+			count--;
+			off = count ? ms->q[head % NR_BUFS].off : 0;
+		}
+	}
+	if (!(flags & MSG_PEEK)) {
+		while (ms->head!=head) {
+			buf_return(ms->q[ms->head % NR_BUFS].bid);
+			ms->head++;
+			returned++;
+		}
+		ms->count = count;
+		if (count) {
+			struct chunk *c = &ms->q[head % NR_BUFS];
+			c->len -= off-c->off;
+			c->off = off;
+		}
+	}
+	if (returned && rearm_all()) {
+		ring_submit();
+	}
+	if (!n && len) {
+		if (ms->eof) {
+			n = 0;
+		} else {
+			errno = ms->err ? ms->err : EAGAIN;
+			n = SOCKET_ERROR;
+		}
+	}
+	compat_unlock();
+	return n;
+}
+
+static int fdset_empty(fd_set *set) {
+	int fd;
+
+	for (fd=0;set && fd<FD_SETSIZE;fd++) {
+		if (FD_ISSET(fd,set)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* with the lock held */
+static int ready_socks(fd_set *mine, fd_set *ready) {
+	int fd, n = 0;
+
+	FD_ZERO(ready);
+	for (fd=0;fd<FD_SETSIZE;fd++) {
+		if (FD_ISSET(fd,mine) && sock_readable(fd)) {
+			FD_SET(fd,ready);
+			n++;
+		}
+	}
+	return n;
+}
+
+/*
+ * The sockets the ring is receiving on are readable when they have
+ * something queued.  Anything else is left to the real select(), which
+ * with a mix of the two is polled every few milliseconds.
+ */
+static int uring_select(fd_set *r, fd_set *w, fd_set *e, struct timeval *tv) {
+	uint64_t deadline = UINT64_MAX;
+	fd_set mine, rest, ready, rr, ww, ee;
+	int fd, n, m;
+
+	if (tv) {
+		deadline = compat_now()+(uint64_t)tv->tv_sec*1000000000ULL
+			+ (uint64_t)tv->tv_usec*1000;
+	}
+	FD_ZERO(&mine);
+	FD_ZERO(&rest);
+	compat_lock();
+	for (fd=0;r && fd<FD_SETSIZE;fd++) {
+		if (FD_ISSET(fd,r)) {
+			FD_SET(fd,find_sock(fd)?&mine:&rest);
+		}
+	}
+	if (fdset_empty(&mine)) {
+		compat_unlock();
+		return select(FD_SETSIZE,r,w,e,tv);
+	}
+
+	if (fdset_empty(&rest) && fdset_empty(w) && fdset_empty(e)) {
+		const void *keys[9];
+		int nkeys = 0;
+
+		/* more than compat_sleep() keeps track of is woken by anything */
+		for (fd=0;fd<FD_SETSIZE && nkeys<9;fd++) {
+			if (FD_ISSET(fd,&mine)) {
+				keys[nkeys++] = find_sock(fd);
+			}
+		}
+		while (!(n = ready_socks(&mine,&ready)) && compat_now()<deadline) {
+			compat_sleep(keys,nkeys,deadline);
+		}
+		compat_unlock();
+		*r = ready;
+		return n;
+	}
+
+	for (;;) {
+		struct timeval slice = { 0, 0 };
+		uint64_t now;
+
+		n = ready_socks(&mine,&ready);
+		compat_unlock();
+		now = compat_now();
+		if (!n && deadline>now) {
+			slice.tv_usec = deadline-now<10000000 ? (deadline-now)/1000 : 10000;
+		}
+		rr = rest;
+		if (w) {
+			ww = *w;
+		}
+		if (e) {
+			ee = *e;
+		}
+		m = select(FD_SETSIZE,&rr,w?&ww:NULL,e?&ee:NULL,&slice);
+		if (m<0) {
+			return m;
+		}
+		if (n || m || compat_now()>=deadline) {
+			break;
+		}
+		compat_lock();
+	}
+	compat_lock();
+	n = ready_socks(&mine,&ready);
+	compat_unlock();
+	for (fd=0;fd<FD_SETSIZE;fd++) {
+		if (FD_ISSET(fd,&rr)) {
+			FD_SET(fd,&ready);
+		}
+	}
+	*r = ready;
+	if (w) {
+		*w = ww;
+	}
+	if (e) {
+		*e = ee;
+	}
+	return n+m;
+}
+
+/*
+ * Before a thread sleeps: submit, and take any completions that came
+ * straight back.  Returns 1 if there were some, the thread's wait may
+ * already be over.
+ */
+static int uring_flush(void) {
+	ring_submit();
+	return reap(compat_now())>0;
+}
+
+/* the reactor */
+
+/* with the lock held, returns the number of completions */
+static int reap(uint64_t now) {
+	unsigned head = *cq_head, n = 0;
+
+	while (head!=__atomic_load_n(cq_tail,__ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe *cqe = &cqes[head & cq_mask];
+		uint64_t ud = cqe->user_data;
+		void *ptr = (void *)(uintptr_t)(ud & ~(uint64_t)TAG_MASK);
+
+		switch (ud & TAG_MASK) {
+		case TAG_READ:
+			read_done(ptr,cqe->res,now);
+			break;
+		case TAG_WATCH:
+			watch_done(ptr,cqe->res);
+			break;
+		case TAG_RECV:
+			recv_done(ptr,cqe->res,cqe->flags);
+			break;
+		}
+		head++;
+		n++;
+	}
+	__atomic_store_n(cq_head,head,__ATOMIC_RELEASE);
+	return n;
+}
+
+static void *reactor(void *arg) {
+	struct watch **pw, *w;
+	unsigned todo;
+
+	compat_lock();
+	for (;;) {
+		reap(compat_now());
+
+		/* the watches the kernel has finished with */
+		for (pw=&dead;(w=*pw);) {
+			if (w->armed) {
+				pw = &w->dead;
+				continue;
+			}
+			*pw = w->dead;
+			free(w);
+		}
+
+		/* what is queued goes in with the wait */
+		__atomic_store_n(sq_tail,sq_local,__ATOMIC_RELEASE);
+		todo = sq_local-__atomic_load_n(sq_head,__ATOMIC_ACQUIRE);
+		compat_unlock();
+		ring_enter(todo,1,IORING_ENTER_GETEVENTS);
+		compat_lock();
+	}
+	return NULL;
+}
+
+static int uring_start(void) {
+	struct io_uring_params params;
+	struct io_uring_buf_reg reg;
+	unsigned char *sq, *cq;
+	pthread_t tid;
+	unsigned i;
+	int err;
+
+	memset(&params,0,sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = CQ_ENTRIES;
+	if ((ringfd = syscall(__NR_io_uring_setup,RING_ENTRIES,&params))<0) {
+		return -1;
+	}
+	if (!(params.features & IORING_FEAT_NODROP)) {
+		/* a burst of completions must not be lost */
+		err = ENOSYS;
+		goto fail;
+	}
+	sq = mmap(NULL,params.sq_off.array+params.sq_entries*sizeof(unsigned),
+		PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ringfd,IORING_OFF_SQ_RING);
+	cq = mmap(NULL,params.cq_off.cqes+params.cq_entries*sizeof(struct io_uring_cqe),
+		PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ringfd,IORING_OFF_CQ_RING);
+	sqes = mmap(NULL,params.sq_entries*sizeof(struct io_uring_sqe),
+		PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ringfd,IORING_OFF_SQES);
+	br = mmap(NULL,NR_BUFS*sizeof(struct io_uring_buf),
+		PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+	bufs = malloc((size_t)NR_BUFS*BUF_SIZE);
+	if (sq==MAP_FAILED || cq==MAP_FAILED || sqes==MAP_FAILED || br==MAP_FAILED || !bufs) {
+		err = ENOMEM;
+		goto fail;
+	}
+	sq_head = (unsigned *)(sq+params.sq_off.head);
+	sq_tail = (unsigned *)(sq+params.sq_off.tail);
+	sq_array = (unsigned *)(sq+params.sq_off.array);
+	sq_mask = *(unsigned *)(sq+params.sq_off.ring_mask);
+	sq_entries = params.sq_entries;
+	sq_local = *sq_tail;
+	for (i=0;i<sq_entries;i++) {
+		sq_array[i] = i;
+	}
+	cq_head = (unsigned *)(cq+params.cq_off.head);
+	cq_tail = (unsigned *)(cq+params.cq_off.tail);
+	cq_mask = *(unsigned *)(cq+params.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe *)(cq+params.cq_off.cqes);
+
+	/* the receive buffers, handed to the kernel once and then recycled */
+	memset(&reg,0,sizeof(reg));
+	reg.ring_addr = (uintptr_t)br;
+	reg.ring_entries = NR_BUFS;
+	reg.bgid = BGID;
+	if (syscall(__NR_io_uring_register,ringfd,IORING_REGISTER_PBUF_RING,&reg,1)<0) {
+		err = errno;
+		goto fail;
+	}
+	br_tail = 0;
+	for (i=0;i<NR_BUFS;i++) {
+		buf_return(i);
+	}
+
+	if ((err = pthread_create(&tid,NULL,reactor,NULL))) {
+		goto fail;
+	}
+	pthread_detach(tid);
+	return 0;
+
+fail:
+	close(ringfd);
+	ringfd = -1;
+	errno = err;
+	return -1;
+}
+
+const struct engine uring_engine = {
+	.name = "io_uring",
+	.peek = 0,
+	.start = uring_start,
+	.read = uring_read,
+	.cancel = uring_cancel,
+	.watch = uring_watch,
+	.unwatch = uring_unwatch,
+	.adopt = uring_adopt,
+	.release = uring_release,
+	.flush = uring_flush,
+	.recv = uring_recv,
+	.select = uring_select,
+};
@@ -0,0 +1,319 @@
+/*
+ * windows.h - the part of win32 that wconsd uses, on top of posix
+ *
+ * Copyright (c) 2010 Hamish Coleman <hamish@zot.org>
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * The native build puts this directory first on the include path, so the
+ * daemon sources are compiled unchanged against these declarations.  Only
+ * the calls the daemon actually makes are provided, and they keep the
+ * win32 semantics that the sources rely on - overlapped reads that honour
+ * the COMMTIMEOUTS, events that can be waited on together, accepted
+ * sockets that stay non-blocking.  The implementation is in compat.c and
+ * comm.c
+ */
+
+#ifndef POSIX_WINDOWS_H
+#define POSIX_WINDOWS_H
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+/* glibc has its own dprintf(), ours is renamed out of its way */
+#define dprintf wconsd_dprintf
+
+typedef void *HANDLE;
+typedef unsigned long DWORD;
+typedef unsigned short WORD;
+typedef unsigned char BYTE;
+typedef long LONG;
+typedef unsigned long ULONG;
+typedef long long LONGLONG;
+typedef unsigned long long ULONGLONG;
+typedef uintptr_t ULONG_PTR;
+typedef int BOOL;
+typedef void *LPVOID;
+typedef char *LPSTR;
+typedef const char *LPCSTR;
+typedef DWORD *LPDWORD;
+
+#define WINAPI
+#define TRUE	1
+#define FALSE	0
+#define MAX_PATH	4096
+#define INFINITE	0xffffffff
+#define MAXDWORD	0xffffffff
+#define INVALID_HANDLE_VALUE	((HANDLE)(intptr_t)-1)
+
+#define LOBYTE(w)	((BYTE)(w))
+#define HIBYTE(w)	((BYTE)((w)>>8))
+#define MAKEWORD(a,b)	((WORD)(((BYTE)(a))|((WORD)((BYTE)(b)))<<8))
+
+#define WAIT_OBJECT_0	0
+#define WAIT_TIMEOUT	258
+#define WAIT_FAILED	0xffffffff
+
+/*
+ * GetLastError() returns errno values, apart from these which are well
+ * clear of them
+ */
+#define NO_ERROR		0
+#define ERROR_INVALID_PARAMETER	87
+#define ERROR_IO_PENDING	997
+#define ERROR_IO_INCOMPLETE	996
+#define ERROR_OPERATION_ABORTED	995
+
+/* CreateFile */
+#define GENERIC_READ		0x80000000
+#define GENERIC_WRITE		0x40000000
+#define FILE_APPEND_DATA	0x00000004
+#define FILE_SHARE_READ		1
+#define FILE_SHARE_WRITE	2
+#define FILE_SHARE_DELETE	4
+#define CREATE_NEW		1
+#define CREATE_ALWAYS		2
+#define OPEN_EXISTING		3
+#define OPEN_ALWAYS		4
+#define FILE_ATTRIBUTE_NORMAL	0x80
+#define FILE_FLAG_OVERLAPPED	0x40000000
+
+/* file mappings */
+#define PAGE_READWRITE		4
+#define FILE_MAP_WRITE		2
+#define FILE_MAP_READ		4
+#define FILE_MAP_ALL_ACCESS	0xf001f
+
+/* DCB */
+#define NOPARITY	0
+#define ODDPARITY	1
+#define EVENPARITY	2
+#define MARKPARITY	3
+#define SPACEPARITY	4
+#define ONESTOPBIT	0
+#define ONE5STOPBITS	1
+#define TWOSTOPBITS	2
+#define DTR_CONTROL_DISABLE	0
+#define DTR_CONTROL_ENABLE	1
+#define DTR_CONTROL_HANDSHAKE	2
+#define RTS_CONTROL_DISABLE	0
+#define RTS_CONTROL_ENABLE	1
+#define RTS_CONTROL_HANDSHAKE	2
+#define RTS_CONTROL_TOGGLE	3
+
+/* PurgeComm */
+#define PURGE_TXABORT	1
+#define PURGE_RXABORT	2
+#define PURGE_TXCLEAR	4
+#define PURGE_RXCLEAR	8
+
+/* ClearCommError */
+#define CE_RXOVER	0x0001
+#define CE_OVERRUN	0x0002
+#define CE_RXPARITY	0x0004
+#define CE_FRAME	0x0008
+#define CE_BREAK	0x0010
+
+/* GetCommModemStatus */
+#define MS_CTS_ON	0x0010
+#define MS_DSR_ON	0x0020
+#define MS_RING_ON	0x0040
+#define MS_RLSD_ON	0x0080
+
+/* SetCommMask and WaitCommEvent */
+#define EV_RXCHAR	0x0001
+#define EV_CTS		0x0008
+#define EV_DSR		0x0010
+#define EV_RLSD		0x0020
+#define EV_BREAK	0x0040
+#define EV_ERR		0x0080
+#define EV_RING		0x0100
+
+/* EscapeCommFunction */
+#define SETXOFF		1
+#define SETXON		2
+#define SETRTS		3
+#define CLRRTS		4
+#define SETDTR		5
+#define CLRDTR		6
+#define SETBREAK	8
+#define CLRBREAK	9
+
+typedef union {
+	struct {
+		DWORD LowPart;
+		LONG HighPart;
+	};
+	LONGLONG QuadPart;
+} LARGE_INTEGER;
+
+typedef struct {
+	DWORD dwLowDateTime;
+	DWORD dwHighDateTime;
+} FILETIME;
+
+typedef struct {
+	WORD wYear, wMonth, wDayOfWeek, wDay;
+	WORD wHour, wMinute, wSecond, wMilliseconds;
+} SYSTEMTIME;
+
+typedef struct {
+	ULONG_PTR Internal;		/* completion status */
+	ULONG_PTR InternalHigh;		/* bytes transferred */
+	DWORD Offset;
+	DWORD OffsetHigh;
+	HANDLE hEvent;
+} OVERLAPPED, *LPOVERLAPPED;
+
+typedef struct {
+	DWORD DCBlength;
+	DWORD BaudRate;
+	DWORD fBinary:1;
+	DWORD fParity:1;
+	DWORD fOutxCtsFlow:1;
+	DWORD fOutxDsrFlow:1;
+	DWORD fDtrControl:2;
+	DWORD fDsrSensitivity:1;
+	DWORD fTXContinueOnXoff:1;
+	DWORD fOutX:1;
+	DWORD fInX:1;
+	DWORD fErrorChar:1;
+	DWORD fNull:1;
+	DWORD fRtsControl:2;
+	DWORD fAbortOnError:1;
+	WORD wReserved;
+	WORD XonLim;
+	WORD XoffLim;
+	BYTE ByteSize;
+	BYTE Parity;
+	BYTE StopBits;
+	char XonChar;
+	char XoffChar;
+	char ErrorChar;
+	char EofChar;
+	char EvtChar;
+} DCB;
+
+typedef struct {
+	DWORD ReadIntervalTimeout;
+	DWORD ReadTotalTimeoutMultiplier;
+	DWORD ReadTotalTimeoutConstant;
+	DWORD WriteTotalTimeoutMultiplier;
+	DWORD WriteTotalTimeoutConstant;
+} COMMTIMEOUTS;
+
+typedef struct {
+	DWORD cbInQue;
+	DWORD cbOutQue;
+} COMSTAT;
+
+typedef struct {
+	pthread_mutex_t m;
+} CRITICAL_SECTION;
+
+typedef DWORD (WINAPI *LPTHREAD_START_ROUTINE)(LPVOID);
+
+/* errors */
+DWORD GetLastError(void);
+void SetLastError(DWORD err);
+void OutputDebugStringA(LPCSTR s);
+
+/* time */
+void Sleep(DWORD ms);
+DWORD GetTickCount(void);
+BOOL QueryPerformanceCounter(LARGE_INTEGER *count);
+BOOL QueryPerformanceFrequency(LARGE_INTEGER *freq);
+void GetSystemTimeAsFileTime(FILETIME *ft);
+void GetLocalTime(SYSTEMTIME *st);
+
+/* synchronisation */
+void InitializeCriticalSection(CRITICAL_SECTION *cs);
+void DeleteCriticalSection(CRITICAL_SECTION *cs);
+void EnterCriticalSection(CRITICAL_SECTION *cs);
+void LeaveCriticalSection(CRITICAL_SECTION *cs);
+BOOL TryEnterCriticalSection(CRITICAL_SECTION *cs);
+HANDLE CreateEvent(void *sa, BOOL manual, BOOL initial, LPCSTR name);
+BOOL SetEvent(HANDLE h);
+BOOL ResetEvent(HANDLE h);
+HANDLE CreateWaitableTimer(void *sa, BOOL manual, LPCSTR name);
+BOOL SetWaitableTimer(HANDLE h, const LARGE_INTEGER *due, LONG period,
+	void *fn, void *arg, BOOL resume);
+HANDLE CreateThread(void *sa, size_t stack, LPTHREAD_START_ROUTINE fn,
+	LPVOID arg, DWORD flags, DWORD *id);
+DWORD WaitForSingleObject(HANDLE h, DWORD ms);
+DWORD WaitForMultipleObjects(DWORD n, const HANDLE *h, BOOL all, DWORD ms);
+BOOL CloseHandle(HANDLE h);
+
+static inline LONG InterlockedIncrement(LONG volatile *p) {
+	return __atomic_add_fetch(p,1,__ATOMIC_SEQ_CST);
+}
+static inline LONG InterlockedDecrement(LONG volatile *p) {
+	return __atomic_sub_fetch(p,1,__ATOMIC_SEQ_CST);
+}
+static inline LONG InterlockedExchangeAdd(LONG volatile *p, LONG v) {
+	return __atomic_fetch_add(p,v,__ATOMIC_SEQ_CST);
+}
+static inline LONG InterlockedExchange(LONG volatile *p, LONG v) {
+	return __atomic_exchange_n(p,v,__ATOMIC_SEQ_CST);
+}
+static inline LONG InterlockedCompareExchange(LONG volatile *p, LONG v, LONG cmp) {
+	__atomic_compare_exchange_n(p,&cmp,v,0,__ATOMIC_SEQ_CST,__ATOMIC_SEQ_CST);
+	return cmp;
+}
+static inline void *InterlockedExchangePointer(void *volatile *p, void *v) {
+	return __atomic_exchange_n(p,v,__ATOMIC_SEQ_CST);
+}
+static inline LONGLONG InterlockedExchangeAdd64(LONGLONG volatile *p, LONGLONG v) {
+	return __atomic_fetch_add(p,v,__ATOMIC_SEQ_CST);
+}
+static inline LONGLONG InterlockedExchange64(LONGLONG volatile *p, LONGLONG v) {
+	return __atomic_exchange_n(p,v,__ATOMIC_SEQ_CST);
+}
+
+/* files and devices */
+HANDLE CreateFile(LPCSTR name, DWORD access, DWORD share, void *sa,
+	DWORD disposition, DWORD flags, HANDLE template);
+BOOL ReadFile(HANDLE h, void *buf, DWORD len, DWORD *done, OVERLAPPED *o);
+BOOL WriteFile(HANDLE h, const void *buf, DWORD len, DWORD *done, OVERLAPPED *o);
+BOOL GetOverlappedResult(HANDLE h, OVERLAPPED *o, DWORD *done, BOOL wait);
+BOOL CancelIoEx(HANDLE h, OVERLAPPED *o);
+BOOL DeleteFile(LPCSTR name);
+HANDLE CreateFileMapping(HANDLE file, void *sa, DWORD protect,
+	DWORD sizehigh, DWORD sizelow, LPCSTR name);
+void *MapViewOfFile(HANDLE map, DWORD access, DWORD offhigh, DWORD offlow,
+	size_t len);
+
+/* serial ports, in comm.c */
+BOOL GetCommState(HANDLE h, DCB *dcb);
+BOOL SetCommState(HANDLE h, DCB *dcb);
+BOOL SetCommTimeouts(HANDLE h, COMMTIMEOUTS *t);
+BOOL GetCommTimeouts(HANDLE h, COMMTIMEOUTS *t);
+BOOL PurgeComm(HANDLE h, DWORD flags);
+BOOL ClearCommError(HANDLE h, DWORD *errors, COMSTAT *cs);
+BOOL SetCommBreak(HANDLE h);
+BOOL ClearCommBreak(HANDLE h);
+BOOL EscapeCommFunction(HANDLE h, DWORD func);
+BOOL GetCommModemStatus(HANDLE h, DWORD *status);
+BOOL SetCommMask(HANDLE h, DWORD mask);
+BOOL GetCommMask(HANDLE h, DWORD *mask);
+BOOL WaitCommEvent(HANDLE h, DWORD *mask, OVERLAPPED *o);
+
+#endif
@@ -0,0 +1,95 @@
+/*
+ * winsock2.h - winsock on top of bsd sockets
+ *
+ * Copyright (c) 2010 Hamish Coleman <hamish@zot.org>
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Sockets are plain file descriptors.  The differences that matter to
+ * wconsd are papered over here: closesocket() wakes any thread blocked on
+ * the socket, select() ignores nfds, and a socket given to WSAEventSelect
+ * - or accepted from one that was - is non-blocking and cannot be made
+ * blocking again until the selection is cleared.  recv() and select() go
+ * through compat.c so that the io_uring engine can hand over what it has
+ * already received.
+ */
+
+#ifndef POSIX_WINSOCK2_H
+#define POSIX_WINSOCK2_H
+
+#include "windows.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+
+typedef int SOCKET;
+typedef HANDLE WSAEVENT;
+
+#define INVALID_SOCKET		(-1)
+#define SOCKET_ERROR		(-1)
+#define WSA_INVALID_EVENT	((WSAEVENT)NULL)
+
+#define SD_RECEIVE	SHUT_RD
+#define SD_SEND		SHUT_WR
+#define SD_BOTH		SHUT_RDWR
+
+#define FD_READ		0x01
+#define FD_ACCEPT	0x08
+#define FD_CLOSE	0x20
+
+#define WSAEINTR	10004
+#define WSAEINVAL	10022
+#define WSAEWOULDBLOCK	10035
+#define WSAENOTSOCK	10038
+#define WSAECONNABORTED	10053
+#define WSAECONNRESET	10054
+#define WSAENOTCONN	10057
+#define WSAESHUTDOWN	10058
+#define WSAETIMEDOUT	10060
+
+typedef struct {
+	WORD wVersion;
+	WORD wHighVersion;
+} WSADATA;
+
+int WSAStartup(WORD version, WSADATA *data);
+int WSACleanup(void);
+int WSAGetLastError(void);
+WSAEVENT WSACreateEvent(void);
+BOOL WSAResetEvent(WSAEVENT ev);
+int WSAEventSelect(SOCKET s, WSAEVENT ev, long events);
+int WSAIoctl(SOCKET s, DWORD code, void *in, DWORD inlen, void *out,
+	DWORD outlen, DWORD *bytes, void *o, void *fn);
+int ioctlsocket(SOCKET s, long cmd, unsigned long *arg);
+int closesocket(SOCKET s);
+SOCKET wconsd_accept(SOCKET s, struct sockaddr *sa, int *salen);
+int wconsd_recv(SOCKET s, char *buf, int len, int flags);
+int wconsd_select(fd_set *r, fd_set *w, fd_set *e, struct timeval *tv);
+
+#define accept(s,sa,salen)	wconsd_accept(s,sa,salen)
+#define recv(s,buf,len,flags)	wconsd_recv(s,buf,len,flags)
+#define select(n,r,w,e,tv)	wconsd_select(r,w,e,tv)
+
+#endif
@@ -0,0 +1,18 @@
+/* winsvc.h - the service manager is unix-scm.c, only the types remain */
+#ifndef POSIX_WINSVC_H
+#define POSIX_WINSVC_H
+
+#include "windows.h"
+
+typedef struct {
+	DWORD dwServiceType;
+	DWORD dwCurrentState;
+	DWORD dwControlsAccepted;
+	DWORD dwWin32ExitCode;
+	DWORD dwServiceSpecificExitCode;
+	DWORD dwCheckPoint;
+	DWORD dwWaitHint;
+} SERVICE_STATUS;
+typedef HANDLE SERVICE_STATUS_HANDLE;
+
+#endif
@@ -0,0 +1,2 @@
+/* ws2tcpip.h - everything needed is in winsock2.h */
+#include "winsock2.h"
@@ -0,0 +1,172 @@
+/*
+ * ringbench.c - measure readers tailing a shared memory ring
+ *
+ * Copyright (c) 2010 Hamish Coleman <hamish@zot.org>
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ *   ringbench [nr_readers [seconds [chunk [MB/s]]]]
+ *
+ * A producer thread writes a known byte pattern into a ring file in
+ * chunks the size of a serial read, the same way wconsd_com_to_net
+ * does, either as fast as it can or at the given rate.  Each reader thread tails the ring with
+ * ringread_poll() and checks every byte.  Bad bytes are only expected
+ * in runs that were reported as lapped.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "ringread.h"
+
+#define RING_SIZE	(1<<20)
+
+static struct shmring_header *h;
+static volatile int running = 1;
+
+struct reader {
+	pthread_t thread;
+	struct ringread *r;
+	uint64_t bytes;
+	uint64_t bad;
+	uint64_t polls;
+	uint64_t lapped;
+};
+
+static inline unsigned char pattern(uint64_t seq) {
+	return seq ^ (seq>>8) ^ (seq>>16);
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static void check(void *ctx, const unsigned char *buf, size_t len) {
+	struct reader *rd = ctx;
+	uint64_t seq = rd->r->pos;
+	size_t i;
+
+	for (i=0;i<len;i++) {
+		if (buf[i]!=pattern(seq+i)) {
+			rd->bad++;
+		}
+	}
+	rd->bytes += len;
+}
+
+static void lapped(void *ctx, uint64_t lost) {
+	struct reader *rd = ctx;
+	rd->lapped++;
+}
+
+static void *reader_thread(void *arg) {
+	struct reader *rd = arg;
+
+	while (running) {
+		if (ringread_wait(rd->r,10)) {
+			ringread_poll(rd->r,check,lapped,rd);
+			rd->polls++;
+		}
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv) {
+	int nr = argc>1 ? atoi(argv[1]) : 4;
+	int secs = argc>2 ? atoi(argv[2]) : 2;
+	uint32_t chunk = argc>3 ? atoi(argv[3]) : 1024;
+	double rate = argc>4 ? atof(argv[4])*1e6 : 0;
+	char path[] = "/tmp/ringbenchXXXXXX";
+	struct reader *readers = calloc(nr,sizeof(struct reader));
+	uint64_t seq = 0, writes = 0;
+	double start, elapsed;
+	int fd, i;
+
+	if ((fd = mkstemp(path))==-1 || ftruncate(fd,SHMRING_DATA+RING_SIZE)) {
+		perror("ringbench");
+		return 1;
+	}
+	unlink(path);
+	h = mmap(NULL,SHMRING_DATA+RING_SIZE,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+	if (h==MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	h->version = SHMRING_VERSION;
+	h->size = RING_SIZE;
+	memcpy(h->magic,SHMRING_MAGIC,4);
+
+	for (i=0;i<nr;i++) {
+		readers[i].r = ringread_attach(h,0);
+		pthread_create(&readers[i].thread,NULL,reader_thread,&readers[i]);
+	}
+
+	start = now();
+	while ((elapsed = now()-start) < secs) {
+		int n;
+
+		if (rate && seq > elapsed*rate) {
+			struct timespec ts = { 0, 100000 };
+			nanosleep(&ts,NULL);
+			continue;
+		}
+
+		/* check the clock every so often, not every chunk */
+		for (n=0;n<(rate?1:256);n++) {
+			uint32_t len = chunk;
+			unsigned char *p = shmring_reserve(h,&len);
+			uint32_t j;
+
+			for (j=0;j<len;j++) {
+				p[j] = pattern(seq+j);
+			}
+			shmring_commit(h,len);
+			seq += len;
+			writes++;
+		}
+	}
+	elapsed = now()-start;
+	running = 0;
+
+	printf("producer: %.1f MB/s in %.0f writes of up to %u bytes, no syscalls\n",
+		seq/elapsed/1e6,(double)writes,chunk);
+	for (i=0;i<nr;i++) {
+		struct reader *rd = &readers[i];
+
+		pthread_join(rd->thread,NULL);
+		printf("reader %i: %.1f MB/s, %.0f polls, %.0f bytes lost in %.0f gaps, "
+			"%.0f lapped runs, %.0f bad bytes\n",
+			i,rd->bytes/elapsed/1e6,(double)rd->polls,
+			(double)rd->r->lost,(double)rd->r->gaps,
+			(double)rd->lapped,(double)rd->bad);
+		if (rd->bad && !rd->r->gaps) {
+			printf("reader %i: bad bytes without a gap being reported!\n",i);
+			return 1;
+		}
+		ringread_close(rd->r);
+	}
+	return 0;
+}
@@ -0,0 +1,212 @@
+/*
+ * ringread.c - read wconsd shared memory rings
+ *
+ * Copyright (c) 2010 Hamish Coleman <hamish@zot.org>
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * A reader never writes to the ring, so any number of them can tail a
+ * port, each at its own pace.  ringread_poll() hands out the new bytes
+ * in place; as the producer does not wait for anyone, a slow reader can
+ * be lapped while it is looking at them, and is told so afterwards
+ * through the gap callback.  Readers that cannot cope with that should
+ * use ringread_copy(), which only returns bytes known to be intact.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ringread.h"
+
+/* start at the newest byte, or at the oldest one still in the ring */
+static void ringread_start(struct ringread *r, int from_oldest) {
+	uint64_t head = shmring_head(r->h);
+
+	r->pos = head;
+	if (from_oldest) {
+		r->pos = head>r->h->size ? head-r->h->size : 0;
+	}
+}
+
+/* use a ring that is already mapped, as the benchmark does */
+struct ringread *ringread_attach(struct shmring_header *h, int from_oldest) {
+	struct ringread *r = calloc(1,sizeof(struct ringread));
+
+	if (!r) {
+		return NULL;
+	}
+	r->fd = -1;
+	r->h = h;
+	ringread_start(r,from_oldest);
+	return r;
+}
+
+struct ringread *ringread_open(const char *path, int from_oldest) {
+	struct shmring_header *h;
+	struct ringread *r;
+	struct stat st;
+	int fd;
+
+	if ((fd = open(path,O_RDONLY))==-1) {
+		return NULL;
+	}
+	if (fstat(fd,&st) || st.st_size<SHMRING_DATA) {
+		close(fd);
+		return NULL;
+	}
+	h = mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+	if (h==MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+	if (memcmp(h->magic,SHMRING_MAGIC,4) || h->version!=SHMRING_VERSION
+			|| SHMRING_DATA+(off_t)h->size > st.st_size) {
+		munmap(h,st.st_size);
+		close(fd);
+		return NULL;
+	}
+	if (!(r = ringread_attach(h,from_oldest))) {
+		munmap(h,st.st_size);
+		close(fd);
+		return NULL;
+	}
+	r->fd = fd;
+	r->maplen = st.st_size;
+	return r;
+}
+
+void ringread_close(struct ringread *r) {
+	if (r->fd!=-1) {
+		munmap(r->h,r->maplen);
+		close(r->fd);
+	}
+	free(r);
+}
+
+/* skip over anything the producer has already overwritten */
+static uint64_t resync(struct ringread *r, uint64_t head) {
+	uint64_t lost;
+
+	if (head-r->pos <= r->h->size) {
+		return 0;
+	}
+	lost = head - r->h->size - r->pos;
+	r->pos = head - r->h->size;
+	r->lost += lost;
+	r->gaps++;
+	return lost;
+}
+
+/*
+ * Hand every new byte to fn, in at most two runs (the ring wraps).
+ * Returns the number of bytes handed out.
+ */
+size_t ringread_poll(struct ringread *r, ringread_fn fn, ringread_gap_fn gap, void *ctx) {
+	uint64_t head = shmring_head(r->h);
+	uint64_t start, lost;
+	uint32_t mask = r->h->size-1;
+	size_t total = 0;
+
+	if ((lost = resync(r,head)) && gap) {
+		gap(ctx,lost);
+	}
+	start = r->pos;
+	while (r->pos!=head) {
+		uint32_t offset = r->pos & mask;
+		size_t len = head-r->pos;
+
+		if (len > r->h->size-offset) {
+			len = r->h->size-offset;
+		}
+		fn(ctx,shmring_data(r->h)+offset,len);
+		r->pos += len;
+		total += len;
+	}
+
+	if (total && !shmring_intact(r->h,start)) {
+		/* we were lapped, some of that was already overwritten */
+		r->gaps++;
+		if (gap) {
+			gap(ctx,total);
+		}
+	}
+	return total;
+}
+
+/* copy out up to len new bytes, only returning ones known to be intact */
+size_t ringread_copy(struct ringread *r, unsigned char *buf, size_t len) {
+	uint32_t mask = r->h->size-1;
+
+	while (1) {
+		uint64_t head = shmring_head(r->h);
+		uint64_t pos;
+		size_t n, done = 0;
+
+		resync(r,head);
+		if (len > head-r->pos) {
+			len = head-r->pos;
+		}
+		pos = r->pos;
+		while (done<len) {
+			uint32_t offset = (pos+done) & mask;
+
+			n = len-done;
+			if (n > r->h->size-offset) {
+				n = r->h->size-offset;
+			}
+			memcpy(buf+done,shmring_data(r->h)+offset,n);
+			done += n;
+		}
+		if (shmring_intact(r->h,pos)) {
+			r->pos += len;
+			return len;
+		}
+		/* lapped during the copy, go round again from further on */
+		r->lost += len;
+		r->gaps++;
+		r->pos = pos+len;
+	}
+}
+
+/*
+ * Wait for the producer to add something.  The ring has no way to wake
+ * readers, so this polls with a backoff up to 1ms.  Returns 1 if there
+ * is new data, 0 on timeout.
+ */
+int ringread_wait(struct ringread *r, int timeout_ms) {
+	struct timespec ts = { 0, 1000 };
+	long waited_us = 0;
+
+	while (shmring_head(r->h)==r->pos) {
+		if (waited_us >= timeout_ms*1000L) {
+			return 0;
+		}
+		nanosleep(&ts,NULL);
+		waited_us += ts.tv_nsec/1000;
+		if (ts.tv_nsec < 1000000) {
+			ts.tv_nsec *= 2;
+		}
+	}
+	return 1;
+}
@@ -0,0 +1,29 @@
+/*
+ * ringread.h - read wconsd shared memory rings
+ *
+ */
+
+#include <stddef.h>
+#include "shmring.h"
+
+struct ringread {
+	int fd;
+	struct shmring_header *h;
+	size_t maplen;
+	uint64_t pos;		/* next byte to hand out */
+	uint64_t lost;		/* bytes overwritten before we got to them */
+	uint64_t gaps;		/* times that happened */
+};
+
+/* called with each run of bytes, in place in the ring */
+typedef void (*ringread_fn)(void *ctx, const unsigned char *buf, size_t len);
+
+/* called when bytes were lost, possibly including some just handed out */
+typedef void (*ringread_gap_fn)(void *ctx, uint64_t lost);
+
+struct ringread *ringread_open(const char *path, int from_oldest);
+struct ringread *ringread_attach(struct shmring_header *h, int from_oldest);
+void ringread_close(struct ringread *);
+size_t ringread_poll(struct ringread *, ringread_fn, ringread_gap_fn, void *ctx);
+size_t ringread_copy(struct ringread *, unsigned char *buf, size_t len);
+int ringread_wait(struct ringread *, int timeout_ms);
@@ -17,6 +17,7 @@ struct SCM_def {
 int SCM_Start(struct SCM_def *, int argc, char **argv);
 char *SCM_Install(struct SCM_def *,char *);
 int SCM_Remove(struct SCM_def *);
+int SCM_Progress(struct SCM_def *, int waithint);	/* still stopping */
 
 #define SVC_OK		0
 #define	SVC_FAIL	-1
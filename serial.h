@@ -0,0 +1,8 @@
+/*
+ * serial.h - opening and setting up COM ports
+ *
+ */
+
+HANDLE serial_open(int port, DCB *dcb, DWORD speed, BYTE data, BYTE parity, BYTE stop);
+int serial_setline(HANDLE serial, DCB *dcb, DWORD speed, BYTE data, BYTE parity, BYTE stop);
+int serial_timeouts(HANDLE serial);
@@ -0,0 +1,199 @@
+/*
+ * shmring.c - publish serial output in shared memory rings
+ *
+ * Copyright (c) 2010 Hamish Coleman <hamish@zot.org>
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * With a ring directory configured, each port gets a memory mapped ring
+ * file the first time it is opened.  The port's reader (see port.c) then
+ * does its ReadFile straight into the ring and everything downstream
+ * works on the bytes in place, so publishing costs no copy and no syscall.
+ * Local readers map the same file and tail it without talking to us.
+ *
+ * The rings are never unmapped: they outlive connections so that
+ * readers can keep tailing a port, and a stuck serial thread might
+ * still be writing into one when the service stops.
+ *
+ * See shmring.h for the layout and the rules readers follow.
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libcli/libcli/libcli.h"
+#include "module.h"
+#include "debug.h"
+#include "shmring.h"
+
+#define MAXPORTS	16
+
+static char ring_dir[MAX_PATH];		/* empty means no rings */
+static DWORD ring_size = 1<<20;		/* bytes of data per ring */
+
+static struct ring_port {
+	struct shmring_header *h;
+	int failed;		/* could not create it, dont keep trying */
+	LONG writes;
+} rings[MAXPORTS+1];
+
+static CRITICAL_SECTION ring_lock;
+
+/* create and map the ring file for a port */
+static struct shmring_header *ring_create(int port) {
+	char path[MAX_PATH+16];
+	DWORD total = SHMRING_DATA+ring_size;
+	struct shmring_header *h;
+	HANDLE file, map;
+
+	snprintf(path,sizeof(path),"%s/COM%i.ring",ring_dir,port);
+	/* readers may have it open, and may delete it */
+	file = CreateFile(path,GENERIC_READ|GENERIC_WRITE,
+		FILE_SHARE_READ|FILE_SHARE_WRITE|FILE_SHARE_DELETE,
+		NULL,CREATE_ALWAYS,FILE_ATTRIBUTE_NORMAL,NULL);
+	if (file==INVALID_HANDLE_VALUE) {
+		dprintf(1,"wconsd: cannot create ring %s (%d)\n",path,GetLastError());
+		return NULL;
+	}
+	map = CreateFileMapping(file,NULL,PAGE_READWRITE,0,total,NULL);
+	CloseHandle(file);
+	if (!map) {
+		return NULL;
+	}
+	h = MapViewOfFile(map,FILE_MAP_ALL_ACCESS,0,0,total);
+	CloseHandle(map);
+	if (!h) {
+		return NULL;
+	}
+
+	memset(h,0,sizeof(*h));
+	h->version = SHMRING_VERSION;
+	h->port = port;
+	h->size = ring_size;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	memcpy(h->magic,SHMRING_MAGIC,4);
+
+	dprintf(1,"wconsd: publishing COM%i output in %s\n",port,path);
+	return h;
+}
+
+/* the ring for a port, mapped the first time, or NULL if it has none */
+struct shmring_header *shmring_get(int port) {
+	struct ring_port *r;
+
+	if (!ring_dir[0] || port<1 || port>MAXPORTS) {
+		return NULL;
+	}
+	r = &rings[port];
+	if (!r->h && !r->failed) {
+		EnterCriticalSection(&ring_lock);
+		if (!r->h && !(r->h = ring_create(port))) {
+			r->failed = 1;
+		}
+		LeaveCriticalSection(&ring_lock);
+	}
+	return r->h;
+}
+
+/* count a write by the port's reader, for show ring */
+void shmring_wrote(int port) {
+	InterlockedIncrement(&rings[port].writes);
+}
+
+static int cmd_showring(struct cli_def *cli, char *command, char *argv[], int argc) {
+	int port;
+
+	cli_print(cli, "directory        %s",ring_dir[0]?ring_dir:"(disabled)");
+	cli_print(cli, "ring size        %lu",ring_size);
+	for (port=1;port<=MAXPORTS;port++) {
+		struct ring_port *r = &rings[port];
+
+		if (r->failed) {
+			cli_print(cli, "COM%-2i            failed",port);
+		} else if (r->h) {
+			cli_print(cli, "COM%-2i            %.0f bytes in %li writes",
+				port,(double)r->h->head,r->writes);
+		}
+	}
+	return CLI_OK;
+}
+
+static int cmd_cring(struct cli_def *cli, char *command, char *argv[], int argc) {
+	DWORD size;
+
+	if (argc!=1) {
+		cli_print(cli,"Need a single value");
+		return CLI_ERROR;
+	}
+
+	if (strstr(command,"directory")) {
+		if (ring_dir[0]) {
+			cli_print(cli,"The ring directory can only be set once");
+			return CLI_ERROR;
+		}
+		snprintf(ring_dir,sizeof(ring_dir),"%s",argv[0]);
+	} else {
+		size = strtoul(argv[0],NULL,0);
+		/* a power of two, so that offsets are a mask */
+		if (size<65536 || (size & (size-1)) || ring_dir[0]) {
+			cli_print(cli,"Size must be a power of two of at least 65536, set before the directory");
+			return CLI_ERROR;
+		}
+		ring_size = size;
+	}
+	return CLI_OK;
+}
+
+/* show the config for this module */
+static int this_showrun(struct cli_def *cli) {
+	cli_print(cli, "ring size %lu",ring_size);
+	if (ring_dir[0]) {
+		cli_print(cli, "ring directory %s",ring_dir);
+	}
+	return CLI_OK;
+}
+
+/* Our local module definition */
+static struct module_def this_module = {
+	.name = "shmring",
+	.desc = "Serial output in shared memory rings",
+	.showrun = this_showrun,
+};
+
+/* initialise and register this module */
+int shmring_init(struct cli_def *cli) {
+	InitializeCriticalSection(&ring_lock);
+
+	cli_register_command(cli, lookup_parent("show"), "ring", cmd_showring,
+		PRIVILEGE_UNPRIVILEGED, MODE_EXEC, "Shared memory ring statistics");
+
+	register_parent("config ring",
+		cli_register_command(cli, NULL, "ring", NULL, PRIVILEGE_PRIVILEGED,
+		MODE_CONFIG, "Serial output in shared memory rings"));
+
+	cli_register_command(cli, lookup_parent("config ring"), "directory", cmd_cring,
+		PRIVILEGE_PRIVILEGED, MODE_CONFIG, "Where to put the ring files");
+
+	cli_register_command(cli, lookup_parent("config ring"), "size", cmd_cring,
+		PRIVILEGE_PRIVILEGED, MODE_CONFIG, "Bytes of data in each ring");
+
+	register_module(&this_module);
+	return 0;
+}
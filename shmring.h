@@ -0,0 +1,86 @@
+/*
+ * shmring.h - shared memory ring of serial output
+ *
+ * This file is shared between the wconsd producer and the ringread
+ * reader library, so it must only use portable types.  All values are
+ * in host byte order, as the file is only ever read on the same machine.
+ *
+ * A ring file (COMn.ring) is a shmring_header padded to SHMRING_DATA
+ * bytes, followed by 'size' bytes of data, 'size' being a power of two.
+ * Byte number 'seq' of the port's output (counting from zero when the
+ * file was created) lives at data[seq & (size-1)].
+ *
+ * There is one producer.  Before it writes into the ring it raises
+ * 'reserve' to cover the bytes it is about to overwrite, and once the
+ * bytes are in place it raises 'head' past them.  A reader that has
+ * consumed up to 'pos' may use the bytes between pos and head, and
+ * afterwards checks that reserve has not moved more than 'size' past
+ * pos - if it has, the producer lapped the reader and what it just used
+ * may have been overwritten.
+ */
+
+#include <stdint.h>
+
+#define SHMRING_MAGIC		"WRNG"
+#define SHMRING_VERSION		1
+#define SHMRING_DATA		4096	/* offset of the data in the file */
+
+struct shmring_header {
+	char magic[4];		/* written last, once the ring is usable */
+	uint32_t version;
+	uint32_t port;		/* COM port number */
+	uint32_t size;		/* bytes of data, a power of two */
+	uint8_t pad1[48];
+
+	/* each counter has its own cache line */
+	uint64_t reserve;	/* the producer may be writing below this */
+	uint8_t pad2[56];
+	uint64_t head;		/* bytes before this are complete */
+	uint8_t pad3[56];
+};
+
+static inline unsigned char *shmring_data(struct shmring_header *h) {
+	return (unsigned char *)h + SHMRING_DATA;
+}
+
+/*
+ * Producer: get space for up to *len bytes at the head.  The space is
+ * contiguous, so *len is cut short at the end of the ring.
+ */
+static inline unsigned char *shmring_reserve(struct shmring_header *h, uint32_t *len) {
+	uint64_t head = h->head;
+	uint32_t offset = head & (h->size-1);
+
+	if (*len > h->size-offset) {
+		*len = h->size-offset;
+	}
+	/* reserve only ever goes up, even if this reservation is smaller */
+	if (head+*len > h->reserve) {
+		__atomic_store_n(&h->reserve,head+*len,__ATOMIC_RELAXED);
+	}
+	/* readers must see the reservation before any of the new data */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return shmring_data(h)+offset;
+}
+
+/* Producer: publish len bytes written into the last reservation */
+static inline void shmring_commit(struct shmring_header *h, uint32_t len) {
+	__atomic_store_n(&h->head,h->head+len,__ATOMIC_RELEASE);
+}
+
+/* Reader: how far the producer has got */
+static inline uint64_t shmring_head(struct shmring_header *h) {
+	return __atomic_load_n(&h->head,__ATOMIC_ACQUIRE);
+}
+
+/* Reader: after using data from pos onwards, was it left alone? */
+static inline int shmring_intact(struct shmring_header *h, uint64_t pos) {
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return __atomic_load_n(&h->reserve,__ATOMIC_RELAXED) - pos <= h->size;
+}
+
+/* the producer, inside wconsd */
+struct cli_def;
+struct shmring_header *shmring_get(int port);
+void shmring_wrote(int port);
+int shmring_init(struct cli_def *);
@@ -41,6 +41,8 @@ int svctest_init(int argc, char **argv);
 int svctest_main(int argc, char **argv);
 int svctest_stop(void *);
 
+HANDLE stopEvent;
+
 struct SCM_def sd = {
         .name = "svctest",
         .desc = "svctest - test win-scm",
@@ -102,6 +104,11 @@ int svctest_init(int argc, char **argv) {
 		return 1;
 	}
 
+	if (!(stopEvent = CreateEvent(NULL,TRUE,FALSE,NULL))) {
+		trace("CreateEvent failed");
+		return 1;
+	}
+
 	char **env = environ;
 	while(*env) {
 		dprintf(1,"%s:%i: env==%s\n",__FILE__,__LINE__,*env);
@@ -118,17 +125,14 @@ int svctest_init(int argc, char **argv) {
         return 0;
 }
 
-int run = 1;
 int svctest_main(int argc, char **argv) {
-	while(run) {
-		/* FIXME - sleep */
-	}
+	WaitForSingleObject(stopEvent,INFINITE);
 	trace("return 0");
         return 0;
 }
 
 int svctest_stop(void *param1) {
-	run = 0;
+	SetEvent(stopEvent);
 	trace("return 0");
         return 0;
 }
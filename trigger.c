@@ -0,0 +1,455 @@
+/*
+ * trigger.c - raise events when serial output matches a pattern
+ *
+ * Copyright (c) 2010 Hamish Coleman <hamish@zot.org>
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * All of the configured patterns are compiled into one Aho-Corasick
+ * automaton (see acmatch.c), and every chunk read from a serial port is
+ * run through it.  Each port keeps its own matcher state, so a pattern
+ * split across two reads is still found.
+ *
+ * Config changes only mark the pattern list as dirty, the next scan
+ * rebuilds the automaton once.  Scanners hold a reference on the
+ * automaton they are using, so it can be replaced at any time.
+ *
+ * Matches are logged with dprintf and kept in a small ring for 'show
+ * triggers'.  If a 'trigger log' file is configured, a thread of its own
+ * appends them from that ring, so the port readers that find them never
+ * wait on the disk.
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libcli/libcli/libcli.h"
+#include "module.h"
+#include "debug.h"
+#include "acmatch.h"
+#include "trigger.h"
+
+#define MAXPORTS	16
+#define MAXEVENTS	32
+#define MAXPATTERN	128
+
+struct automaton {
+	struct acmatch *ac;
+	char **patterns;	/* copy of the pattern list it was built from */
+	int nr_patterns;
+	int generation;
+	LONG refs;
+};
+
+static CRITICAL_SECTION lock;		/* protects everything below */
+static char **patterns;
+static int nr_patterns;
+static int dirty;
+static struct automaton *current;
+static int generation;
+static char trigger_log[MAX_PATH];
+static int log_generation;		/* bumped when trigger_log changes */
+
+struct trigger_port {
+	int generation;		/* the automaton that state belongs to */
+	int state;
+};
+static struct trigger_port ports[MAXPORTS+1];
+
+struct trigger_event {
+	time_t when;
+	int port;
+	char pattern[MAXPATTERN];
+};
+static struct trigger_event events[MAXEVENTS];
+static int next_event;
+static int logged;			/* the next event for the log file */
+
+static HANDLE logEvent;
+static HANDLE logThread;
+
+static struct {
+	LONG matches;
+	LONG unlogged;		/* overwritten before the log thread got to them */
+	LONGLONG bytes;
+	LONGLONG ticks;		/* performance counter ticks spent scanning */
+} counts;
+
+static void automaton_put(struct automaton *a) {
+	int i;
+
+	if (!a || InterlockedDecrement(&a->refs)) {
+		return;
+	}
+	ac_free(a->ac);
+	for (i=0;i<a->nr_patterns;i++) {
+		free(a->patterns[i]);
+	}
+	free(a->patterns);
+	free(a);
+}
+
+/* build a new automaton from the pattern list, called with the lock held */
+static void rebuild(void) {
+	struct automaton *a = NULL;
+	int i;
+
+	dirty = 0;
+	if (nr_patterns && (a = calloc(1,sizeof(*a)))) {
+		a->patterns = calloc(nr_patterns,sizeof(char *));
+		for (i=0;a->patterns && i<nr_patterns;i++) {
+			a->patterns[i] = strdup(patterns[i]);
+		}
+		a->nr_patterns = nr_patterns;
+		a->generation = ++generation;
+		a->refs = 1;
+		if (!a->patterns || !(a->ac = ac_build(a->patterns,nr_patterns))) {
+			dprintf(1,"wconsd: cannot build trigger automaton\n");
+			automaton_put(a);
+			a = NULL;
+		}
+	}
+	automaton_put(current);
+	current = a;
+}
+
+struct match_ctx {
+	struct automaton *a;
+	int port;
+};
+
+static void trigger_event(void *ctx, int pattern, size_t end) {
+	struct match_ctx *m = ctx;
+	struct trigger_event *e;
+	char *text = m->a->patterns[pattern];
+	int wake;
+
+	InterlockedIncrement(&counts.matches);
+	dprintf(1,"wconsd: trigger on COM%i: %s\n",m->port,text);
+
+	EnterCriticalSection(&lock);
+	e = &events[next_event++ % MAXEVENTS];
+	e->when = time(NULL);
+	e->port = m->port;
+	snprintf(e->pattern,sizeof(e->pattern),"%s",text);
+	wake = trigger_log[0];
+	LeaveCriticalSection(&lock);
+
+	if (wake) {
+		SetEvent(logEvent);
+	}
+}
+
+/* append new events to the trigger log, keeping it open between them */
+static DWORD WINAPI trigger_logger(LPVOID lpParam) {
+	struct trigger_event batch[MAXEVENTS];
+	char path[MAX_PATH];
+	int generation = 0;
+	FILE *f = NULL;
+	int i, n;
+
+	while (1) {
+		WaitForSingleObject(logEvent,INFINITE);
+
+		EnterCriticalSection(&lock);
+		if (next_event-logged > MAXEVENTS) {
+			counts.unlogged += next_event-logged-MAXEVENTS;
+			logged = next_event-MAXEVENTS;
+		}
+		for (n=0;logged<next_event;n++) {
+			batch[n] = events[logged++ % MAXEVENTS];
+		}
+		if (generation!=log_generation) {
+			generation = log_generation;
+			snprintf(path,sizeof(path),"%s",trigger_log);
+			if (f) {
+				fclose(f);
+			}
+			f = NULL;
+			if (path[0] && !(f = fopen(path,"a"))) {
+				dprintf(1,"wconsd: cannot open trigger log %s\n",path);
+			}
+		}
+		LeaveCriticalSection(&lock);
+
+		for (i=0;f && i<n;i++) {
+			char stamp[32];
+			strftime(stamp,sizeof(stamp),"%Y-%m-%d %H:%M:%S",localtime(&batch[i].when));
+			fprintf(f,"%s COM%i %s\n",stamp,batch[i].port,batch[i].pattern);
+		}
+		if (f) {
+			fflush(f);
+		}
+	}
+	return 0;
+}
+
+/* called with every chunk read from a serial port */
+void trigger_scan(int port, const unsigned char *buf, int len) {
+	struct trigger_port *p;
+	struct match_ctx m;
+	LARGE_INTEGER start, end;
+
+	if (!nr_patterns || len<=0 || port<1 || port>MAXPORTS) {
+		return;
+	}
+	p = &ports[port];
+
+	EnterCriticalSection(&lock);
+	if (dirty) {
+		rebuild();
+	}
+	m.a = current;
+	if (m.a) {
+		InterlockedIncrement(&m.a->refs);
+	}
+	LeaveCriticalSection(&lock);
+
+	if (!m.a) {
+		return;
+	}
+	if (p->generation!=m.a->generation) {
+		/* the patterns have changed, start matching afresh */
+		p->generation = m.a->generation;
+		p->state = 0;
+	}
+	m.port = port;
+
+	QueryPerformanceCounter(&start);
+	p->state = ac_scan(m.a->ac,p->state,buf,len,trigger_event,&m);
+	QueryPerformanceCounter(&end);
+
+	InterlockedExchangeAdd64(&counts.bytes,len);
+	InterlockedExchangeAdd64(&counts.ticks,end.QuadPart-start.QuadPart);
+
+	automaton_put(m.a);
+}
+
+/*
+ * The port readers take the lock for every match, and printing can wait
+ * on a slow client, so what is shown is copied out first.
+ */
+static int cmd_showtriggers(struct cli_def *cli, char *command, char *argv[], int argc) {
+	struct trigger_event recent[MAXEVENTS];
+	LARGE_INTEGER freq;
+	unsigned long size = 0;
+	int i, n = 0, nr, built;
+
+	QueryPerformanceFrequency(&freq);
+
+	EnterCriticalSection(&lock);
+	nr = nr_patterns;
+	if ((built = current!=NULL)) {
+		size = ac_size(current->ac);
+	}
+	for (i=next_event>MAXEVENTS?next_event-MAXEVENTS:0;i<next_event;i++) {
+		recent[n++] = events[i%MAXEVENTS];
+	}
+	LeaveCriticalSection(&lock);
+
+	cli_print(cli, "patterns         %i",nr);
+	if (built) {
+		cli_print(cli, "automaton size   %lu bytes",size);
+	}
+	cli_print(cli, "matches          %li",counts.matches);
+	if (counts.unlogged) {
+		cli_print(cli, "not logged       %li",counts.unlogged);
+	}
+	cli_print(cli, "bytes scanned    %.0f",(double)counts.bytes);
+	if (counts.bytes) {
+		cli_print(cli, "scan cost        %.2f ns/byte",
+			(double)counts.ticks*1e9/freq.QuadPart/counts.bytes);
+	}
+	cli_print(cli," ");
+	cli_print(cli, "recent events:");
+	for (i=0;i<n;i++) {
+		struct trigger_event *e = &recent[i];
+		char stamp[32];
+		strftime(stamp,sizeof(stamp),"%Y-%m-%d %H:%M:%S",localtime(&e->when));
+		cli_print(cli, "  %s COM%i %s",stamp,e->port,e->pattern);
+	}
+	return CLI_OK;
+}
+
+/* add one pattern, called with the lock held */
+static int add_pattern(const char *text) {
+	char **p;
+
+	if (!*text || strlen(text)>=MAXPATTERN) {
+		return -1;
+	}
+	if (!(p = realloc(patterns,(nr_patterns+1)*sizeof(char *)))) {
+		return -1;
+	}
+	patterns = p;
+	if (!(patterns[nr_patterns] = strdup(text))) {
+		return -1;
+	}
+	nr_patterns++;
+	dirty = 1;
+	return 0;
+}
+
+/* trigger pattern <text ...> - the words are joined back up with spaces */
+static int cmd_cpattern(struct cli_def *cli, char *command, char *argv[], int argc) {
+	char text[MAXPATTERN];
+	int len=0;
+	int i, err;
+
+	if (argc<1) {
+		cli_print(cli,"Need a pattern");
+		return CLI_ERROR;
+	}
+	text[0]=0;
+	for (i=0;i<argc && len<sizeof(text);i++) {
+		len += snprintf(text+len,sizeof(text)-len,"%s%s",i?" ":"",argv[i]);
+	}
+
+	EnterCriticalSection(&lock);
+	err = add_pattern(text);
+	LeaveCriticalSection(&lock);
+
+	if (err) {
+		cli_print(cli,"Cannot add pattern");
+		return CLI_ERROR;
+	}
+	return CLI_OK;
+}
+
+/* trigger file <path> - add one pattern per line */
+static int cmd_cfile(struct cli_def *cli, char *command, char *argv[], int argc) {
+	char line[MAXPATTERN+2];
+	int added=0;
+	FILE *f;
+
+	if (argc!=1 || !(f = fopen(argv[0],"r"))) {
+		cli_print(cli,"Cannot open pattern file");
+		return CLI_ERROR;
+	}
+	EnterCriticalSection(&lock);
+	while (fgets(line,sizeof(line),f)) {
+		line[strcspn(line,"\r\n")]=0;
+		if (line[0] && line[0]!='#' && !add_pattern(line)) {
+			added++;
+		}
+	}
+	LeaveCriticalSection(&lock);
+	fclose(f);
+	cli_print(cli,"Added %i patterns",added);
+	return CLI_OK;
+}
+
+static int cmd_cclear(struct cli_def *cli, char *command, char *argv[], int argc) {
+	int i;
+
+	EnterCriticalSection(&lock);
+	for (i=0;i<nr_patterns;i++) {
+		free(patterns[i]);
+	}
+	free(patterns);
+	patterns = NULL;
+	nr_patterns = 0;
+	rebuild();
+	LeaveCriticalSection(&lock);
+	return CLI_OK;
+}
+
+static int cmd_clog(struct cli_def *cli, char *command, char *argv[], int argc) {
+	if (argc!=1) {
+		cli_print(cli,"Need a filename");
+		return CLI_ERROR;
+	}
+	EnterCriticalSection(&lock);
+	snprintf(trigger_log,sizeof(trigger_log),"%s",argv[0]);
+	log_generation++;
+	logged = next_event;
+	if (!logThread) {
+		logThread = CreateThread(NULL,0,trigger_logger,NULL,0,NULL);
+	}
+	LeaveCriticalSection(&lock);
+	SetEvent(logEvent);
+	return CLI_OK;
+}
+
+/* show the config for this module */
+static int this_showrun(struct cli_def *cli) {
+	char log[MAX_PATH];
+	char (*copy)[MAXPATTERN];
+	int i, nr;
+
+	/* copied out, as for show triggers */
+	EnterCriticalSection(&lock);
+	strcpy(log,trigger_log);
+	nr = nr_patterns;
+	if ((copy = malloc(nr*sizeof(*copy)+1))) {
+		for (i=0;i<nr;i++) {
+			strcpy(copy[i],patterns[i]);
+		}
+	}
+	LeaveCriticalSection(&lock);
+
+	if (log[0]) {
+		cli_print(cli, "trigger log %s",log);
+	}
+	if (!copy) {
+		return CLI_ERROR;
+	}
+	for (i=0;i<nr;i++) {
+		cli_print(cli, "trigger pattern %s",copy[i]);
+	}
+	free(copy);
+	return CLI_OK;
+}
+
+/* Our local module definition */
+static struct module_def this_module = {
+	.name = "trigger",
+	.desc = "Serial output pattern triggers",
+	.showrun = this_showrun,
+};
+
+/* initialise and register this module */
+int trigger_init(struct cli_def *cli) {
+	InitializeCriticalSection(&lock);
+	logEvent = CreateEvent(NULL,FALSE,FALSE,NULL);
+
+	cli_register_command(cli, lookup_parent("show"), "triggers", cmd_showtriggers,
+		PRIVILEGE_UNPRIVILEGED, MODE_EXEC, "Pattern triggers and recent events");
+
+	register_parent("config trigger",
+		cli_register_command(cli, NULL, "trigger", NULL, PRIVILEGE_PRIVILEGED,
+		MODE_CONFIG, "Serial output pattern triggers"));
+
+	cli_register_command(cli, lookup_parent("config trigger"), "pattern", cmd_cpattern,
+		PRIVILEGE_PRIVILEGED, MODE_CONFIG, "Add a pattern to watch for");
+
+	cli_register_command(cli, lookup_parent("config trigger"), "file", cmd_cfile,
+		PRIVILEGE_PRIVILEGED, MODE_CONFIG, "Add patterns from a file, one per line");
+
+	cli_register_command(cli, lookup_parent("config trigger"), "clear", cmd_cclear,
+		PRIVILEGE_PRIVILEGED, MODE_CONFIG, "Remove all patterns");
+
+	cli_register_command(cli, lookup_parent("config trigger"), "log", cmd_clog,
+		PRIVILEGE_PRIVILEGED, MODE_CONFIG, "Append events to this file");
+
+	register_module(&this_module);
+	return 0;
+}
@@ -0,0 +1,7 @@
+/*
+ * trigger.h - raise events when serial output matches a pattern
+ *
+ */
+
+void trigger_scan(int port, const unsigned char *buf, int len);
+int trigger_init(struct cli_def *);
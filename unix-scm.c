@@ -23,13 +23,45 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <signal.h>
+#include <pthread.h>
 
 #include "scm.h"
 
+/*
+ * The equivalent of the service manager asking us to stop is SIGTERM (or
+ * SIGINT at a terminal).  The stop routine is not safe to call from a
+ * signal handler, so the signals are blocked and a thread waits for them.
+ */
+static void *signal_thread(void *param) {
+	struct SCM_def *sd = param;
+	sigset_t set;
+	int sig;
+
+	sigemptyset(&set);
+	sigaddset(&set,SIGTERM);
+	sigaddset(&set,SIGINT);
+	if (sigwait(&set,&sig)==0 && sd->stop) {
+		sd->stop(NULL);
+	}
+	return NULL;
+}
+
 int SCM_Start(struct SCM_def *sd, int argc, char **argv) {
+	sigset_t set;
+	pthread_t tid;
+	int err;
+
 	sd->mode=SVC_CONSOLE;
 
-	int err;
+	/* before any other threads, so that they all inherit the mask */
+	sigemptyset(&set);
+	sigaddset(&set,SIGTERM);
+	sigaddset(&set,SIGINT);
+	pthread_sigmask(SIG_BLOCK,&set,NULL);
+	if (pthread_create(&tid,NULL,signal_thread,sd)==0) {
+		pthread_detach(tid);
+	}
 
 	if (sd->init) {
 		err = sd->init(argc,argv);
@@ -42,11 +74,15 @@ int SCM_Start(struct SCM_def *sd, int argc, char **argv) {
 	return SVC_OK;
 }
 
-char *SCM_Install(struct SCM_def *sd) {
-	return SVC_FAIL;
+/* installing a unit file is left to the packaging */
+char *SCM_Install(struct SCM_def *sd, char *path) {
+	return NULL;
 }
 
 int SCM_Remove(struct SCM_def *sd) {
 	return SVC_FAIL;
 }
 
+int SCM_Progress(struct SCM_def *sd, int waithint) {
+	return SVC_OK;
+}
@@ -25,6 +25,8 @@
 
 #include <winsock2.h>
 #include <ws2tcpip.h>
+#include <mstcpip.h>
+#include <afunix.h>
 #include <windows.h>
 #include <winsvc.h>
 #include <stdio.h>
@@ -36,6 +38,19 @@
 #include "libcli/libcli/libcli.h"
 
 #include "module.h"
+#include "debug.h"
+#include "mccp.h"
+#include "capture.h"
+#include "trigger.h"
+#include "xfer.h"
+#include "pace.h"
+#include "autobaud.h"
+#include "line.h"
+#include "serial.h"
+#include "mux.h"
+#include "shmring.h"
+#include "port.h"
+#include "group.h"
 
 #define VERSION "0.2.6"
 
@@ -45,25 +60,67 @@
 
 /* Sockets for listening and communicating */
 SOCKET ls=INVALID_SOCKET;
+SOCKET lls=INVALID_SOCKET;	/* the local endpoint, if configured */
 
 /* Event objects */
 HANDLE stopEvent;
 HANDLE readEvent, writeEvent;
 WSAEVENT listenSocketEvent;
+WSAEVENT localSocketEvent;
 
-/* COM port */
-DCB dcb;
-COMMTIMEOUTS timeouts;
-
-/* Port default settings are here */
-int   com_port=1;
-DWORD com_speed=9600;
-BYTE  com_data=8;
-BYTE  com_parity=NOPARITY;
-BYTE  com_stop=ONESTOPBIT;
+/*
+ * The line settings of each port are in line.c, and each session starts
+ * out with them, on port 1
+ */
+#define DEFAULT_PORT	1
 
 int   default_tcpport = 23;
 
+/*
+ * An AF_UNIX endpoint for clients on this host.  Who may connect is
+ * decided by the permissions on the directory holding the socket.
+ */
+char  local_path[UNIX_PATH_MAX];	/* empty means no local endpoint */
+int   local_raw = 0;		/* local clients get raw bytes, not telnet */
+
+/*
+ * Dead peer detection.  The TCP keepalive values are applied to every
+ * accepted socket, the probe is an IAC DO TIMING-MARK sent once a peer
+ * that has negotiated telnet options has been silent for keepalive_idle
+ * seconds.
+ */
+int   keepalive_idle = 10;	/* seconds of silence before probing */
+int   keepalive_interval = 2;	/* seconds between TCP keepalive probes */
+int   keepalive_count = 3;	/* unanswered probes before declaring death */
+int   keepalive_probe = 1;	/* send telnet TIMING-MARK probes */
+
+/* Bounds on how long the teardown of a connection or the service may take */
+DWORD shutdown_drain = 500;	/* ms to let queued serial output drain */
+DWORD shutdown_timeout = 3000;	/* ms to wait for worker threads to exit */
+DWORD stop_tick;		/* when the service was asked to stop */
+
+/* What is done about a client that cannot keep up with its port */
+#define CLIENT_DROP		0	/* drop its oldest output, and tell it */
+#define CLIENT_BLOCK		1	/* hold the device off with RTS */
+#define CLIENT_DISCONNECT	2	/* drop, and give up on it after a deadline */
+const char *client_policies[] = { "drop", "block", "disconnect" };
+int client_policy = CLIENT_DROP;
+DWORD client_queue = 0;		/* bytes a client may be behind, 0 for the ring */
+DWORD client_deadline = 30000;	/* ms behind before a client is disconnected */
+
+/* Global counters, updated with the Interlocked functions */
+struct wconsd_stats {
+	LONG connections;	/* total accepted connections */
+	LONG dead_peers;	/* connections torn down as dead */
+	LONG dead_port_ms;	/* time serial ports were held by dead peers */
+	LONG stuck_threads;	/* workers abandoned after a shutdown timeout */
+	LONG line_changes;	/* open ports given new line settings */
+	LONG line_discarded;	/* output that could not drain before one */
+	LONG slow_drops;	/* times a slow client's oldest output was dropped */
+	LONG slow_holds;	/* times a device was held off for one */
+	LONG slow_disconnects;	/* slow clients given up on */
+} stats;
+
 /* TODO - these buffers are ugly and large */
 char *hostname[BUFSIZE];
 struct hostent *host_entry;
@@ -74,6 +131,7 @@ SERVICE_STATUS_HANDLE wconsd_statusHandle;
 
 
 /* these match the official telnet codes */
+#define TELNET_OPTION_SE	0xf0
 #define TELNET_OPTION_SB	0xfa
 #define TELNET_OPTION_WILL	0xfb
 #define TELNET_OPTION_WONT	0xfc
@@ -83,6 +141,40 @@ SERVICE_STATUS_HANDLE wconsd_statusHandle;
 
 /* these are my local state-tracking codes */
 #define TELNET_OPTION_SBXX	0xfa00	/* received IAC SB xx */
+#define TELNET_OPTION_SBIAC	0xfa01	/* received an IAC after IAC SB xx */
+
+#define SB_MAX	64		/* longest subnegotiation we act on */
+
+/* RFC 2217 COM-PORT-OPTION, the server's replies are the command + 100 */
+#define TELNET_OPTION_COMPORT	0x2c
+#define COMPORT_SERVER		100
+#define COMPORT_SIGNATURE	0
+#define COMPORT_SET_BAUDRATE	1
+#define COMPORT_SET_DATASIZE	2
+#define COMPORT_SET_PARITY	3
+#define COMPORT_SET_STOPSIZE	4
+#define COMPORT_SET_CONTROL	5
+#define COMPORT_NOTIFY_LINESTATE	6
+#define COMPORT_NOTIFY_MODEMSTATE	7
+#define COMPORT_FLOWCONTROL_SUSPEND	8
+#define COMPORT_FLOWCONTROL_RESUME	9
+#define COMPORT_SET_LINESTATE_MASK	10
+#define COMPORT_SET_MODEMSTATE_MASK	11
+#define COMPORT_PURGE_DATA	12
+
+/*
+ * Resuming the port's output from a byte offset.  Not an assigned telnet
+ * option - a collector that does not know it will never send DO for it.
+ * Each byte a port reads has a sequence number, counting up from when
+ * its ring was made, and these travel as 8 bytes, most significant first.
+ */
+#define TELNET_OPTION_RESUME	0xc8
+#define RESUME_SEQ		0	/* the next byte sent has this number */
+#define RESUME_FROM		1	/* client: send from this number on */
+#define RESUME_GAP		2	/* from, to: these bytes are not coming */
+
+#define RESUME_ASK		1	/* conn->resume_op: tell it where we are */
+#define RESUME_SEEK		2	/* and move there first */
 
 #define MAXCONNECTIONS	8
 
@@ -94,21 +186,68 @@ struct connection {
 	HANDLE menuThread;
 	SOCKET net;
 	int serialconnected;
-	HANDLE serial;
-	HANDLE serialThread;
+	int port;		/* COM port number, valid while serialconnected */
+	int want_port;		/* the port the next open is for */
+	const struct line *line;	/* our own settings, or NULL for the port's */
+	struct port_cursor cursor;	/* where we are in the port's output */
+	HANDLE serial;		/* the port's handle, borrowed while attached */
+	HANDLE serialThread;	/* com_to_net, or group_to_net */
+	struct group_session *group;	/* on a group of ports instead */
+	int spectate;		/* the next open only watches the port */
+	int told_spectator;	/* that what it types is not being sent */
+	LONG flow_held;		/* RTS is down because we are behind */
+	LONG drops;		/* times our oldest output was dropped */
+	LONG holds;		/* times we held the device off */
+	DWORD caught_up;	/* when com_to_net last had nothing to send */
+	LONG too_slow;		/* given up on for being too far behind */
+	int autoclose;		/* close the port when the client goes? */
+	int hold;		/* hold the session instead, for it to come back */
 	int option_runmenu;	/* are we at the menu? */
 	int option_binary;	/* binary transmission requested */
 	int option_echo;	/* will we echo chars received? */
 	int option_keepalive;	/* will we send IAC NOPs all the time? */
+	int option_raw;		/* no telnet, just bytes in both directions */
+	int local;		/* connected through the local endpoint */
 	int net_bytes_rx;
 	int net_bytes_tx;
+	DWORD last_rx_tick;	/* when we last heard anything from the peer */
+	DWORD probe_tick;	/* when the outstanding probe was sent, or 0 */
+	int telnet_peer;	/* it has negotiated, so it will answer a probe */
+	int peer_dead;		/* set if we gave up on the peer */
+	LONG net_closed;	/* shut down, closed once our threads are done */
+	CRITICAL_SECTION net_lock;	/* serialises writers to the socket */
+	struct mccp *mccp;	/* compression state, if negotiated */
+	struct xfer *xfer;	/* file transfer in progress, gets serial rx */
+	CRITICAL_SECTION xfer_lock;	/* held while com_to_net uses xfer */
+	CRITICAL_SECTION io_lock;	/* held while net_to_com writes to the port */
+	struct pacer *pacer;	/* paced writes to the port, if configured */
+	CRITICAL_SECTION pacer_lock;	/* held while freeing the pacer, or purging another's */
 	struct sockaddr *sa;
 	int telnet_option;	/* Set to indicate option processing status */
 	int telnet_option_param;/* saved parameters from telnet options */
+	unsigned char sb[SB_MAX];	/* the subnegotiation being received */
+	int sb_len;
+	int option_comport;	/* RFC 2217 agreed with the client */
+	int comport_pending;	/* and it has not been given the port yet */
+	unsigned char modem_mask;	/* which modem state changes it wants */
+	unsigned char line_mask;	/* and which line errors */
+	int dtr, rts, brk;	/* the control lines, as the client last set them */
+	HANDLE modemThread;	/* sends it modem and line state changes */
+	int option_resume;	/* it can be told sequence numbers and gaps */
+	LONG resume_op;		/* for the com_to_net thread, which has the cursor */
+	LONGLONG resume_from;	/* where RESUME_SEEK goes, set and read interlocked */
 };
 struct connection connection[MAXCONNECTIONS];
 
+/*
+ * The command tree is built once on this, by wconsd_init and the modules,
+ * and is not changed after that.  Each session gets a cli_def of its own
+ * which borrows the tree - see run_cli()
+ */
 struct cli_def *cli;
+CRITICAL_SECTION cli_lock;	/* held by the one session using the tree */
+int cli_user;			/* and its connection id */
+int cli_idle = 60;	/* seconds, for new sessions */
 
 int wconsd_init(int argc, char **argv);
 int wconsd_main(int argc, char **argv);
@@ -153,6 +292,138 @@ int dprintf(unsigned char severity, const char *fmt, ...) {
 	return i;
 }
 
+int client_too_slow(struct connection *conn);
+
+/*
+ * The sockets are non-blocking - they inherit the listener's event
+ * select - so send() fails with WSAEWOULDBLOCK when the client is not
+ * keeping up.  Wait for room, a second at a time, for as long as the
+ * client is allowed to be behind, but under any policy for no more than
+ * wait ms without it taking anything.  That is as long as the keepalives
+ * would take to give up on a dead peer, and the client is given up on
+ * the same way, as the net_lock is held meanwhile.  With no wait, what
+ * does not fit straight away is dropped.
+ */
+int net_send_all(struct connection *conn, const char *buf, int len, DWORD wait) {
+	fd_set set_write;
+	struct timeval tv;
+	DWORD since = GetTickCount();
+	int sent = 0;
+	int bytes;
+
+	while (sent < len) {
+		bytes = send(conn->net,buf+sent,len-sent,0);
+		if (bytes==SOCKET_ERROR) {
+			if (WSAGetLastError()!=WSAEWOULDBLOCK || client_too_slow(conn)) {
+				return -1;
+			}
+			if (!wait) {
+				return sent?sent:-1;
+			}
+			if (GetTickCount()-since >= wait) {
+				if (!InterlockedExchange(&conn->too_slow,1)) {
+					dprintf(1,"wconsd[%i]: client took nothing for %lu ms, closing\n",
+						conn->id,(unsigned long)wait);
+					conn->peer_dead=1;
+					InterlockedIncrement(&stats.dead_peers);
+					shutdown(conn->net,SD_BOTH);
+				}
+				return -1;
+			}
+			FD_ZERO(&set_write);
+			FD_SET(conn->net,&set_write);
+			tv.tv_sec = 1;
+			tv.tv_usec = 0;
+			if (select(conn->net+1,NULL,&set_write,NULL,&tv)==SOCKET_ERROR) {
+				return -1;
+			}
+			continue;
+		}
+		sent += bytes;
+		since = GetTickCount();
+	}
+	return sent;
+}
+
+/* how long a send may wait for a client that is taking nothing */
+DWORD net_send_wait(void) {
+	return (keepalive_idle + keepalive_interval*keepalive_count)*1000;
+}
+
+/* where the compressed stream's output goes, with net_lock held */
+int net_send_deflated(void *ctx, const void *buf, int len) {
+	struct connection *conn = ctx;
+
+	return net_send_all(conn,buf,len,net_send_wait())!=len;
+}
+
+/*
+ * Compress and send, with net_lock held.  Once part of the stream has
+ * failed to go, the client cannot inflate anything after it, so the
+ * connection is given up on.
+ */
+int net_send_compressed(struct connection *conn, const void *buf, int len, int flush) {
+	int bytes = mccp_send(conn->mccp,buf,len,flush);
+
+	if (bytes==-1 && !InterlockedExchange(&conn->too_slow,1)) {
+		dprintf(1,"wconsd[%i]: compressed output lost, closing\n",conn->id);
+		shutdown(conn->net,SD_BOTH);
+	}
+	return bytes;
+}
+
+/*
+ * send a buffer to a net connection, compressing it if that has been
+ * negotiated.  flush is zero if more output is expected very soon.
+ */
+int net_send(struct connection *conn, const void *buf, int len, int flush) {
+	int bytes;
+
+	EnterCriticalSection(&conn->net_lock);
+	if (conn->mccp) {
+		bytes = net_send_compressed(conn,buf,len,flush);
+	} else if (len) {
+		bytes = net_send_all(conn,buf,len,net_send_wait());
+	} else {
+		bytes = 0;
+	}
+	LeaveCriticalSection(&conn->net_lock);
+	return bytes;
+}
+
+/*
+ * The client has agreed to compression: start the stream, and only if
+ * that worked send the marker uncompressed, or refuse after all
+ */
+void net_start_compress(struct connection *conn) {
+	struct mccp *m;
+
+	EnterCriticalSection(&conn->net_lock);
+	if (!conn->mccp) {
+		/* the client inflates everything after the marker */
+		if (!(m = mccp_new(net_send_deflated,conn))) {
+			dprintf(1,"wconsd[%i]: cannot start compression\n",conn->id);
+			net_send_all(conn,"\xff\xfc\x56",3,net_send_wait()); /* IAC WONT COMPRESS2 */
+		} else if (net_send_all(conn,"\xff\xfa\x56\xff\xf0",5,net_send_wait())==5) {
+			/* IAC SB COMPRESS2 IAC SE */
+			conn->mccp = m;
+		} else {
+			mccp_free(m,0);
+		}
+	}
+	LeaveCriticalSection(&conn->net_lock);
+}
+
+/* end the compressed stream, if there is one */
+void net_stop_compress(struct connection *conn) {
+	EnterCriticalSection(&conn->net_lock);
+	if (conn->mccp) {
+		mccp_free(conn->mccp,!conn->net_closed);
+		conn->mccp=NULL;
+	}
+	LeaveCriticalSection(&conn->net_lock);
+}
+
 /*
  * format a string and send it to a net connection
  */
@@ -166,10 +437,10 @@ int netprintf(struct connection *conn, const char *fmt, ...) {
 	i=vsnprintf(buf,sizeof(buf),fmt,args);
 	va_end(args);
 
-	bytes = send(conn->net,buf,(i>MAXLEN)?MAXLEN-1:i,0);
+	bytes = net_send(conn,buf,(i>MAXLEN)?MAXLEN-1:i,1);
 
 	if (bytes==-1) {
-		dprintf(1,"wconsd[%i]: netprintf: send error %i\n",conn->id,GetLastError());
+		dprintf(1,"wconsd[%i]: netprintf: send error %i\n",conn->id,WSAGetLastError());
 	} else {
 		conn->net_bytes_tx += bytes;
 	}
@@ -177,119 +448,790 @@ int netprintf(struct connection *conn, const char *fmt, ...) {
 	return i;
 }
 
-/* open the com port */
-int open_com_port(struct connection *conn) {
-	/* Open the COM port */
-	char portstr[12];
+/*
+ * Tell another connection something, from a thread that is not its own.
+ * This never waits: if the connection is in the middle of a send, or
+ * its client is not taking anything, the notice is dropped.
+ */
+int netnotice(struct connection *conn, const char *fmt, ...) {
+	va_list args;
+	char buf[MAXLEN];
+	fd_set set_write;
+	struct timeval tv = {0,0};
+	int i;
+	int bytes = -1;
 
-	if (conn->serialconnected) {
-		dprintf(1,"wcons[%i]: open_com_port: serialconnected\n",conn->id);
+	va_start(args,fmt);
+	i=vsnprintf(buf,sizeof(buf),fmt,args);
+	va_end(args);
+	if (i>=MAXLEN) {
+		i = MAXLEN-1;
 	}
 
-	sprintf(portstr, "\\\\.\\COM%d", com_port);
-	conn->serial = CreateFile(portstr,
+	if (!TryEnterCriticalSection(&conn->net_lock)) {
+		dprintf(1,"wconsd[%i]: busy, notice dropped\n",conn->id);
+		return -1;
+	}
+	if (!conn->mccp) {
+		bytes = net_send_all(conn,buf,i,0);
+	} else {
+		/* a compressed stream cannot be cut short, so only if it fits */
+		FD_ZERO(&set_write);
+		FD_SET(conn->net,&set_write);
+		if (select(conn->net+1,NULL,&set_write,NULL,&tv)==1) {
+			bytes = net_send_compressed(conn,buf,i,1);
+		}
+	}
+	LeaveCriticalSection(&conn->net_lock);
+
+	if (bytes==-1) {
+		dprintf(1,"wconsd[%i]: client not taking anything, notice dropped\n",conn->id);
+	} else {
+		conn->net_bytes_tx += bytes;
+	}
+	return bytes;
+}
+
+/*
+ * Turn on TCP keepalives for a newly accepted socket, so that a peer
+ * that has vanished without a FIN is noticed by the stack
+ */
+void set_tcp_keepalive(SOCKET s) {
+	struct tcp_keepalive ka;
+	DWORD bytes;
+	int one=1;
+
+	if (setsockopt(s,SOL_SOCKET,SO_KEEPALIVE,(void*)&one,sizeof(one))==SOCKET_ERROR) {
+		dprintf(1,"wconsd: SO_KEEPALIVE failed %i\n",WSAGetLastError());
+		return;
+	}
+
+	ka.onoff=1;
+	ka.keepalivetime=keepalive_idle*1000;
+	ka.keepaliveinterval=keepalive_interval*1000;
+	if (WSAIoctl(s,SIO_KEEPALIVE_VALS,&ka,sizeof(ka),NULL,0,&bytes,NULL,NULL)==SOCKET_ERROR) {
+		dprintf(1,"wconsd: SIO_KEEPALIVE_VALS failed %i\n",WSAGetLastError());
+	}
+#ifdef TCP_KEEPCNT
+	/* Only newer versions of windows allow the probe count to be set */
+	setsockopt(s,IPPROTO_TCP,TCP_KEEPCNT,(void*)&keepalive_count,sizeof(keepalive_count));
+#endif
+}
+
+/*
+ * Finish with the client.  This only shuts the socket down: com_to_net
+ * may be sending on it right now, so it is closed by the connection
+ * cleanup once that thread has been joined.
+ */
+void net_close(struct connection *conn) {
+	InterlockedExchange(&conn->net_closed,1);
+	shutdown(conn->net,SD_BOTH);
+}
+
+/*
+ * We have given up on this peer, shut the socket down and remember why,
+ * so that the connection cleanup can account for the time it held the port
+ */
+void peer_dead(struct connection *conn) {
+	conn->peer_dead=1;
+	InterlockedIncrement(&stats.dead_peers);
+	net_close(conn);
+}
+
+/*
+ * Called whenever a connection has been idle for a select timeout.
+ * Once the peer has been silent for long enough, send an IAC DO
+ * TIMING-MARK - any reply at all (WILL or WONT) proves that it is alive.
+ * Only a peer that has negotiated something is probed: a plain TCP
+ * client, such as nc or a script, would never answer, and is left to
+ * the TCP keepalives.
+ *
+ * Returns nonzero if the peer was declared dead and the socket closed
+ */
+int check_peer_alive(struct connection *conn) {
+	DWORD now = GetTickCount();
+
+	/* local peers cannot vanish without the socket closing */
+	if (!keepalive_probe || conn->local || !conn->telnet_peer) {
+		return 0;
+	}
+
+	if (conn->probe_tick) {
+		if (now - conn->probe_tick < keepalive_interval*keepalive_count*1000) {
+			return 0;
+		}
+		dprintf(1,"wconsd[%i]: peer did not answer probe, closing\n",conn->id);
+		peer_dead(conn);
+		return 1;
+	}
+
+	if (now - conn->last_rx_tick >= keepalive_idle*1000) {
+		dprintf(2,"wconsd[%i]: probing idle peer\n",conn->id);
+		conn->probe_tick = now?now:1;
+		netprintf(conn,"\xff\xfd\x06");	/* IAC DO TIMING-MARK */
+	}
+	return 0;
+}
+
+/* describe where a connection came from */
+char *peer_name(struct connection *conn, char *buf, int len) {
+	if (!conn->sa) {
+		buf[0]=0;
+	} else if (conn->local) {
+		snprintf(buf,len,"local%s",conn->option_raw?" (raw)":"");
+	} else {
+		/* FIXME - IPv4 Specific */
+		snprintf(buf,len,"%s:%i",
+			inet_ntoa(((struct sockaddr_in*)conn->sa)->sin_addr),
+			htons(((struct sockaddr_in*)conn->sa)->sin_port));
+	}
+	return buf;
+}
+
+/* note that the peer has sent us something */
+void peer_heard(struct connection *conn, int size) {
+	conn->net_bytes_rx+=size;
+	conn->last_rx_tick=GetTickCount();
+	conn->probe_tick=0;
+}
+
+/*
+ * Set the line settings of an open port.  Everything other than the
+ * framing is fixed: binary, no flow control, DTR and RTS always on.
+ */
+int serial_setline(HANDLE serial, DCB *dcb, DWORD speed, BYTE data, BYTE parity, BYTE stop) {
+	if (!GetCommState(serial, dcb)) {
+		return -1;
+	}
+
+	// Fill in the device control block
+	dcb->BaudRate=speed;
+	dcb->ByteSize=data;
+	dcb->Parity=parity;		// NOPARITY, ODDPARITY, EVENPARITY
+	dcb->StopBits=stop;		// ONESTOPBIT, ONE5STOPBITS, TWOSTOPBITS
+	dcb->fBinary=TRUE;
+	dcb->fOutxCtsFlow=FALSE;
+	dcb->fOutxDsrFlow=FALSE;
+	dcb->fDtrControl=DTR_CONTROL_ENABLE; // Always on
+	dcb->fDsrSensitivity=FALSE;
+	dcb->fTXContinueOnXoff=FALSE;
+	dcb->fOutX=FALSE;
+	dcb->fInX=FALSE;
+	dcb->fErrorChar=FALSE;
+	dcb->fNull=FALSE;
+	dcb->fRtsControl=RTS_CONTROL_ENABLE; // Always on
+	dcb->fAbortOnError=FALSE;
+
+	if (!SetCommState(serial, dcb)) {
+		return -1;
+	}
+	return 0;
+}
+
+/* the read timeouts that every serial reader expects */
+int serial_timeouts(HANDLE serial) {
+	COMMTIMEOUTS timeouts;
+
+	/* FIXME - these values need much more tuning */
+	timeouts.ReadIntervalTimeout=20;
+	timeouts.ReadTotalTimeoutMultiplier=0;
+	/*
+	 * Note that this means that the serial to net thread wakes
+	 * each and ever 50 milliseconds
+	 */
+	timeouts.ReadTotalTimeoutConstant=50;
+	timeouts.WriteTotalTimeoutMultiplier=0;
+	timeouts.WriteTotalTimeoutConstant=0;
+	if (!SetCommTimeouts(serial, &timeouts)) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Open a COM port with the given line settings.  This does not depend on
+ * a telnet connection, so anything wanting a port can use it.
+ */
+HANDLE serial_open(int port, DCB *dcb, DWORD speed, BYTE data, BYTE parity, BYTE stop) {
+	char portstr[12];
+	HANDLE serial;
+
+	sprintf(portstr, "\\\\.\\COM%d", port);
+	serial = CreateFile(portstr,
 		GENERIC_READ | GENERIC_WRITE,
 		0, // Exclusive access
 		NULL,
 		OPEN_EXISTING,
 		FILE_FLAG_OVERLAPPED,
 		NULL);
-	if (conn->serial == INVALID_HANDLE_VALUE) {
+	if (serial == INVALID_HANDLE_VALUE) {
+		return INVALID_HANDLE_VALUE;
+	}
+
+	if (serial_setline(serial,dcb,speed,data,parity,stop) || serial_timeouts(serial)) {
+		CloseHandle(serial);
+		return INVALID_HANDLE_VALUE;
+	}
+	return serial;
+}
+
+/*
+ * The settings this session would open its port with.  Only the session's
+ * own thread changes conn->line, and a snapshot is never changed, so this
+ * is safe from anywhere without a lock.
+ */
+const struct line *session_line(struct connection *conn) {
+	const struct line *l = conn->line;
+
+	return l ? l : line_default(conn->want_port);
+}
+
+/* change one of the settings for this session only */
+void session_set_line(struct connection *conn, const struct line *l) {
+	if ((l = line_make(l))) {
+		InterlockedExchangePointer((void *volatile *)&conn->line,(void *)l);
+	}
+}
+
+/*
+ * Attach to the com port, which opens it unless it is already open (see
+ * port.c) - either way the session then only writes to the handle, the
+ * port's own reader does the reading.  If another session is writing to
+ * it, or we were asked to, the session is only a spectator, which
+ * leaves the port alone.
+ */
+int open_com_port(struct connection *conn) {
+	const struct line *l = session_line(conn);
+
+	if (conn->serialconnected) {
+		dprintf(1,"wcons[%i]: open_com_port: serialconnected\n",conn->id);
+	}
+
+	conn->port = conn->want_port;
+	conn->cursor.id = conn->id;
+	conn->told_spectator = 0;
+	if (conn->spectate || port_attach(conn->port,l,&conn->cursor)) {
+		if ((!conn->spectate && port_held(conn->port)) ||
+		    port_watch(conn->port,&conn->cursor)) {
+			return -1;
+		}
+		conn->serial = conn->cursor.serial;
+		conn->serialconnected=1;
+		dprintf(1,"wconsd[%i]: spectating COM%i\n",conn->id,conn->port);
+		return 0;
+	}
+	conn->serial = conn->cursor.serial;
+	dprintf(1,"wconsd[%i]: %s COM%i in %.1f ms\n",conn->id,
+		conn->cursor.warm?"attached to warm":"opened",conn->port,conn->cursor.ms);
+
+	if (l->autobaud || autobaud_enabled) {
+		/* the session keeps the speed that was found */
+		struct line found = *l;
+
+		found.speed = port_line(&conn->cursor)->speed;
+		session_set_line(conn,&found);
+	}
+
+	/* serial_setline raised them, the client may want them down */
+	if (!conn->dtr) {
+		EscapeCommFunction(conn->serial,CLRDTR);
+	}
+	if (!conn->rts) {
+		EscapeCommFunction(conn->serial,CLRRTS);
+	}
+	conn->brk=0;
+
+	conn->serialconnected=1;
+	return 0;
+}
+
+/*
+ * Give the UART a chance to send whatever is still queued for it, but
+ * only until the deadline - after that the output is thrown away.
+ * Returns the number of bytes thrown away.
+ */
+DWORD drain_com_port(struct connection *conn, DWORD timeout) {
+	DWORD start = GetTickCount();
+	DWORD errors;
+	COMSTAT cs;
+
+	while (ClearCommError(conn->serial,&errors,&cs) && cs.cbOutQue) {
+		if (GetTickCount()-start >= timeout) {
+			dprintf(1,"wconsd[%i]: discarding %lu undrained bytes\n",
+				conn->id,cs.cbOutQue);
+			PurgeComm(conn->serial,PURGE_TXABORT|PURGE_TXCLEAR);
+			return cs.cbOutQue;
+		}
+		Sleep(10);
+	}
+	return 0;
+}
+
+/* what putting new line settings into force on an open port cost */
+struct line_change {
+	double ms;		/* from asking to the new settings being in force */
+	DWORD discarded;	/* output bytes that could not drain in time */
+};
+
+/*
+ * Put new line settings into force on the session's open port, without
+ * closing it.  Output already queued was written for the old settings,
+ * so it is given until the drain deadline to go out at them and the pacer
+ * is held off meanwhile; anything left after that is discarded, and
+ * counted.  What has been received was framed by the UART as it arrived,
+ * so the reader carries on and loses nothing.
+ *
+ * Called from the menu, and for RFC 2217 requests from the telnet option
+ * parser - in both cases on the thread that would otherwise be writing.
+ */
+int reconfigure_port(struct connection *conn, const struct line *l, struct line_change *r) {
+	LARGE_INTEGER start, end, freq;
+	int ret;
+
+	QueryPerformanceCounter(&start);
+	if (conn->pacer) {
+		pace_hold(conn->pacer);
+	}
+	r->discarded = drain_com_port(conn,shutdown_drain);
+	ret = port_setline(&conn->cursor,l);
+	/* that raised DTR and RTS, which an RFC 2217 client may have dropped */
+	if (!conn->dtr) {
+		EscapeCommFunction(conn->serial,CLRDTR);
+	}
+	if (!conn->rts) {
+		EscapeCommFunction(conn->serial,CLRRTS);
+	}
+	if (conn->pacer) {
+		pace_resume(conn->pacer);
+	}
+	QueryPerformanceCounter(&end);
+	QueryPerformanceFrequency(&freq);
+	r->ms = (end.QuadPart-start.QuadPart)*1000.0/freq.QuadPart;
+
+	InterlockedIncrement(&stats.line_changes);
+	InterlockedExchangeAdd(&stats.line_discarded,r->discarded);
+	dprintf(1,"wconsd[%i]: COM%i now %lu %i %s %s, took %.1f ms, %lu discarded%s\n",
+		conn->id,conn->port,l->speed,l->data,line_parity_name(l->parity),
+		line_stop_name(l->stop),r->ms,r->discarded,ret?", failed":"");
+	return ret;
+}
+
+/* is the session on a port it may not write to? */
+int spectating(struct connection *conn) {
+	return conn->serialconnected && conn->cursor.watching;
+}
+
+/*
+ * A session's queue is what it has still to be sent of its port's
+ * output, which is in the port's ring - so a client that cannot keep up
+ * only ever holds up its own com_to_net thread, never the port's reader
+ * or the other sessions.  client_queue bounds it more tightly than the
+ * ring does, and client_policy says what happens once it is reached.
+ */
+uint64_t client_bound(struct connection *conn) {
+	uint64_t size = port_ringsize(&conn->cursor);
+
+	return client_queue && client_queue<size ? client_queue : size;
+}
+
+/*
+ * How many ms the session's oldest unsent output has waited.  If it came
+ * before the reads the port remembers, all that is known is that it came
+ * after the session last caught up.
+ */
+double client_lag(struct connection *conn) {
+	double lag = port_lag(&conn->cursor);
+
+	if (lag < 0) {
+		lag = GetTickCount()-conn->caught_up;
+	}
+	return lag;
+}
+
+/* ask the device to wait for us, with RTS, or let it carry on */
+void client_hold(struct connection *conn, int hold) {
+	if (hold && !InterlockedExchange(&conn->flow_held,1)) {
+		dprintf(1,"wconsd[%i]: %.0f bytes behind, holding COM%i off\n",
+			conn->id,(double)port_backlog(&conn->cursor),conn->port);
+		EscapeCommFunction(conn->serial,CLRRTS);
+		InterlockedIncrement(&conn->holds);
+		InterlockedIncrement(&stats.slow_holds);
+	} else if (!hold && InterlockedExchange(&conn->flow_held,0)) {
+		/* back to where the client left it */
+		if (conn->rts) {
+			EscapeCommFunction(conn->serial,SETRTS);
+		}
+	}
+}
+
+/*
+ * Called by com_to_net before each read from the port, when it is the
+ * only one moving the cursor.  A writer blocking holds the device off
+ * when half the queue is used and lets it go at a quarter; otherwise -
+ * spectators never hold up the port - the oldest output over the bound
+ * is dropped, which the client is told of as a gap.
+ */
+void client_trim(struct connection *conn) {
+	uint64_t bound = client_bound(conn);
+	uint64_t behind = port_backlog(&conn->cursor);
+
+	if (client_policy==CLIENT_BLOCK && !spectating(conn)) {
+		if (behind > bound/2) {
+			client_hold(conn,1);
+		} else if (behind < bound/4) {
+			client_hold(conn,0);
+		}
+		return;
+	}
+	client_hold(conn,0);
+	if (behind > bound && port_skip(&conn->cursor,bound)) {
+		InterlockedIncrement(&conn->drops);
+		InterlockedIncrement(&stats.slow_drops);
+	}
+}
+
+/*
+ * Give up on a client that is past the deadline, if that is the policy:
+ * the thread reading from it sees the socket shut down and cleans up.
+ * Called while waiting to send to it, and by client_check.
+ */
+int client_too_slow(struct connection *conn) {
+	double lag;
+
+	if (client_policy!=CLIENT_DISCONNECT || !conn->serialconnected || !conn->cursor.port ||
+	    (lag = client_lag(conn)) < client_deadline) {
+		return 0;
+	}
+	if (!InterlockedExchange(&conn->too_slow,1)) {
+		dprintf(1,"wconsd[%i]: %.0f ms behind on COM%i, disconnecting\n",
+			conn->id,lag,conn->port);
+		InterlockedIncrement(&stats.slow_disconnects);
+		shutdown(conn->net,SD_BOTH);
+	}
+	return 1;
+}
+
+/*
+ * Called every couple of seconds by the thread reading from the client,
+ * for when com_to_net is stuck sending to it.  Holds the device off if
+ * that is the policy, or gives up on a client that is past the deadline.
+ * Returns nonzero if the client was given up on.
+ */
+int client_check(struct connection *conn) {
+	if (!conn->serialconnected || !conn->cursor.port) {
+		return 0;
+	}
+	if (client_policy==CLIENT_BLOCK && !spectating(conn)) {
+		if (port_backlog(&conn->cursor) > client_bound(conn)/2) {
+			client_hold(conn,1);
+		}
+		return 0;
+	}
+	if (!client_too_slow(conn)) {
+		return 0;
+	}
+	net_close(conn);
+	return 1;
+}
+
+/*
+ * Change the session's line settings, putting them into force on its port
+ * if that is open.  The menu and RFC 2217 requests both come this way.
+ * If the port will not take them the session keeps the old ones.
+ */
+int session_change_line(struct connection *conn, const struct line *l, struct line_change *r) {
+	r->ms = 0;
+	r->discarded = 0;
+	if (spectating(conn)) {
+		/* the settings are the writer's */
 		return -1;
 	}
+	if (conn->serialconnected && reconfigure_port(conn,l,r)) {
+		return -1;
+	}
+	session_set_line(conn,l);
+	return 0;
+}
+
+/* a menu command has changed a setting */
+void menu_set_line(struct connection *conn, const struct line *l) {
+	struct line_change r;
+
+	if (spectating(conn)) {
+		netprintf(conn,"error: only the writer can change COM%i's settings\r\n",conn->port);
+	} else if (session_change_line(conn,l,&r)) {
+		netprintf(conn,"error: COM%i did not take the new settings\r\n",conn->port);
+	} else if (conn->serialconnected) {
+		netprintf(conn,"applied to COM%i in %.1f ms, %lu bytes of output discarded\r\n",
+			conn->port,r.ms,r.discarded);
+	}
+}
+
+/*
+ * Stop using the com port, and wake the threads using it on our behalf
+ * so that they notice.  The port may be staying open for the next
+ * session, so only our own I/O is disturbed: the com_to_net thread waits
+ * on the cursor's event and the modem thread in WaitCommEvent, which a
+ * new event mask ends.
+ */
+void close_com_port(struct connection *conn) {
+	conn->serialconnected=0;
+	if (conn->serial==INVALID_HANDLE_VALUE) {
+		return;
+	}
+	if (conn->cursor.event) {
+		SetEvent(conn->cursor.event);
+	}
+	if (conn->modemThread!=NULL) {
+		SetCommMask(conn->serial,0);
+	}
+}
+
+/*
+ * Given an active connection, force close its
+ * serial port. waiting - for a bounded time - for all relevant resources
+ */
+void close_serial_connection(struct connection *conn) {
+	if (!conn->active) {
+		dprintf(1,"wconsd: closing closed connection %i\n",conn->id);
+		return;
+	}
+	conn->option_runmenu=1;
+	if (conn->pacer) {
+		pace_stop(conn->pacer);
+	}
+	if (conn->serialconnected && !conn->hold && !spectating(conn) &&
+	    !port_kept(&conn->cursor)) {
+		/* it is about to be closed, not just left to get on with it */
+		drain_com_port(conn,shutdown_drain);
+	}
+	if (conn->serialconnected) {
+		client_hold(conn,0);
+	}
+	close_com_port(conn);
+	if (conn->group) {
+		group_stop(conn->group);
+	}
+	if (conn->serialThread!=NULL) {
+		if (WaitForSingleObject(conn->serialThread,shutdown_timeout)==WAIT_TIMEOUT) {
+			dprintf(1,"wconsd[%i]: serial thread did not exit, abandoning it\n",conn->id);
+			InterlockedIncrement(&stats.stuck_threads);
+			/* it might still look at the pacer, so leak that */
+			EnterCriticalSection(&conn->pacer_lock);
+			conn->pacer=NULL;
+			LeaveCriticalSection(&conn->pacer_lock);
+		}
+		CloseHandle(conn->serialThread);
+		conn->serialThread=NULL;
+	}
+	if (conn->modemThread!=NULL) {
+		if (WaitForSingleObject(conn->modemThread,shutdown_timeout)==WAIT_TIMEOUT) {
+			dprintf(1,"wconsd[%i]: modem thread did not exit, abandoning it\n",conn->id);
+			InterlockedIncrement(&stats.stuck_threads);
+		}
+		CloseHandle(conn->modemThread);
+		conn->modemThread=NULL;
+	}
+	if (conn->group) {
+		group_close(conn->group,shutdown_timeout);
+		conn->group=NULL;
+	}
+	/* a spectator has nothing to come back to */
+	if (!conn->hold || conn->cursor.watching ||
+	    port_hold(&conn->cursor,conn->id,conn->line)) {
+		port_detach(&conn->cursor,shutdown_timeout);
+	}
+	conn->hold=0;
+	conn->spectate=0;
+	conn->serial=INVALID_HANDLE_VALUE;
+	EnterCriticalSection(&conn->pacer_lock);
+	if (conn->pacer) {
+		pace_free(conn->pacer);
+		conn->pacer=NULL;
+	}
+	LeaveCriticalSection(&conn->pacer_lock);
+}
+
+/* show the config for this module */
+static int this_showrun(struct cli_def *cli) {
+        cli_print(cli, "debug level %i",dprintf_level);
+        cli_print(cli, "idle %i",cli_idle);
+        cli_print(cli, "listen port %i",default_tcpport);
+        if (local_path[0]) {
+                cli_print(cli, "listen local %s",local_path);
+                cli_print(cli, "listen local-raw %i",local_raw);
+        }
+        cli_print(cli, "keepalive idle %i",keepalive_idle);
+        cli_print(cli, "keepalive interval %i",keepalive_interval);
+        cli_print(cli, "keepalive count %i",keepalive_count);
+        cli_print(cli, "keepalive probe %i",keepalive_probe);
+        cli_print(cli, "shutdown drain %lu",shutdown_drain);
+        cli_print(cli, "shutdown timeout %lu",shutdown_timeout);
+        cli_print(cli, "client queue %lu",client_queue);
+        cli_print(cli, "client policy %s",client_policies[client_policy]);
+        cli_print(cli, "client deadline %lu",client_deadline);
+        return CLI_OK;
+}
+
+static int cmd_showstats(struct cli_def *cli, char *command, char *argv[], int argc) {
+	cli_print(cli, "connections accepted     %li",stats.connections);
+	cli_print(cli, "dead peers reclaimed     %li",stats.dead_peers);
+	cli_print(cli, "port time held by dead   %li ms",stats.dead_port_ms);
+	cli_print(cli, "abandoned threads        %li",stats.stuck_threads);
+	cli_print(cli, "live line changes        %li",stats.line_changes);
+	cli_print(cli, "bytes discarded by them  %li",stats.line_discarded);
+	cli_print(cli, "slow client drops        %li",stats.slow_drops);
+	cli_print(cli, "devices held off         %li",stats.slow_holds);
+	cli_print(cli, "slow clients dropped     %li",stats.slow_disconnects);
+	return CLI_OK;
+}
+
+/*
+ * Where to listen.  These are read from the config file before the
+ * sockets are opened, and have no effect after that.
+ */
+static int cmd_clisten(struct cli_def *cli, char *command, char *argv[], int argc) {
+	if (argc!=1) {
+		cli_print(cli,"Need a single value");
+		return CLI_ERROR;
+	}
+
+	if (strstr(command,"local-raw")) {
+		local_raw = atoi(argv[0]);
+	} else if (strstr(command,"local")) {
+		if (strlen(argv[0])>=UNIX_PATH_MAX) {
+			cli_print(cli,"Path is too long for a local socket");
+			return CLI_ERROR;
+		}
+		snprintf(local_path,sizeof(local_path),"%s",argv[0]);
+	} else {
+		if (atoi(argv[0])<1 || atoi(argv[0])>65535) {
+			cli_print(cli,"Need a TCP port number");
+			return CLI_ERROR;
+		}
+		default_tcpport = atoi(argv[0]);
+	}
+	return CLI_OK;
+}
+
+/* set one of the shutdown deadlines, given in milliseconds */
+static int cmd_cshutdown(struct cli_def *cli, char *command, char *argv[], int argc) {
+	if (argc!=1 || atoi(argv[0])<0) {
+		cli_print(cli,"Need a single value in milliseconds");
+		return CLI_ERROR;
+	}
+
+	if (strstr(command,"drain")) {
+		shutdown_drain = atoi(argv[0]);
+	} else {
+		shutdown_timeout = atoi(argv[0]);
+	}
+	return CLI_OK;
+}
+
+/* client queue <bytes>, client policy drop|block|disconnect, client deadline <ms> */
+static int cmd_cclient(struct cli_def *cli, char *command, char *argv[], int argc) {
+	int i;
 
-	if (!GetCommState(conn->serial, &dcb)) {
-		return -1;
+	if (argc!=1) {
+		cli_print(cli,"Need a single value");
+		return CLI_ERROR;
 	}
 
-	// Fill in the device control block
-	dcb.BaudRate=com_speed;
-	dcb.ByteSize=com_data;
-	dcb.Parity=com_parity;		// NOPARITY, ODDPARITY, EVENPARITY
-	dcb.StopBits=com_stop;		// ONESTOPBIT, ONE5STOPBITS, TWOSTOPBITS
-	dcb.fBinary=TRUE;
-	dcb.fOutxCtsFlow=FALSE;
-	dcb.fOutxDsrFlow=FALSE;
-	dcb.fDtrControl=DTR_CONTROL_ENABLE; // Always on
-	dcb.fDsrSensitivity=FALSE;
-	dcb.fTXContinueOnXoff=FALSE;
-	dcb.fOutX=FALSE;
-	dcb.fInX=FALSE;
-	dcb.fErrorChar=FALSE;
-	dcb.fNull=FALSE;
-	dcb.fRtsControl=RTS_CONTROL_ENABLE; // Always on
-	dcb.fAbortOnError=FALSE;
-
-	if (!SetCommState(conn->serial, &dcb)) {
-		return -1;
+	if (strstr(command,"policy")) {
+		for (i=0;i<3;i++) {
+			if (!strcmp(argv[0],client_policies[i])) {
+				client_policy = i;
+				return CLI_OK;
+			}
+		}
+		cli_print(cli,"Policy is drop, block or disconnect");
+		return CLI_ERROR;
 	}
-
-	/* FIXME - these values need much more tuning */
-	timeouts.ReadIntervalTimeout=20;
-	timeouts.ReadTotalTimeoutMultiplier=0;
-	/*
-	 * Note that this means that the serial to net thread wakes
-	 * each and ever 50 milliseconds
-	 */
-	timeouts.ReadTotalTimeoutConstant=50;
-	timeouts.WriteTotalTimeoutMultiplier=0;
-	timeouts.WriteTotalTimeoutConstant=0;
-	if (!SetCommTimeouts(conn->serial, &timeouts)) {
-		return -1;
+	if (atoi(argv[0])<0) {
+		cli_print(cli,"Invalid value");
+		return CLI_ERROR;
 	}
-	conn->serialconnected=1;
-	return 0;
+	if (strstr(command,"queue")) {
+		client_queue = atoi(argv[0]);
+	} else {
+		client_deadline = atoi(argv[0]);
+	}
+	return CLI_OK;
 }
 
-/* close the com port */
-void close_com_port(struct connection *conn) {
-	CloseHandle(conn->serial);
-	conn->serial=INVALID_HANDLE_VALUE;
-	conn->serialconnected=0;
-}
+/* how far behind each session on a port is */
+static int cmd_showclients(struct cli_def *cli, char *command, char *argv[], int argc) {
+	int i;
 
-/*
- * Given an active connection, force close its
- * serial port. waiting for all relevant resources
- */
-void close_serial_connection(struct connection *conn) {
-	if (!conn->active) {
-		dprintf(1,"wconsd: closing closed connection %i\n",conn->id);
-		return;
+	cli_print(cli, "  id port  role          behind        lag         lost  drops  holds");
+	for (i=0;i<MAXCONNECTIONS;i++) {
+		struct connection *conn = &connection[i];
+
+		if (!conn->active || !conn->serialconnected) {
+			continue;
+		}
+		cli_print(cli, "%4i COM%-2i %-9s %10.0f %8.0fms %12.0f %6li %6li%s",
+			conn->id,conn->port,conn->cursor.watching?"spectator":"writer",
+			(double)port_backlog(&conn->cursor),client_lag(conn),
+			(double)conn->cursor.lost,conn->drops,conn->holds,
+			conn->flow_held?"  held off":"");
 	}
-	conn->option_runmenu=1;
-	close_com_port(conn);
-	WaitForSingleObject(conn->serialThread,INFINITE);
-	CloseHandle(conn->serialThread);
-	conn->serialThread=NULL;
+	return CLI_OK;
 }
 
-/* show the config for this module */
-static int this_showrun(struct cli_def *cli) {
-        cli_print(cli, "debug level %i",dprintf_level);
-        cli_print(cli, "listen port %i",default_tcpport);
-        return CLI_OK;
+/* set one of the keepalive values, given in seconds (or 0/1 for probe) */
+static int cmd_ckeepalive(struct cli_def *cli, char *command, char *argv[], int argc) {
+	int *value;
+
+	if (argc!=1) {
+		cli_print(cli,"Need a single value");
+		return CLI_ERROR;
+	}
+
+	if (strstr(command,"idle")) {
+		value = &keepalive_idle;
+	} else if (strstr(command,"interval")) {
+		value = &keepalive_interval;
+	} else if (strstr(command,"count")) {
+		value = &keepalive_count;
+	} else {
+		value = &keepalive_probe;
+	}
+
+	if (atoi(argv[0])<0 || (value!=&keepalive_probe && atoi(argv[0])<1)) {
+		cli_print(cli,"Invalid value");
+		return CLI_ERROR;
+	}
+	*value = atoi(argv[0]);
+	return CLI_OK;
 }
 
 /* NOTE: this function is replicated in show_status */
 static int cmd_showport(struct cli_def *cli, char *command, char *argv[], int argc) {
+	struct connection *conn;
+	const struct line *l;
 
-	cli_print(cli, "status:");
-	cli_print(cli, "  port=%d  speed=%ld  data=%d  parity=%d  stop=%d",
-			com_port, com_speed, com_data, com_parity, com_stop);
+	/* the config file is run without a connection */
+	if (!(conn = cli_get_context(cli))) {
+		cli_print(cli,"no session, see show line");
+		return CLI_OK;
+	}
+	l = session_line(conn);
 
-	/* FIXME - need to associate a connection object with a cli object */
-#if 0
+	cli_print(cli, "status:");
+	cli_print(cli, "  port=%d  speed=%ld%s  data=%d  parity=%d  stop=%d",
+			conn->want_port, l->speed, (l->autobaud||autobaud_enabled)?"(auto)":"",
+			l->data, l->parity, l->stop);
 	if(conn->serialconnected) {
 		cli_print(cli, "  state=open");
 	} else {
 		cli_print(cli, "  state=closed");
 	}
 	cli_print(cli," ");
-	cli_print(cli,"  connectionid=%i  hostname=%s",conn->id,hostname);
+	cli_print(cli,"  connectionid=%i  hostname=%s",conn->id,(char *)hostname);
 	cli_print(cli,"  echo=%i  binary=%i  keepalive=%i",
 		conn->option_echo,conn->option_binary,conn->option_keepalive);
-#endif
 	cli_print(cli," ");
 	return CLI_OK;
 }
@@ -305,43 +1247,61 @@ static int cmd_cdebuglevel(struct cli_def *cli, char *command, char *argv[], int
 }
 
 static int cmd_cidle(struct cli_def *cli, char *command, char *argv[], int argc) {
-	cli_set_idle_timeout(cli, atoi(argv[0]));
+	/* for this session and the ones started after it */
+	cli_idle = atoi(argv[0]);
+	cli_set_idle_timeout(cli, cli_idle);
 	return CLI_OK;
 }
 
+/* a connection's role on its port, for the connection tables */
+char role_flag(struct connection *conn) {
+	if (conn->group) {
+		return group_watching(conn->group) ? 'R' : 'W';
+	}
+	if (!conn->serialconnected) {
+		return ' ';
+	}
+	return conn->cursor.watching ? 'R' : 'W';
+}
+
+/* a handle as the number windows shows for it, for the connection tables */
+static int handle_id(HANDLE h) {
+	return (int)(intptr_t)h;
+}
+
 static int cmd_conntable(struct cli_def *cli, char *command, char *argv[], int argc) {
+	char peer[64];
 	int i;
 	cli_print(cli,
-		"Flags: A - Active Slot, S - Serial active,");
+		"Flags: A - Active Slot, S - Serial active, W - Writer, R - Read-only,");
 	cli_print(cli,
 		"       M - Run Menu, B - Binary transmission, E - Echo enabled,");
 	cli_print(cli,
 		"       K - Telnet Keepalives, * - This connection");
 	cli_print(cli," ");
-	cli_print(cli, "s flags  id mThr net  serial serialTh netrx nettx peer address");
-	cli_print(cli, "- ------ -- ---- ---- ------ -------- ----- ----- ------------");
+	cli_print(cli, "s flags   id mThr net  serial serialTh netrx nettx peer address");
+	cli_print(cli, "- ------- -- ---- ---- ------ -------- ----- ----- ------------");
 	for (i=0;i<MAXCONNECTIONS;i++) {
-		cli_print(cli,"%i%c%c%c%c%c%c%c %2i %4i %4i %6i %8i %5i %5i %s:%i",
+		cli_print(cli,"%i%c%c%c%c%c%c%c%c %2i %4i %4i %6i %8i %5i %5i %s",
 			i,
 			' ',
 			connection[i].active?'A':' ',
 			connection[i].serialconnected?'S':' ',
+			role_flag(&connection[i]),
 			connection[i].option_runmenu?'M':' ',
 			connection[i].option_binary?'B':' ',
 			connection[i].option_echo?'E':' ',
 			connection[i].option_keepalive?'K':' ',
 			connection[i].id,
 
-			connection[i].menuThread,
+			handle_id(connection[i].menuThread),
 			connection[i].net,
 
-			connection[i].serial,
-			connection[i].serialThread,
+			handle_id(connection[i].serial),
+			handle_id(connection[i].serialThread),
 			connection[i].net_bytes_rx,
 			connection[i].net_bytes_tx,
-			/* FIXME - IPv4 Specific */
-			connection[i].sa?inet_ntoa(((struct sockaddr_in*)connection[i].sa)->sin_addr):"",
-			connection[i].sa?htons(((struct sockaddr_in*)connection[i].sa)->sin_port):0
+			peer_name(&connection[i],peer,sizeof(peer))
 		);
 	}
 	return CLI_OK;
@@ -362,6 +1322,17 @@ static struct module_def this_module = {
  */
 static void initialise_all_modules(struct cli_def *cli) {
 	modules_init(cli);	/* done first, to register the parents */
+	mccp_init(cli);
+	capture_init(cli);
+	trigger_init(cli);
+	xfer_init(cli);
+	pace_init(cli);
+	line_init(cli);
+	autobaud_init(cli);
+	mux_init(cli);
+	group_init(cli);
+	shmring_init(cli);
+	port_init(cli);
 
 	/*
 	 * register stuff from the main program
@@ -372,7 +1343,7 @@ static void initialise_all_modules(struct cli_def *cli) {
 		PRIVILEGE_UNPRIVILEGED, MODE_EXEC, "Connection Table");
 
 	cli_register_command(cli, lookup_parent("show"), "port", cmd_showport,
-		PRIVILEGE_UNPRIVILEGED, MODE_EXEC, "Default serial configuration");
+		PRIVILEGE_UNPRIVILEGED, MODE_EXEC, "Serial configuration and this session");
 
 	cli_register_command(cli, lookup_parent("debug"), "level", cmd_debuglevel,
 		PRIVILEGE_PRIVILEGED, MODE_EXEC, "Logging output level");
@@ -387,6 +1358,64 @@ static void initialise_all_modules(struct cli_def *cli) {
 	cli_register_command(cli, NULL, "idle", cmd_cidle,
 		PRIVILEGE_PRIVILEGED, MODE_CONFIG, "idle timeout");
 
+	cli_register_command(cli, lookup_parent("show"), "statistics", cmd_showstats,
+		PRIVILEGE_UNPRIVILEGED, MODE_EXEC, "Global counters");
+
+	register_parent("config keepalive",
+		cli_register_command(cli, NULL, "keepalive", NULL, PRIVILEGE_PRIVILEGED,
+		MODE_CONFIG, "Dead peer detection"));
+
+	cli_register_command(cli, lookup_parent("config keepalive"), "idle", cmd_ckeepalive,
+		PRIVILEGE_PRIVILEGED, MODE_CONFIG, "Seconds of silence before probing");
+
+	cli_register_command(cli, lookup_parent("config keepalive"), "interval", cmd_ckeepalive,
+		PRIVILEGE_PRIVILEGED, MODE_CONFIG, "Seconds between probes");
+
+	cli_register_command(cli, lookup_parent("config keepalive"), "count", cmd_ckeepalive,
+		PRIVILEGE_PRIVILEGED, MODE_CONFIG, "Unanswered probes before disconnect");
+
+	cli_register_command(cli, lookup_parent("config keepalive"), "probe", cmd_ckeepalive,
+		PRIVILEGE_PRIVILEGED, MODE_CONFIG, "Send TIMING-MARK probes to telnet clients (0/1)");
+
+	register_parent("config listen",
+		cli_register_command(cli, NULL, "listen", NULL, PRIVILEGE_PRIVILEGED,
+		MODE_CONFIG, "Where to accept connections"));
+
+	cli_register_command(cli, lookup_parent("config listen"), "port", cmd_clisten,
+		PRIVILEGE_PRIVILEGED, MODE_CONFIG, "TCP port for telnet connections");
+
+	cli_register_command(cli, lookup_parent("config listen"), "local", cmd_clisten,
+		PRIVILEGE_PRIVILEGED, MODE_CONFIG, "Path of a local (AF_UNIX) socket");
+
+	cli_register_command(cli, lookup_parent("config listen"), "local-raw", cmd_clisten,
+		PRIVILEGE_PRIVILEGED, MODE_CONFIG, "Local clients get raw bytes, not telnet (0/1)");
+
+	register_parent("config shutdown",
+		cli_register_command(cli, NULL, "shutdown", NULL, PRIVILEGE_PRIVILEGED,
+		MODE_CONFIG, "Teardown deadlines"));
+
+	cli_register_command(cli, lookup_parent("config shutdown"), "drain", cmd_cshutdown,
+		PRIVILEGE_PRIVILEGED, MODE_CONFIG, "ms allowed for serial output to drain");
+
+	cli_register_command(cli, lookup_parent("config shutdown"), "timeout", cmd_cshutdown,
+		PRIVILEGE_PRIVILEGED, MODE_CONFIG, "ms allowed for threads to exit");
+
+	register_parent("config client",
+		cli_register_command(cli, NULL, "client", NULL, PRIVILEGE_PRIVILEGED,
+		MODE_CONFIG, "Clients that cannot keep up with their port"));
+
+	cli_register_command(cli, lookup_parent("config client"), "queue", cmd_cclient,
+		PRIVILEGE_PRIVILEGED, MODE_CONFIG, "Bytes a client may fall behind, 0 for the ring");
+
+	cli_register_command(cli, lookup_parent("config client"), "policy", cmd_cclient,
+		PRIVILEGE_PRIVILEGED, MODE_CONFIG, "Once it has: drop, block or disconnect");
+
+	cli_register_command(cli, lookup_parent("config client"), "deadline", cmd_cclient,
+		PRIVILEGE_PRIVILEGED, MODE_CONFIG, "ms behind before disconnect gives up on it");
+
+	cli_register_command(cli, lookup_parent("show"), "clients", cmd_showclients,
+		PRIVILEGE_UNPRIVILEGED, MODE_EXEC, "How far behind each session is");
+
 	register_module(&this_module);
 }
 
@@ -398,6 +1427,7 @@ static void usage(const char *name, struct option *option)
 	printf("   -r              remove service 'wconsd'\n");
 	printf("   -d              run wconsd in foreground mode\n");
 	printf("   -p port         listen on the given port in foreground mode\n");
+	printf("   -c file         load configuration commands from file\n");
 
 	printf("\n");
 	while(option->name) {
@@ -414,11 +1444,12 @@ static int do_getopt(const int argc, char **argv) {
 		{"remove", 0, 0, 'r'},
 		{"debug", 2, 0, 'd'},
 		{"port", 1, 0, 'p'},
+		{"config", 1, 0, 'c'},
 		{0,0,0,0}
 	};
 
 	while(1) {
-		int c = getopt_long(argc,argv, "ird::p:",
+		int c = getopt_long(argc,argv, "ird::p:c:",
 			long_options,NULL);
 		if (c==-1)
 			break;
@@ -453,6 +1484,17 @@ static int do_getopt(const int argc, char **argv) {
 					default_tcpport = atoi(optarg);
 				}
 				break;
+			case 'c': {
+				/* run the file through the cli as config commands */
+				FILE *f = fopen(optarg,"r");
+				if (!f) {
+					printf("Cannot open config file '%s'\n",optarg);
+					return 2;
+				}
+				cli_file(cli,f,PRIVILEGE_PRIVILEGED,MODE_CONFIG);
+				fclose(f);
+				break;
+			}
 			default:
 				usage("wconsd",long_options);
 				return 1;
@@ -462,6 +1504,7 @@ static int do_getopt(const int argc, char **argv) {
 }
 
 int wconsd_stop(void *param1) {
+	stop_tick = GetTickCount();
 	SetEvent(stopEvent);
 	return 0;
 }
@@ -477,6 +1520,39 @@ int libcli_test(struct cli_def *cli, char *command, char *argv[], int argc) {
 }
 
 
+/*
+ * Open the local endpoint.  A stale socket file left by an earlier run
+ * would stop the bind, so it is removed first.
+ */
+int local_listen(void) {
+	struct sockaddr_un sun;
+
+	memset(&sun,0,sizeof(sun));
+	sun.sun_family=AF_UNIX;
+	snprintf(sun.sun_path,sizeof(sun.sun_path),"%s",local_path);
+	DeleteFile(local_path);
+
+	lls=socket(AF_UNIX,SOCK_STREAM,0);
+	if (lls==INVALID_SOCKET) {
+		return -1;
+	}
+	if (bind(lls,(struct sockaddr *)&sun,sizeof(sun))==SOCKET_ERROR
+			|| listen(lls,SOMAXCONN)==SOCKET_ERROR) {
+		closesocket(lls);
+		lls=INVALID_SOCKET;
+		return -1;
+	}
+	localSocketEvent = WSACreateEvent();
+	if (localSocketEvent==WSA_INVALID_EVENT
+			|| WSAEventSelect(lls,localSocketEvent,FD_ACCEPT)==SOCKET_ERROR) {
+		closesocket(lls);
+		lls=INVALID_SOCKET;
+		return -1;
+	}
+	dprintf(1,"wconsd: listening on %s%s\n",local_path,local_raw?" (raw)":"");
+	return 0;
+}
+
 /* Initialise wconsd: open a listening socket and the COM port, and
  * create lots of event objects. */
 int wconsd_init(int argc, char **argv) {
@@ -559,67 +1635,534 @@ int wconsd_init(int argc, char **argv) {
 	if (gethostname((char *)hostname,sizeof(hostname))==SOCKET_ERROR) {
 		return 1;
 	}
-	dprintf(1,"wconsd: Hostname is %s\n",hostname);
+	dprintf(1,"wconsd: Hostname is %s\n",hostname);
+
+	host_entry=gethostbyname((char *)hostname);
+	if (!host_entry) {
+		/* not every unix box can resolve its own name */
+		dprintf(1,"wconsd: cannot resolve %s\n",hostname);
+	} else if (host_entry->h_addrtype==AF_INET) {
+		dprintf(1,"wconsd: IP Address is %s\n",inet_ntoa (*(struct in_addr *)*host_entry->h_addr_list));
+		/* FIXME - enumerate all the IP addresses from the list */
+	} else {
+		host_entry=0;
+		return 0;
+	}
+
+	/* Create a socket to listen for connections. */
+	memset(&sin,0,sizeof(sin));
+	sin.sin_family=AF_INET;
+	sin.sin_port=htons(default_tcpport);
+	ls=socket(AF_INET,SOCK_STREAM,0);
+/*
+ FIXME:
+you can open sockets on Windows so that they support read/write. Just create it with
+
+  fh = WSASocket (domain, type, protocol, NULL, 0, 0);
+
+
+instead of socket.
+(see http://lists.gnu.org/archive/html/qemu-devel/2010-01/msg00383.html)
+*/
+	if (ls==INVALID_SOCKET) {
+		return 9;
+	}
+#ifndef MS_WINDOWS
+	{
+	int one=1;
+	setsockopt(ls,SOL_SOCKET,SO_REUSEADDR,(void*)&one,sizeof(one));
+	}
+#endif
+	if (bind(ls,(struct sockaddr *)&sin,sizeof(sin))==SOCKET_ERROR) {
+		dprintf(1,"wconsd: wconsd_init: failed to bind socket\n");
+		return 10;
+	}
+	if (listen(ls,1)==SOCKET_ERROR) {
+		return 11;
+	}
+	dprintf(1,"wconsd: listening on port %i\n",default_tcpport);
+
+	if (mux_start()) {
+		dprintf(1,"wconsd: wconsd_init: failed to start the mux listener\n");
+	}
+	if (local_path[0] && local_listen()) {
+		dprintf(1,"wconsd: wconsd_init: failed to start the local endpoint\n");
+	}
+
+
+	/* Mark the socket as non-blocking */
+	if (WSAEventSelect(ls,listenSocketEvent,FD_ACCEPT)==SOCKET_ERROR) {
+		return 12;
+	}
+
+	cli_register_command(cli, NULL, "test", libcli_test, PRIVILEGE_UNPRIVILEGED,
+		MODE_EXEC, NULL);
+#if 0
+	cli_set_auth_callback(cli, check_auth);
+	cli_set_enable_callback(cli, check_enable);
+#endif
+
+	return 0;
+}
+
+/*
+ * RFC 2217 COM-PORT-OPTION: a client that agrees to it can set the line
+ * and the control lines itself, and is told of modem and line state
+ * changes as they happen.
+ */
+
+/* send the server's reply to a command, escaping any IAC in its value */
+void comport_send(struct connection *conn, int cmd, const void *data, int len) {
+	unsigned char buf[4+2*SB_MAX+2];
+	const unsigned char *p = data;
+	int n = 0;
+	int bytes;
+
+	buf[n++]=TELNET_OPTION_IAC;
+	buf[n++]=TELNET_OPTION_SB;
+	buf[n++]=TELNET_OPTION_COMPORT;
+	buf[n++]=cmd+COMPORT_SERVER;
+	while (len-- > 0) {
+		if (*p==TELNET_OPTION_IAC) {
+			buf[n++]=TELNET_OPTION_IAC;
+		}
+		buf[n++]=*p++;
+	}
+	buf[n++]=TELNET_OPTION_IAC;
+	buf[n++]=TELNET_OPTION_SE;
+
+	bytes = net_send(conn,buf,n,1);
+	if (bytes==-1) {
+		dprintf(1,"wconsd[%i]: comport_send: send error %i\n",conn->id,WSAGetLastError());
+	} else {
+		conn->net_bytes_tx += bytes;
+	}
+}
+
+void comport_send_byte(struct connection *conn, int cmd, unsigned char v) {
+	comport_send(conn,cmd,&v,1);
+}
+
+/*
+ * Apply a SET-CONTROL and return the value to answer it with, which is
+ * the state of the setting it belongs to, or -1 for a value that is not
+ * in RFC 2217.  The control lines are remembered while the port is
+ * closed and set when it is opened.  We do no flow control, so asking
+ * for any is answered with none.
+ */
+int comport_control(struct connection *conn, unsigned char v) {
+	HANDLE serial = conn->serialconnected && !spectating(conn) ? conn->serial : NULL;
+
+	switch (v) {
+	case 5:	/* break on */
+		if (serial && SetCommBreak(serial)) {
+			conn->brk=1;
+		}
+		break;
+	case 6:	/* break off */
+		if (serial && ClearCommBreak(serial)) {
+			conn->brk=0;
+		}
+		break;
+	case 8:	/* DTR on */
+		if (!serial || EscapeCommFunction(serial,SETDTR)) {
+			conn->dtr=1;
+		}
+		break;
+	case 9:	/* DTR off */
+		if (!serial || EscapeCommFunction(serial,CLRDTR)) {
+			conn->dtr=0;
+		}
+		break;
+	case 11: /* RTS on */
+		if (!serial || EscapeCommFunction(serial,SETRTS)) {
+			conn->rts=1;
+		}
+		break;
+	case 12: /* RTS off */
+		if (!serial || EscapeCommFunction(serial,CLRRTS)) {
+			conn->rts=0;
+		}
+		break;
+	}
+
+	switch (v) {
+	case 0: case 1: case 2: case 3:
+	case 17: case 19:	/* DCD and DSR flow control are outbound */
+		return 1;	/* outbound flow control: none */
+	case 4: case 5: case 6:
+		return conn->brk ? 5 : 6;
+	case 7: case 8: case 9:
+		return conn->dtr ? 8 : 9;
+	case 10: case 11: case 12:
+		return conn->rts ? 11 : 12;
+	case 13: case 14: case 15: case 16:
+	case 18:		/* DTR flow control is inbound */
+		return 14;	/* inbound flow control: none */
+	default:
+		return -1;
+	}
+}
+
+/* a line setting from the client, for the session and any open port */
+void comport_change_line(struct connection *conn, const struct line *l) {
+	struct line_change r;
+
+	if (session_change_line(conn,l,&r)) {
+		dprintf(1,"wconsd[%i]: RFC 2217 line change failed\n",conn->id);
+	}
+}
+
+void comport_option(struct connection *conn, const unsigned char *sb, int len) {
+	struct line l = *session_line(conn);
+	unsigned char v = len>1 ? sb[1] : 0;
+	unsigned char reply[4];
+	char signature[SB_MAX];
+	DWORD speed;
+	int n;
+
+	if (len<1) {
+		return;
+	}
+	switch (sb[0]) {
+	case COMPORT_SIGNATURE:
+		if (len>1) {
+			dprintf(1,"wconsd[%i]: RFC 2217 client is %.*s\n",conn->id,len-1,sb+1);
+			break;
+		}
+		/* an empty one asks for ours */
+		n = snprintf(signature,sizeof(signature),"wconsd %s COM%i",VERSION,conn->want_port);
+		comport_send(conn,COMPORT_SIGNATURE,signature,n);
+		break;
+
+	case COMPORT_SET_BAUDRATE:
+		if (len<5) {
+			break;
+		}
+		speed = (DWORD)sb[1]<<24 | sb[2]<<16 | sb[3]<<8 | sb[4];
+		/* zero asks what it is */
+		if (speed && autobaud_valid(speed)) {
+			l.speed=speed;
+			l.autobaud=0;
+			comport_change_line(conn,&l);
+		}
+		speed = session_line(conn)->speed;
+		reply[0]=speed>>24;
+		reply[1]=speed>>16;
+		reply[2]=speed>>8;
+		reply[3]=speed;
+		comport_send(conn,COMPORT_SET_BAUDRATE,reply,4);
+		break;
+
+	case COMPORT_SET_DATASIZE:
+		if (v>=5 && v<=8) {
+			l.data=v;
+			comport_change_line(conn,&l);
+		}
+		comport_send_byte(conn,COMPORT_SET_DATASIZE,session_line(conn)->data);
+		break;
+
+	case COMPORT_SET_PARITY:
+		/* RFC 2217 counts from NONE=1, windows from NOPARITY=0 */
+		if (v>=1 && v<=SPACEPARITY+1) {
+			l.parity=v-1;
+			comport_change_line(conn,&l);
+		}
+		comport_send_byte(conn,COMPORT_SET_PARITY,session_line(conn)->parity+1);
+		break;
+
+	case COMPORT_SET_STOPSIZE:
+		if (v>=1 && v<=3) {
+			l.stop = v==1 ? ONESTOPBIT : v==2 ? TWOSTOPBITS : ONE5STOPBITS;
+			comport_change_line(conn,&l);
+		}
+		switch (session_line(conn)->stop) {
+		case ONESTOPBIT:	v=1; break;
+		case TWOSTOPBITS:	v=2; break;
+		default:		v=3; break;
+		}
+		comport_send_byte(conn,COMPORT_SET_STOPSIZE,v);
+		break;
+
+	case COMPORT_SET_CONTROL:
+		if ((n = comport_control(conn,v))!=-1) {
+			comport_send_byte(conn,COMPORT_SET_CONTROL,n);
+		}
+		break;
+
+	case COMPORT_SET_LINESTATE_MASK:
+		conn->line_mask=v;
+		comport_send_byte(conn,COMPORT_SET_LINESTATE_MASK,v);
+		break;
+
+	case COMPORT_SET_MODEMSTATE_MASK:
+		conn->modem_mask=v;
+		comport_send_byte(conn,COMPORT_SET_MODEMSTATE_MASK,v);
+		break;
+
+	case COMPORT_PURGE_DATA:
+		/* 1 is the receive buffer, 2 the transmit one, 3 both */
+		if (conn->serialconnected && !spectating(conn) && v>=1 && v<=3) {
+			PurgeComm(conn->serial,((v&1)?PURGE_RXCLEAR:0)|((v&2)?PURGE_TXCLEAR:0));
+		}
+		comport_send_byte(conn,COMPORT_PURGE_DATA,v);
+		break;
+
+	case COMPORT_FLOWCONTROL_SUSPEND:
+	case COMPORT_FLOWCONTROL_RESUME:
+		/* the port output already waits for the client's TCP window */
+		dprintf(2,"wconsd[%i]: RFC 2217 flow control %i ignored\n",conn->id,sb[0]);
+		break;
+
+	default:
+		dprintf(1,"wconsd[%i]: RFC 2217 command %i ignored\n",conn->id,sb[0]);
+	}
+}
+
+/* tell the client the modem lines, with the delta bits for what changed */
+void comport_modemstate(struct connection *conn, DWORD last, DWORD now) {
+	DWORD changed = last ^ now;
+	unsigned char state = now & 0xf0;	/* the MS_ bits are RFC 2217's */
+
+	if (changed & MS_CTS_ON) {
+		state |= 0x01;
+	}
+	if (changed & MS_DSR_ON) {
+		state |= 0x02;
+	}
+	if ((changed & MS_RING_ON) && !(now & MS_RING_ON)) {
+		state |= 0x04;	/* the trailing edge of a ring */
+	}
+	if (changed & MS_RLSD_ON) {
+		state |= 0x08;
+	}
+	state &= conn->modem_mask;
+	if (state) {
+		comport_send_byte(conn,COMPORT_NOTIFY_MODEMSTATE,state);
+	}
+}
+
+/* tell the client of any line errors */
+void comport_linestate(struct connection *conn) {
+	unsigned char state = 0;
+	DWORD errors;
+	COMSTAT cs;
+
+	if (!ClearCommError(conn->serial,&errors,&cs)) {
+		return;
+	}
+	if (errors & CE_BREAK) {
+		state |= 0x10;
+	}
+	if (errors & CE_FRAME) {
+		state |= 0x08;
+	}
+	if (errors & CE_RXPARITY) {
+		state |= 0x04;
+	}
+	if (errors & (CE_OVERRUN|CE_RXOVER)) {
+		state |= 0x02;
+	}
+	state &= conn->line_mask;
+	if (state) {
+		comport_send_byte(conn,COMPORT_NOTIFY_LINESTATE,state);
+	}
+}
+
+/*
+ * Report modem and line state changes to an RFC 2217 client while the
+ * port is open.  The port tells us of them with WaitCommEvent, so
+ * nothing is polled.
+ */
+DWORD WINAPI wconsd_modem_events(LPVOID lpParam) {
+	struct connection *conn = (struct connection*)lpParam;
+	HANDLE serial = conn->serial;
+	OVERLAPPED o={0};
+	DWORD events;
+	DWORD last = 0;
+	DWORD status;
+	DWORD size;
+
+	dprintf(1,"wconsd[%i]: debug: start wconsd_modem_events\n",conn->id);
+
+	o.hEvent=CreateEvent(NULL,TRUE,FALSE,NULL);
+	SetCommMask(serial,EV_CTS|EV_DSR|EV_RLSD|EV_RING|EV_BREAK|EV_ERR);
+
+	/* where the lines are to start with */
+	if (GetCommModemStatus(serial,&last)) {
+		comport_modemstate(conn,last,last);
+	}
+
+	while (conn->serialconnected && conn->option_comport) {
+		if (!WaitCommEvent(serial,&events,&o)) {
+			if (GetLastError()!=ERROR_IO_PENDING ||
+			    !GetOverlappedResult(serial,&o,&size,TRUE)) {
+				dprintf(1,"wconsd[%i]: modem events stopped, error %d\n",
+					conn->id,GetLastError());
+				break;
+			}
+		}
+		if (!conn->serialconnected || !conn->option_comport) {
+			break;
+		}
+		if (events & (EV_BREAK|EV_ERR)) {
+			comport_linestate(conn);
+		}
+		if ((events & (EV_CTS|EV_DSR|EV_RLSD|EV_RING)) &&
+		    GetCommModemStatus(serial,&status)) {
+			comport_modemstate(conn,last,status);
+			last=status;
+		}
+	}
 
-	host_entry=gethostbyname((char *)hostname);
-	if (host_entry->h_addrtype==AF_INET) {
-		dprintf(1,"wconsd: IP Address is %s\n",inet_ntoa (*(struct in_addr *)*host_entry->h_addr_list));
-		/* FIXME - enumerate all the IP addresses from the list */
-	} else {
-		host_entry=0;
-		return 0;
+	CloseHandle(o.hEvent);
+	dprintf(1,"wconsd[%i]: debug: finish wconsd_modem_events\n",conn->id);
+	return 0;
+}
+
+/* once the client has agreed and the port is open, start reporting */
+void comport_start(struct connection *conn) {
+	/* a spectator leaves the port's events to the writer */
+	if (conn->option_comport && conn->serialconnected && !spectating(conn) &&
+	    conn->modemThread==NULL) {
+		conn->modemThread=CreateThread(NULL,0,wconsd_modem_events,conn,0,NULL);
 	}
+}
 
-	/* Create a socket to listen for connections. */
-	memset(&sin,0,sizeof(sin));
-	sin.sin_family=AF_INET;
-	sin.sin_port=htons(default_tcpport);
-	ls=socket(AF_INET,SOCK_STREAM,0);
 /*
- FIXME:
-you can open sockets on Windows so that they support read/write. Just create it with
-
-  fh = WSASocket (domain, type, protocol, NULL, 0, 0);
+ * Resuming: the com_to_net thread owns the cursor, so requests are left
+ * for it and it answers them in their place in the output.
+ */
+void resume_send(struct connection *conn, int cmd, uint64_t a, uint64_t b, int nr) {
+	unsigned char buf[3+2*2*8+3];
+	uint64_t v[2] = { a, b };
+	int n = 0;
+	int i, j;
+	int bytes;
 
+	buf[n++]=TELNET_OPTION_IAC;
+	buf[n++]=TELNET_OPTION_SB;
+	buf[n++]=TELNET_OPTION_RESUME;
+	buf[n++]=cmd;
+	for (i=0;i<nr;i++) {
+		for (j=56;j>=0;j-=8) {
+			buf[n]=v[i]>>j;
+			if (buf[n++]==TELNET_OPTION_IAC) {
+				buf[n++]=TELNET_OPTION_IAC;
+			}
+		}
+	}
+	buf[n++]=TELNET_OPTION_IAC;
+	buf[n++]=TELNET_OPTION_SE;
 
-instead of socket.
-(see http://lists.gnu.org/archive/html/qemu-devel/2010-01/msg00383.html)
-*/
-	if (ls==INVALID_SOCKET) {
-		return 9;
+	bytes = net_send(conn,buf,n,1);
+	if (bytes!=-1) {
+		conn->net_bytes_tx += bytes;
 	}
-#ifndef MS_WINDOWS
-	{
-	int one=1;
-	setsockopt(ls,SOL_SOCKET,SO_REUSEADDR,(void*)&one,sizeof(one));
+}
+
+/* tell the client that the bytes from..to are not coming */
+void resume_gap(struct connection *conn, uint64_t from, uint64_t to) {
+	dprintf(1,"wconsd[%i]: COM%i output %.0f to %.0f lost\n",conn->id,conn->port,
+		(double)from,(double)to);
+	if (conn->option_resume) {
+		resume_send(conn,RESUME_GAP,from,to,2);
+	} else if (!conn->option_binary && !conn->option_raw) {
+		netprintf(conn,"\r\n[wconsd: %.0f bytes lost]\r\n",(double)(to-from));
 	}
-#endif
-	if (bind(ls,(struct sockaddr *)&sin,sizeof(sin))==SOCKET_ERROR) {
-		dprintf(1,"wconsd: wconsd_init: failed to bind socket\n");
-		return 10;
+}
+
+/* leave a request for the com_to_net thread, a seek replacing an ask */
+void resume_request(struct connection *conn, LONG op, uint64_t from) {
+	if (op==RESUME_SEEK) {
+		InterlockedExchange64(&conn->resume_from,from);
+		InterlockedExchange(&conn->resume_op,op);
+	} else {
+		InterlockedCompareExchange(&conn->resume_op,op,0);
 	}
-	if (listen(ls,1)==SOCKET_ERROR) {
-		return 11;
+	if (conn->cursor.event) {
+		SetEvent(conn->cursor.event);
 	}
-	dprintf(1,"wconsd: listening on port %i\n",default_tcpport);
+}
 
+/* an offset from the client, or a request for ours */
+void resume_option(struct connection *conn, const unsigned char *sb, int len) {
+	uint64_t seq = 0;
+	int i;
 
-	/* Mark the socket as non-blocking */
-	if (WSAEventSelect(ls,listenSocketEvent,FD_ACCEPT)==SOCKET_ERROR) {
-		return 12;
+	if (len==1 && sb[0]==RESUME_SEQ) {
+		resume_request(conn,RESUME_ASK,0);
+	} else if (len==9 && sb[0]==RESUME_FROM) {
+		for (i=1;i<9;i++) {
+			seq = seq<<8 | sb[i];
+		}
+		resume_request(conn,RESUME_SEEK,seq);
+	} else {
+		dprintf(1,"wconsd[%i]: RESUME %i, %i bytes ignored\n",conn->id,len?sb[0]:-1,len);
 	}
+}
 
-	cli_set_banner(cli, "wconsd serial to telnet");
-	cli_set_hostname(cli, (char *)hostname);
-	cli_set_idle_timeout(cli, 60);
-	cli_register_command(cli, NULL, "test", libcli_test, PRIVILEGE_UNPRIVILEGED,
-		MODE_EXEC, NULL);
-#if 0
-	cli_set_auth_callback(cli, check_auth);
-	cli_set_enable_callback(cli, check_enable);
-#endif
+/* do what resume_option left for us, on the com_to_net thread */
+void resume_apply(struct connection *conn) {
+	uint64_t from;
+
+	switch (InterlockedExchange(&conn->resume_op,0)) {
+	case RESUME_SEEK:
+		/* a 64 bit read, which a second SEEK could tear on x86 */
+		from = InterlockedExchangeAdd64(&conn->resume_from,0);
+		port_seek(&conn->cursor,from);
+		if (conn->cursor.pos>from) {
+			resume_gap(conn,from,conn->cursor.pos);
+		}
+		/* fall through */
+	case RESUME_ASK:
+		if (conn->option_resume) {
+			resume_send(conn,RESUME_SEQ,conn->cursor.pos,0,1);
+		}
+		break;
+	}
+}
 
-	return 0;
+/* a complete IAC SB option ... IAC SE */
+void process_subnegotiation(struct connection *conn, int option, const unsigned char *sb, int len) {
+	switch (option) {
+	case 5:	/* STATUS */
+		if (len<1 || sb[0]!=1) {
+			dprintf(1,"wconsd[%i]: option IAC SB 5 %i\n",conn->id,len?sb[0]:-1);
+			break;
+		}
+		/* SEND */
+		dprintf(1,"wconsd[%i]: option IAC SB 5 SEND\n",conn->id);
+		/* FIXME - add option_binary */
+		netprintf(conn,"%s%c%s%s%s",
+			"\xff\xfa\x05",
+			0,
+			"\xfb\x05",
+			conn->option_echo?"\xfb\x01":"",
+			"\xff\xf0");
+		break;
+	case TELNET_OPTION_COMPORT:
+		if (conn->option_comport) {
+			comport_option(conn,sb,len);
+		}
+		break;
+	case TELNET_OPTION_RESUME:
+		if (conn->option_resume) {
+			resume_option(conn,sb,len);
+		}
+		break;
+	default:
+		dprintf(1,"wconsd[%i]: option IAC SB %i, %i bytes ignored\n",conn->id,option,len);
+	}
+}
+
+/* the parameters of a subnegotiation, too many marks it as too long */
+void sb_add(struct connection *conn, unsigned char ch) {
+	if (conn->sb_len<SB_MAX) {
+		conn->sb[conn->sb_len++]=ch;
+	} else {
+		conn->sb_len=SB_MAX+1;
+	}
 }
 
 /*
@@ -655,7 +2198,7 @@ unsigned char  process_telnet_option(struct connection*conn, unsigned char ch) {
 					return 0; /* dont echo */
 
 				case 0xf3:	/* Break */
-					if (conn->serialconnected) {
+					if (conn->serialconnected && !spectating(conn)) {
 						dprintf(2,"wconsd[%i]: send break\n",conn->id);
 						Sleep(1000);
 						SetCommBreak(conn->serial);
@@ -681,6 +2224,7 @@ unsigned char  process_telnet_option(struct connection*conn, unsigned char ch) {
 				case TELNET_OPTION_WONT:
 				case TELNET_OPTION_DO:
 				case TELNET_OPTION_DONT:
+					conn->telnet_peer=1;
 					conn->telnet_option=ch;
 					return 0; /* dont echo */
 
@@ -697,14 +2241,73 @@ unsigned char  process_telnet_option(struct connection*conn, unsigned char ch) {
 		case TELNET_OPTION_SB:	/* received IAC SB 	0xfa */
 			conn->telnet_option=TELNET_OPTION_SBXX;
 			conn->telnet_option_param=ch;
+			conn->sb_len=0;
+			return 0; /* dont echo */
+
+		case TELNET_OPTION_SBXX: /* inside IAC SB xx ... IAC SE */
+			if (ch==TELNET_OPTION_IAC) {
+				conn->telnet_option=TELNET_OPTION_SBIAC;
+			} else {
+				sb_add(conn,ch);
+			}
 			return 0; /* dont echo */
 
+		case TELNET_OPTION_SBIAC:
+			if (ch==TELNET_OPTION_IAC) {
+				/* an escaped 0xff in the parameters */
+				sb_add(conn,ch);
+				conn->telnet_option=TELNET_OPTION_SBXX;
+				return 0; /* dont echo */
+			}
+			if (ch==TELNET_OPTION_SE) {
+				conn->telnet_option=0;
+				if (conn->sb_len>SB_MAX) {
+					dprintf(1,"wconsd[%i]: option IAC SB %i too long, ignored\n",
+						conn->id,conn->telnet_option_param);
+				} else {
+					process_subnegotiation(conn,conn->telnet_option_param,
+						conn->sb,conn->sb_len);
+				}
+				return 0; /* dont echo */
+			}
+			/* the peer broke off the subnegotiation for another command */
+			dprintf(1,"wconsd[%i]: option IAC SB %i ended by IAC %i\n",
+				conn->id,conn->telnet_option_param,ch);
+			conn->telnet_option=TELNET_OPTION_IAC;
+			return process_telnet_option(conn,ch);
+
 		case TELNET_OPTION_WILL: /* received IAC WILL 	0xfb */
+			if (ch==TELNET_OPTION_COMPORT) {
+				dprintf(2,"wconsd[%i]: WILL COM-PORT-OPTION\n",conn->id);
+				if (!conn->option_comport) {
+					netprintf(conn,"\xff\xfd\x2c"); /* IAC DO */
+					conn->option_comport=1;
+					/* it wants the port, not the menu */
+					conn->comport_pending=conn->option_runmenu;
+					comport_start(conn);
+				}
+				conn->telnet_option=0;
+				return 0; /* dont echo */
+			}
+			/* a WILL TIMING-MARK is the answer to our liveness probe */
 			dprintf(2,"wconsd[%i]: option IAC WILL %i\n",conn->id,ch);
 			conn->telnet_option=0;
 			return 0; /* dont echo */
 		case TELNET_OPTION_WONT: /* received IAC WONT 	0xfc */
-			dprintf(1,"wconsd[%i]: option IAC WONT %i\n",conn->id,ch);
+			if (ch==0x06) {
+				/* TIMING-MARK probe answered by a minimal client */
+				dprintf(2,"wconsd[%i]: option IAC WONT TIMING-MARK\n",conn->id);
+			} else if (ch==TELNET_OPTION_COMPORT) {
+				dprintf(2,"wconsd[%i]: WONT COM-PORT-OPTION\n",conn->id);
+				if (conn->option_comport) {
+					netprintf(conn,"\xff\xfe\x2c"); /* IAC DONT */
+				}
+				/* the modem thread sees this and stops */
+				conn->option_comport=0;
+				conn->comport_pending=0;
+			} else {
+				dprintf(1,"wconsd[%i]: option IAC WONT %i\n",conn->id,ch);
+			}
 			conn->telnet_option=0;
 			return 0; /* dont echo */
 		case TELNET_OPTION_DO: /* received IAC DO 	0xfd */
@@ -716,6 +2319,22 @@ unsigned char  process_telnet_option(struct connection*conn, unsigned char ch) {
 					dprintf(2,"wconsd[%i]: DO ECHO\n",conn->id);
 					conn->option_echo=1;
 					break;
+				case TELNET_OPTION_COMPRESS2:
+					if (mccp_enabled) {
+						dprintf(2,"wconsd[%i]: DO COMPRESS2\n",conn->id);
+						net_start_compress(conn);
+					} else {
+						netprintf(conn,"\xff\xfc\x56"); /* IAC WONT */
+					}
+					break;
+				case TELNET_OPTION_RESUME:
+					dprintf(2,"wconsd[%i]: DO RESUME\n",conn->id);
+					if (!conn->option_resume) {
+						netprintf(conn,"\xff\xfb\xc8"); /* IAC WILL */
+						conn->option_resume=1;
+						resume_request(conn,RESUME_ASK,0);
+					}
+					break;
 				default:
 					dprintf(2,"wconsd[%i]: option IAC DO %i\n",conn->id,ch);
 					break;
@@ -731,6 +2350,17 @@ unsigned char  process_telnet_option(struct connection*conn, unsigned char ch) {
 					dprintf(1,"wconsd[%i]: DONT ECHO\n",conn->id);
 					conn->option_echo=0;
 					break;
+				case TELNET_OPTION_COMPRESS2:
+					dprintf(2,"wconsd[%i]: DONT COMPRESS2\n",conn->id);
+					net_stop_compress(conn);
+					break;
+				case TELNET_OPTION_RESUME:
+					dprintf(2,"wconsd[%i]: DONT RESUME\n",conn->id);
+					if (conn->option_resume) {
+						netprintf(conn,"\xff\xfc\xc8"); /* IAC WONT */
+					}
+					conn->option_resume=0;
+					break;
 				default:
 					dprintf(2,"wconsd[%i]: option IAC DONT %i\n",conn->id,ch);
 					break;
@@ -739,49 +2369,6 @@ unsigned char  process_telnet_option(struct connection*conn, unsigned char ch) {
 			return 0; /* dont echo */
 
 		default:
-			if (conn->telnet_option==TELNET_OPTION_SBXX) {
-				/* received IAC SB x */
-				int option = conn->telnet_option_param;
-
-				if (ch==0) {
-					/* IS */
-					dprintf(1,"wconsd[%i]: option IAC SB %i IS\n",
-						conn->id,option);
-					/*
-					 * TODO - stay in telnet option mode while
-					 * absorbing the IS buffer
-					 */
-					conn->telnet_option=0;
-					return 0; /* dont echo */
-				} else if (ch>1) {
-					/* error ? */
-					dprintf(1,"wconsd[%i]: option IAC SB %i %i\n",
-						conn->id,option,ch);
-					conn->telnet_option=0;
-					return 0; /* dont echo */
-				}
-
-				/* SEND */
-				if (option == 5) {
-					dprintf(1,"wconsd[%i]: option IAC SB 5 SEND\n",conn->id);
-					/* FIXME - add option_binary */
-					netprintf(conn,"%s%c%s%s%s",
-						"\xff\xfa\x05",
-						0,
-						"\xfb\x05",
-						conn->option_echo?"\xfb\x01":"",
-						"\xff\xf0");
-					conn->telnet_option=0;
-					return 0; /* dont echo */
-				} else {
-					/* error ? */
-					dprintf(1,"wconsd[%i]: option IAC SB %i %i\n",
-						conn->id,option,ch);
-					conn->telnet_option=0;
-					return 0; /* dont echo */
-				}
-			}
-
 			dprintf(1,"wconsd[%i]: invalid conn->telnet_option==%i \n",conn->id,conn->telnet_option);
 
 	}
@@ -794,22 +2381,17 @@ unsigned char  process_telnet_option(struct connection*conn, unsigned char ch) {
  * Wrap up all the crazy file writing process in a function
  */
 int serial_writefile(struct connection *conn,OVERLAPPED *o,unsigned char *buf,int size) {
-	DWORD wsize;
+	int wsize;
 
 	if (!conn->serialconnected) {
 		dprintf(1,"wconsd[%i]: serial_writefile but serial closed\n",conn->id);
 		return 0;
 	}
 
-	if (!WriteFile(conn->serial,buf,size,&wsize,o)) {
-		if (GetLastError()==ERROR_IO_PENDING) {
-			// Wait for it...
-			if (!GetOverlappedResult(conn->serial,o,&wsize,TRUE)) {
-				dprintf(1,"wconsd[%i]: Error %d (overlapped) writing to COM port\n",conn->id,GetLastError());
-			}
-		} else {
-			dprintf(1,"wconsd[%i]: Error %d writing to COM port\n",conn->id,GetLastError());
-		}
+	/* refused if the writer's role has been taken away */
+	if ((wsize = port_write(&conn->cursor,o,buf,size))<0) {
+		dprintf(1,"wconsd[%i]: no longer writing to COM%i\n",conn->id,conn->port);
+		return 0;
 	}
 	if (wsize!=size) {
 		dprintf(1,"wconsd[%i]: Eeek! WriteFile: wrote %d of %d\n",conn->id,wsize,size);
@@ -817,6 +2399,46 @@ int serial_writefile(struct connection *conn,OVERLAPPED *o,unsigned char *buf,in
 	return wsize;
 }
 
+/*
+ * Write what the client typed to the session's port, or ports.  Called
+ * with io_lock held, so that a kill from another connection cannot
+ * close the port or free the group under the write.
+ */
+static void session_write(struct connection *conn, OVERLAPPED *o, unsigned char *buf, DWORD size) {
+	if (conn->group) {
+		group_write(conn->group,buf,size);
+		return;
+	}
+
+	if (!conn->serialconnected) {
+		dprintf(1,"wconsd[%i]: data to send, but serial closed\n",conn->id);
+		return;
+	}
+
+	if (conn->cursor.watching) {
+		/* only for the notice, port_write is what enforces the role */
+		if (!conn->told_spectator) {
+			netprintf(conn,"\r\n[wconsd: spectating COM%i, 'steal' at the menu to type]\r\n",
+				conn->port);
+			conn->told_spectator = 1;
+		}
+		return;
+	}
+
+	capture_data(conn->port,conn->id,CAPTURE_DIR_TX,buf,size);
+
+	if (conn->pacer) {
+		pace_write(conn->pacer,buf,size);
+		return;
+	}
+
+	/*
+	 * we could check the return value to see if there was a
+	 * short write, but what would our options be?
+	 */
+	serial_writefile(conn,o,buf,size);
+}
+
 DWORD WINAPI wconsd_net_to_com(LPVOID lpParam)
 {
 	struct connection * conn = (struct connection*)lpParam;
@@ -832,7 +2454,7 @@ DWORD WINAPI wconsd_net_to_com(LPVOID lpParam)
 	dprintf(1,"wconsd[%i]: debug: start wconsd_net_to_com\n",conn->id);
 
 	o.hEvent = writeEvent;
-	while (conn->serialconnected) {
+	while (conn->serialconnected || conn->group) {
 		/* There's a bug in some versions of Windows which leads
 		 * to recv() returning -1 and indicating error WSAEWOULDBLOCK,
 		 * even on a blocking socket. This select() is here to work
@@ -841,6 +2463,7 @@ DWORD WINAPI wconsd_net_to_com(LPVOID lpParam)
 		 * These sockets are non-blocking, so I am unsure that the
 		 * above statement is still true
 		 */
+		FD_ZERO(&s);
 		FD_SET(conn->net,&s);
 		tv.tv_sec = 2;
 		tv.tv_usec = 0;
@@ -848,8 +2471,7 @@ DWORD WINAPI wconsd_net_to_com(LPVOID lpParam)
 		/* TODO - examine the retval for the select */
 		size=recv(conn->net,(void*)&buf,BUFSIZE,0);
 		if (size==0) {
-			closesocket(conn->net);
-			conn->net=INVALID_SOCKET;
+			net_close(conn);
 			dprintf(1,"wconsd[%i]: wconsd_net_to_com size==0\n",conn->id);
 			return 0;
 		}
@@ -861,10 +2483,18 @@ DWORD WINAPI wconsd_net_to_com(LPVOID lpParam)
 					if (conn->option_keepalive) {
 						netprintf(conn,"\xff\xf1");
 					}
+					/* before the probe, which waits behind a stuck send */
+					if (client_check(conn) || check_peer_alive(conn)) {
+						return 0;
+					}
 					continue;
+				case WSAETIMEDOUT:
+				case WSAECONNABORTED:
+					/* the TCP keepalives gave up */
+					peer_dead(conn);
+					return 0;
 				case WSAECONNRESET:
-					closesocket(conn->net);
-					conn->net=INVALID_SOCKET;
+					net_close(conn);
 					return 0;
 				default:
 					dprintf(1,"wconsd[%i]: net_to_com socket error (%i)\n",conn->id,err);
@@ -873,7 +2503,7 @@ DWORD WINAPI wconsd_net_to_com(LPVOID lpParam)
 			}
 			continue;
 		}
-		conn->net_bytes_rx+=size;
+		peer_heard(conn,size);
 
 		/*
 		 * Scan for telnet options and process then remove them
@@ -884,7 +2514,7 @@ DWORD WINAPI wconsd_net_to_com(LPVOID lpParam)
 		 * the semantics of processing at the wrong point
 		 */
 		pbuf=buf;
-		bytes_to_scan=size;
+		bytes_to_scan=conn->option_raw?0:size;
 		while(bytes_to_scan--) {
 			/* TODO - use ->telnet_option || 0xff to chose to call process_telnet_option */
 			if(!process_telnet_option(conn,*pbuf)) {
@@ -900,18 +2530,20 @@ DWORD WINAPI wconsd_net_to_com(LPVOID lpParam)
 		 * Scan for CR NUL sequences and uncook them
 		 * it also appears that I need to uncook CR LF sequences
 		 */
-		if (!conn->option_binary) {
+		if (!conn->option_binary && !conn->option_raw) {
 			pbuf=buf;
-			bytes_to_scan=size;
-			while ((pbuf=memchr(pbuf,0x0d,bytes_to_scan))!=NULL) {
+			while ((pbuf=memchr(pbuf,0x0d,size-(pbuf-buf)))!=NULL) {
 				pbuf++;
+				if (pbuf==buf+size) {
+					/* the CR ended the read */
+					break;
+				}
 				if (*pbuf!=0x00&&*pbuf!=0x0a) {
 					continue;
 				}
 
-				bytes_to_scan = size-(pbuf-buf)+1;
 				size -= 1;
-				memmove(pbuf,pbuf+1,bytes_to_scan);
+				memmove(pbuf,pbuf+1,size-(pbuf-buf));
 			}
 			/* TODO - emulate cisco's ctrl-^,x sequence for exit to menu */
 		}
@@ -925,79 +2557,356 @@ DWORD WINAPI wconsd_net_to_com(LPVOID lpParam)
 			return 0;
 		}
 
-		if (!conn->serialconnected) {
-			dprintf(1,"wconsd[%i]: data to send, but serial closed\n",conn->id);
-			continue;
-		}
+		EnterCriticalSection(&conn->io_lock);
+		session_write(conn,&o,buf,size);
+		LeaveCriticalSection(&conn->io_lock);
+	}
+	dprintf(1,"wconsd[%i]: debug: finish wconsd_net_to_com\n",conn->id);
+	return 0;
+}
+
+DWORD WINAPI wconsd_com_to_net(LPVOID lpParam)
+{
+	struct connection * conn = (struct connection*)lpParam;
+	unsigned char buf[BUFSIZE];
+	uint64_t pos;
+	DWORD size;
+	int sent;
+
+	dprintf(1,"wconsd[%i]: debug: start wconsd_com_to_net\n",conn->id);
+
+	/* where the output starts, for a client that is counting */
+	resume_request(conn,RESUME_ASK,0);
+
+	while (conn->serialconnected) {
+		/* the port's reader sets this when it has more */
+		WaitForSingleObject(conn->cursor.event,1000);
+
+		sent=0;
+		resume_apply(conn);
+		pos=conn->cursor.pos;
+		while (conn->serialconnected) {
+			client_trim(conn);
+			if (!(size=port_read(&conn->cursor,buf,BUFSIZE))) {
+				conn->caught_up = GetTickCount();
+				break;
+			}
+			if (conn->cursor.pos-size != pos) {
+				/* the reader lapped us, or we were too far behind */
+				resume_gap(conn,pos,conn->cursor.pos-size);
+			}
+			pos=conn->cursor.pos;
+
+			if (conn->pacer) {
+				pace_echo(conn->pacer,buf,size);
+			}
+
+			EnterCriticalSection(&conn->xfer_lock);
+			if (conn->xfer) {
+				/* the receiver's handshaking is not for the client */
+				xfer_rx(conn->xfer,buf,size);
+				LeaveCriticalSection(&conn->xfer_lock);
+				continue;
+			}
+			LeaveCriticalSection(&conn->xfer_lock);
 
+			if (net_send(conn,buf,size,0)==-1) {
+				dprintf(1,"wconsd[%i]: wconsd_com_to_net send failed\n",conn->id);
+				return 0;
+			}
+			conn->net_bytes_tx+=size;
+			sent=1;
+		}
 		/*
-		 * we could check the return value to see if there was a
-		 * short write, but what would our options be?
+		 * Having caught up is when the line has gone idle, which is
+		 * when any held back compressed output gets flushed.
 		 */
-		serial_writefile(conn,&o,buf,size);
+		if (sent) {
+			net_send(conn,NULL,0,1);
+		}
+		if (!port_alive(&conn->cursor)) {
+			dprintf(1,"wconsd[%i]: COM%i has stopped being read\n",conn->id,conn->port);
+			conn->serialconnected=0;
+		}
+	}
+	dprintf(1,"wconsd[%i]: debug: finish wconsd_com_to_net\n",conn->id);
+	return 0;
+}
+
+/* the lines the ports in the session's group print */
+DWORD WINAPI wconsd_group_to_net(LPVOID lpParam)
+{
+	struct connection * conn = (struct connection*)lpParam;
+	unsigned char buf[8*BUFSIZE];
+	int size;
+
+	dprintf(1,"wconsd[%i]: debug: start wconsd_group_to_net\n",conn->id);
+	while ((size=group_read(conn->group,buf,sizeof(buf)))>0) {
+		if (net_send(conn,buf,size,1)==-1) {
+			dprintf(1,"wconsd[%i]: wconsd_group_to_net send failed\n",conn->id);
+			break;
+		}
+		conn->net_bytes_tx+=size;
+	}
+	dprintf(1,"wconsd[%i]: debug: finish wconsd_group_to_net\n",conn->id);
+	return 0;
+}
+
+/*
+ * Open the serial port, if needed, and make sure there is a com_to_net
+ * thread reading from it.
+ */
+int start_serial(struct connection *conn) {
+	if (conn->group) {
+		/* it is the group's ports, which are already going */
+		return 0;
+	}
+	if (!conn->serialconnected) {
+		if (conn->cursor.port) {
+			/* still attached to a port that stopped being read */
+			close_serial_connection(conn);
+		}
+		if (open_com_port(conn)) {
+			int id = port_held(conn->want_port);
+
+			if (conn->spectate) {
+				netprintf(conn,"error: COM%i is not open to be watched\r\n\n",
+					conn->want_port);
+				conn->spectate = 0;
+			} else if (id) {
+				netprintf(conn,"error: session %i is held on COM%i, 'attach %i' takes it over\r\n\n",
+					id,conn->want_port,id);
+			} else {
+				netprintf(conn,"error: cannot open port\r\n\n");
+			}
+			return -1;
+		}
+	}
+
+	if (spectating(conn)) {
+		int id = port_writer(conn->port);
+
+		if (id) {
+			netprintf(conn,"spectating COM%i, which session %i is writing to\r\n",
+				conn->port,id);
+		} else {
+			netprintf(conn,"spectating COM%i, which nobody is writing to\r\n",
+				conn->port);
+		}
+	} else if (conn->pacer==NULL) {
+		conn->pacer=pace_new(conn->port,&conn->cursor);
+	}
+	if (conn->serialThread==NULL) {
+		/* we might already have a com_to_net thread */
+		conn->serialThread=CreateThread(NULL,0,wconsd_com_to_net,conn,0,NULL);
+	}
+	comport_start(conn);
+	return 0;
+}
+
+void cmd_open(struct connection *conn) {
+	dprintf(1,"wconsd[%i]: debug: start cmd_open\n",conn->id);
+
+	if (start_serial(conn)) {
+		return;
+	}
+
+	netprintf(conn,"\r\n\n");
+
+	conn->option_runmenu=0;
+	wconsd_net_to_com(conn);
+	conn->option_runmenu=1;
+}
+
+/*
+ * Start a session on a group of ports, or one watching them, then carry
+ * on as cmd_open does.  Ports in the group that cannot be had are left
+ * out.
+ */
+void cmd_group(struct connection *conn, char *name, int watch) {
+	char why[160];
+
+	if (!name) {
+		netprintf(conn,"must specify a group\r\n");
+		return;
+	}
+	if (conn->serialconnected || conn->group) {
+		netprintf(conn,"error: close the port first\r\n");
+		return;
+	}
+	if (conn->cursor.port) {
+		/* still attached to a port that stopped being read */
+		close_serial_connection(conn);
+	}
+	conn->group = group_open(name,conn->id,watch,why,sizeof(why));
+	if (why[0]) {
+		netprintf(conn,"%s: %s\r\n",conn->group?"warning":"error",why);
+	}
+	if (!conn->group) {
+		return;
+	}
+	conn->serialThread=CreateThread(NULL,0,wconsd_group_to_net,conn,0,NULL);
+	cmd_open(conn);
+}
+
+/*
+ * Take over a session held for its client - by connection id, or with
+ * com<n> the one on port n - and carry on from where it left off.
+ */
+void cmd_attach(struct connection *conn, char *which) {
+	const struct line *l;
+	int id = 0, n = 0;
+
+	if (!which) {
+		netprintf(conn,"must specify a session id, or com<n> for a port\r\n");
+		return;
+	}
+	if (conn->serialconnected) {
+		netprintf(conn,"error: close COM%i first\r\n",conn->port);
+		return;
+	}
+	if (!strncmp(which,"com",3)) {
+		n = atoi(which+3);
+	} else {
+		id = atoi(which);
+	}
+	if (conn->cursor.port) {
+		/* still attached to a port that stopped being read */
+		close_serial_connection(conn);
+	}
+	conn->cursor.id = conn->id;
+	if ((n = port_reattach(id,n,&conn->cursor,&l))<0) {
+		netprintf(conn,"error: no session %s is held\r\n",which);
+		return;
 	}
-	dprintf(1,"wconsd[%i]: debug: finish wconsd_net_to_com\n",conn->id);
-	return 0;
+	conn->port = conn->want_port = n;
+	InterlockedExchangePointer((void *volatile *)&conn->line,(void *)l);
+	conn->serial = conn->cursor.serial;
+	conn->serialconnected = 1;
+	dprintf(1,"wconsd[%i]: took over the session held on COM%i\n",conn->id,n);
+	netprintf(conn,"attached to COM%i, %.0f bytes waiting, %.0f lost\r\n",
+		n,(double)port_backlog(&conn->cursor),(double)conn->cursor.lost);
+	cmd_open(conn);
 }
 
-DWORD WINAPI wconsd_com_to_net(LPVOID lpParam)
-{
-	struct connection * conn = (struct connection*)lpParam;
-	unsigned char buf[BUFSIZE];
-	DWORD size;
-	OVERLAPPED o={0};
-
-	o.hEvent=readEvent;
-
-	dprintf(1,"wconsd[%i]: debug: start wconsd_com_to_net\n",conn->id);
+/* find an active connection by its id */
+struct connection *find_connection(int id) {
+	int i;
 
-	while (conn->serialconnected) {
-		if (!ReadFile(conn->serial,buf,BUFSIZE,&size,&o)) {
-			if (GetLastError()==ERROR_IO_PENDING) {
-				// Wait for overlapped operation to complete
-				if (!GetOverlappedResult(conn->serial,&o,&size,TRUE)) {
-					dprintf(1,"wconsd: Error %d (overlapped) reading from COM port\n",GetLastError());
-				}
-			} else {
-				dprintf(1,"wconsd[%i]: Error %d reading from COM port\n",conn->id,GetLastError());
-				conn->serialconnected=0;
-				continue;
-			}
-		}
-		/* We might not have any data if the ReadFile timed out */
-		if (size>0) {
-			if (send(conn->net,(void*)&buf,size,0)==-1) {
-				dprintf(1,"wconsd[%i]: wconsd_com_to_net send failed\n",conn->id);
-				return 0;
-			}
-			conn->net_bytes_tx+=size;
+	for (i=0;i<MAXCONNECTIONS;i++) {
+		if (connection[i].active && connection[i].id==id) {
+			return &connection[i];
 		}
 	}
-	dprintf(1,"wconsd[%i]: debug: finish wconsd_com_to_net\n",conn->id);
-	return 0;
+	return NULL;
 }
 
-void cmd_open(struct connection *conn) {
-	dprintf(1,"wconsd[%i]: debug: start cmd_open\n",conn->id);
+/* a spectator takes over writing to the port */
+void cmd_steal(struct connection *conn) {
+	struct connection *from;
+	int id;
 
-	if (!conn->serialconnected) {
-		if (open_com_port(conn)) {
-			netprintf(conn,"error: cannot open port\r\n\n");
-			return;
+	if (!spectating(conn)) {
+		netprintf(conn,"error: only a spectator can take over a port\r\n");
+		return;
+	}
+	if ((id = port_take(&conn->cursor))<0) {
+		netprintf(conn,"error: COM%i is held for session %i, 'attach %i' takes it over\r\n",
+			conn->port,port_held(conn->port),port_held(conn->port));
+		return;
+	}
+	if (id && (from = find_connection(id))) {
+		/* nothing it had queued goes out after us */
+		EnterCriticalSection(&from->pacer_lock);
+		if (from->pacer) {
+			pace_purge(from->pacer);
 		}
+		LeaveCriticalSection(&from->pacer_lock);
+		netnotice(from,"\r\n[wconsd: session %i has taken over writing to COM%i]\r\n",
+			conn->id,conn->port);
 	}
+	dprintf(1,"wconsd[%i]: took COM%i from session %i\n",conn->id,conn->port,id);
+	netprintf(conn,"writing to COM%i\r\n",conn->port);
+	cmd_open(conn);
+}
 
-	netprintf(conn,"\r\n\n");
+/* the writer lets a spectator on the same port have it */
+void cmd_handoff(struct connection *conn, char *which) {
+	struct connection *to;
 
-	PurgeComm(conn->serial,PURGE_RXCLEAR|PURGE_RXABORT);
-	if (conn->serialThread==NULL) {
-		/* we might already have a com_to_net thread */
-		conn->serialThread=CreateThread(NULL,0,wconsd_com_to_net,conn,0,NULL);
+	if (!which) {
+		netprintf(conn,"must specify a connection id\r\n");
+		return;
 	}
+	if (!conn->serialconnected || spectating(conn)) {
+		netprintf(conn,"error: only the writer can hand a port over\r\n");
+		return;
+	}
+	to = find_connection(atoi(which));
+	if (!to || !spectating(to) || to->port!=conn->port ||
+	    port_handoff(&conn->cursor,&to->cursor)) {
+		netprintf(conn,"error: session %s is not spectating COM%i\r\n",which,conn->port);
+		return;
+	}
+	if (conn->pacer) {
+		pace_purge(conn->pacer);
+	}
+	conn->told_spectator = 0;
+	to->told_spectator = 0;
+	dprintf(1,"wconsd[%i]: handed COM%i to session %i\n",conn->id,conn->port,to->id);
+	netnotice(to,"\r\n[wconsd: session %i has handed COM%i to you]\r\n",conn->id,conn->port);
+	netprintf(conn,"session %i is now writing to COM%i, you are spectating\r\n",
+		to->id,conn->port);
+}
 
-	conn->option_runmenu=0;
-	wconsd_net_to_com(conn);
-	conn->option_runmenu=1;
+/*
+ * Send a file from the transfer directory to the serial port.  The menu
+ * thread is busy until it is done, and the client does not see what the
+ * device sends in the meantime.
+ */
+void cmd_send(struct connection *conn, char *name, char *protocol) {
+	const struct line *l;
+	struct xfer *xfer;
+	char result[160];
+	int proto;
+	long size;
+	FILE *f;
+
+	if (!name) {
+		netprintf(conn,"must specify a file\r\n\n");
+		return;
+	}
+	if ((proto = xfer_protocol(protocol))==-1) {
+		netprintf(conn,"protocol must be raw, xmodem, ymodem or ymodem-g\r\n\n");
+		return;
+	}
+	if (!(f = xfer_open(name,&size))) {
+		netprintf(conn,"error: cannot open %s\r\n\n",name);
+		return;
+	}
+	if (start_serial(conn) || spectating(conn) || !(xfer = xfer_new())) {
+		fclose(f);
+		return;
+	}
+
+	/* start, data, parity and stop bits, for the line rate */
+	l = session_line(conn);
+	xfer_set_baud(xfer,l->speed,
+		1+l->data+(l->parity!=NOPARITY)+(l->stop==TWOSTOPBITS?2:1));
+
+	netprintf(conn,"sending %s, %li bytes, %s\r\n",
+		name,size,protocol?protocol:"raw");
+	conn->xfer = xfer;
+	xfer_send(xfer,conn->serial,proto,f,name,size,result,sizeof(result));
+
+	/* com_to_net may be handing it what the device said */
+	EnterCriticalSection(&conn->xfer_lock);
+	conn->xfer = NULL;
+	LeaveCriticalSection(&conn->xfer_lock);
+	netprintf(conn,"%s\r\n\n",result);
+
+	fclose(f);
+	xfer_free(xfer);
 }
 
 void send_help(struct connection *conn) {
@@ -1006,10 +2915,15 @@ void send_help(struct connection *conn) {
 		"\r\n"
 		"available commands:\r\n"
 		"\r\n"
+		"attach          - Take over a held session: attach <id>|com<n>\r\n"
+		"autoclose       - Close the port when the client goes: autoclose [false|true]\r\n"
 		"binary          - toggle the binary comms mode\r\n"
 		"close           - Stop serial communications\r\n"
 		"copyright       - Print the copyright notice\r\n"
 		"data            - Set number of data bits\r\n"
+		"detach          - Leave the port open for this session, and quit\r\n"
+		"group           - Type to every port in a group: group <name>\r\n"
+		"handoff         - Let a spectator write to the port: handoff <id>\r\n"
 		"help            - This guff\r\n"
 		"kill_conn       - Stop a given connection's serial communications\r\n"
 		"keepalive       - toggle the generation of keepalive packets\r\n"
@@ -1017,10 +2931,15 @@ void send_help(struct connection *conn) {
 		"parity          - Set the serial parity\r\n"
 		"port            - Set serial port number\r\n"
 		"quit            - exit from this session\r\n"
+		"resume          - Open the port, sending its output from an offset\r\n"
+		"send            - Send a file: send <file> [raw|xmodem|ymodem|ymodem-g]\r\n"
 		"show_conn_table - Show the connections table\r\n"
-		"speed           - Set serial port speed\r\n"
+		"spectate        - Follow an open port without writing to it\r\n"
+		"speed           - Set serial port speed, or auto to detect it\r\n"
 		"status          - Show current serial port status\r\n"
+		"steal           - Take over writing to the port being spectated\r\n"
 		"stop            - Set number of stop bits\r\n"
+		"watch           - Follow the output of open ports: watch all|<group>\r\n"
 		"\r\n"
 		"see http://wob.zot.org/2/wiki/wconsd for more information\r\n"
 		"\r\n");
@@ -1028,20 +2947,39 @@ void send_help(struct connection *conn) {
 
 /* NOTE: this function is replicated in cmd_showport */
 void show_status(struct connection* conn) {
+	const struct line *l = session_line(conn);
+
 	/* print the status to the net connection */
 
 	netprintf(conn, "status:\r\n\n"
-			"  port=%d  speed=%d  data=%d  parity=%d  stop=%d\r\n",
-			com_port, com_speed, com_data, com_parity, com_stop);
-
-	if(conn->serialconnected) {
-		netprintf(conn, "  state=open\r\n\n");
+			"  port=%d  speed=%ld%s  data=%d  parity=%d  stop=%d\r\n",
+			conn->want_port, l->speed, (l->autobaud||autobaud_enabled)?"(auto)":"",
+			l->data, l->parity, l->stop);
+
+	if (conn->group) {
+		char desc[1024];
+
+		group_describe(conn->group,desc,sizeof(desc));
+		netprintf(conn, "  state=group\r\n%s\n",desc);
+	} else if(conn->serialconnected) {
+		netprintf(conn, "  state=open  role=%s  offset=%.0f  lost=%.0f\r\n",
+			spectating(conn)?"spectator":"writer",
+			(double)conn->cursor.pos,(double)conn->cursor.lost);
+		netprintf(conn, "  behind=%.0f  lag=%.0fms  drops=%li  holds=%li%s\r\n\n",
+			(double)port_backlog(&conn->cursor),client_lag(conn),
+			conn->drops,conn->holds,conn->flow_held?"  (holding the port off)":"");
 	} else {
 		netprintf(conn, "  state=closed\r\n\n");
 	}
 	netprintf(conn,"  connectionid=%i  hostname=%s\r\n",conn->id,hostname);
-	netprintf(conn,"  echo=%i  binary=%i  keepalive=%i\r\n",
-		conn->option_echo,conn->option_binary,conn->option_keepalive);
+	netprintf(conn,"  echo=%i  binary=%i  keepalive=%i  autoclose=%s\r\n",
+		conn->option_echo,conn->option_binary,conn->option_keepalive,
+		conn->autoclose?"true":"false");
+	if (conn->mccp) {
+		double in, out;
+		mccp_counts(conn->mccp,&in,&out);
+		netprintf(conn,"  compressed=%.0f/%.0f bytes\r\n",out,in);
+	}
 	netprintf(conn,"\r\n");
 }
 
@@ -1058,9 +2996,57 @@ int check_atoi(char *p,int old_value,struct connection *conn,char *error) {
 	return atoi(p);
 }
 
+/*
+ * Run a cli session on the connection.  Its mode, privilege, idle timeout
+ * and history are its own, so any number of them can be in progress at
+ * once; the commands are the shared tree, and find the connection they
+ * serve with cli_get_context()
+ */
+void run_cli(struct connection *conn) {
+	struct cli_def *session;
+	struct cli_command *own;
+
+	/*
+	 * Borrowing the tree relies on libcli internals: cli_def.commands is
+	 * where cli_loop looks for commands, and libcli keeps per session
+	 * state in the tree itself - cli_loop, enable and configure rebuild
+	 * each command's unique_len for the session's privilege and mode.
+	 * So only one session at a time may be in the cli.
+	 */
+	if (!TryEnterCriticalSection(&cli_lock)) {
+		netprintf(conn,"error: session %i is in the menu, try again when it is done\r\n",
+			cli_user);
+		return;
+	}
+	if (!(session = cli_init())) {
+		LeaveCriticalSection(&cli_lock);
+		netprintf(conn,"error: cannot start a cli session\r\n");
+		return;
+	}
+	cli_user = conn->id;
+	/* put aside the built in commands cli_init() gave it, for cli_done() */
+	own = session->commands;
+	session->commands = cli->commands;
+
+	cli_set_banner(session, "wconsd serial to telnet");
+	cli_set_hostname(session, (char *)hostname);
+	cli_set_idle_timeout(session, cli_idle);
+	cli_set_context(session, conn);
+
+	/* libcli reads the socket itself, so it has to stop being event selected */
+	WSAEventSelect(conn->net,NULL,0);
+	cli_loop(session,conn->net);
+
+	session->commands = own;
+	cli_done(session);
+	cli_user = 0;
+	LeaveCriticalSection(&cli_lock);
+}
+
 void process_menu_line(struct connection*conn, char *line) {
 	char *command;
 	char *parameter1;
+	char *parameter2;
 
 	/*
 	 * FIXME - non re-entrant code
@@ -1072,6 +3058,7 @@ void process_menu_line(struct connection*conn, char *line) {
 	 */
 	command = strtok(line," ");
 	parameter1 = strtok(NULL," ");
+	parameter2 = strtok(NULL," ");
 
 	if (!strcmp(command, "help") || !strcmp(command, "?")) {
 		// help
@@ -1101,73 +3088,144 @@ void process_menu_line(struct connection*conn, char *line) {
 		"  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.\r\n"
 		"\n");
 	} else if (!strcmp(command, "port")) {		// port
-		int new = check_atoi(parameter1,com_port,conn,"must specify a port\r\n");
+		int new = check_atoi(parameter1,conn->want_port,conn,"must specify a port\r\n");
 
-		if (new >= 1 && new <= 16) {
-			com_port=new;
+		if (new >= 1 && new <= LINE_PORTS) {
+			conn->want_port=new;
 		}
 	} else if (!strcmp(command, "speed")) {		// speed
-		com_speed = check_atoi(parameter1,com_port,conn,"must specify a speed\r\n");
+		struct line l = *session_line(conn);
+
+		if (!parameter1) {
+			netprintf(conn,"must specify a speed, or auto\r\n");
+			return;
+		}
+		if (!strcmp(parameter1, "auto")) {
+			l.autobaud=1;
+		} else if (autobaud_valid(atoi(parameter1))) {
+			l.speed=atoi(parameter1);
+			l.autobaud=0;
+		} else {
+			netprintf(conn,"%s is not a standard speed\r\n",parameter1);
+			return;
+		}
+		menu_set_line(conn,&l);
 	} else if (!strcmp(command, "data")) {		// data
+		struct line l = *session_line(conn);
+
 		if (!parameter1) {
 			netprintf(conn,"Please specify number of data bits {5,6,7,8}\r\n");
 			return;
 		}
 		if (!strcmp(parameter1, "5")) {
-			com_data=5;
+			l.data=5;
 		} else if (!strcmp(parameter1, "6")) {
-			com_data=6;
+			l.data=6;
 		} else if (!strcmp(parameter1, "7")) {
-			com_data=7;
+			l.data=7;
 		} else if (!strcmp(parameter1, "8")) {
-			com_data=8;
+			l.data=8;
 		}
+		menu_set_line(conn,&l);
 		show_status(conn);
 	} else if (!strcmp(command, "parity")) {	// parity
+		struct line l = *session_line(conn);
+
 		if (!parameter1) {
 			netprintf(conn,"Please specify the parity {no,even,odd,mark,space}\r\n");
 			return;
 		}
 		if (!strcmp(parameter1, "no") || !strcmp(parameter1, "0")) {
-			com_parity=NOPARITY;
+			l.parity=NOPARITY;
 		} else if (!strcmp(parameter1, "even") || !strcmp(parameter1, "2")) {
-			com_parity=EVENPARITY;
+			l.parity=EVENPARITY;
 		} else if (!strcmp(parameter1, "odd") || !strcmp(parameter1, "1")) {
-			com_parity=ODDPARITY;
+			l.parity=ODDPARITY;
 		} else if (!strcmp(parameter1, "mark")) {
-			com_parity=MARKPARITY;
+			l.parity=MARKPARITY;
 		} else if (!strcmp(parameter1, "space")) {
-			com_parity=SPACEPARITY;
+			l.parity=SPACEPARITY;
 		}
+		menu_set_line(conn,&l);
 		show_status(conn);
 	} else if (!strcmp(command, "stop")) {
+		struct line l = *session_line(conn);
+
 		if (!parameter1) {
 			netprintf(conn,"Please specify the number of stop bits {1,1.5,2}\r\n");
 			return;
 		}
 		if (!strcmp(parameter1, "one") || !strcmp(parameter1, "1")) {
-			com_stop=ONESTOPBIT;
+			l.stop=ONESTOPBIT;
 		} else if (!strcmp(parameter1, "one5") || !strcmp(parameter1, "1.5")) {
-			com_stop=ONE5STOPBITS;
+			l.stop=ONE5STOPBITS;
 		} else if (!strcmp(parameter1, "two") || !strcmp(parameter1, "2")) {
-			com_stop=TWOSTOPBITS;
+			l.stop=TWOSTOPBITS;
 		}
+		menu_set_line(conn,&l);
 		show_status(conn);
 	} else if (!strcmp(command, "open")) {		// open
-		int new = check_atoi(parameter1,com_port,conn,"Opening default port\r\n");
+		int new = check_atoi(parameter1,conn->want_port,conn,"Opening default port\r\n");
 
-		if (new >= 1 && new <= 16) {
-			com_port=new;
+		if (new >= 1 && new <= LINE_PORTS) {
+			conn->want_port=new;
 		}
 		cmd_open(conn);
+	} else if (!strcmp(command, "send")) {
+		cmd_send(conn,parameter1,parameter2);
 	} else if (!strcmp(command, "close")) {			// close
 		close_serial_connection(conn);
 		netprintf(conn,"info: actual com port closed\r\n\n");
+	} else if (!strcmp(command, "resume")) {
+		if (!parameter1) {
+			netprintf(conn,"must specify the offset to resume from\r\n");
+			return;
+		}
+		resume_request(conn,RESUME_SEEK,strtoull(parameter1,NULL,0));
+		cmd_open(conn);
+	} else if (!strcmp(command, "group")) {
+		cmd_group(conn,parameter1,0);
+	} else if (!strcmp(command, "watch")) {
+		cmd_group(conn,parameter1,1);
+	} else if (!strcmp(command, "spectate")) {
+		if (conn->serialconnected) {
+			netprintf(conn,"error: close COM%i first\r\n",conn->port);
+			return;
+		}
+		conn->spectate=1;
+		cmd_open(conn);
+	} else if (!strcmp(command, "steal")) {
+		cmd_steal(conn);
+	} else if (!strcmp(command, "handoff")) {
+		cmd_handoff(conn,parameter1);
+	} else if (!strcmp(command, "attach")) {
+		cmd_attach(conn,parameter1);
+	} else if (!strcmp(command, "autoclose")) {
+		if (!parameter1) {
+			netprintf(conn,"autoclose is %s\r\n",conn->autoclose?"true":"false");
+		} else if (!strcmp(parameter1,"false") || !strcmp(parameter1,"0")) {
+			conn->autoclose=0;
+		} else if (!strcmp(parameter1,"true") || !strcmp(parameter1,"1")) {
+			conn->autoclose=1;
+		} else {
+			netprintf(conn,"Please specify false or true\r\n");
+		}
+	} else if (!strcmp(command, "detach")) {
+		if (!conn->serialconnected) {
+			netprintf(conn,"error: no port is open\r\n");
+			return;
+		}
+		netprintf(conn,"session %i held on COM%i, 'attach %i' to come back\r\n",
+			conn->id,conn->port,conn->id);
+		/* the socket closing brings thread_new_connection round to it */
+		conn->autoclose=0;
+		conn->option_runmenu=0;
+		net_close(conn);
+		return;
 	} else if (!strcmp(command, "quit")) {
 		// quit the connection
 		conn->option_runmenu=0;
-		closesocket(conn->net);
-		conn->net=INVALID_SOCKET;
+		net_close(conn);
 		return;
 	} else if (!strcmp(command, "keepalive")) {
 		conn->option_keepalive=!conn->option_keepalive;
@@ -1176,48 +3234,44 @@ void process_menu_line(struct connection*conn, char *line) {
 		conn->option_binary=!conn->option_binary;
 		return;
 	} else if (!strcmp(command, "show_conn_table")) {
+		char peer[64];
 		int i;
 		netprintf(conn,
-			"Flags: A - Active Slot, S - Serial active,\r\n"
+			"Flags: A - Active Slot, S - Serial active, W - Writer, R - Read-only,\r\n"
 			"       M - Run Menu, B - Binary transmission, E - Echo enabled,\r\n"
 			"       K - Telnet Keepalives, * - This connection\r\n"
 			"\r\n");
 		netprintf(conn,
-				"s flags  id mThr net  serial serialTh netrx nettx peer address\r\n");
+				"s flags   id mThr net  serial serialTh netrx nettx peer address\r\n");
 		netprintf(conn,
-				"- ------ -- ---- ---- ------ -------- ----- ----- ------------\r\n");
+				"- ------- -- ---- ---- ------ -------- ----- ----- ------------\r\n");
 		for (i=0;i<MAXCONNECTIONS;i++) {
-			netprintf(conn,"%i%c%c%c%c%c%c%c %2i %4i ",
+			netprintf(conn,"%i%c%c%c%c%c%c%c%c %2i %4i ",
 				i,
 				&connection[i]==conn?'*':' ',
 				connection[i].active?'A':' ',
 				connection[i].serialconnected?'S':' ',
+				role_flag(&connection[i]),
 				connection[i].option_runmenu?'M':' ',
 				connection[i].option_binary?'B':' ',
 				connection[i].option_echo?'E':' ',
 				connection[i].option_keepalive?'K':' ',
 				connection[i].id,
 
-				connection[i].menuThread);
+				handle_id(connection[i].menuThread));
 			netprintf(conn,"%4i ", connection[i].net);
 
 			if (connection[i].serialconnected) {
 				netprintf(conn,"%6i %8i ",
-					connection[i].serial,
-					connection[i].serialThread);
+					handle_id(connection[i].serial),
+					handle_id(connection[i].serialThread));
 			} else {
 				netprintf(conn,"                ");
 			}
 			netprintf(conn, "%5i %5i ",
 				connection[i].net_bytes_rx,
 				connection[i].net_bytes_tx);
-			if (connection[i].sa) {
-				/* FIXME - IPv4 Specific */
-				netprintf(conn,"%s:%i",
-					inet_ntoa(((struct sockaddr_in*)connection[i].sa)->sin_addr),
-					htons(((struct sockaddr_in*)connection[i].sa)->sin_port));
-			}
-			netprintf(conn, "\r\n");
+			netprintf(conn,"%s\r\n",peer_name(&connection[i],peer,sizeof(peer)));
 		}
 	} else if (!strcmp(command, "kill_conn")) {
 		int connid = check_atoi(parameter1,0,conn,"must specify a connection id\r\n");
@@ -1234,11 +3288,14 @@ void process_menu_line(struct connection*conn, char *line) {
 			netprintf(conn,"Connection ID %i not found\r\n",connid);
 			return;
 		}
-		netprintf(&connection[i],"Serial Connection Closed by Connection ID %i\r\n",conn->id);
+		netnotice(&connection[i],"Serial Connection Closed by Connection ID %i\r\n",conn->id);
+		/* wait out any write its net_to_com has under way */
+		EnterCriticalSection(&connection[i].io_lock);
 		close_serial_connection(&connection[i]);
+		LeaveCriticalSection(&connection[i].io_lock);
 		netprintf(conn,"Connection ID %i serial port closed\r\n",connid);
 	} else if (!strcmp(command, "menu")) {
-		cli_loop(cli,conn->net);
+		run_cli(conn);
 	} else {
 		/* other, unknown commands */
 		netprintf(conn,"\r\nInvalid Command: '%s'\r\n\r\n",line);
@@ -1249,10 +3306,129 @@ void show_prompt(struct connection *conn) {
 	netprintf(conn,"%s> ",hostname);
 }
 
+/*
+ * The menu's line editor.  Everything it says back to the peer - the
+ * echo, rubouts, bells and the next prompt - is collected in out[] and
+ * sent once for each buffer received, so a pasted line costs one send
+ * rather than one per character.  A single keystroke is still answered
+ * as soon as it has been read.
+ */
+#define HISTORY	16
+
+struct editor {
+	unsigned char line[MAXLEN];
+	DWORD len;
+	int esc;		/* 1 after ESC, 2 inside ESC [ or ESC O */
+	char history[HISTORY][MAXLEN];
+	int hist_count;		/* lines remembered, the newest at hist_count-1 */
+	int hist_pos;		/* lines back while browsing, 0 for a new line */
+	char out[BUFSIZE];
+	int outlen;
+};
+
+void editor_flush(struct connection *conn, struct editor *ed) {
+	int bytes;
+
+	if (!ed->outlen) {
+		return;
+	}
+	bytes = net_send(conn,ed->out,ed->outlen,1);
+	if (bytes==-1) {
+		dprintf(1,"wconsd[%i]: editor_flush: send error %i\n",conn->id,WSAGetLastError());
+	} else {
+		conn->net_bytes_tx += bytes;
+	}
+	ed->outlen=0;
+}
+
+void editor_put(struct connection *conn, struct editor *ed, const char *s, int len) {
+	while (len) {
+		int n = sizeof(ed->out)-ed->outlen;
+
+		if (n==0) {
+			editor_flush(conn,ed);
+			continue;
+		}
+		if (n>len) {
+			n=len;
+		}
+		memcpy(ed->out+ed->outlen,s,n);
+		ed->outlen+=n;
+		s+=n;
+		len-=n;
+	}
+}
+
+void editor_echo(struct connection *conn, struct editor *ed, const char *s, int len) {
+	if (conn->option_echo) {
+		editor_put(conn,ed,s,len);
+	}
+}
+
+void editor_prompt(struct connection *conn, struct editor *ed) {
+	editor_put(conn,ed,(char*)hostname,strlen((char*)hostname));
+	editor_put(conn,ed,"> ",2);
+}
+
+/* rub out the last n chars of the line */
+void editor_erase(struct connection *conn, struct editor *ed, DWORD n) {
+	while (n--) {
+		editor_echo(conn,ed,"\x08 \x08",3);
+		ed->len--;
+	}
+}
+
+/* ctrl-W: the spaces before the cursor, then the word before those */
+void editor_erase_word(struct connection *conn, struct editor *ed) {
+	DWORD i = ed->len;
+
+	while (i>0 && ed->line[i-1]==' ') {
+		i--;
+	}
+	while (i>0 && ed->line[i-1]!=' ') {
+		i--;
+	}
+	editor_erase(conn,ed,ed->len-i);
+}
+
+/* replace the whole line, for browsing the history */
+void editor_replace(struct connection *conn, struct editor *ed, const char *s) {
+	editor_erase(conn,ed,ed->len);
+	ed->len=strlen(s);
+	memcpy(ed->line,s,ed->len);
+	editor_echo(conn,ed,s,ed->len);
+}
+
+void editor_remember(struct editor *ed) {
+	char *line = (char*)ed->line;
+
+	ed->hist_pos=0;
+	if (ed->hist_count && !strcmp(ed->history[ed->hist_count-1],line)) {
+		return;
+	}
+	if (ed->hist_count==HISTORY) {
+		memmove(ed->history[0],ed->history[1],sizeof(ed->history[0])*(HISTORY-1));
+		ed->hist_count--;
+	}
+	strcpy(ed->history[ed->hist_count++],line);
+}
+
+/* up (older) is 1, down (newer) is -1 */
+void editor_browse(struct connection *conn, struct editor *ed, int dir) {
+	int pos = ed->hist_pos+dir;
+
+	if (pos<0 || pos>ed->hist_count) {
+		editor_put(conn,ed,"\x07",1);
+		return;
+	}
+	ed->hist_pos=pos;
+	editor_replace(conn,ed,pos ? ed->history[ed->hist_count-pos] : "");
+}
+
 void run_menu(struct connection * conn) {
 	unsigned char buf[BUFSIZE+5];	/* ensure there is room for our kludge telnet options */
-	unsigned char line[MAXLEN];
-	DWORD size, linelen=0;
+	struct editor *ed;
+	DWORD size;
 	WORD i;
 
 	unsigned long zero=0;
@@ -1260,20 +3436,34 @@ void run_menu(struct connection * conn) {
 	struct timeval tv;
 
 	unsigned char last_ch;
-	unsigned char ch;
+	unsigned char ch=0;
 
-	/* IAC WILL ECHO */
-	/* IAC WILL suppress go ahead */
-	/* IAC WILL status */
-	/* IAC WONT linemode */
-	netprintf(conn,"\xff\xfb\x01\xff\xfb\x03\xff\xfb\x05\xff\xfc\x22");
+	if (!(ed = calloc(1,sizeof(*ed)))) {
+		dprintf(1,"wconsd[%i]: run_menu out of memory\n",conn->id);
+		return;
+	}
+
+	if (conn->option_raw) {
+		/* no options to negotiate, and IAC is just another char */
+	} else {
+		/* IAC WILL ECHO */
+		/* IAC WILL suppress go ahead */
+		/* IAC WILL status */
+		/* IAC WONT linemode */
+		netprintf(conn,"\xff\xfb\x01\xff\xfb\x03\xff\xfb\x05\xff\xfc\x22");
+	}
+	if (mccp_enabled && !conn->option_raw) {
+		/* IAC WILL COMPRESS2 */
+		netprintf(conn,"\xff\xfb\x56");
+	}
 
 	netprintf(conn,"\r\nwconsd serial port server (version %s)\r\n\r\n",VERSION);
 	send_help(conn);
 	show_prompt(conn);
 
 	FD_ZERO(&set_read);
-	while (conn->option_runmenu) {
+	/* the socket is shut down if the serial session found the peer dead */
+	while (conn->option_runmenu && !conn->net_closed) {
 		FD_SET(conn->net,&set_read);
 		tv.tv_sec = 2;
 		tv.tv_usec = 0;
@@ -1282,9 +3472,8 @@ void run_menu(struct connection * conn) {
 		size=recv(conn->net,(void*)&buf,BUFSIZE,0);
 
 		if (size==0) {
-			closesocket(conn->net);
-			conn->net=INVALID_SOCKET;
-			return;
+			net_close(conn);
+			break;
 		}
 		if (size==SOCKET_ERROR) {
 			int err = WSAGetLastError();
@@ -1294,10 +3483,21 @@ void run_menu(struct connection * conn) {
 					if (conn->option_keepalive) {
 						netprintf(conn,"\xff\xf1");
 					}
+					/* before the probe, which waits behind a stuck send */
+					if (client_check(conn) || check_peer_alive(conn)) {
+						free(ed);
+						return;
+					}
 					continue;
+				case WSAETIMEDOUT:
+				case WSAECONNABORTED:
+					/* the TCP keepalives gave up */
+					peer_dead(conn);
+					free(ed);
+					return;
 				case WSAECONNRESET:
-					closesocket(conn->net);
-					conn->net=INVALID_SOCKET;
+					net_close(conn);
+					free(ed);
 					return;
 				default:
 					dprintf(1,"wconsd[%i]: run_menu socket error (%i)\n",conn->id,WSAGetLastError());
@@ -1306,7 +3506,7 @@ void run_menu(struct connection * conn) {
 			}
 			continue;
 		}
-		conn->net_bytes_rx+=size;
+		peer_heard(conn,size);
 
 		for (i = 0; i < size; i++) {
 			last_ch=ch;
@@ -1322,6 +3522,25 @@ void run_menu(struct connection * conn) {
 				 */
 				continue;
 			}
+			if (ed->esc==1) {
+				if (ch=='[' || ch=='O') {
+					ed->esc=2;
+					continue;
+				}
+				/* not a sequence we know, the char stands alone */
+				ed->esc=0;
+			} else if (ed->esc==2) {
+				/* parameters, up to the final char */
+				if (ch>=0x40 && ch<=0x7e) {
+					ed->esc=0;
+					if (ch=='A') {
+						editor_browse(conn,ed,1);
+					} else if (ch=='B') {
+						editor_browse(conn,ed,-1);
+					}
+				}
+				continue;
+			}
 			if (ch==0) {
 				/*
 				 * NULLs could occur as the second char in a
@@ -1330,14 +3549,32 @@ void run_menu(struct connection * conn) {
 				continue;
 			} else if (ch==127 || ch==8) {
 				// backspace
-				if (linelen > 0) {
-					netprintf(conn,"\x08 \x08");
-					linelen--;
+				if (ed->len > 0) {
+					editor_erase(conn,ed,1);
 				} else {
 					/* if the linebuf is empty, ring the bell */
-					netprintf(conn,"\x07");
+					editor_put(conn,ed,"\x07",1);
 				}
 				continue;
+			} else if (ch==0x15) {
+				/* ctrl-U */
+				editor_erase(conn,ed,ed->len);
+				continue;
+			} else if (ch==0x17) {
+				/* ctrl-W */
+				editor_erase_word(conn,ed);
+				continue;
+			} else if (ch==0x10) {
+				/* ctrl-P */
+				editor_browse(conn,ed,1);
+				continue;
+			} else if (ch==0x0e) {
+				/* ctrl-N */
+				editor_browse(conn,ed,-1);
+				continue;
+			} else if (ch==0x1b) {
+				ed->esc=1;
+				continue;
 			} else if (ch==0x0d || ch==0x0a) {
 				// detected cr or lf
 
@@ -1346,27 +3583,31 @@ void run_menu(struct connection * conn) {
 					continue;
 				}
 
-				if (conn->option_echo)
-					/* echo the endofline */
-					netprintf(conn,"\r\n");
+				/* echo the endofline */
+				editor_echo(conn,ed,"\r\n",2);
 
-				if (linelen!=0) {
-					line[linelen]=0;	// ensure string is terminated
+				if (ed->len!=0) {
+					ed->line[ed->len]=0;	// ensure string is terminated
+					editor_remember(ed);
 
-					process_menu_line(conn,(char*)line);
+					/* the command's output follows what was typed */
+					editor_flush(conn,ed);
+					process_menu_line(conn,(char*)ed->line);
 					if (!conn->option_runmenu) {
 						/* exiting the menu.. */
+						free(ed);
 						return;
 					}
 				}
 
-				show_prompt(conn);
-				linelen=0;
+				editor_prompt(conn,ed);
+				ed->len=0;
+				ed->hist_pos=0;
 				continue;
 			} else if (ch<0x20) {
 				/* ignore other ctrl chars */
 				continue;
-			} else if (ch==TELNET_OPTION_IAC) {
+			} else if (ch==TELNET_OPTION_IAC && !conn->option_raw) {
 				/* start a telnet option packet */
 				process_telnet_option(conn,ch);
 				/*
@@ -1377,21 +3618,35 @@ void run_menu(struct connection * conn) {
 			} else {
 				// other chars
 
-				if (linelen < MAXLEN - 1) {
-					line[linelen] = ch;
-					linelen++;
-					if (conn->option_echo) {
-						netprintf(conn,"%c",ch);	/* echo */
-					}
+				if (ed->len < MAXLEN - 1) {
+					ed->line[ed->len] = ch;
+					ed->len++;
+					editor_echo(conn,ed,(char*)&ch,1);
 				} else {
-					netprintf(conn,"\x07"); /* linebuf full bell */
+					editor_put(conn,ed,"\x07",1); /* linebuf full bell */
 				}
 				continue;
 			}
 		}
+
+		/* everything this buffer had to say, in one go */
+		editor_flush(conn,ed);
+
+		if (conn->comport_pending) {
+			/* an RFC 2217 client wants the port, not the menu */
+			conn->comport_pending=0;
+			cmd_open(conn);
+			if (!conn->option_runmenu) {
+				free(ed);
+				return;
+			}
+			editor_prompt(conn,ed);
+			ed->len=0;
+			editor_flush(conn,ed);
+		}
 	}
 
-	/* not reached */
+	free(ed);
 }
 
 DWORD WINAPI thread_new_connection(LPVOID lpParam) {
@@ -1405,45 +3660,229 @@ DWORD WINAPI thread_new_connection(LPVOID lpParam) {
 
 	/* TODO print bytecounts */
 	/* maybe close file descriptors? */
-	shutdown(conn->net,SD_BOTH);
-	closesocket(conn->net);
+	net_stop_compress(conn);
+	net_close(conn);
 
+	int had_serial = conn->serialconnected;
+	/* with autoclose off the port carries on without us */
+	conn->hold = !conn->autoclose && had_serial;
 	close_serial_connection(conn);
 
+	/*
+	 * com_to_net is joined, or abandoned and failing on the shut down
+	 * socket, so nothing is left to send on it before it is reused
+	 */
+	EnterCriticalSection(&conn->net_lock);
+	closesocket(conn->net);
+	conn->net=INVALID_SOCKET;
+	LeaveCriticalSection(&conn->net_lock);
+
+	if (conn->peer_dead && had_serial) {
+		/* the port was locked from the last sign of life until now */
+		DWORD locked = GetTickCount() - conn->last_rx_tick;
+		dprintf(1,"wconsd[%i]: dead peer held serial port for %lu ms\n",
+			conn->id,locked);
+		InterlockedExchangeAdd(&stats.dead_port_ms,locked);
+	}
+
 	conn->active=0;
 
-	/* TODO - who closes menuThread ? */
+	/* menuThread is closed when the slot is reused, or at shutdown */
 	return 0;
 }
 
+/*
+ * Ask every connection to finish and wait - with a deadline - for their
+ * threads.  Shutting down the socket wakes the menu or net_to_com loop,
+ * which then tears down its own serial port.
+ */
+void close_all_connections(void) {
+	HANDLE threads[MAXCONNECTIONS];
+	DWORD start = GetTickCount();
+	int nr_threads=0;
+	int i;
+
+	for (i=0;i<MAXCONNECTIONS;i++) {
+		if (connection[i].active) {
+			dprintf(1,"wconsd[%i]: closing for shutdown\n",connection[i].id);
+			shutdown(connection[i].net,SD_BOTH);
+		}
+		if (connection[i].menuThread) {
+			threads[nr_threads++]=connection[i].menuThread;
+		}
+	}
+
+	while (nr_threads) {
+		/* keep the service manager informed that we are progressing */
+		SCM_Progress(&sd,shutdown_timeout);
+		if (WaitForMultipleObjects(nr_threads,threads,TRUE,250)!=WAIT_TIMEOUT) {
+			break;
+		}
+		if (GetTickCount()-start >= shutdown_timeout) {
+			dprintf(1,"wconsd: connections did not close, abandoning them\n");
+			InterlockedIncrement(&stats.stuck_threads);
+			break;
+		}
+	}
+
+	for (i=0;i<MAXCONNECTIONS;i++) {
+		if (connection[i].menuThread) {
+			CloseHandle(connection[i].menuThread);
+			connection[i].menuThread=NULL;
+		}
+	}
+}
+
+/*
+ * Take a newly accepted socket into a free slot of the connection table
+ * and start its menu thread.  Local connections skip the TCP specific
+ * setup and may be raw.
+ */
+void new_connection(SOCKET as, struct sockaddr *sa, int salen, int local) {
+	unsigned long zero=0;
+	int i;
+	int count;
+
+	/* search for an empty connection slot */
+	i=next_connection_slot%MAXCONNECTIONS;
+	count=0;
+	while(connection[i].active && count<MAXCONNECTIONS) {
+		count++;
+		i = (i+1)%MAXCONNECTIONS;
+	}
+	if (count==MAXCONNECTIONS) {
+		dprintf(1,"wconsd: connection table overflow\n");
+		/* FIXME - properly reject the incoming connection */
+		/* for now, just close the socket */
+		closesocket(as);
+		return;
+	}
+	next_connection_slot = (next_connection_slot+1)%MAXCONNECTIONS;
+	if (connection[i].menuThread) {
+		/* the previous user of this slot has finished */
+		CloseHandle(connection[i].menuThread);
+	}
+	connection[i].active=1;	/* mark this entry busy */
+	connection[i].id = next_connection_id++;
+	connection[i].menuThread=NULL;
+	connection[i].net=as;
+	connection[i].serialconnected=0;
+	connection[i].serial=INVALID_HANDLE_VALUE;
+	connection[i].serialThread=NULL;
+	connection[i].group=NULL;
+	connection[i].spectate=0;
+	connection[i].flow_held=0;
+	connection[i].drops=0;
+	connection[i].holds=0;
+	connection[i].caught_up=GetTickCount();
+	connection[i].too_slow=0;
+	connection[i].autoclose=1;
+	connection[i].hold=0;
+	connection[i].option_runmenu=1;	/* start in the menu */
+	connection[i].want_port=DEFAULT_PORT;
+	connection[i].line=NULL;
+	connection[i].option_comport=0;
+	connection[i].comport_pending=0;
+	connection[i].modem_mask=0xff;	/* the defaults RFC 2217 gives */
+	connection[i].line_mask=0;
+	connection[i].dtr=1;
+	connection[i].rts=1;
+	connection[i].brk=0;
+	connection[i].modemThread=NULL;
+	connection[i].option_resume=0;
+	connection[i].resume_op=0;
+	connection[i].option_binary=0;
+	connection[i].option_echo=0;
+	connection[i].option_keepalive=0;
+	connection[i].option_raw=local && local_raw;
+	connection[i].local=local;
+	connection[i].net_bytes_rx=0;
+	connection[i].net_bytes_tx=0;
+	connection[i].last_rx_tick=GetTickCount();
+	connection[i].probe_tick=0;
+	connection[i].telnet_peer=0;
+	connection[i].peer_dead=0;
+	connection[i].net_closed=0;
+	connection[i].telnet_option=0;
+	connection[i].telnet_option_param=0;
+
+	if (connection[i].sa) {
+		/* Do lazy de-allocation so that the info is
+		 * still visible to show conn table */
+		free(connection[i].sa);
+	}
+	if ((connection[i].sa=malloc(salen))==NULL) {
+		dprintf(1,"wconsd[%i]: malloc failed\n",
+			connection[i].id);
+	} else {
+		memcpy(connection[i].sa,sa,salen);
+	}
+
+	dprintf(1,"wconsd[%i]: accepted new connection in slot %i\n",connection[i].id,i);
+
+
+	/* we successfully accepted the connection */
+
+	ioctlsocket(connection[i].net,FIONBIO,&zero);
+	if (!local) {
+		set_tcp_keepalive(connection[i].net);
+	}
+	if (client_queue) {
+		/* or the stack's buffer is most of the queue */
+		int sndbuf = client_queue;
+
+		setsockopt(connection[i].net,SOL_SOCKET,SO_SNDBUF,(void*)&sndbuf,sizeof(sndbuf));
+	}
+	InterlockedIncrement(&stats.connections);
+
+	connection[i].menuThread = CreateThread(NULL,0,thread_new_connection,&connection[i],0,NULL);
+}
+
 int wconsd_main(int argc, char **argv)
 {
-	HANDLE wait_array[2];
+	HANDLE wait_array[4];
+	int nr_waits=3;
 	BOOL run=TRUE;
 	DWORD o;
 	SOCKET as;
-	unsigned long zero=0;
 
 	struct sockaddr_in sa;
+	struct sockaddr_un lsa;
 	int salen;
 
 	int i;
-	int count;
+
+	InitializeCriticalSection(&cli_lock);
 
 	/* clear out any bogus data in the connections table */
 	for (i=0;i<MAXCONNECTIONS;i++) {
 		connection[i].active = 0;
+		connection[i].mccp = NULL;
+		connection[i].xfer = NULL;
+		connection[i].pacer = NULL;
+		InitializeCriticalSection(&connection[i].net_lock);
+		InitializeCriticalSection(&connection[i].xfer_lock);
+		InitializeCriticalSection(&connection[i].io_lock);
+		InitializeCriticalSection(&connection[i].pacer_lock);
 	}
 
 	/* Main loop: wait for a connection, service it, repeat
 	 * until signalled that the service is terminating */
 	wait_array[0]=stopEvent;
 	wait_array[1]=listenSocketEvent;
+	wait_array[2]=port_held_event;
+	if (lls!=INVALID_SOCKET) {
+		wait_array[nr_waits++]=localSocketEvent;
+	}
 
 	while (run) {
 		dprintf(1,"wconsd: debug: start wconsd_main loop\n");
 
-		o=WaitForMultipleObjects(2,wait_array,FALSE,INFINITE);
+		/* waking when the next held session is due to be let go */
+		o=WaitForMultipleObjects(nr_waits,wait_array,FALSE,port_expire());
+		if (o==WAIT_TIMEOUT) {
+			continue;
+		}
 
 		switch (o-WAIT_OBJECT_0) {
 		case 0: /* stopEvent */
@@ -1462,59 +3901,22 @@ int wconsd_main(int argc, char **argv)
 
 			dprintf(1,"wconsd: new connection from %s\n",
 					inet_ntoa(sa.sin_addr));
+			new_connection(as,(struct sockaddr*)&sa,salen,0);
+			break;
+		case 2: /* port_held_event */
+			/* a session was held, port_expire has a new deadline */
+			break;
+		case 3: /* localSocketEvent */
+			WSAResetEvent(localSocketEvent);
+			salen = sizeof(lsa);
+			as=accept(lls,(struct sockaddr*)&lsa,&salen);
 
-			/* search for an empty connection slot */
-			i=next_connection_slot%MAXCONNECTIONS;
-			count=0;
-			while(connection[i].active && count<MAXCONNECTIONS) {
-				count++;
-				i = (i+1)%MAXCONNECTIONS;
-			}
-			if (i==MAXCONNECTIONS) {
-				dprintf(1,"wconsd: connection table overflow\n");
-				/* FIXME - properly reject the incoming connection */
-				/* for now, just close the socket */
-				closesocket(as);
+			if (as==INVALID_SOCKET) {
 				break;
 			}
-			next_connection_slot = (next_connection_slot+1)%MAXCONNECTIONS;
-			connection[i].active=1;	/* mark this entry busy */
-			connection[i].id = next_connection_id++;
-			connection[i].menuThread=NULL;
-			connection[i].net=as;
-			connection[i].serialconnected=0;
-			connection[i].serial=INVALID_HANDLE_VALUE;
-			connection[i].serialThread=NULL;
-			connection[i].option_runmenu=1;	/* start in the menu */
-			connection[i].option_binary=0;
-			connection[i].option_echo=0;
-			connection[i].option_keepalive=0;
-			connection[i].net_bytes_rx=0;
-			connection[i].net_bytes_tx=0;
-			connection[i].telnet_option=0;
-			connection[i].telnet_option_param=0;
-
-			if (connection[i].sa) {
-				/* Do lazy de-allocation so that the info is
-				 * still visible to show conn table */
-				free(connection[i].sa);
-			}
-			if ((connection[i].sa=malloc(salen))==NULL) {
-				dprintf(1,"wconsd[%i]: malloc failed\n",
-					connection[i].id);
-			} else {
-				memcpy(connection[i].sa,&sa,salen);
-			}
-
-			dprintf(1,"wconsd[%i]: accepted new connection in slot %i\n",connection[i].id,i);
-
-
-			/* we successfully accepted the connection */
-
-			ioctlsocket(connection[i].net,FIONBIO,&zero);
-
-			connection[i].menuThread = CreateThread(NULL,0,thread_new_connection,&connection[i],0,NULL);
 
+			dprintf(1,"wconsd: new local connection\n");
+			new_connection(as,(struct sockaddr*)&lsa,salen,1);
 			break;
 		default:
 			run=FALSE; // Stop the service - I want to get off!
@@ -1522,9 +3924,17 @@ int wconsd_main(int argc, char **argv)
 		}
 	}
 
-	/* TODO - look through the connection table and close everything */
-
 	closesocket(ls);
+	if (lls!=INVALID_SOCKET) {
+		closesocket(lls);
+		DeleteFile(local_path);
+	}
+	close_all_connections();
+	port_shutdown(shutdown_timeout);
+	mux_shutdown(shutdown_timeout);
+	capture_shutdown();
+
+	dprintf(1,"wconsd: stop to exit took %lu ms\n",GetTickCount()-stop_tick);
 	WSACleanup();
 	return 0;
 }
@@ -39,6 +39,7 @@ VOID WINAPI ServiceCtrlHandler(DWORD opcode) {
 	svcStatus.dwWin32ExitCode = NO_ERROR;
 	if (opcode == SERVICE_CONTROL_STOP) {
 		svcStatus.dwCurrentState = SERVICE_STOP_PENDING;
+		svcStatus.dwCheckPoint = 1;
 		SetServiceStatus( svcHandle, &svcStatus );
 		global_sd->stop(NULL);
 		return;
@@ -105,11 +106,28 @@ VOID WINAPI ServiceMain(DWORD argc, LPSTR *argv)
 	err=sd->main(argc,argv);
 
 	svcStatus.dwCurrentState = SERVICE_STOPPED;
+	svcStatus.dwCheckPoint = 0;
 	svcStatus.dwWin32ExitCode = NO_ERROR;
 	SetServiceStatus( svcHandle, &svcStatus );
 	return;
 }
 
+/*
+ * Called by a service that is taking a while to stop, so that the SCM
+ * can see it is still making progress and does not consider it hung
+ */
+int SCM_Progress(struct SCM_def *sd, int waithint) {
+	if (sd->mode==SVC_CONSOLE || svcStatus.dwCurrentState!=SERVICE_STOP_PENDING) {
+		return SVC_OK;
+	}
+	svcStatus.dwCheckPoint++;
+	svcStatus.dwWaitHint = waithint;
+	if (!SetServiceStatus( svcHandle, &svcStatus )) {
+		return SVC_FAIL;
+	}
+	return SVC_OK;
+}
+
 int SCM_Start_Console(struct SCM_def *sd) {
 
 	sd->mode=SVC_CONSOLE;
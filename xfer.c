@@ -0,0 +1,507 @@
+/*
+ * xfer.c - send files to a serial port with raw, XMODEM or YMODEM
+ *
+ * Copyright (c) 2010 Hamish Coleman <hamish@zot.org>
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Firmware images are taken from the configured transfer directory and
+ * written straight to the serial port, so they never pass through the
+ * telnet stream and its IAC and CR NUL munging.
+ *
+ * While a transfer is running, the serial reader hands whatever the
+ * device sends to xfer_rx() instead of the client, which is where the
+ * ACK/NAK/C/G handshake characters come from.
+ *
+ * Writes are double buffered overlapped I/O: the next block is queued
+ * while the previous one is still going out, so with the streaming modes
+ * (raw and YMODEM-G) the UART is never left idle waiting for us.
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libcli/libcli/libcli.h"
+#include "module.h"
+#include "debug.h"
+#include "xfer.h"
+
+#define SOH	0x01
+#define STX	0x02
+#define EOT	0x04
+#define ACK	0x06
+#define NAK	0x15
+#define CAN	0x18
+#define CPMEOF	0x1a
+
+#define XFER_RXBUF	256
+#define XFER_BLOCK	(3+1024+2)
+#define XFER_NAME	(128-1-11-1)	/* the longest name block 0 has room for with a size */
+#define XFER_RETRIES	10
+#define XFER_START_TIMEOUT	60000	/* ms to wait for the receiver */
+#define XFER_ACK_TIMEOUT	10000
+
+static char xfer_dir[MAX_PATH];		/* empty means transfers are disabled */
+
+static struct {
+	LONG transfers;
+	LONG failures;
+	double bytes;
+} counts;
+
+struct xfer {
+	CRITICAL_SECTION lock;
+	HANDLE rxEvent;
+	unsigned char rx[XFER_RXBUF];
+	int rx_head, rx_tail;
+
+	int baud;
+	int bits_per_char;
+
+	/* the double buffered writer */
+	HANDLE serial;
+	OVERLAPPED o[2];
+	unsigned char buf[2][XFER_BLOCK];
+	int busy[2];
+	int next;
+	int write_error;
+};
+
+int xfer_protocol(const char *name) {
+	if (!name || !strcmp(name,"raw")) {
+		return XFER_RAW;
+	} else if (!strcmp(name,"xmodem")) {
+		return XFER_XMODEM;
+	} else if (!strcmp(name,"ymodem")) {
+		return XFER_YMODEM;
+	} else if (!strcmp(name,"ymodem-g")) {
+		return XFER_YMODEM_G;
+	}
+	return -1;
+}
+
+/*
+ * Open a file from the transfer directory.  Only plain names are
+ * accepted, nothing that could wander out of the directory, and none
+ * too long to go in a YMODEM header.
+ */
+FILE *xfer_open(const char *name, long *size) {
+	char path[MAX_PATH+256];
+	FILE *f;
+
+	if (!xfer_dir[0] || !name || !*name || strlen(name)>XFER_NAME ||
+	    strpbrk(name,"\\/:") || !strcmp(name,"..")) {
+		return NULL;
+	}
+	snprintf(path,sizeof(path),"%s/%s",xfer_dir,name);
+	if (!(f = fopen(path,"rb"))) {
+		return NULL;
+	}
+	fseek(f,0,SEEK_END);
+	*size = ftell(f);
+	fseek(f,0,SEEK_SET);
+	return f;
+}
+
+struct xfer *xfer_new(void) {
+	struct xfer *x = calloc(1,sizeof(struct xfer));
+
+	if (!x) {
+		return NULL;
+	}
+	InitializeCriticalSection(&x->lock);
+	x->rxEvent = CreateEvent(NULL,FALSE,FALSE,NULL);
+	x->o[0].hEvent = CreateEvent(NULL,TRUE,FALSE,NULL);
+	x->o[1].hEvent = CreateEvent(NULL,TRUE,FALSE,NULL);
+	x->baud = 9600;
+	x->bits_per_char = 10;
+	return x;
+}
+
+void xfer_free(struct xfer *x) {
+	CloseHandle(x->rxEvent);
+	CloseHandle(x->o[0].hEvent);
+	CloseHandle(x->o[1].hEvent);
+	DeleteCriticalSection(&x->lock);
+	free(x);
+}
+
+void xfer_set_baud(struct xfer *x, int baud, int bits_per_char) {
+	x->baud = baud;
+	x->bits_per_char = bits_per_char;
+}
+
+/* called by the serial reader with whatever the device has sent */
+void xfer_rx(struct xfer *x, const unsigned char *buf, int len) {
+	EnterCriticalSection(&x->lock);
+	while (len--) {
+		int next = (x->rx_head+1) % XFER_RXBUF;
+		if (next==x->rx_tail) {
+			/* the receiver is chatty, only the latest matters */
+			x->rx_tail = (x->rx_tail+1) % XFER_RXBUF;
+		}
+		x->rx[x->rx_head] = *buf++;
+		x->rx_head = next;
+	}
+	LeaveCriticalSection(&x->lock);
+	SetEvent(x->rxEvent);
+}
+
+/* get the next char from the device, or -1 on timeout */
+static int xfer_getc(struct xfer *x, DWORD timeout) {
+	DWORD start = GetTickCount();
+	int ch;
+
+	while (1) {
+		EnterCriticalSection(&x->lock);
+		if (x->rx_head!=x->rx_tail) {
+			ch = x->rx[x->rx_tail];
+			x->rx_tail = (x->rx_tail+1) % XFER_RXBUF;
+			LeaveCriticalSection(&x->lock);
+			return ch;
+		}
+		LeaveCriticalSection(&x->lock);
+
+		if (GetTickCount()-start >= timeout) {
+			return -1;
+		}
+		WaitForSingleObject(x->rxEvent,timeout-(GetTickCount()-start));
+	}
+}
+
+static void xfer_rxflush(struct xfer *x) {
+	EnterCriticalSection(&x->lock);
+	x->rx_tail = x->rx_head;
+	LeaveCriticalSection(&x->lock);
+}
+
+/* wait for one of the writer's buffers to become free */
+static void writer_wait(struct xfer *x, int i) {
+	DWORD wsize;
+
+	if (!x->busy[i]) {
+		return;
+	}
+	if (!GetOverlappedResult(x->serial,&x->o[i],&wsize,TRUE)) {
+		x->write_error = GetLastError();
+	}
+	x->busy[i] = 0;
+}
+
+/* queue a block for writing, returning as soon as it is in flight */
+static int writer_put(struct xfer *x, const unsigned char *buf, int len) {
+	int i = x->next;
+	DWORD wsize;
+
+	writer_wait(x,i);
+	if (x->write_error) {
+		return -1;
+	}
+	memcpy(x->buf[i],buf,len);
+	ResetEvent(x->o[i].hEvent);
+	if (!WriteFile(x->serial,x->buf[i],len,&wsize,&x->o[i])
+			&& GetLastError()!=ERROR_IO_PENDING) {
+		x->write_error = GetLastError();
+		return -1;
+	}
+	x->busy[i] = 1;
+	x->next = !i;
+	return 0;
+}
+
+/* wait until everything queued has been handed to the driver */
+static int writer_flush(struct xfer *x) {
+	writer_wait(x,0);
+	writer_wait(x,1);
+	return x->write_error?-1:0;
+}
+
+static unsigned short crc16(const unsigned char *buf, int len) {
+	unsigned short crc = 0;
+	int i;
+
+	while (len--) {
+		crc ^= *buf++ << 8;
+		for (i=0;i<8;i++) {
+			crc = crc&0x8000 ? (crc<<1)^0x1021 : crc<<1;
+		}
+	}
+	return crc;
+}
+
+/* build a block in buf, returning its total length */
+static int make_block(unsigned char *buf, int blockno, const unsigned char *data, int len, int size) {
+	unsigned short crc;
+
+	buf[0] = size==1024?STX:SOH;
+	buf[1] = blockno;
+	buf[2] = ~blockno;
+	memcpy(buf+3,data,len);
+	memset(buf+3+len,CPMEOF,size-len);
+	crc = crc16(buf+3,size);
+	buf[3+size] = crc>>8;
+	buf[4+size] = crc;
+	return 5+size;
+}
+
+/*
+ * Wait for the receiver to ask for the transfer to start with the given
+ * char ('C' or 'G').  Returns 0 when it does, -1 on timeout or cancel.
+ */
+static int wait_start(struct xfer *x, int want) {
+	DWORD start = GetTickCount();
+	int ch, last=0;
+
+	while (GetTickCount()-start < XFER_START_TIMEOUT) {
+		ch = xfer_getc(x,1000);
+		if (ch==want) {
+			return 0;
+		}
+		if (ch==CAN && last==CAN) {
+			return -1;
+		}
+		last = ch;
+	}
+	return -1;
+}
+
+/*
+ * Send a block and, unless streaming, wait for it to be ACKed, resending
+ * on NAK or timeout.  Returns 0 on success.
+ */
+static int send_block(struct xfer *x, const unsigned char *block, int len, int streaming) {
+	int tries, ch, last=0;
+
+	for (tries=0;tries<XFER_RETRIES;tries++) {
+		if (writer_put(x,block,len)) {
+			return -1;
+		}
+		if (streaming) {
+			/* nothing comes back unless the receiver gives up */
+			while ((ch = xfer_getc(x,0))!=-1) {
+				if (ch==CAN && last==CAN) {
+					return -1;
+				}
+				last = ch;
+			}
+			return 0;
+		}
+		if (writer_flush(x)) {
+			return -1;
+		}
+		while ((ch = xfer_getc(x,XFER_ACK_TIMEOUT))!=-1) {
+			if (ch==ACK) {
+				return 0;
+			}
+			if (ch==NAK) {
+				break;
+			}
+			if (ch==CAN && last==CAN) {
+				return -1;
+			}
+			last = ch;
+		}
+	}
+	return -1;
+}
+
+/* send EOT until the receiver ACKs it */
+static int send_eot(struct xfer *x) {
+	unsigned char eot = EOT;
+	int tries, ch;
+
+	for (tries=0;tries<XFER_RETRIES;tries++) {
+		if (writer_put(x,&eot,1) || writer_flush(x)) {
+			return -1;
+		}
+		/* YMODEM receivers NAK the first EOT on purpose */
+		while ((ch = xfer_getc(x,XFER_ACK_TIMEOUT))!=-1 && ch!=ACK && ch!=NAK);
+		if (ch==ACK) {
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* the YMODEM block zero, with file name and size, or empty to end a batch */
+static int send_header(struct xfer *x, const char *name, long size, int streaming) {
+	unsigned char data[128];
+	unsigned char block[XFER_BLOCK];
+	int len=0;
+
+	memset(data,0,sizeof(data));
+	if (name) {
+		len = snprintf((char *)data,sizeof(data)-1,"%s",name)+1;
+		if (len>sizeof(data)-1) {
+			/* xfer_open refuses such names, but the size must fit */
+			len = sizeof(data)-1;
+		}
+		snprintf((char *)data+len,sizeof(data)-len,"%ld",size);
+	}
+	len = make_block(block,0,data,sizeof(data),128);
+	/* even in YMODEM-G, receivers ACK the header naming a file */
+	return send_block(x,block,len,streaming && !name);
+}
+
+/* one file with XMODEM-1K or YMODEM(-G) */
+static int send_modem(struct xfer *x, int protocol, FILE *f, const char *name, long size, long *sent) {
+	unsigned char data[1024];
+	unsigned char block[XFER_BLOCK];
+	int start_char = protocol==XFER_YMODEM_G ? 'G' : 'C';
+	int streaming = protocol==XFER_YMODEM_G;
+	int blockno = 1;
+	int len;
+
+	xfer_rxflush(x);
+	if (wait_start(x,start_char)) {
+		return -1;
+	}
+
+	if (protocol!=XFER_XMODEM) {
+		if (send_header(x,name,size,streaming) || wait_start(x,start_char)) {
+			return -1;
+		}
+	}
+
+	while ((len = fread(data,1,sizeof(data),f))>0) {
+		/* a short tail fits in a 128 byte block, saving some padding */
+		len = make_block(block,blockno++,data,len,len<=128?128:1024);
+		if (send_block(x,block,len,streaming)) {
+			return -1;
+		}
+		*sent += len;
+	}
+	if (writer_flush(x) || send_eot(x)) {
+		return -1;
+	}
+
+	if (protocol!=XFER_XMODEM) {
+		/* an empty header ends the batch */
+		if (wait_start(x,start_char) || send_header(x,NULL,0,streaming)) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* just stream the file to the port */
+static int send_raw(struct xfer *x, FILE *f, long *sent) {
+	unsigned char data[1024];
+	int len;
+
+	while ((len = fread(data,1,sizeof(data),f))>0) {
+		if (writer_put(x,data,len)) {
+			return -1;
+		}
+		*sent += len;
+	}
+	return writer_flush(x);
+}
+
+/*
+ * Send a file, blocking until it is done.  A summary of the transfer,
+ * including how close to the line rate it got, is left in result.
+ */
+int xfer_send(struct xfer *x, HANDLE serial, int protocol, FILE *f,
+		const char *name, long size, char *result, int resultlen) {
+	LARGE_INTEGER freq, start, end;
+	double secs, rate, line_rate;
+	long sent = 0;
+	int err;
+
+	x->serial = serial;
+	x->write_error = 0;
+	x->next = 0;
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&start);
+	if (protocol==XFER_RAW) {
+		err = send_raw(x,f,&sent);
+	} else {
+		err = send_modem(x,protocol,f,name,size,&sent);
+	}
+	writer_flush(x);
+	QueryPerformanceCounter(&end);
+
+	secs = (double)(end.QuadPart-start.QuadPart)/freq.QuadPart;
+	rate = secs>0 ? sent/secs : 0;
+	line_rate = (double)x->baud/x->bits_per_char;
+
+	InterlockedIncrement(&counts.transfers);
+	if (err) {
+		InterlockedIncrement(&counts.failures);
+	}
+	counts.bytes += sent;
+
+	snprintf(result,resultlen,
+		"%s: %ld bytes on the wire in %.1f s, %.0f bytes/s, %.0f%% of %i baud",
+		err?"transfer failed":"transfer complete",
+		sent,secs,rate,line_rate?100*rate/line_rate:0,x->baud);
+	dprintf(1,"wconsd: %s %s\n",name,result);
+	return err;
+}
+
+static int cmd_showtransfers(struct cli_def *cli, char *command, char *argv[], int argc) {
+	cli_print(cli, "directory        %s",xfer_dir[0]?xfer_dir:"(disabled)");
+	cli_print(cli, "transfers        %li",counts.transfers);
+	cli_print(cli, "failures         %li",counts.failures);
+	cli_print(cli, "bytes sent       %.0f",counts.bytes);
+	return CLI_OK;
+}
+
+static int cmd_cdirectory(struct cli_def *cli, char *command, char *argv[], int argc) {
+	if (argc!=1) {
+		cli_print(cli,"Need a directory");
+		return CLI_ERROR;
+	}
+	snprintf(xfer_dir,sizeof(xfer_dir),"%s",argv[0]);
+	return CLI_OK;
+}
+
+/* show the config for this module */
+static int this_showrun(struct cli_def *cli) {
+	if (xfer_dir[0]) {
+		cli_print(cli, "transfer directory %s",xfer_dir);
+	}
+	return CLI_OK;
+}
+
+/* Our local module definition */
+static struct module_def this_module = {
+	.name = "xfer",
+	.desc = "Serial file transfers",
+	.showrun = this_showrun,
+};
+
+/* initialise and register this module */
+int xfer_init(struct cli_def *cli) {
+	cli_register_command(cli, lookup_parent("show"), "transfers", cmd_showtransfers,
+		PRIVILEGE_UNPRIVILEGED, MODE_EXEC, "File transfer statistics");
+
+	register_parent("config transfer",
+		cli_register_command(cli, NULL, "transfer", NULL, PRIVILEGE_PRIVILEGED,
+		MODE_CONFIG, "Serial file transfers"));
+
+	cli_register_command(cli, lookup_parent("config transfer"), "directory", cmd_cdirectory,
+		PRIVILEGE_PRIVILEGED, MODE_CONFIG, "Files that may be sent from the menu");
+
+	register_module(&this_module);
+	return 0;
+}
@@ -0,0 +1,23 @@
+/*
+ * xfer.h - send files to a serial port with raw, XMODEM or YMODEM
+ *
+ */
+
+#define XFER_RAW	0
+#define XFER_XMODEM	1	/* XMODEM-1K, CRC */
+#define XFER_YMODEM	2	/* YMODEM batch, one file */
+#define XFER_YMODEM_G	3	/* YMODEM-G, streaming without ACKs */
+
+struct xfer;
+
+int xfer_protocol(const char *name);
+FILE *xfer_open(const char *name, long *size);
+
+struct xfer *xfer_new(void);
+void xfer_free(struct xfer *);
+void xfer_rx(struct xfer *, const unsigned char *, int);
+int xfer_send(struct xfer *, HANDLE serial, int protocol, FILE *f,
+	const char *name, long size, char *result, int resultlen);
+
+void xfer_set_baud(struct xfer *, int baud, int bits_per_char);
+int xfer_init(struct cli_def *);